@@ -3,31 +3,168 @@
  * Copyright 2014-2015 Philipp Zabel
  * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
  */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "blobwatch.h"
 #include "debug.h"
 #include "flicker.h"
+#include "latency.h"
+#include "leds.h"
 
 struct leds;
 
-/* temporary global */
-extern int rift_dk2_flicker;
-
 #include <stdio.h>
 
-#define THRESHOLD 0x9f
+/* Minimum time between two reports of dropped blobs, in ns */
+#define DROPPED_REPORT_INTERVAL	1000000000ULL
+
+/* Fixed threshold, and range of the adaptive threshold */
+#define DEFAULT_THRESHOLD	0x9f
+#define THRESHOLD_MIN		0x40
+#define THRESHOLD_MAX		0xe0
+
+/* Distance of the adaptive threshold above the background level */
+#define THRESHOLD_MARGIN	0x20
+
+/*
+ * The adaptive threshold moves by at most THRESHOLD_STEP per frame, so that
+ * blob areas seen by the flicker detector change only slowly, and only if
+ * it is off by more than THRESHOLD_HYSTERESIS.
+ */
+#define THRESHOLD_STEP		2
+#define THRESHOLD_HYSTERESIS	8
+
+/* The brightness histogram samples every 8th pixel of every 8th line */
+#define HISTOGRAM_SAMPLING	8
+#define HISTOGRAM_BIN_SHIFT	3
+#define HISTOGRAM_BINS		(256 >> HISTOGRAM_BIN_SHIFT)
 
 #define NUM_FRAMES_HISTORY	2
 
+/* Initial size of the per-frame blob arrays, they grow on demand */
+#define INITIAL_BLOBS		64
+
+/* Padding around predicted blob bounding boxes in ROI mode */
+#define ROI_PADDING		8
+
+/* Number of frames a track is kept after its blob disappeared */
+#define DEFAULT_TRACK_HISTORY	2
+
+/*
+ * The association gate around a predicted blob position grows with half the
+ * predicted motion and the image motion expected from the IMU, up to
+ * MAX_GATE_MARGIN pixels beyond the blob's bounding box.
+ */
+#define MAX_GATE_MARGIN		32
+
+/*
+ * Elongated blobs are only associated if the major axis is within 30 degrees
+ * (cos² = 0.75) of the motion direction, and if the blur length does not
+ * exceed the motion by more than the gate margin plus BLUR_SLACK pixels.
+ */
+#define BLUR_MIN_COS2		0.75f
+#define BLUR_SLACK		2
+
+/* Cells of the blob association grid are 16x16 pixels */
+#define GRID_CELL_SHIFT		4
+
 #define abs(x) ((x) >= 0 ? (x) : -(x))
 #define min(x, y) ((x) < (y) ? (x) : (y))
 #define max(x, y) ((x) > (y) ? (x) : (y))
 
+/*
+ * A contiguous range of pixels [start, end) in a scanline
+ */
+struct span {
+	uint16_t start;
+	uint16_t end;
+};
+
+/*
+ * A rectangular region of interest [x0, x1) x [y0, y1)
+ */
+struct window {
+	int x0;
+	int y0;
+	int x1;
+	int y1;
+};
+
+/*
+ * A tracked blob that has not been observed for missed frames.
+ */
+struct lost_track {
+	struct blob blob;
+	int missed;
+};
+
+/*
+ * A blob of a previous frame, observed steps frames ago, that may be
+ * continued by a blob in the current frame at the predicted position x, y,
+ * give or take gate_x, gate_y pixels. Candidates in the same association
+ * grid cell are linked via next.
+ */
+struct candidate {
+	struct blob *blob;
+	int x;
+	int y;
+	int gate_x;
+	int gate_y;
+	int steps;
+	int next;
+	bool taken;
+};
+
+/*
+ * A possible association of a blob with a candidate at squared distance cost
+ */
+struct match {
+	int cost;
+	int blob;
+	int candidate;
+};
+
+struct blobwatch;
+
+/*
+ * A horizontal strip of scanlines [y0, y1) that is scanned independently.
+ * Blob properties are accumulated per strip local blob index, so that blobs
+ * crossing strip borders can be merged afterwards.
+ */
+struct strip {
+	struct blobwatch *bw;
+	int y0;
+	int y1;
+	/* current and previous scanline, alternating */
+	struct extent_line el[2];
+	/* copy of the first scanline */
+	struct extent_line top;
+	struct extent *extents;
+	struct span *spans;
+	int num_blobs;
+	int max_blobs;
+	int dropped_blobs;
+	struct blob_sums *blobs;
+	/* Sampled brightness histogram and brightest extent pixel */
+	uint32_t histogram[HISTOGRAM_BINS];
+	uint8_t peak;
+	pthread_t thread;
+	unsigned int generation;
+};
+
 /*
  * Blob detector internal state
  */
@@ -36,11 +173,245 @@ struct blobwatch {
 	int height;
 	int last_observation;
 	struct blobservation history[NUM_FRAMES_HISTORY];
-	struct extent_line el[480];
 	bool debug;
+	/* Identify blobs by their blinking pattern, if enabled */
+	bool flicker;
 	struct flicker *fl;
+
+	/* Strips, all but the first one are scanned by worker threads */
+	int num_strips;
+	struct strip *strips;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned int generation;
+	int pending;
+	bool quit;
+	/* Frame currently being scanned by the workers */
+	uint8_t *frame;
+	int pixel_stride;
+	bool roi_scan;
+
+	/* Blob detection threshold, adapted to the histogram if enabled */
+	uint8_t threshold;
+	bool auto_threshold;
+	uint32_t histogram[HISTOGRAM_BINS];
+
+	/* Blobs of all strips, and their union-find forest */
+	int max_merge;
+	struct blob_sums *merge;
+	int *parent;
+
+	/* Region of interest mode */
+	bool roi;
+	int full_scan_interval;
+	int frames_since_full_scan;
+	bool full_scan_requested;
+	int num_windows;
+	int max_windows;
+	struct window *windows;
+
+	/* Blob association */
+	int track_history;
+	int num_lost;
+	int max_lost;
+	struct lost_track *lost;
+	int num_candidates;
+	int max_candidates;
+	struct candidate *candidates;
+	int max_matches;
+	struct match *matches;
+	int grid_width;
+	int grid_height;
+	int *grid;
+	/* Expected image motion in pixels per frame, and the widest gate */
+	float image_motion;
+	int max_gate;
+
+	/* Blobs dropped since the last report, and the time of that report */
+	int dropped_blobs;
+	uint64_t dropped_report_ns;
 };
 
+/*
+ * Grows the array pointed to by array, with elements of the given size and
+ * currently *max_elements elements, to hold at least n elements.
+ *
+ * Returns 0 on success or -ENOMEM.
+ */
+static int reserve_array(void *array, int *max_elements, int n, size_t size)
+{
+	void **p = array;
+	void *new;
+	int max;
+
+	if (n <= *max_elements)
+		return 0;
+
+	max = max(max(n, 2 * *max_elements), INITIAL_BLOBS);
+
+	new = realloc(*p, max * size);
+	if (!new)
+		return -ENOMEM;
+	*p = new;
+	*max_elements = max;
+
+	return 0;
+}
+
+/*
+ * Grows the blob and tracking arrays of the observation ob to hold at least
+ * n blobs. The arrays are never shrunk, so that after a few frames no more
+ * allocations are needed.
+ *
+ * Returns 0 on success or -ENOMEM.
+ */
+static int blobservation_reserve(struct blobservation *ob, int n)
+{
+	/* Both arrays grow to the same size, only then update max_blobs */
+	int max_tracked = ob->max_blobs;
+
+	if (reserve_array(&ob->tracked, &max_tracked, n,
+			  sizeof(*ob->tracked)) < 0)
+		return -ENOMEM;
+
+	return reserve_array(&ob->blobs, &ob->max_blobs, n,
+			     sizeof(*ob->blobs));
+}
+
+/*
+ * Grows the blob array of strip st to hold at least n blobs.
+ *
+ * Returns 0 on success or -ENOMEM.
+ */
+static int strip_reserve(struct strip *st, int n)
+{
+	return reserve_array(&st->blobs, &st->max_blobs, n,
+			     sizeof(*st->blobs));
+}
+
+static void process_strip(struct blobwatch *bw, struct strip *st);
+
+/*
+ * Scans one strip per frame, woken up by blobwatch_process.
+ */
+static void *blobwatch_worker(void *data)
+{
+	struct strip *st = data;
+	struct blobwatch *bw = st->bw;
+
+	pthread_mutex_lock(&bw->lock);
+	for (;;) {
+		while (bw->generation == st->generation && !bw->quit)
+			pthread_cond_wait(&bw->start, &bw->lock);
+		if (bw->quit)
+			break;
+		st->generation = bw->generation;
+		pthread_mutex_unlock(&bw->lock);
+
+		process_strip(bw, st);
+
+		pthread_mutex_lock(&bw->lock);
+		if (--bw->pending == 0)
+			pthread_cond_signal(&bw->done);
+	}
+	pthread_mutex_unlock(&bw->lock);
+
+	return NULL;
+}
+
+/*
+ * Stops all worker threads and frees the strips.
+ */
+static void free_strips(struct blobwatch *bw)
+{
+	int i;
+
+	pthread_mutex_lock(&bw->lock);
+	bw->quit = true;
+	pthread_cond_broadcast(&bw->start);
+	pthread_mutex_unlock(&bw->lock);
+
+	for (i = 1; i < bw->num_strips; i++) {
+		if (bw->strips[i].bw)
+			pthread_join(bw->strips[i].thread, NULL);
+	}
+
+	for (i = 0; i < bw->num_strips; i++) {
+		free(bw->strips[i].extents);
+		free(bw->strips[i].spans);
+		free(bw->strips[i].blobs);
+	}
+	free(bw->strips);
+	bw->strips = NULL;
+	bw->num_strips = 0;
+	bw->quit = false;
+}
+
+/*
+ * Splits the frame into num_threads strips of equal height and starts a
+ * worker thread for every strip but the first, which is scanned by the
+ * thread calling blobwatch_process. Must not be called concurrently with
+ * blobwatch_process.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int blobwatch_set_threads(struct blobwatch *bw, int num_threads)
+{
+	int max_extents = (bw->width + 1) / 4;
+	struct strip *st;
+	int i, ret;
+
+	num_threads = min(max(num_threads, 1), bw->height);
+
+	free_strips(bw);
+
+	bw->strips = calloc(num_threads, sizeof(*bw->strips));
+	if (!bw->strips)
+		return -ENOMEM;
+	bw->num_strips = num_threads;
+
+	for (i = 0; i < num_threads; i++) {
+		st = &bw->strips[i];
+		st->y0 = i * bw->height / num_threads;
+		st->y1 = (i + 1) * bw->height / num_threads;
+
+		st->extents = calloc(3 * max_extents, sizeof(struct extent));
+		if (!st->extents || strip_reserve(st, INITIAL_BLOBS) < 0)
+			goto err;
+		st->el[0].extents = st->extents;
+		st->el[1].extents = st->extents + max_extents;
+		st->top.extents = st->extents + 2 * max_extents;
+		st->el[0].max = st->el[1].max = st->top.max = max_extents;
+
+		if (bw->max_windows) {
+			st->spans = malloc(bw->max_windows * sizeof(struct span));
+			if (!st->spans)
+				goto err;
+		}
+	}
+
+	for (i = 1; i < num_threads; i++) {
+		st = &bw->strips[i];
+		st->bw = bw;
+		st->generation = bw->generation;
+		ret = pthread_create(&st->thread, NULL, blobwatch_worker, st);
+		if (ret) {
+			st->bw = NULL;
+			free_strips(bw);
+			return -ret;
+		}
+		/* Workers inherit the scheduling policy of the caller */
+		pthread_setname_np(st->thread, "blobwatch");
+	}
+
+	return 0;
+
+err:
+	free_strips(bw);
+	return -ENOMEM;
+}
+
 /*
  * Allocates and initializes blobwatch structure.
  *
@@ -49,6 +420,7 @@ struct blobwatch {
 struct blobwatch *blobwatch_new(int width, int height)
 {
 	struct blobwatch *bw = malloc(sizeof(*bw));
+	int i;
 
 	if (!bw)
 		return NULL;
@@ -59,67 +431,543 @@ struct blobwatch *blobwatch_new(int width, int height)
 	bw->last_observation = -1;
 	bw->debug = true;
 	bw->fl = flicker_new();
+	bw->roi = false;
+	bw->track_history = DEFAULT_TRACK_HISTORY;
+	bw->threshold = DEFAULT_THRESHOLD;
+	bw->auto_threshold = false;
+	pthread_mutex_init(&bw->lock, NULL);
+	pthread_cond_init(&bw->start, NULL);
+	pthread_cond_init(&bw->done, NULL);
+
+	if (blobwatch_set_threads(bw, 1) < 0)
+		goto err;
+
+	bw->grid_width = (width + (1 << GRID_CELL_SHIFT) - 1) >>
+			 GRID_CELL_SHIFT;
+	bw->grid_height = (height + (1 << GRID_CELL_SHIFT) - 1) >>
+			  GRID_CELL_SHIFT;
+	bw->grid = malloc(bw->grid_width * bw->grid_height * sizeof(int));
+	if (!bw->grid)
+		goto err;
+
+	for (i = 0; i < NUM_FRAMES_HISTORY; i++) {
+		if (blobservation_reserve(&bw->history[i], INITIAL_BLOBS) < 0)
+			goto err;
+	}
 
 	return bw;
+
+err:
+	blobwatch_free(bw);
+	return NULL;
 }
 
 /*
- * Stores blob information collected in the last extent e into the blob
- * array b at index e->index.
+ * Frees the blobwatch structure and all per-frame storage.
  */
-static inline void store_blob(struct extent *e, int y, struct blob *b)
+void blobwatch_free(struct blobwatch *bw)
 {
-	b += e->index;
+	int i;
+
+	if (!bw)
+		return;
+
+	for (i = 0; i < NUM_FRAMES_HISTORY; i++) {
+		free(bw->history[i].blobs);
+		free(bw->history[i].tracked);
+	}
+	free_strips(bw);
+	pthread_cond_destroy(&bw->done);
+	pthread_cond_destroy(&bw->start);
+	pthread_mutex_destroy(&bw->lock);
+	free(bw->windows);
+	free(bw->lost);
+	free(bw->candidates);
+	free(bw->matches);
+	free(bw->grid);
+	free(bw->merge);
+	free(bw->parent);
+	flicker_free(bw->fl);
+	free(bw);
+}
+
+/*
+ * Enables or disables region of interest mode. In ROI mode, only padded
+ * windows around the predicted positions of previously observed blobs are
+ * scanned. Every full_scan_interval frames, or if there are no blobs left to
+ * track, the whole frame is scanned to pick up new blobs.
+ */
+void blobwatch_set_roi(struct blobwatch *bw, bool enable,
+		       int full_scan_interval)
+{
+	bw->roi = enable;
+	bw->full_scan_interval = full_scan_interval;
+	bw->full_scan_requested = true;
+}
+
+/*
+ * Enables or disables adapting the blob detection threshold to the
+ * brightness of the scene. If disabled, the fixed default threshold is used.
+ */
+void blobwatch_set_auto_threshold(struct blobwatch *bw, bool enable)
+{
+	bw->auto_threshold = enable;
+	if (!enable)
+		bw->threshold = DEFAULT_THRESHOLD;
+}
+
+/*
+ * Sets the number of frames a track is kept after its blob was last seen,
+ * so that it can be continued if the blob reappears near its predicted
+ * position after a short occlusion.
+ */
+void blobwatch_set_track_history(struct blobwatch *bw, int frames)
+{
+	bw->track_history = max(frames, 0);
+	if (!bw->track_history)
+		bw->num_lost = 0;
+}
+
+/*
+ * Requests that the next frame is scanned completely, for example after
+ * tracking was lost.
+ */
+void blobwatch_request_full_scan(struct blobwatch *bw)
+{
+	bw->full_scan_requested = true;
+}
+
+/*
+ * Enables or disables LED identification by blinking pattern. This should
+ * only be enabled while the tracked device makes its LEDs blink.
+ */
+void blobwatch_set_flicker(struct blobwatch *bw, bool enable)
+{
+	bw->flicker = enable && bw->fl;
+}
+
+/*
+ * Sets the LED blinking pattern phase of the next frame, if the device
+ * reports it, or -1.
+ */
+void blobwatch_set_led_phase(struct blobwatch *bw, int led_phase)
+{
+	if (bw->fl)
+		flicker_set_led_phase(bw->fl, led_phase);
+}
+
+/*
+ * Sets the mask of LEDs that the flicker detector may assign to blobs.
+ */
+void blobwatch_set_visible_leds(struct blobwatch *bw, uint64_t visible)
+{
+	if (bw->fl)
+		flicker_set_visible(bw->fl, visible);
+}
+
+/*
+ * Sets the image motion in pixels per frame that is expected in the next
+ * frame from the IMU angular rate and velocity, or 0 if unknown. Association
+ * gates are widened accordingly, so that tracks survive fast motion.
+ */
+void blobwatch_set_image_motion(struct blobwatch *bw, float motion)
+{
+	bw->image_motion = motion > 0 ? motion : 0;
+}
+
+/*
+ * Stores blob information accumulated in e into blob b.
+ */
+static inline void store_blob(const struct blob_sums *e, struct blob *b)
+{
+	double cx = (double)e->sum_ix / e->sum_i;
+	double cy = (double)e->sum_iy / e->sum_i;
+	int y = e->bottom;
+
 	b->x = (e->left + e->right) / 2;
 	b->y = (e->top + y) / 2;
 	b->vx = 0;
 	b->vy = 0;
+	b->cx = cx;
+	b->cy = cy;
+	/* Rounding cx to float would dominate the variance of small blobs */
+	b->cxx = (double)e->sum_ixx / e->sum_i - cx * cx;
+	b->cxy = (double)e->sum_ixy / e->sum_i - cx * cy;
+	b->cyy = (double)e->sum_iyy / e->sum_i - cy * cy;
 	b->width = e->right - e->left + 1;
 	b->height = y - e->top + 1;
 	b->area = e->area;
 	b->age = 0;
 	b->track_index = -1;
 	b->pattern = 0;
+	b->pattern_known = 0;
 	b->led_id = -1;
 }
 
 /*
- * Collects contiguous ranges of pixels with values larger than a threshold of
- * 0x9f in a given scanline and stores them in extents. Processing stops after
- * num_extents.
+ * Returns the index of the first pixel at or after position x whose value
+ * exceeds the threshold, or width if there is none.
+ */
+static inline int find_above_gray(const uint8_t *line, int x, int width,
+				  uint8_t threshold)
+{
+#if defined(__AVX2__)
+	const __m256i t = _mm256_set1_epi8(threshold + 1);
+
+	for (; x + 32 <= width; x += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(line + x));
+		uint32_t mask = _mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(_mm256_max_epu8(v, t), v));
+		if (mask)
+			return x + __builtin_ctz(mask);
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i t16 = _mm_set1_epi8(threshold + 1);
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(line + x));
+		uint32_t mask = _mm_movemask_epi8(
+				_mm_cmpeq_epi8(_mm_max_epu8(v, t16), v));
+		if (mask)
+			return x + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t t = vdupq_n_u8(threshold);
+
+	for (; x + 16 <= width; x += 16) {
+		uint8x16_t above = vcgtq_u8(vld1q_u8(line + x), t);
+		/* Narrow to 4 bits per pixel to get a 64-bit mask */
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+				vshrn_n_u16(vreinterpretq_u16_u8(above), 4)), 0);
+		if (mask)
+			return x + (__builtin_ctzll(mask) >> 2);
+	}
+#endif
+	for (; x < width; x++) {
+		if (line[x] > threshold)
+			return x;
+	}
+
+	return width;
+}
+
+/*
+ * Returns the index of the first pixel at or after position x whose value
+ * does not exceed the threshold, or width if there is none.
+ */
+static inline int find_below_gray(const uint8_t *line, int x, int width,
+				  uint8_t threshold)
+{
+#if defined(__AVX2__)
+	const __m256i t = _mm256_set1_epi8(threshold + 1);
+
+	for (; x + 32 <= width; x += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(line + x));
+		uint32_t mask = ~_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(_mm256_max_epu8(v, t), v));
+		if (mask)
+			return x + __builtin_ctz(mask);
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i t16 = _mm_set1_epi8(threshold + 1);
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(line + x));
+		uint32_t mask = ~_mm_movemask_epi8(
+				_mm_cmpeq_epi8(_mm_max_epu8(v, t16), v)) &
+				0xffff;
+		if (mask)
+			return x + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t t = vdupq_n_u8(threshold);
+
+	for (; x + 16 <= width; x += 16) {
+		uint8x16_t below = vcleq_u8(vld1q_u8(line + x), t);
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+				vshrn_n_u16(vreinterpretq_u16_u8(below), 4)), 0);
+		if (mask)
+			return x + (__builtin_ctzll(mask) >> 2);
+	}
+#endif
+	for (; x < width; x++) {
+		if (line[x] <= threshold)
+			return x;
+	}
+
+	return width;
+}
+
+#if defined(__AVX2__)
+/*
+ * Loads the luma components of 32 YUYV pixels.
+ */
+static inline __m256i load_luma_avx2(const uint8_t *yuyv)
+{
+	const __m256i mask = _mm256_set1_epi16(0x00ff);
+	__m256i lo = _mm256_loadu_si256((const __m256i *)yuyv);
+	__m256i hi = _mm256_loadu_si256((const __m256i *)(yuyv + 32));
+
+	/* packus interleaves 128-bit lanes, restore the pixel order */
+	return _mm256_permute4x64_epi64(
+			_mm256_packus_epi16(_mm256_and_si256(lo, mask),
+					    _mm256_and_si256(hi, mask)), 0xd8);
+}
+#endif
+
+#if defined(__SSE2__)
+/*
+ * Loads the luma components of 16 YUYV pixels.
+ */
+static inline __m128i load_luma_sse2(const uint8_t *yuyv)
+{
+	const __m128i mask = _mm_set1_epi16(0x00ff);
+	__m128i lo = _mm_loadu_si128((const __m128i *)yuyv);
+	__m128i hi = _mm_loadu_si128((const __m128i *)(yuyv + 16));
+
+	return _mm_packus_epi16(_mm_and_si128(lo, mask),
+				_mm_and_si128(hi, mask));
+}
+#endif
+
+/*
+ * Same as find_above_gray, but reads the luma components of YUYV pixels
+ * directly, without prior conversion to grayscale.
+ */
+static inline int find_above_yuyv(const uint8_t *line, int x, int width,
+				  uint8_t threshold)
+{
+#if defined(__AVX2__)
+	const __m256i t = _mm256_set1_epi8(threshold + 1);
+
+	for (; x + 32 <= width; x += 32) {
+		__m256i v = load_luma_avx2(line + 2 * x);
+		uint32_t mask = _mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(_mm256_max_epu8(v, t), v));
+		if (mask)
+			return x + __builtin_ctz(mask);
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i t16 = _mm_set1_epi8(threshold + 1);
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i v = load_luma_sse2(line + 2 * x);
+		uint32_t mask = _mm_movemask_epi8(
+				_mm_cmpeq_epi8(_mm_max_epu8(v, t16), v));
+		if (mask)
+			return x + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t t = vdupq_n_u8(threshold);
+
+	for (; x + 16 <= width; x += 16) {
+		/* De-interleave luma and chroma components */
+		uint8x16_t above = vcgtq_u8(vld2q_u8(line + 2 * x).val[0], t);
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+				vshrn_n_u16(vreinterpretq_u16_u8(above), 4)), 0);
+		if (mask)
+			return x + (__builtin_ctzll(mask) >> 2);
+	}
+#endif
+	for (; x < width; x++) {
+		if (line[2 * x] > threshold)
+			return x;
+	}
+
+	return width;
+}
+
+/*
+ * Same as find_below_gray, but reads the luma components of YUYV pixels
+ * directly, without prior conversion to grayscale.
+ */
+static inline int find_below_yuyv(const uint8_t *line, int x, int width,
+				  uint8_t threshold)
+{
+#if defined(__AVX2__)
+	const __m256i t = _mm256_set1_epi8(threshold + 1);
+
+	for (; x + 32 <= width; x += 32) {
+		__m256i v = load_luma_avx2(line + 2 * x);
+		uint32_t mask = ~_mm256_movemask_epi8(
+				_mm256_cmpeq_epi8(_mm256_max_epu8(v, t), v));
+		if (mask)
+			return x + __builtin_ctz(mask);
+	}
+#endif
+#if defined(__SSE2__)
+	const __m128i t16 = _mm_set1_epi8(threshold + 1);
+
+	for (; x + 16 <= width; x += 16) {
+		__m128i v = load_luma_sse2(line + 2 * x);
+		uint32_t mask = ~_mm_movemask_epi8(
+				_mm_cmpeq_epi8(_mm_max_epu8(v, t16), v)) &
+				0xffff;
+		if (mask)
+			return x + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t t = vdupq_n_u8(threshold);
+
+	for (; x + 16 <= width; x += 16) {
+		uint8x16_t below = vcleq_u8(vld2q_u8(line + 2 * x).val[0], t);
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+				vshrn_n_u16(vreinterpretq_u16_u8(below), 4)), 0);
+		if (mask)
+			return x + (__builtin_ctzll(mask) >> 2);
+	}
+#endif
+	for (; x < width; x++) {
+		if (line[2 * x] <= threshold)
+			return x;
+	}
+
+	return width;
+}
+
+/*
+ * Returns the index of the first pixel at or after position x whose value
+ * exceeds the threshold. Pixels are pixel_stride bytes apart: 1 for GRAY8,
+ * 2 for the luma components of YUYV.
+ */
+static inline int find_above(const uint8_t *line, int x, int width,
+			     int pixel_stride, uint8_t threshold)
+{
+	if (pixel_stride == 2)
+		return find_above_yuyv(line, x, width, threshold);
+	return find_above_gray(line, x, width, threshold);
+}
+
+/*
+ * Returns the index of the first pixel at or after position x whose value
+ * does not exceed the threshold.
+ */
+static inline int find_below(const uint8_t *line, int x, int width,
+			     int pixel_stride, uint8_t threshold)
+{
+	if (pixel_stride == 2)
+		return find_below_yuyv(line, x, width, threshold);
+	return find_below_gray(line, x, width, threshold);
+}
+
+/*
+ * Accumulates the properties of b into a.
+ */
+static inline void merge_sums(struct blob_sums *a, const struct blob_sums *b)
+{
+	a->top = min(a->top, b->top);
+	a->bottom = max(a->bottom, b->bottom);
+	a->left = min(a->left, b->left);
+	a->right = max(a->right, b->right);
+	a->area += b->area;
+	a->sum_i += b->sum_i;
+	a->sum_ix += b->sum_ix;
+	a->sum_iy += b->sum_iy;
+	a->sum_ixx += b->sum_ixx;
+	a->sum_ixy += b->sum_ixy;
+	a->sum_iyy += b->sum_iyy;
+}
+
+/*
+ * Initializes the intensity weighted moments in e from the pixels start to
+ * end of the scanline at row y. All of these pixels are known to exceed the
+ * threshold, so the weights are strictly positive.
+ *
+ * Returns the brightest pixel value of the extent.
+ */
+static inline uint8_t extent_moments(const uint8_t *line, int pixel_stride,
+				     int start, int end, int y,
+				     uint8_t threshold, struct blob_sums *e)
+{
+	uint32_t sum_i = 0;
+	uint64_t sum_ix = 0;
+	uint64_t sum_ixx = 0;
+	uint8_t peak = 0;
+	int x;
+
+	for (x = start; x <= end; x++) {
+		uint8_t value = line[x * pixel_stride];
+		uint32_t i = value - threshold;
+
+		peak = max(peak, value);
+		sum_i += i;
+		sum_ix += i * x;
+		sum_ixx += (uint64_t)(i * x) * x;
+	}
+
+	e->sum_i = sum_i;
+	e->sum_ix = sum_ix;
+	e->sum_iy = (uint64_t)sum_i * y;
+	e->sum_ixx = sum_ixx;
+	e->sum_ixy = sum_ix * y;
+	e->sum_iyy = (uint64_t)sum_i * y * y;
+
+	return peak;
+}
+
+/*
+ * Collects contiguous ranges of pixels with values larger than the current
+ * threshold in a given scanline and stores them in extents, together with their
+ * intensity weighted moments. Processing stops after num_extents. Where
+ * available, SIMD compare masks are used to find extent boundaries 16 or 32
+ * pixels at a time.
  * Extents are marked with the same index as overlapping extents of the previous
- * scanline, and properties of the formed blobs are accumulated.
+ * scanline, and properties of the formed blobs are accumulated directly into
+ * the blob array of strip st, so that the extent lines only carry what is
+ * needed to find the overlaps.
  *
  * Returns the number of extents found.
  */
-static int process_scanline(uint8_t *line, int width, int height, int y,
+static int process_scanline(uint8_t *line, int pixel_stride, uint8_t threshold,
+			    const struct span *spans, int num_spans,
+			    int height, int y,
 			    struct extent_line *el, struct extent_line *prev_el,
-			    int index, struct blobservation *ob)
+			    int index, struct strip *st)
 {
-	struct extent *le_end = prev_el->extents;
-	struct extent *le = prev_el->extents;
+	const struct span *span = spans;
+	struct extent *le_end = NULL;
+	struct extent *le = NULL;
 	struct extent *extent = el->extents;
-	struct blob *blobs = ob->blobs;
-	int num_extents = MAX_EXTENTS_PER_LINE;
-	int num_blobs = MAX_BLOBS_PER_FRAME;
+	int num_extents = el->max;
+	int num_blobs = st->max_blobs;
+	struct blob_sums sums;
+	uint8_t peak;
 	int center;
 	int x, e = 0;
+	int width;
+
+	if (prev_el) {
+		le = prev_el->extents;
+		le_end = le + prev_el->num;
+	}
+
+	if (!num_spans)
+		goto done;
 
-	if (prev_el)
-		le_end += prev_el->num;
+	x = span->start;
+	width = span->end;
 
-	for (x = 0; x < width; x++) {
+	for (;; x++) {
 		int start, end;
 
-		/* Loop until pixel value exceeds threshold */
-		if (line[x] <= THRESHOLD)
+		/* Skip ahead until pixel value exceeds threshold */
+		x = find_above(line, x, width, pixel_stride, threshold);
+		if (x == width) {
+			/* Continue with the next window on this line */
+			if (++span == spans + num_spans)
+				break;
+			x = span->start - 1;
+			width = span->end;
 			continue;
+		}
 
 		start = x++;
 
-		/* Loop until pixel value falls below threshold */
-		while (x < width && line[x] > THRESHOLD)
-			x++;
+		/* Skip ahead until pixel value falls below threshold */
+		x = find_below(line, x, width, pixel_stride, threshold);
 
 		end = x - 1;
 		/* Filter out single pixel and two-pixel extents */
@@ -131,16 +979,23 @@ static int process_scanline(uint8_t *line, int width, int height, int y,
 		extent->start = start;
 		extent->end = end;
 		extent->index = index;
-		extent->area = x - start;
+
+		sums.top = y;
+		sums.bottom = min(y + 1, height - 1);
+		sums.left = start;
+		sums.right = end;
+		sums.area = x - start;
+		peak = extent_moments(line, pixel_stride, start, end, y,
+				      threshold, &sums);
+		st->peak = max(st->peak, peak);
 
 		if (prev_el && index < num_blobs) {
 			/*
 			 * Previous extents without significant overlap are the
-			 * bottom of finished blobs. Store them into an array.
+			 * bottom of finished blobs, skip them.
 			 */
-			while (le < le_end && le->end < center &&
-			       le->index < num_blobs)
-				store_blob(le++, y, blobs);
+			while (le < le_end && le->end < center)
+				le++;
 
 			/*
 			 * A previous extent with significant overlap is
@@ -148,11 +1003,8 @@ static int process_scanline(uint8_t *line, int width, int height, int y,
 			 */
 			if (le < le_end &&
 			    le->start <= center && le->end > center) {
-				extent->top = le->top;
-				extent->left = min(extent->start, le->left);
-				extent->right = max(extent->end, le->right);
-				extent->area += le->area;
 				extent->index = le->index;
+				merge_sums(&st->blobs[le->index], &sums);
 				le++;
 			}
 		}
@@ -162,10 +1014,14 @@ static int process_scanline(uint8_t *line, int width, int height, int y,
 		 * blob index.
 		 */
 		if (extent->index == index) {
-			extent->top = y;
-			extent->left = extent->start;
-			extent->right = extent->end;
+			if (index < num_blobs)
+				st->blobs[index] = sums;
 			index++;
+
+			/* Make room for the next blob, if possible */
+			if (index == num_blobs &&
+			    strip_reserve(st, index + 1) == 0)
+				num_blobs = st->max_blobs;
 		}
 
 		if (++e == num_extents)
@@ -173,62 +1029,419 @@ static int process_scanline(uint8_t *line, int width, int height, int y,
 		extent++;
 	}
 
-	if (prev_el) {
-		/*
-		 * If there are no more extents on this line, all remaining
-		 * extents in the previous line are finished blobs. Store them.
-		 */
-		while (le < le_end && le->index < num_blobs)
-			store_blob(le++, y, blobs);
+done:
+	el->num = e;
+
+	return index;
+}
+
+/*
+ * Collects blobs of the last observation and lost tracks as candidates for
+ * association with the blobs of the next frame, and predicts their positions.
+ *
+ * Returns the number of candidates.
+ */
+static int collect_candidates(struct blobwatch *bw, struct blobservation *ob)
+{
+	struct candidate *c;
+	struct blob *b;
+	int i, n = ob->num_blobs + bw->num_lost;
+	int motion;
+
+	if (reserve_array(&bw->candidates, &bw->max_candidates, n,
+			  sizeof(*c)) < 0)
+		n = 0;
+
+	bw->max_gate = 0;
+
+	for (i = 0; i < n; i++) {
+		c = &bw->candidates[i];
+		if (i < ob->num_blobs) {
+			b = &ob->blobs[i];
+			c->steps = 1;
+		} else {
+			b = &bw->lost[i - ob->num_blobs].blob;
+			c->steps = bw->lost[i - ob->num_blobs].missed + 1;
+		}
+		c->blob = b;
+		c->x = b->x + b->vx * c->steps;
+		c->y = b->y + b->vy * c->steps;
+		motion = bw->image_motion * c->steps;
+		c->gate_x = min((abs(b->vx) * c->steps + motion) / 2,
+				MAX_GATE_MARGIN);
+		c->gate_y = min((abs(b->vy) * c->steps + motion) / 2,
+				MAX_GATE_MARGIN);
+		bw->max_gate = max(bw->max_gate, max(c->gate_x, c->gate_y));
+		c->taken = false;
 	}
 
-	el->num = e;
+	bw->num_candidates = n;
+
+	return n;
+}
+
+/*
+ * Calculates padded windows around the predicted positions of all candidate
+ * blobs, sorted by their left edge.
+ */
+static int predict_windows(struct blobwatch *bw)
+{
+	struct window *windows;
+	struct span *spans;
+	int num = bw->num_candidates;
+	int i, j, n = 0;
 
-	if (y == height - 1) {
-		/* All extents of the last line are finished blobs, too. */
-		for (extent = el->extents; extent < el->extents + el->num;
-		     extent++) {
-			if (extent->index < num_blobs)
-				store_blob(extent, y, blobs);
+	if (num > bw->max_windows) {
+		windows = realloc(bw->windows, num * sizeof(*windows));
+		if (!windows)
+			return 0;
+		bw->windows = windows;
+		for (i = 0; i < bw->num_strips; i++) {
+			spans = realloc(bw->strips[i].spans,
+					num * sizeof(*spans));
+			if (!spans)
+				return 0;
+			bw->strips[i].spans = spans;
 		}
+		bw->max_windows = num;
 	}
 
-	return index;
+	windows = bw->windows;
+	for (i = 0; i < num; i++) {
+		struct candidate *c = &bw->candidates[i];
+		struct blob *b = c->blob;
+		int x = c->x;
+		int y = c->y;
+		int rx = b->width / 2 + abs(b->vx) * c->steps + c->gate_x +
+			 ROI_PADDING;
+		int ry = b->height / 2 + abs(b->vy) * c->steps + c->gate_y +
+			 ROI_PADDING;
+		struct window w = {
+			.x0 = max(x - rx, 0),
+			.y0 = max(y - ry, 0),
+			.x1 = min(x + rx + 1, bw->width),
+			.y1 = min(y + ry + 1, bw->height),
+		};
+
+		if (w.x0 >= w.x1 || w.y0 >= w.y1)
+			continue;
+
+		/* Insertion sort by left edge */
+		for (j = n; j > 0 && windows[j - 1].x0 > w.x0; j--)
+			windows[j] = windows[j - 1];
+		windows[j] = w;
+		n++;
+	}
+
+	bw->num_windows = n;
+
+	return n;
 }
 
 /*
- * Collects extents from all scanlines in a frame and stores them in
- * the extent_line array el.
+ * Collects the merged, sorted horizontal spans of all windows that
+ * intersect scanline y.
  */
-static void process_frame(uint8_t *lines, int width, int height,
-			  struct extent_line *el, struct blobservation *ob)
+static int window_spans(struct window *windows, int num_windows, int y,
+			struct span *spans)
 {
-	struct extent_line *last_el;
+	struct window *w;
+	int n = 0;
+
+	for (w = windows; w < windows + num_windows; w++) {
+		if (y < w->y0 || y >= w->y1)
+			continue;
+
+		if (n && w->x0 <= spans[n - 1].end) {
+			spans[n - 1].end = max(spans[n - 1].end, w->x1);
+		} else {
+			spans[n].start = w->x0;
+			spans[n].end = w->x1;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Collects extents from all scanlines in the strip st, alternating between
+ * the two extent lines for the current and previous scanline. In ROI mode,
+ * only the windows around predicted blob positions are scanned, skipping all
+ * other pixels.
+ */
+static void process_strip(struct blobwatch *bw, struct strip *st)
+{
+	int stride = bw->width * bw->pixel_stride;
+	uint8_t *lines = bw->frame + st->y0 * stride;
+	struct span span = { .start = 0, .end = bw->width };
+	const struct span *spans = &span;
+	uint8_t threshold = bw->threshold;
+	int num_spans = 1;
 	int index = 0;
-	int y;
+	int x, y;
+
+	memset(st->histogram, 0, sizeof(st->histogram));
+	st->peak = 0;
+
+	for (y = st->y0; y < st->y1; y++, lines += stride) {
+		/* Sample the whole frame, even in ROI mode */
+		if ((y & (HISTOGRAM_SAMPLING - 1)) == 0) {
+			for (x = 0; x < bw->width; x += HISTOGRAM_SAMPLING) {
+				st->histogram[lines[x * bw->pixel_stride] >>
+					      HISTOGRAM_BIN_SHIFT]++;
+			}
+		}
+		if (bw->roi_scan) {
+			num_spans = window_spans(bw->windows, bw->num_windows,
+						 y, st->spans);
+			spans = st->spans;
+		}
+		index = process_scanline(lines, bw->pixel_stride, threshold,
+					 spans, num_spans, bw->height, y,
+					 &st->el[y & 1],
+					 y > st->y0 ? &st->el[~y & 1] : NULL,
+					 index, st);
+		if (y == st->y0) {
+			memcpy(st->top.extents, st->el[y & 1].extents,
+			       st->el[y & 1].num * sizeof(struct extent));
+			st->top.num = st->el[y & 1].num;
+		}
+	}
+
+	st->num_blobs = min(st->max_blobs, index);
+	st->dropped_blobs = index - st->num_blobs;
+}
+
+/*
+ * Returns the root of the union-find tree containing blob i.
+ */
+static int find_root(int *parent, int i)
+{
+	while (parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+
+	return i;
+}
+
+/*
+ * Merges the trees containing blobs i and j. The root with the lower index
+ * is kept, so that blobs stay sorted by the strip they start in.
+ */
+static void union_blobs(int *parent, int i, int j)
+{
+	i = find_root(parent, i);
+	j = find_root(parent, j);
+
+	if (i < j)
+		parent[j] = i;
+	else
+		parent[i] = j;
+}
+
+/*
+ * Links blobs crossing the border between strips upper and lower, using
+ * the same overlap rule as process_scanline.
+ */
+static void link_strips(struct strip *upper, int upper_offset,
+			struct strip *lower, int lower_offset, int *parent)
+{
+	struct extent_line *el = &upper->el[(upper->y1 - 1) & 1];
+	struct extent *le = el->extents;
+	struct extent *le_end = le + el->num;
+	struct extent *extent;
+	int center;
+
+	for (extent = lower->top.extents;
+	     extent < lower->top.extents + lower->top.num; extent++) {
+		center = (extent->start + extent->end) / 2;
+
+		while (le < le_end && le->end < center)
+			le++;
+
+		if (le < le_end && le->start <= center && le->end > center) {
+			if (le->index < upper->num_blobs &&
+			    extent->index < lower->num_blobs) {
+				union_blobs(parent, upper_offset + le->index,
+					    lower_offset + extent->index);
+			}
+			le++;
+		}
+	}
+}
+
+/*
+ * Merges blobs that cross strip borders and stores all blobs found in the
+ * frame into the observation ob.
+ */
+static void merge_strips(struct blobwatch *bw, struct blobservation *ob)
+{
+	struct blob_sums *merge = bw->merge;
+	int *parent = bw->parent;
+	int offset, num, dropped;
+	int i, n;
+
+	num = 0;
+	dropped = 0;
+	for (i = 0; i < bw->num_strips; i++) {
+		num += bw->strips[i].num_blobs;
+		dropped += bw->strips[i].dropped_blobs;
+	}
+
+	if (num > bw->max_merge) {
+		merge = realloc(bw->merge, num * sizeof(*merge));
+		if (merge)
+			bw->merge = merge;
+		parent = realloc(bw->parent, num * sizeof(*parent));
+		if (parent)
+			bw->parent = parent;
+		if (!merge || !parent) {
+			ob->num_blobs = 0;
+			ob->dropped_blobs = num + dropped;
+			return;
+		}
+		bw->max_merge = num;
+	}
+
+	offset = 0;
+	for (i = 0; i < bw->num_strips; i++) {
+		struct strip *st = &bw->strips[i];
+
+		memcpy(merge + offset, st->blobs,
+		       st->num_blobs * sizeof(*merge));
+		offset += st->num_blobs;
+	}
+
+	for (i = 0; i < num; i++)
+		parent[i] = i;
+
+	offset = 0;
+	for (i = 1; i < bw->num_strips; i++) {
+		struct strip *upper = &bw->strips[i - 1];
+
+		link_strips(upper, offset, &bw->strips[i],
+			    offset + upper->num_blobs, parent);
+		offset += upper->num_blobs;
+	}
+
+	/* Roots always precede the other blobs in their tree */
+	for (i = 0; i < num; i++) {
+		n = find_root(parent, i);
+		if (n != i)
+			merge_sums(&merge[n], &merge[i]);
+	}
+
+	n = 0;
+	for (i = 0; i < num; i++) {
+		if (parent[i] != i)
+			continue;
+		if (n == ob->max_blobs && blobservation_reserve(ob, n + 1) < 0) {
+			dropped++;
+			continue;
+		}
+		store_blob(&merge[i], &ob->blobs[n++]);
+	}
+
+	ob->num_blobs = n;
+	ob->dropped_blobs = dropped;
+}
+
+/*
+ * Scans all strips of the frame, in parallel if there are worker threads,
+ * and collects the blobs into the observation ob.
+ */
+static void process_frame(struct blobwatch *bw, uint8_t *frame,
+			  int pixel_stride, bool roi_scan,
+			  struct blobservation *ob)
+{
+	int i, j;
 
-	ob->num_blobs = 0;
+	bw->frame = frame;
+	bw->pixel_stride = pixel_stride;
+	bw->roi_scan = roi_scan;
 
-	index = process_scanline(lines, width, height, 0, el, NULL, 0, ob);
+	if (bw->num_strips > 1) {
+		pthread_mutex_lock(&bw->lock);
+		bw->pending = bw->num_strips - 1;
+		bw->generation++;
+		pthread_cond_broadcast(&bw->start);
+		pthread_mutex_unlock(&bw->lock);
+	}
+
+	process_strip(bw, &bw->strips[0]);
+
+	if (bw->num_strips > 1) {
+		pthread_mutex_lock(&bw->lock);
+		while (bw->pending)
+			pthread_cond_wait(&bw->done, &bw->lock);
+		pthread_mutex_unlock(&bw->lock);
+	}
+
+	merge_strips(bw, ob);
+
+	memset(bw->histogram, 0, sizeof(bw->histogram));
+	ob->peak = 0;
+	for (i = 0; i < bw->num_strips; i++) {
+		for (j = 0; j < HISTOGRAM_BINS; j++)
+			bw->histogram[j] += bw->strips[i].histogram[j];
+		ob->peak = max(ob->peak, bw->strips[i].peak);
+	}
+	ob->threshold = bw->threshold;
+}
 
-	for (y = 1; y < height; y++) {
-		last_el = el++;
-		lines += width;
-		index = process_scanline(lines, width, height, y, el, last_el,
-					 index, ob);
+/*
+ * Estimates the background level as the 99th percentile of the sampled
+ * pixel values, which are dominated by the scene rather than by the few
+ * LED pixels, and moves the threshold a margin above it. If there are
+ * many more blobs than LEDs, the threshold is raised further to get rid of
+ * reflections and light sources, until the blob count falls again. This
+ * keeps the cost of association and pose estimation bounded.
+ */
+static void update_threshold(struct blobwatch *bw, struct blobservation *ob,
+			     int num_leds)
+{
+	uint32_t total = 0, seen = 0, rank;
+	bool too_many;
+	int i, target, diff;
+
+	for (i = 0; i < HISTOGRAM_BINS; i++)
+		total += bw->histogram[i];
+	rank = total - total / 100;
+	for (i = 0; i < HISTOGRAM_BINS - 1; i++) {
+		seen += bw->histogram[i];
+		if (seen >= rank)
+			break;
 	}
+	ob->background = ((i + 1) << HISTOGRAM_BIN_SHIFT) - 1;
+
+	if (!bw->auto_threshold)
+		return;
+
+	too_many = num_leds && ob->num_blobs > 2 * num_leds;
+	target = ob->background + THRESHOLD_MARGIN;
+	if (too_many)
+		target = max(target, bw->threshold + THRESHOLD_STEP);
+	else if (num_leds && ob->num_blobs > num_leds)
+		target = max(target, bw->threshold);
+	target = min(max(target, THRESHOLD_MIN), THRESHOLD_MAX);
 
-	ob->num_blobs = min(MAX_BLOBS_PER_FRAME, index);
+	diff = target - bw->threshold;
+	if (!too_many && abs(diff) <= THRESHOLD_HYSTERESIS)
+		return;
+
+	bw->threshold += min(max(diff, -THRESHOLD_STEP), THRESHOLD_STEP);
 }
 
 /*
  * Finds the first free tracking slot.
  */
-static int find_free_track(uint8_t *tracked)
+static int find_free_track(int32_t *tracked, int max_tracks)
 {
 	int i;
 
-	for (i = 0; i < MAX_BLOBS_PER_FRAME; i++) {
+	for (i = 0; i < max_tracks; i++) {
 		if (tracked[i] == 0)
 			return i;
 	}
@@ -236,80 +1449,317 @@ static int find_free_track(uint8_t *tracked)
 	return -1;
 }
 
+/*
+ * Returns the association grid cell containing position x, y, clamped to
+ * the grid.
+ */
+static inline int grid_cell(struct blobwatch *bw, int x, int y)
+{
+	x = min(max(x >> GRID_CELL_SHIFT, 0), bw->grid_width - 1);
+	y = min(max(y >> GRID_CELL_SHIFT, 0), bw->grid_height - 1);
+
+	return y * bw->grid_width + x;
+}
+
+static int compare_matches(const void *a, const void *b)
+{
+	const struct match *m1 = a;
+	const struct match *m2 = b;
+
+	if (m1->cost != m2->cost)
+		return m1->cost - m2->cost;
+	if (m1->candidate != m2->candidate)
+		return m1->candidate - m2->candidate;
+	return m1->blob - m2->blob;
+}
+
+/*
+ * Returns true if the elongated blob b could be the motion blurred image of
+ * candidate c's blob: its major axis has to be aligned with the candidate's
+ * motion, and the blur length must not exceed the distance travelled during
+ * a frame, with the same margin per frame as the gate. The length of a
+ * uniform streak is sqrt(12) times its standard deviation, so the blur
+ * length is estimated as the difference between the lengths along the
+ * major and minor axes.
+ */
+static bool blur_matches(struct blobwatch *bw, const struct blob *b,
+			 const struct candidate *c)
+{
+	float vx = c->blob->vx;
+	float vy = c->blob->vy;
+	float v2 = vx * vx + vy * vy;
+	float half = 0.5f * (b->cxx - b->cyy);
+	float root = __builtin_sqrtf(half * half + b->cxy * b->cxy);
+	float l1 = 0.5f * (b->cxx + b->cyy) + root;
+	float l2 = l1 - 2 * root;
+	float ex, ey, e2, dot, margin, blur;
+
+	if (v2 < 1.0f)
+		return false;
+
+	/* Major axis, from whichever eigenvector row is better conditioned */
+	if (b->cxx >= b->cyy) {
+		ex = l1 - b->cyy;
+		ey = b->cxy;
+	} else {
+		ex = b->cxy;
+		ey = l1 - b->cxx;
+	}
+	e2 = ex * ex + ey * ey;
+	dot = vx * ex + vy * ey;
+	if (dot * dot < BLUR_MIN_COS2 * v2 * e2)
+		return false;
+
+	margin = (float)(max(c->gate_x, c->gate_y) + BLUR_SLACK) / c->steps;
+	blur = __builtin_sqrtf(12.0f * l1) - __builtin_sqrtf(12.0f * max(l2, 0));
+
+	return blur <= __builtin_sqrtf(v2) + bw->image_motion + margin;
+}
+
+/*
+ * Collects all pairs of blobs in observation ob and candidates whose
+ * predicted position falls into the blob's bounding box, widened by the
+ * candidate's gate, looking up candidates in a spatial hash grid, sorted by
+ * increasing distance. Elongated blobs are only paired with candidates that
+ * move along their major axis.
+ *
+ * Returns the number of matches.
+ */
+static int find_matches(struct blobwatch *bw, struct blobservation *ob)
+{
+	struct candidate *candidates = bw->candidates;
+	int *grid = bw->grid;
+	int i, j, n = 0;
+	int cx, cy, cell;
+
+	for (i = 0; i < bw->grid_width * bw->grid_height; i++)
+		grid[i] = -1;
+
+	for (j = 0; j < bw->num_candidates; j++) {
+		cell = grid_cell(bw, candidates[j].x, candidates[j].y);
+		candidates[j].next = grid[cell];
+		grid[cell] = j;
+	}
+
+	for (i = 0; i < ob->num_blobs; i++) {
+		struct blob *b2 = &ob->blobs[i];
+		int x0 = b2->x - b2->width / 2 - bw->max_gate;
+		int y0 = b2->y - b2->height / 2 - bw->max_gate;
+		int x1 = b2->x + b2->width / 2 + bw->max_gate;
+		int y1 = b2->y + b2->height / 2 + bw->max_gate;
+		int c0 = grid_cell(bw, x0, y0);
+		int c1 = grid_cell(bw, x1, y1);
+		/* Tall and wide (<= 1:2, >= 2:1) blobs */
+		bool elongated = 2 * b2->width <= b2->height ||
+				 b2->width >= 2 * b2->height;
+
+		for (cy = c0 / bw->grid_width; cy <= c1 / bw->grid_width; cy++)
+		for (cx = c0 % bw->grid_width; cx <= c1 % bw->grid_width; cx++)
+		for (j = grid[cy * bw->grid_width + cx]; j >= 0;
+		     j = candidates[j].next) {
+			struct candidate *c = &candidates[j];
+			int dx = abs(c->x - b2->x);
+			int dy = abs(c->y - b2->y);
+
+			/*
+			 * Check if the estimated next position falls into
+			 * b2's bounding box, widened by the gate.
+			 */
+			if (2 * dx > b2->width + 2 * c->gate_x ||
+			    2 * dy > b2->height + 2 * c->gate_y)
+				continue;
+
+			if (elongated && !blur_matches(bw, b2, c))
+				continue;
+
+			if (reserve_array(&bw->matches, &bw->max_matches,
+					  n + 1, sizeof(struct match)) < 0)
+				goto out;
+
+			bw->matches[n].cost = dx * dx + dy * dy;
+			bw->matches[n].blob = i;
+			bw->matches[n].candidate = j;
+			n++;
+		}
+	}
+
+out:
+	qsort(bw->matches, n, sizeof(struct match), compare_matches);
+
+	return n;
+}
+
+/*
+ * Continues the tracks of candidates with the blobs at their predicted
+ * positions. Pairs are assigned greedily in order of increasing distance, so
+ * every candidate continues into at most one blob.
+ */
+static void associate_blobs(struct blobwatch *bw, struct blobservation *ob)
+{
+	int num_matches = find_matches(bw, ob);
+	struct match *m;
+
+	for (m = bw->matches; m < bw->matches + num_matches; m++) {
+		struct candidate *c = &bw->candidates[m->candidate];
+		struct blob *b1 = c->blob;
+		struct blob *b2 = &ob->blobs[m->blob];
+
+		if (c->taken || b2->age > 0)
+			continue;
+		c->taken = true;
+
+		b2->age = b1->age + 1;
+		if (b1->track_index >= 0 &&
+		    b1->track_index < ob->max_blobs &&
+		    ob->tracked[b1->track_index] == 0) {
+			/* Only overwrite tracks that are not already set */
+			b2->track_index = b1->track_index;
+			ob->tracked[b2->track_index] = m->blob + 1;
+			b2->pattern = b1->pattern;
+			b2->pattern_known = b1->pattern_known;
+			b2->led_id = b1->led_id;
+			/* Blinking pattern bits of missed frames are unknown */
+			flicker_skip_frames(b2, c->steps - 1);
+		}
+		b2->vx = (b2->x - b1->x) / c->steps;
+		b2->vy = (b2->y - b1->y) / c->steps;
+		b2->last_area = b1->area;
+	}
+}
+
+/*
+ * Keeps tracked candidates that were not continued in the current frame as
+ * lost tracks, until they have been missing for track_history frames.
+ */
+static void update_lost_tracks(struct blobwatch *bw,
+			       struct blobservation *last_ob)
+{
+	struct candidate *c = bw->candidates + last_ob->num_blobs;
+	int i, n = 0;
+
+	if (bw->num_candidates < last_ob->num_blobs + bw->num_lost) {
+		/* Candidates could not be allocated, drop all lost tracks */
+		bw->num_lost = 0;
+		return;
+	}
+
+	/* Age lost tracks, the candidate array still points into bw->lost */
+	for (i = 0; i < bw->num_lost; i++, c++) {
+		if (c->taken || bw->lost[i].missed >= bw->track_history)
+			continue;
+		bw->lost[n] = bw->lost[i];
+		bw->lost[n].missed++;
+		n++;
+	}
+
+	for (i = 0, c = bw->candidates; i < last_ob->num_blobs; i++, c++) {
+		if (c->taken || c->blob->track_index < 0 ||
+		    bw->track_history == 0)
+			continue;
+		if (reserve_array(&bw->lost, &bw->max_lost, n + 1,
+				  sizeof(struct lost_track)) < 0)
+			break;
+		bw->lost[n].blob = *c->blob;
+		bw->lost[n].missed = 1;
+		n++;
+	}
+
+	bw->num_lost = n;
+	bw->num_candidates = 0;
+}
+
 /*
  * Detects blobs in the current frame and compares them with the observation
- * history.
+ * history. Consecutive pixels are pixel_stride bytes apart, so that YUYV
+ * frames can be processed directly by using a stride of 2. Frames that do
+ * not have the size given to blobwatch_new produce no observation.
  */
 void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
-		       int width, int height, int skipped, struct leds *leds,
-		       struct blobservation **output)
+		       int width, int height, int pixel_stride, int skipped,
+		       struct leds *leds, struct blobservation **output)
 {
 	int last = bw->last_observation;
 	int current = (last + 1) % NUM_FRAMES_HISTORY;
 	struct blobservation *ob = &bw->history[current];
-	struct blobservation *last_ob = &bw->history[last];
-	struct extent_line *el = bw->el;
-	int i, j;
+	struct blobservation *last_ob = &bw->history[max(last, 0)];
+	bool full_scan;
+	int i, j, n;
 
-	process_frame(frame, width, height, el, ob);
-
-	/* If there is no previous observation, our work is done here */
-	if (bw->last_observation == -1) {
-		bw->last_observation = current;
+	/* The strips and scratch buffers are laid out for the frame size */
+	if (bw->num_strips == 0 || width != bw->width || height != bw->height) {
 		if (output)
 			*output = NULL;
 		return;
 	}
 
-	/* Otherwise track blobs over time */
-	memset(ob->tracked, 0, sizeof(uint8_t) * MAX_BLOBS_PER_FRAME);
-
 	/*
-	 * Associate blobs found at a previous blobs' estimated next
-	 * positions with their predecessors.
+	 * In ROI mode, scan only around predicted blob positions unless
+	 * there is nothing to track or a periodic full scan is due.
 	 */
-	for (i = 0; i < ob->num_blobs; i++) {
-		struct blob *b2 = &ob->blobs[i];
+	if (bw->last_observation != -1)
+		collect_candidates(bw, last_ob);
 
-		/* Filter out tall and wide (<= 1:2, >= 2:1) blobs */
-		if (2 * b2->width <= b2->height ||
-		    b2->width >= 2 * b2->height)
-			continue;
+	full_scan = !bw->roi || bw->full_scan_requested ||
+		    bw->last_observation == -1 ||
+		    bw->frames_since_full_scan >= bw->full_scan_interval ||
+		    predict_windows(bw) == 0;
 
-		for (j = 0; j < last_ob->num_blobs; j++) {
-			struct blob *b1 = &last_ob->blobs[j];
-			int x, y, dx, dy;
+	process_frame(bw, frame, pixel_stride, !full_scan, ob);
+	update_threshold(bw, ob, leds ? leds->num : 0);
+	if (full_scan) {
+		bw->frames_since_full_scan = 0;
+		bw->full_scan_requested = false;
+	} else {
+		bw->frames_since_full_scan++;
+	}
 
-			/* Estimate b1's next position */
-			x = b1->x + b1->vx;
-			y = b1->y + b1->vy;
+	/*
+	 * Report dropped blobs on the first occurrence, and then at most
+	 * once per interval with the number dropped since the last report
+	 */
+	if (ob->dropped_blobs) {
+		uint64_t now = latency_now_ns();
 
-			/* Absolute distance */
-			dx = abs(x - b2->x);
-			dy = abs(y - b2->y);
+		bw->dropped_blobs += ob->dropped_blobs;
+		if (!bw->dropped_report_ns ||
+		    now - bw->dropped_report_ns >= DROPPED_REPORT_INTERVAL) {
+			printf("Blobwatch: out of memory, dropped %d blobs\n",
+			       bw->dropped_blobs);
+			bw->dropped_blobs = 0;
+			bw->dropped_report_ns = now;
+		}
+	}
 
-			/*
-			 * Check if b1's estimated next position falls
-			 * into b2's bounding box.
-			 */
-			if (2 * dx > b2->width ||
-			    2 * dy > b2->height)
-				continue;
+	/* If there is no previous observation, our work is done here */
+	if (bw->last_observation == -1) {
+		bw->last_observation = current;
+		if (output)
+			*output = NULL;
+		return;
+	}
 
-			b2->age = b1->age + 1;
-			if (b1->track_index >= 0 &&
-			    ob->tracked[b1->track_index] == 0) {
-				/* Only overwrite tracks that are not already set */
-				b2->track_index = b1->track_index;
-				ob->tracked[b2->track_index] = i + 1;
-				b2->pattern = b1->pattern;
-				b2->led_id = b1->led_id;
-			}
-			b2->vx = b2->x - b1->x;
-			b2->vy = b2->y - b1->y;
-			b2->last_area = b1->area;
-			break;
-		}
+	/*
+	 * Otherwise track blobs over time. Make sure that all track indices
+	 * of the previous observation and lost tracks can be carried over.
+	 */
+	n = last_ob->max_blobs;
+	for (i = 0; i < bw->num_lost; i++)
+		n = max(n, bw->lost[i].blob.track_index + 1);
+	blobservation_reserve(ob, n);
+	memset(ob->tracked, 0, sizeof(*ob->tracked) * ob->max_blobs);
+
+	/*
+	 * Associate blobs found at a previous blobs' or lost tracks' estimated
+	 * next positions with their predecessors.
+	 */
+	associate_blobs(bw, ob);
+	update_lost_tracks(bw, last_ob);
+
+	/* Reserve the tracking slots of lost tracks */
+	for (i = 0; i < bw->num_lost; i++) {
+		j = bw->lost[i].blob.track_index;
+		if (j < ob->max_blobs && ob->tracked[j] == 0)
+			ob->tracked[j] = -1;
 	}
 
 	/*
@@ -320,11 +1770,18 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 		struct blob *b2 = &ob->blobs[i];
 
 		if (b2->age > 0 && b2->track_index < 0)
-			b2->track_index = find_free_track(ob->tracked);
+			b2->track_index = find_free_track(ob->tracked,
+							  ob->max_blobs);
 		if (b2->track_index >= 0)
 			ob->tracked[b2->track_index] = i + 1;
 	}
 
+	for (i = 0; i < bw->num_lost; i++) {
+		j = bw->lost[i].blob.track_index;
+		if (j < ob->max_blobs && ob->tracked[j] == -1)
+			ob->tracked[j] = 0;
+	}
+
 	/* Check blob <-> tracked array links for consistency */
 	for (i = 0; i < ob->num_blobs; i++) {
 		struct blob *b = &ob->blobs[i];
@@ -336,10 +1793,14 @@ void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
 		}
 	}
 
-	if (rift_dk2_flicker) {
+	ob->flicker_ns = 0;
+	if (bw->flicker) {
+		uint64_t start = latency_now_ns();
+
 		/* Identify blobs by their blinking pattern */
 		flicker_process(bw->fl, ob->blobs, ob->num_blobs, skipped,
 				leds);
+		ob->flicker_ns = latency_now_ns() - start;
 	}
 
 	/* Return observed blobs */
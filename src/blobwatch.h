@@ -11,24 +11,46 @@
 
 struct leds;
 
-#define MAX_EXTENTS_PER_LINE 11
-#define MAX_BLOBS_PER_FRAME  42
-
+/*
+ * A run of pixels [start, end] above the threshold in a single scanline,
+ * belonging to the blob with the given strip local index. Only the fields
+ * needed to find overlaps with the next scanline are stored here, all blob
+ * properties are accumulated in struct blob_sums.
+ */
 struct extent {
 	uint16_t start;
 	uint16_t end;
-	/* inherited parameters */
+	int32_t index;
+};
+
+/*
+ * Properties of a blob, accumulated from all of its extents
+ */
+struct blob_sums {
 	uint16_t top;
+	/* line below the last line, or the last line of the frame */
+	uint16_t bottom;
 	uint16_t left;
 	uint16_t right;
-	uint8_t index;
 	uint32_t area;
+	/* intensity weighted moments, weights are pixel value - threshold */
+	uint32_t sum_i;
+	uint64_t sum_ix;
+	uint64_t sum_iy;
+	uint64_t sum_ixx;
+	uint64_t sum_ixy;
+	uint64_t sum_iyy;
 };
 
+/*
+ * Extents found in a single scanline. Extents are at least three pixels long
+ * and separated by at least one pixel, so max = (width + 1) / 4 extents always
+ * suffice.
+ */
 struct extent_line {
-	struct extent extents[MAX_EXTENTS_PER_LINE];
-	uint16_t num;
-	uint16_t padding[3];
+	struct extent *extents;
+	int num;
+	int max;
 };
 
 struct blob {
@@ -37,32 +59,64 @@ struct blob {
 	uint16_t y;
 	int16_t vx;
 	int16_t vy;
+	/* intensity weighted centroid and covariance */
+	float cx;
+	float cy;
+	float cxx;
+	float cxy;
+	float cyy;
 	/* bounding box */
 	uint16_t width;
 	uint16_t height;
 	uint32_t area;
 	uint32_t last_area;
 	uint32_t age;
-	int16_t track_index;
+	int32_t track_index;
+	/* blinking pattern, newest bit first, and mask of the observed bits */
 	uint16_t pattern;
+	uint16_t pattern_known;
 	int8_t led_id;
 };
 
 /*
- * Stores all blobs observed in a single frame.
+ * Stores all blobs observed in a single frame. The blob and tracking arrays
+ * grow as needed and are reused for later frames. If they could not be grown,
+ * the number of blobs that had to be dropped is stored in dropped_blobs.
  */
 struct blobservation {
 	int num_blobs;
-	struct blob blobs[MAX_BLOBS_PER_FRAME];
+	int max_blobs;
+	int dropped_blobs;
+	struct blob *blobs;
 	int tracked_blobs;
-	uint8_t tracked[MAX_BLOBS_PER_FRAME];
+	int32_t *tracked;
+	/* Time spent in the flicker detector for this frame, in ns */
+	uint64_t flicker_ns;
+	/*
+	 * Detection threshold used for this frame, background level of the
+	 * sampled pixels, and the brightest pixel of all detected extents
+	 */
+	uint8_t threshold;
+	uint8_t background;
+	uint8_t peak;
 };
 
 struct blobwatch;
 
 struct blobwatch *blobwatch_new(int width, int height);
+void blobwatch_free(struct blobwatch *bw);
+int blobwatch_set_threads(struct blobwatch *bw, int num_threads);
+void blobwatch_set_roi(struct blobwatch *bw, bool enable,
+		       int full_scan_interval);
+void blobwatch_set_auto_threshold(struct blobwatch *bw, bool enable);
+void blobwatch_set_track_history(struct blobwatch *bw, int frames);
+void blobwatch_request_full_scan(struct blobwatch *bw);
+void blobwatch_set_flicker(struct blobwatch *bw, bool enable);
+void blobwatch_set_led_phase(struct blobwatch *bw, int led_phase);
+void blobwatch_set_visible_leds(struct blobwatch *bw, uint64_t visible);
+void blobwatch_set_image_motion(struct blobwatch *bw, float motion);
 void blobwatch_process(struct blobwatch *bw, uint8_t *frame,
-		       int width, int height, int skipped,
+		       int width, int height, int pixel_stride, int skipped,
 		       struct leds *leds,
 		       struct blobservation **output);
 
@@ -0,0 +1,349 @@
+/*
+ * On-disk cache of device calibration data
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * Reading the factory calibration from the devices takes many small feature
+ * reports or control transfers. The parsed calibration is stored in the user
+ * cache directory, keyed by device kind, serial number, and firmware
+ * version, so that the next start can skip the readout. Cached data is used
+ * right away and validated against the device in a background thread.
+ * Devices that can run with default parameters can also have a missing
+ * calibration read in the background and applied once it arrives.
+ *
+ * A refined calibration, as estimated offline by tools/refine-calibration
+ * from recorded sessions, can be placed next to the cached factory data. It
+ * replaces the factory data handed to the device, while validation and
+ * caching still operate on the factory data only.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "calibration-cache.h"
+#include "calibration-data.h"
+#include "recording.h"
+#include "replay.h"
+
+struct calibration_validation {
+	OuvrtDevice *dev;
+	char *filename;
+	void *data;
+	size_t size;
+	calibration_read_func read;
+	const char *kind;
+	/* Applies data read in the background, or NULL */
+	calibration_done_func done;
+};
+
+/*
+ * Returns the newly allocated cache file name for the given device, or NULL
+ * if the device can not be identified.
+ */
+static char *calibration_cache_filename(OuvrtDevice *dev, const char *kind,
+					const char *version)
+{
+	char *name, *filename;
+
+	if (!dev->serial || !version)
+		return NULL;
+
+	name = g_strdup_printf("%s-%s-%s.bin", kind, dev->serial, version);
+	g_strcanon(name, G_CSET_A_2_Z G_CSET_a_2_z G_CSET_DIGITS "-._", '_');
+	filename = g_build_filename(g_get_user_cache_dir(), "ouvrt", name,
+				    NULL);
+	g_free(name);
+
+	return filename;
+}
+
+/*
+ * Loads size bytes of calibration data from the cache file.
+ *
+ * Returns 0 on success, or -1 if the file is missing, stale, or corrupted.
+ */
+static int calibration_cache_load(const char *filename, void *data,
+				  size_t size)
+{
+	struct calibration_cache_header *header;
+	char *contents;
+	gsize length;
+	int ret = -1;
+
+	if (!g_file_get_contents(filename, &contents, &length, NULL))
+		return -1;
+
+	header = (struct calibration_cache_header *)contents;
+	if (length == sizeof(*header) + size &&
+	    memcmp(header->magic, CALIBRATION_CACHE_MAGIC, 4) == 0 &&
+	    header->format == CALIBRATION_CACHE_FORMAT &&
+	    header->size == size &&
+	    header->crc == crc32(0, (Bytef *)(header + 1), size)) {
+		memcpy(data, header + 1, size);
+		ret = 0;
+	}
+
+	g_free(contents);
+
+	return ret;
+}
+
+/*
+ * Atomically replaces the cache file with the given calibration data.
+ */
+static void calibration_cache_store(const char *filename, const void *data,
+				    size_t size)
+{
+	struct calibration_cache_header *header;
+	GError *error = NULL;
+	char *dirname;
+
+	header = g_malloc(sizeof(*header) + size);
+	memcpy(header->magic, CALIBRATION_CACHE_MAGIC, 4);
+	header->format = CALIBRATION_CACHE_FORMAT;
+	header->size = size;
+	header->crc = crc32(0, data, size);
+	memcpy(header + 1, data, size);
+
+	dirname = g_path_get_dirname(filename);
+	g_mkdir_with_parents(dirname, 0700);
+	g_free(dirname);
+
+	if (!g_file_set_contents(filename, (const char *)header,
+				 sizeof(*header) + size, &error)) {
+		g_print("Failed to write calibration cache: %s\n",
+			error->message);
+		g_error_free(error);
+	}
+
+	g_free(header);
+}
+
+/*
+ * Replaces the calibration data with the refined calibration of the same
+ * kind for this device, if there is a valid one. The refined file does not
+ * depend on the firmware version and is never written by the daemon.
+ */
+static void calibration_cache_apply_refined(OuvrtDevice *dev, const char *kind,
+					    void *data, size_t size)
+{
+	char *filename;
+
+	filename = calibration_cache_filename(dev, kind, "refined");
+	if (filename && calibration_cache_load(filename, data, size) == 0)
+		g_print("%s: Using refined %s calibration\n", dev->name, kind);
+	g_free(filename);
+}
+
+/*
+ * GThreadFunc that reads the calibration from the device and updates the
+ * cache file if it does not match the cached data anymore. If the device
+ * accepts calibration data in the background, the fresh data is handed to
+ * it right away, otherwise it is used from the next start on.
+ */
+static gpointer calibration_validate_routine(gpointer user_data)
+{
+	struct calibration_validation *v = user_data;
+	void *data;
+
+	data = g_malloc0(v->size);
+	if (v->read(v->dev, data) == 0 && memcmp(data, v->data, v->size)) {
+		calibration_cache_store(v->filename, data, v->size);
+		if (v->done) {
+			g_print("%s: Cached calibration is outdated, updated from device\n",
+				v->dev->name);
+			calibration_cache_apply_refined(v->dev, v->kind, data,
+							v->size);
+			v->done(v->dev, data);
+		} else {
+			g_print("%s: Cached calibration is outdated, updated from device for the next start\n",
+				v->dev->name);
+		}
+	}
+
+	g_free(data);
+	g_free(v->data);
+	g_free(v->filename);
+	g_free(v);
+
+	return NULL;
+}
+
+/*
+ * Loads the calibration data from the cache file, if it is valid, and starts
+ * the background validation, which passes outdated data to done if that is
+ * not NULL. Takes ownership of the filename.
+ *
+ * Returns 0 on success, or -1 if the data is not cached. In that case, the
+ * filename is not freed.
+ */
+static int calibration_cache_get_cached(OuvrtDevice *dev, const char *kind,
+					char *filename, void *data,
+					size_t size,
+					calibration_read_func read,
+					calibration_done_func done,
+					GThread **validation)
+{
+	struct calibration_validation *v;
+
+	if (!filename || calibration_cache_load(filename, data, size) < 0)
+		return -1;
+
+	v = g_malloc(sizeof(*v));
+	v->dev = dev;
+	v->filename = filename;
+	v->data = g_malloc(size);
+	memcpy(v->data, data, size);
+	v->size = size;
+	v->read = read;
+	v->kind = kind;
+	v->done = done;
+
+	calibration_cache_join(validation);
+	*validation = g_thread_new("calibration",
+				   calibration_validate_routine, v);
+	calibration_cache_apply_refined(dev, kind, data, size);
+	recording_write_calibration(dev, kind, data, size);
+
+	return 0;
+}
+
+/*
+ * GThreadFunc that reads missing calibration data from the device, stores it
+ * in the cache, and hands it to the device.
+ */
+static gpointer calibration_read_routine(gpointer user_data)
+{
+	struct calibration_validation *v = user_data;
+
+	if (v->read(v->dev, v->data) == 0) {
+		if (v->filename)
+			calibration_cache_store(v->filename, v->data, v->size);
+		calibration_cache_apply_refined(v->dev, v->kind, v->data,
+						v->size);
+		recording_write_calibration(v->dev, v->kind, v->data, v->size);
+		v->done(v->dev, v->data);
+	} else {
+		g_print("%s: Failed to read %s calibration\n", v->dev->name,
+			v->kind);
+	}
+
+	g_free(v->data);
+	g_free(v->filename);
+	g_free(v);
+
+	return NULL;
+}
+
+/*
+ * Obtains size bytes of calibration data of the given kind. If it is found
+ * in the cache, the cached data is returned and the device calibration is
+ * read in a background validation thread. The caller must join the thread
+ * using calibration_cache_join before closing the device. Otherwise, the
+ * calibration is read from the device and stored in the cache. Either way,
+ * a refined calibration replaces the returned data if there is one. During
+ * replay, the calibration is taken from the recording instead.
+ *
+ * Returns 0 on success, negative values on error.
+ */
+int calibration_cache_get(OuvrtDevice *dev, const char *kind,
+			  const char *version, void *data, size_t size,
+			  calibration_read_func read, GThread **validation)
+{
+	char *filename;
+	int ret;
+
+	/* Never touch the hardware during replay */
+	if (replay_active()) {
+		ret = replay_get_calibration(dev, kind, data, size);
+		if (ret < 0)
+			memset(data, 0, size);
+		return ret;
+	}
+
+	filename = calibration_cache_filename(dev, kind, version);
+	if (calibration_cache_get_cached(dev, kind, filename, data, size, read,
+					 NULL, validation) == 0)
+		return 0;
+
+	memset(data, 0, size);
+	ret = read(dev, data);
+	if (ret == 0) {
+		if (filename)
+			calibration_cache_store(filename, data, size);
+		calibration_cache_apply_refined(dev, kind, data, size);
+		recording_write_calibration(dev, kind, data, size);
+	}
+	g_free(filename);
+
+	return ret;
+}
+
+/*
+ * Obtains size bytes of calibration data of the given kind like
+ * calibration_cache_get, but does not wait for the device if the data is not
+ * cached. Instead, it is read in a background thread, and passed to done
+ * from there when it arrives. Cached or replayed data is passed to done
+ * before this returns, and again from the validation thread if the device
+ * reports different data. The caller must join the thread using
+ * calibration_cache_join before closing the device.
+ *
+ * Returns 0 on success or if the data is being read, negative values on
+ * error.
+ */
+int calibration_cache_get_async(OuvrtDevice *dev, const char *kind,
+				const char *version, size_t size,
+				calibration_read_func read,
+				calibration_done_func done,
+				GThread **thread)
+{
+	struct calibration_validation *v;
+	char *filename;
+	void *data;
+	int ret;
+
+	data = g_malloc0(size);
+
+	if (replay_active()) {
+		ret = calibration_cache_get(dev, kind, version, data, size,
+					    read, thread);
+		if (ret == 0)
+			done(dev, data);
+		g_free(data);
+		return ret;
+	}
+
+	filename = calibration_cache_filename(dev, kind, version);
+	if (calibration_cache_get_cached(dev, kind, filename, data, size, read,
+					 done, thread) == 0) {
+		done(dev, data);
+		g_free(data);
+		return 0;
+	}
+
+	memset(data, 0, size);
+	v = g_malloc(sizeof(*v));
+	v->dev = dev;
+	v->filename = filename;
+	v->data = data;
+	v->size = size;
+	v->read = read;
+	v->kind = kind;
+	v->done = done;
+
+	calibration_cache_join(thread);
+	*thread = g_thread_new("calibration", calibration_read_routine, v);
+
+	return 0;
+}
+
+/*
+ * Waits for a running background validation to finish.
+ */
+void calibration_cache_join(GThread **validation)
+{
+	if (*validation) {
+		g_thread_join(*validation);
+		*validation = NULL;
+	}
+}
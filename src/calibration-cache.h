@@ -0,0 +1,38 @@
+/*
+ * On-disk cache of device calibration data
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __CALIBRATION_CACHE_H__
+#define __CALIBRATION_CACHE_H__
+
+#include <glib.h>
+#include <stddef.h>
+
+#include "device.h"
+
+/*
+ * Reads size bytes of parsed calibration data from the device into data.
+ * Must not change the device state, as it may be called from a background
+ * thread while the device is running. Returns 0 on success, negative values
+ * on error.
+ */
+typedef int (*calibration_read_func)(OuvrtDevice *dev, void *data);
+
+/*
+ * Applies calibration data obtained by calibration_cache_get_async. May be
+ * called from a background thread while the device is running.
+ */
+typedef void (*calibration_done_func)(OuvrtDevice *dev, const void *data);
+
+int calibration_cache_get(OuvrtDevice *dev, const char *kind,
+			  const char *version, void *data, size_t size,
+			  calibration_read_func read, GThread **validation);
+int calibration_cache_get_async(OuvrtDevice *dev, const char *kind,
+				const char *version, size_t size,
+				calibration_read_func read,
+				calibration_done_func done,
+				GThread **thread);
+void calibration_cache_join(GThread **validation);
+
+#endif /* __CALIBRATION_CACHE_H__ */
@@ -0,0 +1,49 @@
+/*
+ * Calibration data as stored in the calibration cache
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * Cache files consist of a struct calibration_cache_header followed by the
+ * calibration structure of the device kind, in native byte order. This does
+ * not depend on GLib, so that the tools can read and write cache files.
+ */
+#ifndef __CALIBRATION_DATA_H__
+#define __CALIBRATION_DATA_H__
+
+#include <stdint.h>
+
+#include "leds.h"
+#include "math.h"
+
+#define CALIBRATION_CACHE_MAGIC		"OUVC"
+/* Increment when the layout of any cached structure changes */
+#define CALIBRATION_CACHE_FORMAT	1
+
+struct calibration_cache_header {
+	char magic[4];
+	uint32_t format;
+	uint32_t size;
+	uint32_t crc;
+};
+
+struct imu {
+	vec3 position;
+};
+
+/*
+ * Rift DK2 factory calibration, kind "rift-dk2"
+ */
+struct rift_dk2_calibration {
+	struct leds leds;
+	struct imu imu;
+};
+
+/*
+ * Camera DK2 intrinsics, kind "camera-dk2"
+ */
+struct camera_dk2_calibration {
+	double camera_matrix[9];
+	double dist_coeffs[5];
+};
+
+#endif /* __CALIBRATION_DATA_H__ */
@@ -13,19 +13,43 @@
 
 #include <glib-object.h>
 
+#include "blobwatch.h"
+#include "calibration-cache.h"
+#include "calibration-data.h"
 #include "camera-dk2.h"
 #include "camera-v4l2.h"
 #include "device.h"
 #include "esp570.h"
 #include "mt9v034.h"
+#include "undistort.h"
 
 #define WIDTH		752
 #define HEIGHT		480
 #define FRAMERATE	60
 
+/* Number of frames between exposure control steps */
+#define EXPOSURE_INTERVAL	30
+
+/* Integration time range in rows for exposure control */
+#define EXPOSURE_ROWS_MIN	4
+#define EXPOSURE_ROWS_MAX	22
+
+/*
+ * Exposure is increased if the brightest LED pixels stay below
+ * LED_PEAK_MIN, and decreased if the background rises above
+ * BACKGROUND_MAX, where the adaptive blob threshold cannot follow anymore.
+ */
+#define LED_PEAK_MIN		0xc0
+#define BACKGROUND_MAX		0xc0
+
 struct _OuvrtCameraDK2Private {
 	char *version;
 	bool sync;
+	GThread *calibration_validation;
+	/* Exposure control state, only used in synchronized mode */
+	int gain;
+	int exposure_rows;
+	int level_frames;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(OuvrtCameraDK2, ouvrt_camera_dk2, \
@@ -57,9 +81,15 @@ static int camera_dk2_start(OuvrtDevice *dev)
 		return ret;
 	}
 
+	/* Start with the full readout window */
+	mt9v034_sensor_set_window(fd, 0, HEIGHT);
+
 	/* Enable synchronised exposure by default */
 	mt9v034_sensor_enable_sync(fd);
 	camera->priv->sync = TRUE;
+	camera->priv->gain = MT9V034_ANALOG_GAIN_MIN;
+	camera->priv->exposure_rows = MT9V034_SYNC_EXPOSURE_ROWS;
+	camera->priv->level_frames = 0;
 
 	/* I have no idea what this does */
 	esp570_i2c_write(fd, 0x60, 0x05, 0x0001);
@@ -74,15 +104,11 @@ static int camera_dk2_start(OuvrtDevice *dev)
  */
 static void ouvrt_camera_dk2_finalize(GObject *object)
 {
-	free(OUVRT_CAMERA_DK2(object)->priv->version);
-	G_OBJECT_CLASS(ouvrt_camera_dk2_parent_class)->finalize(object);
-}
-
-static void ouvrt_camera_dk2_class_init(OuvrtCameraDK2Class *klass)
-{
-	G_OBJECT_CLASS(klass)->finalize = ouvrt_camera_dk2_finalize;
+	OuvrtCameraDK2Private *priv = OUVRT_CAMERA_DK2(object)->priv;
 
-	OUVRT_DEVICE_CLASS(klass)->start = camera_dk2_start;
+	calibration_cache_join(&priv->calibration_validation);
+	free(priv->version);
+	G_OBJECT_CLASS(ouvrt_camera_dk2_parent_class)->finalize(object);
 }
 
 static void ouvrt_camera_dk2_init(OuvrtCameraDK2 *self)
@@ -95,14 +121,20 @@ static void ouvrt_camera_dk2_init(OuvrtCameraDK2 *self)
 	self->v4l2.pixelformat = V4L2_PIX_FMT_GREY;
 	self->priv = ouvrt_camera_dk2_get_instance_private(self);
 	self->priv->sync = FALSE;
+	self->priv->calibration_validation = NULL;
+	self->priv->gain = MT9V034_ANALOG_GAIN_MIN;
+	self->priv->exposure_rows = MT9V034_SYNC_EXPOSURE_ROWS;
+	self->priv->level_frames = 0;
 }
 
-static void camera_dk2_get_calibration(OuvrtCameraDK2 *camera_dk2)
+/*
+ * Reads the camera matrix and distortion coefficients from EEPROM.
+ */
+static int camera_dk2_read_calibration(OuvrtDevice *dev, void *data)
 {
-	OuvrtCamera *camera = OUVRT_CAMERA(camera_dk2);
-	OuvrtDevice *dev = &camera->dev;
-	double * const A = camera->camera_matrix.m;
-	double * const k = camera->dist_coeffs;
+	struct camera_dk2_calibration *cal = data;
+	double * const A = cal->camera_matrix;
+	double * const k = cal->dist_coeffs;
 	char buf[128];
 	double fx, fy, cx, cy;
 	double k1, k2, p1, p2, k3;
@@ -113,7 +145,7 @@ static void camera_dk2_get_calibration(OuvrtCameraDK2 *camera_dk2)
 	for (i = 0; i < 128; i += 32) {
 		ret = esp570_eeprom_read(dev->fd, 0x2000 + i, 32, buf + i);
 		if (ret < 0)
-			return;
+			return ret;
 	}
 
 	fx = *(double *)(buf + 18);
@@ -139,6 +171,112 @@ static void camera_dk2_get_calibration(OuvrtCameraDK2 *camera_dk2)
 	 * k = [ k₁ k₂, p₁, p₂, k₃ ]
 	 */
 	k[0] = k1; k[1] = k2; k[2] = p1; k[3] = p2; k[4] = k3;
+
+	return 0;
+}
+
+/*
+ * Obtains the camera intrinsics from the calibration cache or from EEPROM.
+ */
+static void camera_dk2_get_calibration(OuvrtCameraDK2 *camera_dk2)
+{
+	OuvrtCamera *camera = OUVRT_CAMERA(camera_dk2);
+	struct camera_dk2_calibration cal;
+	int ret;
+
+	ret = calibration_cache_get(&camera->dev, "camera-dk2",
+				    camera_dk2->priv->version, &cal,
+				    sizeof(cal), camera_dk2_read_calibration,
+				    &camera_dk2->priv->calibration_validation);
+	if (ret < 0)
+		return;
+
+	memcpy(camera->camera_matrix.m, cal.camera_matrix,
+	       sizeof(cal.camera_matrix));
+	memcpy(camera->dist_coeffs, cal.dist_coeffs, sizeof(cal.dist_coeffs));
+
+	undistort_map_free(camera->undistort);
+	camera->undistort = undistort_map_new(&camera->camera_matrix,
+					      camera->dist_coeffs,
+					      camera->width, camera->height);
+}
+
+/*
+ * Applies the recorded camera intrinsics.
+ */
+static int camera_dk2_replay_start(OuvrtDevice *dev)
+{
+	camera_dk2_get_calibration(OUVRT_CAMERA_DK2(dev));
+
+	return 0;
+}
+
+/*
+ * Adjusts analog gain and integration time to the observed brightness
+ * levels. Gain is preferred for dim LEDs, as longer integration collects
+ * more ambient light relative to the short LED flashes. In bright scenes,
+ * gain is reduced first, then the integration time.
+ */
+static void camera_dk2_process_levels(OuvrtCameraV4L2 *v4l2,
+				      const struct blobservation *ob)
+{
+	OuvrtCameraDK2Private *priv = OUVRT_CAMERA_DK2(v4l2)->priv;
+	int fd = v4l2->camera.dev.fd;
+	int gain = priv->gain;
+	int rows = priv->exposure_rows;
+	int ret;
+
+	if (!priv->sync || ++priv->level_frames < EXPOSURE_INTERVAL)
+		return;
+	priv->level_frames = 0;
+
+	if (ob->background > BACKGROUND_MAX) {
+		if (gain > MT9V034_ANALOG_GAIN_MIN)
+			gain = gain * 4 / 5;
+		else if (rows > EXPOSURE_ROWS_MIN)
+			rows--;
+	} else if (ob->num_blobs && ob->peak < LED_PEAK_MIN) {
+		if (gain < MT9V034_ANALOG_GAIN_MAX)
+			gain = gain * 5 / 4;
+		else if (rows < EXPOSURE_ROWS_MAX)
+			rows++;
+	}
+
+	if (gain != priv->gain) {
+		ret = mt9v034_sensor_set_analog_gain(fd, gain);
+		if (ret >= 0) {
+			g_print("Camera DK2: Analog gain %d -> %d\n",
+				priv->gain, ret);
+			priv->gain = ret;
+		}
+	}
+	if (rows != priv->exposure_rows) {
+		ret = mt9v034_sensor_set_exposure_rows(fd, rows);
+		if (ret >= 0) {
+			g_print("Camera DK2: Exposure %d -> %d rows\n",
+				priv->exposure_rows, rows);
+			priv->exposure_rows = rows;
+		}
+	}
+}
+
+/*
+ * Restricts the sensor readout to the given rows.
+ */
+static int camera_dk2_set_window(OuvrtCameraV4L2 *v4l2, int y0, int y1)
+{
+	return mt9v034_sensor_set_window(v4l2->camera.dev.fd, y0, y1 - y0);
+}
+
+static void ouvrt_camera_dk2_class_init(OuvrtCameraDK2Class *klass)
+{
+	G_OBJECT_CLASS(klass)->finalize = ouvrt_camera_dk2_finalize;
+	OUVRT_CAMERA_V4L2_CLASS(klass)->process_levels =
+		camera_dk2_process_levels;
+	OUVRT_CAMERA_V4L2_CLASS(klass)->set_window = camera_dk2_set_window;
+
+	OUVRT_DEVICE_CLASS(klass)->start = camera_dk2_start;
+	OUVRT_DEVICE_CLASS(klass)->replay_start = camera_dk2_replay_start;
 }
 
 /*
@@ -201,6 +339,8 @@ void ouvrt_camera_dk2_set_sync_exposure(OuvrtCameraDK2 *camera, gboolean sync)
 
 	if (sync) {
 		mt9v034_sensor_enable_sync(fd);
+		camera->priv->gain = MT9V034_ANALOG_GAIN_MIN;
+		camera->priv->exposure_rows = MT9V034_SYNC_EXPOSURE_ROWS;
 	} else {
 		mt9v034_sensor_disable_sync(fd);
 	}
@@ -4,29 +4,126 @@
  * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
  */
 #include <errno.h>
+#include <linux/dma-buf.h>
 #include <linux/videodev2.h>
 #include <poll.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
 #include <sys/fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <time.h>
 #include <unistd.h>
 
 #include "camera-v4l2.h"
-#include "debug.h"
+#include "clock-sync.h"
 #include "debug-gst.h"
+#include "imu-ring.h"
+#include "recording.h"
+#include "thread-policy.h"
 #include "tracker.h"
 
+/* Must be a power of two, at least VIDEO_MAX_FRAME */
+#define FRAME_RING_SIZE		32
+
+/*
+ * Readout windows are aligned to 32 rows, and only shrunk if that saves at
+ * least WINDOW_SHRINK rows, to avoid frequent window changes
+ */
+#define WINDOW_ALIGN		32
+#define WINDOW_SHRINK		64
+
+struct frame_ring_entry {
+	struct v4l2_buffer buf;
+	double timestamps[2];
+};
+
+/*
+ * Single-producer/single-consumer ring of dequeued buffers, filled by the
+ * capture thread and drained by the tracking worker, which requeues the
+ * buffers after processing. Only the producer writes head, and only the
+ * consumer writes tail.
+ */
+struct frame_ring {
+	struct frame_ring_entry entries[FRAME_RING_SIZE];
+	unsigned int capacity;
+	unsigned int head;
+	unsigned int tail;
+	int efd;
+};
+
 struct _OuvrtCameraV4L2Private {
-	uint32_t offset[3];
-	void *buf[3];
+	unsigned int num_buffers;
+	uint32_t *offset;
+	void **buf;
+	int *dmabuf;
+	struct frame_ring ring;
+	unsigned int dropped;
+	struct imu_ring_reader imu_reader;
+	/* Sensor readout window rows, and the newest frame before the change */
+	int window_y0;
+	int window_y1;
+	bool window_pending;
+	uint32_t window_sequence;
+	int window_dropped;
+	/* Last pose estimate, shown in the debug stream */
+	dquat rot;
+	dvec3 trans;
 };
 
+/* Number of V4L2 buffers to request, can be changed with --buffers */
+int camera_v4l2_num_buffers = 4;
+/* Export MMAP buffers as DMABUFs, can be enabled with --dmabuf */
+gboolean camera_v4l2_export_dmabuf = FALSE;
+/* Read out only the rows around tracked objects, enabled with --window */
+gboolean camera_v4l2_sensor_window = FALSE;
+
+/*
+ * Brackets CPU access to an exported buffer, so that caches are kept
+ * coherent with the device. Does nothing for plain MMAP buffers.
+ */
+static void dmabuf_sync(int dmabuf_fd, uint64_t flags)
+{
+	struct dma_buf_sync sync = {
+		.flags = flags | DMA_BUF_SYNC_RW,
+	};
+
+	if (dmabuf_fd == -1)
+		return;
+
+	if (ioctl(dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync) < 0)
+		g_print("v4l2: DMA_BUF_IOCTL_SYNC error: %d\n", errno);
+}
+
 G_DEFINE_TYPE_WITH_PRIVATE(OuvrtCameraV4L2, ouvrt_camera_v4l2,
 			   OUVRT_TYPE_CAMERA)
 
+/*
+ * Unmaps and closes the buffers mapped and exported so far, and frees the
+ * buffer arrays.
+ */
+static void camera_v4l2_free_buffers(OuvrtCameraV4L2 *v4l2)
+{
+	OuvrtCameraV4L2Private *priv = v4l2->priv;
+	unsigned int i;
+
+	for (i = 0; priv->buf && priv->dmabuf && i < priv->num_buffers; i++) {
+		if (priv->buf[i])
+			munmap(priv->buf[i], v4l2->camera.sizeimage);
+		if (priv->dmabuf[i] != -1)
+			close(priv->dmabuf[i]);
+	}
+	free(priv->dmabuf);
+	free(priv->buf);
+	free(priv->offset);
+	priv->dmabuf = NULL;
+	priv->buf = NULL;
+	priv->offset = NULL;
+	priv->num_buffers = 0;
+}
+
 /*
  * Requests buffers and starts streaming.
  *
@@ -58,7 +155,7 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
 		}
 	};
 	struct v4l2_requestbuffers reqbufs = {
-		.count = 3,
+		.count = camera_v4l2_num_buffers,
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
 		.memory = V4L2_MEMORY_MMAP,
 	};
@@ -91,18 +188,29 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
 	if (ret < 0)
 		g_print("v4l2: S_PARM error: %d\n", errno);
 
-	if (1 /* DEBUG */) {
-		reqbufs.memory = V4L2_MEMORY_USERPTR;
-		camera->sizeimage += sizeof(struct ouvrt_debug_attachment);
-	}
-
 	ret = ioctl(fd, VIDIOC_REQBUFS, &reqbufs);
 	if (ret < 0)
 		g_print("v4l2: REQBUFS error: %d\n", errno);
-	if (reqbufs.count > 3) {
+	if (reqbufs.count < 3 || reqbufs.count > FRAME_RING_SIZE) {
 		g_print("v4l2: REQBUFS error: %d buffers\n", reqbufs.count);
-		return -1;
+		ret = -1;
+		goto err_free;
 	}
+	priv->num_buffers = reqbufs.count;
+	priv->window_y0 = 0;
+	priv->window_y1 = height;
+	priv->window_pending = false;
+	priv->window_dropped = 0;
+	priv->offset = calloc(reqbufs.count, sizeof(*priv->offset));
+	priv->buf = calloc(reqbufs.count, sizeof(*priv->buf));
+	priv->dmabuf = calloc(reqbufs.count, sizeof(*priv->dmabuf));
+	if (!priv->offset || !priv->buf || !priv->dmabuf) {
+		g_print("v4l2: Failed to allocate buffer arrays\n");
+		ret = -ENOMEM;
+		goto err_free;
+	}
+	for (i = 0; i < reqbufs.count; i++)
+		priv->dmabuf[i] = -1;
 
 	g_print("v4l2: %dx%d %4.4s %d Hz, %d buffers à %d bytes\n",
 		format.fmt.pix.width, format.fmt.pix.height,
@@ -112,24 +220,49 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
 		reqbufs.count, format.fmt.pix.sizeimage);
 
 	for (i = 0; i < reqbufs.count; i++) {
-		struct v4l2_buffer buf;
+		struct v4l2_exportbuffer expbuf = {
+			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			.index = i,
+			.flags = O_RDWR | O_CLOEXEC,
+		};
+		struct v4l2_buffer buf = {
+			.index = i,
+			.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+			.memory = V4L2_MEMORY_MMAP,
+		};
 
-		buf.index = i;
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		ret = ioctl(fd, VIDIOC_QUERYBUF, &buf);
 		if (ret < 0)
 			g_print("v4l2: QUERYBUF error\n");
 
-		if (reqbufs.memory == V4L2_MEMORY_MMAP) {
+		if (camera_v4l2_export_dmabuf) {
+			ret = ioctl(fd, VIDIOC_EXPBUF, &expbuf);
+			if (ret < 0)
+				g_print("v4l2: EXPBUF error: %d\n", errno);
+			else
+				priv->dmabuf[i] = expbuf.fd;
+		}
+
+		/*
+		 * Map the DMABUF if the buffer was exported, so that CPU
+		 * accesses can be synchronized with DMA_BUF_IOCTL_SYNC.
+		 */
+		if (priv->dmabuf[i] != -1) {
+			priv->buf[i] = mmap(NULL, camera->sizeimage,
+					    PROT_READ | PROT_WRITE,
+					    MAP_SHARED, priv->dmabuf[i], 0);
+		} else {
 			priv->buf[i] = mmap(NULL, camera->sizeimage,
 					    PROT_READ | PROT_WRITE,
-					    MAP_SHARED, dev->fd,
-					    buf.m.offset);
-			priv->offset[i] = buf.m.offset;
-		} else if (reqbufs.memory == V4L2_MEMORY_USERPTR) {
-			priv->buf[i] = malloc(camera->sizeimage);
-			buf.m.userptr = (unsigned long)priv->buf[i];
+					    MAP_SHARED, fd, buf.m.offset);
 		}
+		if (priv->buf[i] == MAP_FAILED) {
+			g_print("v4l2: mmap error: %d\n", errno);
+			priv->buf[i] = NULL;
+			ret = -1;
+			goto err_free;
+		}
+		priv->offset[i] = buf.m.offset;
 
 		ret = ioctl(fd, VIDIOC_QBUF, &buf);
 		if (ret < 0)
@@ -138,15 +271,21 @@ static int ouvrt_camera_v4l2_start(OuvrtDevice *dev)
 
 	ret = ioctl(fd, VIDIOC_STREAMON, &format.type);
 	if (ret < 0) {
-		g_print("v4l2: STREAMON error\n");
-		reqbufs.count = 0;
-		ioctl(fd, VIDIOC_REQBUFS, &reqbufs);
+		g_print("v4l2: STREAMON error: %d\n", errno);
+		goto err_free;
 	}
 
 	g_print("v4l2: Started streaming\n");
 
 	camera->debug = debug_gst_new(width, height, camera->framerate);
+	debug_gst_set_attachment(camera->debug, camera->debug_attachment);
+
+	return ret;
 
+err_free:
+	camera_v4l2_free_buffers(v4l2);
+	reqbufs.count = 0;
+	ioctl(fd, VIDIOC_REQBUFS, &reqbufs);
 	return ret;
 }
 
@@ -168,43 +307,408 @@ static void convert_yuyv_to_grayscale(uint8_t *frame, int width, int height)
 	}
 }
 
-static dquat rot;
-static dvec3 trans;
+/*
+ * Adds a dequeued buffer to the frame ring. Returns false if the ring is
+ * full, in which case the caller still owns the buffer.
+ */
+static bool frame_ring_push(struct frame_ring *ring,
+			    const struct frame_ring_entry *entry)
+{
+	unsigned int head = ring->head;
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+
+	if (head - tail >= ring->capacity)
+		return false;
+
+	ring->entries[head % FRAME_RING_SIZE] = *entry;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	if (write(ring->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		g_print("v4l2: eventfd write error: %d\n", errno);
+
+	return true;
+}
 
 /*
- * Receives frames from the camera and processes them.
+ * Removes the oldest buffer from the frame ring. Returns false if the ring
+ * is empty.
  */
-static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
+static bool frame_ring_pop(struct frame_ring *ring,
+			   struct frame_ring_entry *entry)
+{
+	unsigned int tail = ring->tail;
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if (tail == head)
+		return false;
+
+	*entry = ring->entries[tail % FRAME_RING_SIZE];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/*
+ * Wakes up the tracking worker without queueing a frame.
+ */
+static void frame_ring_kick(struct frame_ring *ring)
+{
+	uint64_t one = 1;
+
+	if (write(ring->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		g_print("v4l2: eventfd write error: %d\n", errno);
+}
+
+/*
+ * Returns the sequence number of the newest frame dequeued by the capture
+ * thread. Must only be called by the consumer, after at least one frame was
+ * popped, so that the entry cannot be overwritten while it is read.
+ */
+static uint32_t frame_ring_newest_sequence(struct frame_ring *ring)
+{
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	return ring->entries[(head - 1) % FRAME_RING_SIZE].buf.sequence;
+}
+
+/*
+ * Moves the rows of a frame read out with a sensor window into place and
+ * clears the rows outside of the window, so that all further processing
+ * sees full frames.
+ *
+ * Returns false if the frame may have been read out before the last window
+ * change took effect, or if its size does not match the window.
+ */
+static bool camera_v4l2_expand_window(OuvrtCameraV4L2 *v4l2,
+				      struct v4l2_buffer *buf, uint8_t *raw,
+				      int pixel_stride)
 {
-	OuvrtCameraV4L2 *v4l2 = OUVRT_CAMERA_V4L2(dev);
 	OuvrtCameraV4L2Private *priv = v4l2->priv;
-	OuvrtCamera *camera = OUVRT_CAMERA(dev);
-	struct v4l2_buffer buf;
+	int stride = v4l2->camera.width * pixel_stride;
+	int height = v4l2->camera.height;
+	int y0 = priv->window_y0;
+	int y1 = priv->window_y1;
+	unsigned int size = (y1 - y0) * stride;
+	bool full = (y0 == 0 && y1 == height);
+
+	/*
+	 * All frames that were already captured when the window was changed,
+	 * and the frame in flight at that time, still use the old window.
+	 */
+	if (priv->window_pending) {
+		if ((int32_t)(buf->sequence - priv->window_sequence) <= 1)
+			return false;
+		priv->window_pending = false;
+	}
+
+	/* Full frames may be padded, windowed frames must match exactly */
+	if (buf->bytesused < size || (!full && buf->bytesused != size))
+		return false;
+
+	if (full)
+		return true;
+
+	memmove(raw + y0 * stride, raw, size);
+	memset(raw, 0, y0 * stride);
+	memset(raw + y1 * stride, 0, (height - y1) * stride);
+
+	return true;
+}
+
+/*
+ * Requests a new sensor readout window around the rows in which the tracker
+ * expects the tracked objects in the next frame.
+ */
+static void camera_v4l2_update_window(OuvrtCameraV4L2 *v4l2)
+{
+	OuvrtCameraV4L2Class *klass = OUVRT_CAMERA_V4L2_GET_CLASS(v4l2);
+	OuvrtCameraV4L2Private *priv = v4l2->priv;
+	OuvrtCamera *camera = &v4l2->camera;
+	int y0, y1;
+
+	if (!camera_v4l2_sensor_window || !klass->set_window ||
+	    !camera->tracker || priv->window_pending)
+		return;
+
+	ouvrt_tracker_get_window(camera->tracker, camera->tracker_camera,
+				 &y0, &y1);
+	if (y0 >= y1)
+		return;
+
+	y0 &= ~(WINDOW_ALIGN - 1);
+	y1 = MIN((y1 + WINDOW_ALIGN - 1) & ~(WINDOW_ALIGN - 1),
+		 camera->height);
+
+	/* Grow immediately, shrink only if it is worth it */
+	if (y0 >= priv->window_y0 && y1 <= priv->window_y1 &&
+	    (priv->window_y1 - priv->window_y0) - (y1 - y0) < WINDOW_SHRINK)
+		return;
+
+	/*
+	 * Frames still waiting in the frame ring were read out with the old
+	 * window. Sample the newest one before the window is changed.
+	 */
+	priv->window_sequence = frame_ring_newest_sequence(&priv->ring);
+
+	if (klass->set_window(v4l2, y0, y1) < 0)
+		return;
+
+	priv->window_y0 = y0;
+	priv->window_y1 = y1;
+	priv->window_pending = true;
+}
+
+/*
+ * Runs blob detection and pose estimation on a single dequeued frame,
+ * pushes it to the debug stream and returns the buffer to the driver.
+ *
+ * Returns 0 on success, negative values on error.
+ */
+static int ouvrt_camera_v4l2_process_frame(OuvrtCameraV4L2 *v4l2,
+					   struct frame_ring_entry *entry,
+					   int pixel_stride)
+{
+	OuvrtCameraV4L2Class *klass = OUVRT_CAMERA_V4L2_GET_CLASS(v4l2);
+	OuvrtCameraV4L2Private *priv = v4l2->priv;
+	OuvrtCamera *camera = OUVRT_CAMERA(v4l2);
+	OuvrtDevice *dev = OUVRT_DEVICE(v4l2);
+	struct v4l2_buffer *buf = &entry->buf;
+	int dmabuf_fd;
 	int width = camera->width;
 	int height = camera->height;
 	double timestamps[4];
-	struct timespec tp;
-	struct pollfd pfd;
 	int skipped;
 	void *raw;
 	int ret;
 
-	pfd.fd = dev->fd;
+	timestamps[0] = entry->timestamps[0];
+	timestamps[1] = entry->timestamps[1];
+
+	if (timestamps[1] > timestamps[0]) {
+		latency_histogram_add(&camera->capture_latency.hist,
+				      (timestamps[1] - timestamps[0]) * 1e9);
+	}
+
+	if (buf->memory == V4L2_MEMORY_MMAP &&
+	    buf->index < priv->num_buffers &&
+	    buf->m.offset == priv->offset[buf->index])
+		raw = priv->buf[buf->index];
+	else
+		raw = NULL;
+	if (!raw) {
+		g_print("v4l2: Dequeued unknown buffer %u at offset 0x%x, disabling camera\n",
+			buf->index, buf->m.offset);
+		return -1;
+	}
+	dmabuf_fd = priv->dmabuf[buf->index];
+
+	/* This includes frames dropped because the frame ring was full */
+	skipped = buf->sequence - camera->sequence - 1;
+	if (skipped < 0)
+		skipped = 0;
+	camera->sequence = buf->sequence;
+
+	dmabuf_sync(dmabuf_fd, DMA_BUF_SYNC_START);
+
+	/*
+	 * Frames captured while the readout window changes are not passed
+	 * on, the tracker sees them as skipped frames.
+	 */
+	if (!camera_v4l2_expand_window(v4l2, buf, raw, pixel_stride)) {
+		priv->window_dropped += skipped + 1;
+		dmabuf_sync(dmabuf_fd, DMA_BUF_SYNC_END);
+		goto requeue;
+	}
+	skipped += priv->window_dropped;
+	priv->window_dropped = 0;
+
+	recording_write_frame(dev, raw, width, height, pixel_stride,
+			      buf->sequence, timestamps[0]);
+
+	/*
+	 * Find bright blobs in the camera image and identify individual LEDs
+	 * using the estimated pose at time of exposure or, if that is not
+	 * available, using the LED blinking pattern. The observation belongs
+	 * to the tracker, so keep it from being replaced until the frame has
+	 * been pushed to the debug stream.
+	 */
+	struct blobservation *ob = NULL;
+	g_mutex_lock(&camera->tracker_lock);
+	if (camera->tracker) {
+		ouvrt_tracker_process_frame(camera->tracker,
+					    camera->tracker_camera,
+					    raw, width, height,
+					    pixel_stride, buf->sequence,
+					    timestamps[0], skipped, &ob);
+	}
+
+	timestamps[2] = clock_sync_host_time();
+
+	if (ob && camera->tracker) {
+		/*
+		 * If we got an observation, calculate the pose from
+		 * blob detector output, intrinsic camera parameters,
+		 * and the known LED positions.
+		 */
+		ouvrt_tracker_process_blobs(camera->tracker,
+					    camera->tracker_camera, ob->blobs,
+					    ob->num_blobs,
+					    &camera->camera_matrix,
+					    camera->dist_coeffs,
+					    camera->undistort, &priv->rot,
+					    &priv->trans);
+	}
+
+	if (ob && klass->process_levels)
+		klass->process_levels(v4l2, ob);
+
+	camera_v4l2_update_window(v4l2);
+
+	timestamps[3] = clock_sync_host_time();
+
+	/*
+	 * The blob detector reads the luma components of YUYV frames
+	 * directly. Only convert to grayscale in place if the frame
+	 * is going to be streamed to a debug client.
+	 */
+	if (v4l2->pixelformat == V4L2_PIX_FMT_YUYV &&
+	    debug_gst_connected(camera->debug))
+		convert_yuyv_to_grayscale(raw, width, height);
+
+	dmabuf_sync(dmabuf_fd, DMA_BUF_SYNC_END);
+
+	/* Follow the IMU samples of the device tracked by this camera */
+	struct imu_ring_reader *imu_reader = NULL;
+	if (camera->tracker && debug_gst_attachment_enabled(camera->debug)) {
+		struct imu_ring *imu = ouvrt_tracker_get_imu_ring(camera->tracker);
+
+		if (priv->imu_reader.ring != imu)
+			imu_ring_reader_init(&priv->imu_reader, imu);
+		imu_reader = &priv->imu_reader;
+	}
+
+	debug_gst_frame_push(camera->debug, raw, width * height, dmabuf_fd,
+			     ob, imu_reader, &priv->rot, &priv->trans,
+			     timestamps);
+	g_mutex_unlock(&camera->tracker_lock);
+
+requeue:
+	ret = ioctl(dev->fd, VIDIOC_QBUF, buf);
+	if (ret < 0) {
+		g_print("v4l2: QBUF error: %d, disabling camera\n",
+			errno);
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Takes frames from the frame ring and processes them, so that slow pose
+ * estimation never keeps the capture thread from dequeueing buffers.
+ */
+static gpointer ouvrt_camera_v4l2_tracking_thread(gpointer data)
+{
+	OuvrtCameraV4L2 *v4l2 = OUVRT_CAMERA_V4L2(data);
+	OuvrtCameraV4L2Private *priv = v4l2->priv;
+	OuvrtDevice *dev = OUVRT_DEVICE(v4l2);
+	struct frame_ring *ring = &priv->ring;
+	struct frame_ring_entry entry;
+	struct pollfd pfd;
+	int pixel_stride;
+	uint64_t count;
+	int ret;
+
+	pfd.fd = ring->efd;
 	pfd.events = POLLIN;
 
+	pixel_stride = (v4l2->pixelformat == V4L2_PIX_FMT_YUYV) ? 2 : 1;
+
+	thread_policy_apply(dev->name, "tracking");
+
+	/* The capture thread kicks the ring when it stops */
+	while (dev->active) {
+		ret = poll(&pfd, 1, -1);
+		if (ret == -1) {
+			if (errno != EINTR)
+				g_print("v4l2: poll error: %d\n", errno);
+			continue;
+		}
+
+		if (read(ring->efd, &count, sizeof(count)) < 0 &&
+		    errno != EAGAIN)
+			g_print("v4l2: eventfd read error: %d\n", errno);
+
+		while (dev->active && frame_ring_pop(ring, &entry)) {
+			ret = ouvrt_camera_v4l2_process_frame(v4l2, &entry,
+							      pixel_stride);
+			if (ret < 0) {
+				dev->active = FALSE;
+				break;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Receives frames from the camera and hands them to the tracking worker.
+ */
+static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
+{
+	OuvrtCameraV4L2 *v4l2 = OUVRT_CAMERA_V4L2(dev);
+	OuvrtCameraV4L2Private *priv = v4l2->priv;
+	struct frame_ring *ring = &priv->ring;
+	struct frame_ring_entry entry;
+	struct v4l2_buffer *buf = &entry.buf;
+	struct pollfd pfd[2];
+	GThread *worker;
+	int ret;
+
+	/*
+	 * Keep at least one buffer queued in the driver while the worker
+	 * processes another one, so that capture never stalls.
+	 */
+	ring->capacity = priv->num_buffers - 2;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->efd == -1) {
+		g_print("v4l2: eventfd error: %d, disabling camera\n", errno);
+		dev->active = FALSE;
+		return;
+	}
+	priv->dropped = 0;
+
+	worker = g_thread_new("tracking", ouvrt_camera_v4l2_tracking_thread,
+			      v4l2);
+
+	pfd[0].fd = dev->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = dev->stop_fd;
+	pfd[1].events = POLLIN;
+
 	while (dev->active) {
-		ret = poll(&pfd, 1, 1000);
-		if (ret == -1 || ret == 0) {
-			if (ret == -1)
+		ret = poll(pfd, 2, -1);
+		if (ret == -1) {
+			if (errno != EINTR)
 				g_print("v4l2: poll error: %d\n", errno);
 			continue;
 		}
 
-		if (pfd.events & (POLLERR | POLLHUP | POLLNVAL))
+		if (pfd[1].revents & POLLIN)
+			break;
+
+		/* The camera was unplugged */
+		if (pfd[0].revents & (POLLERR | POLLHUP | POLLNVAL))
 			break;
 
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-		ret = ioctl(dev->fd, VIDIOC_DQBUF, &buf);
+		memset(buf, 0, sizeof(*buf));
+		buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf->memory = V4L2_MEMORY_MMAP;
+		ret = ioctl(dev->fd, VIDIOC_DQBUF, buf);
 		if (ret < 0) {
 			g_print("v4l2: DQBUF error: %d, disabling camera\n",
 			       errno);
@@ -212,72 +716,35 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 			break;
 		}
 
-		clock_gettime(CLOCK_MONOTONIC, &tp);
-		timestamps[0] = buf.timestamp.tv_sec + 1e-6 * buf.timestamp.tv_usec;
-		timestamps[1] = tp.tv_sec + 1e-9 * tp.tv_nsec;
-
-		if (buf.memory == V4L2_MEMORY_MMAP) {
-			raw = priv->buf[buf.index];
-			if (buf.m.offset != priv->offset[buf.index])
-				raw = NULL;
-		} else if (buf.memory == V4L2_MEMORY_USERPTR) {
-			raw = (void *)buf.m.userptr;
-			if (raw != priv->buf[buf.index])
-				raw = NULL;
-		} else {
-			raw = NULL;
-		}
-		if (!raw) {
-			g_print("v4l2: DQBUF error: %d, disabling camera\n",
-				errno);
+		if (buf->index >= priv->num_buffers) {
+			g_print("v4l2: DQBUF error: index %u, disabling camera\n",
+				buf->index);
 			dev->active = FALSE;
 			break;
 		}
 
-		if (v4l2->pixelformat == V4L2_PIX_FMT_YUYV)
-			convert_yuyv_to_grayscale(raw, width, height);
-
-		skipped = buf.sequence - camera->sequence - 1;
-		if (skipped < 0)
-			skipped = 0;
-		camera->sequence = buf.sequence;
-
+		entry.timestamps[1] = clock_sync_host_time();
 		/*
-		 * Find bright blobs in the camera image and identify individual LEDs
-		 * using the estimated pose at time of exposure or, if that is not
-		 * available, using the LED blinking pattern.
+		 * Use the driver timestamp if it is taken from the monotonic
+		 * clock, otherwise fall back to the dequeue time.
 		 */
-		struct blobservation *ob = NULL;
-		if (camera->tracker) {
-			ouvrt_tracker_process_frame(camera->tracker,
-						    raw, width, height, skipped,
-						    &ob);
-		}
-
-		clock_gettime(CLOCK_MONOTONIC, &tp);
-		timestamps[2] = tp.tv_sec + 1e-9 * tp.tv_nsec;
-
-		if (ob && camera->tracker) {
-			/*
-			 * If we got an observation, calculate the pose from
-			 * blob detector output, intrinsic camera parameters,
-			 * and the known LED positions.
-			 */
-			ouvrt_tracker_process_blobs(camera->tracker, ob->blobs,
-						    ob->num_blobs,
-						    &camera->camera_matrix,
-						    camera->dist_coeffs,
-						    &rot, &trans);
+		if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+		    V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+			entry.timestamps[0] = buf->timestamp.tv_sec +
+					      1e-6 * buf->timestamp.tv_usec;
+		} else {
+			entry.timestamps[0] = entry.timestamps[1];
 		}
 
-		clock_gettime(CLOCK_MONOTONIC, &tp);
-		timestamps[3] = tp.tv_sec + 1e-9 * tp.tv_nsec;
-
-		debug_gst_frame_push(camera->debug, raw, camera->sizeimage,
-				     width * height, ob, &rot, &trans,
-				     timestamps);
+		if (frame_ring_push(ring, &entry))
+			continue;
 
-		ret = ioctl(dev->fd, VIDIOC_QBUF, &buf);
+		/*
+		 * The worker is still busy with older frames, drop this one.
+		 * The tracker notices the gap in the sequence numbers.
+		 */
+		priv->dropped++;
+		ret = ioctl(dev->fd, VIDIOC_QBUF, buf);
 		if (ret < 0) {
 			g_print("v4l2: QBUF error: %d, disabling camera\n",
 				errno);
@@ -285,6 +752,17 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 			break;
 		}
 	}
+
+	dev->active = FALSE;
+	frame_ring_kick(ring);
+	g_thread_join(worker);
+
+	close(ring->efd);
+	ring->efd = -1;
+
+	if (priv->dropped)
+		g_print("v4l2: Dropped %u frames while tracking was busy\n",
+			priv->dropped);
 }
 
 /*
@@ -293,7 +771,6 @@ static void ouvrt_camera_v4l2_thread(OuvrtDevice *dev)
 static void ouvrt_camera_v4l2_stop(OuvrtDevice *dev)
 {
 	OuvrtCameraV4L2 *v4l2 = OUVRT_CAMERA_V4L2(dev);
-	OuvrtCameraV4L2Private *priv = v4l2->priv;
 	OuvrtCamera *camera = OUVRT_CAMERA(dev);
 	struct v4l2_requestbuffers reqbufs = {
 		.count = 0,
@@ -301,20 +778,8 @@ static void ouvrt_camera_v4l2_stop(OuvrtDevice *dev)
 		.memory = V4L2_MEMORY_MMAP,
 	};
 	int ret;
-	int i;
 
-	if (priv->offset[1]) {
-		for (i = 0; i < 3; i++) {
-			munmap(priv->buf[i], camera->sizeimage);
-			priv->buf[i] = NULL;
-		}
-	} else {
-		reqbufs.memory = V4L2_MEMORY_USERPTR;
-		for (i = 0; i < 3; i++) {
-			free(priv->buf[i]);
-			priv->buf[i] = NULL;
-		}
-	}
+	camera_v4l2_free_buffers(v4l2);
 
 	ret = ioctl(dev->fd, VIDIOC_STREAMOFF, &reqbufs.type);
 	if (ret < 0)
@@ -18,7 +18,7 @@
 #define OUVRT_IS_CAMERA_V4L2(obj)	(G_TYPE_CHECK_INSTANCE_TYPE((obj), \
 					 OUVRT_TYPE_CAMERA_V4L2))
 #define OUVRT_CAMERA_V4L2_CLASS(klass)	(G_TYPE_CHECK_CLASS_CAST((klass), \
-					 OUVRT_TYPE_CAMERA, \
+					 OUVRT_TYPE_CAMERA_V4L2, \
 					 OuvrtCameraV4L2Class))
 #define OUVRT_IS_CAMERA_V4L2_CLASS(klass) \
 					(G_TYPE_CHECK_CLASS_TYPE((klass), \
@@ -26,12 +26,13 @@
 #define OUVRT_CAMERA_V4L2_GET_CLASS(obj) \
 					(G_TYPE_INSTANCE_GET_CLASS((obj), \
 					 OUVRT_TYPE_CAMERA_V4L2, \
-					 OuvrtCameraClass))
+					 OuvrtCameraV4L2Class))
 
 typedef struct _OuvrtCameraV4L2		OuvrtCameraV4L2;
 typedef struct _OuvrtCameraV4L2Class	OuvrtCameraV4L2Class;
 typedef struct _OuvrtCameraV4L2Private	OuvrtCameraV4L2Private;
 
+struct blobservation;
 struct debug_gst;
 
 struct _OuvrtCameraV4L2 {
@@ -44,8 +45,21 @@ struct _OuvrtCameraV4L2 {
 
 struct _OuvrtCameraV4L2Class {
 	OuvrtCameraClass parent_class;
+
+	/*
+	 * Called from the tracking thread with the brightness levels of each
+	 * observation, to control the sensor exposure
+	 */
+	void (*process_levels)(OuvrtCameraV4L2 *v4l2,
+			       const struct blobservation *ob);
+	/* Restricts the sensor readout to the frame rows [y0, y1) */
+	int (*set_window)(OuvrtCameraV4L2 *v4l2, int y0, int y1);
 };
 
+extern int camera_v4l2_num_buffers;
+extern gboolean camera_v4l2_export_dmabuf;
+extern gboolean camera_v4l2_sensor_window;
+
 GType ouvrt_camera_v4l2_get_type(void);
 
 #endif /* __CAMERA_V4L2_H__ */
@@ -4,13 +4,50 @@
  * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
  */
 #include <glib.h>
+#include <string.h>
 
 #include "camera.h"
+#include "undistort.h"
 
 G_DEFINE_TYPE(OuvrtCamera, ouvrt_camera, OUVRT_TYPE_DEVICE)
 
-static void ouvrt_camera_class_init(OuvrtCameraClass *klass G_GNUC_UNUSED)
+/*
+ * Attaches the camera to the given pose tracker, detaching it from the
+ * previous one. The camera keeps a reference to its tracker. If the camera
+ * is streaming, this waits until the current frame is processed.
+ */
+void ouvrt_camera_set_tracker(OuvrtCamera *camera, OuvrtTracker *tracker)
+{
+	g_mutex_lock(&camera->tracker_lock);
+	if (camera->tracker) {
+		ouvrt_tracker_remove_camera(camera->tracker,
+					    camera->tracker_camera);
+		g_object_unref(camera->tracker);
+		camera->tracker = NULL;
+		camera->tracker_camera = -1;
+	}
+
+	if (tracker) {
+		camera->tracker_camera = ouvrt_tracker_add_camera(tracker);
+		if (camera->tracker_camera >= 0)
+			camera->tracker = g_object_ref(tracker);
+	}
+	g_mutex_unlock(&camera->tracker_lock);
+}
+
+static void ouvrt_camera_finalize(GObject *object)
+{
+	OuvrtCamera *camera = OUVRT_CAMERA(object);
+
+	ouvrt_camera_set_tracker(camera, NULL);
+	g_mutex_clear(&camera->tracker_lock);
+	undistort_map_free(camera->undistort);
+	G_OBJECT_CLASS(ouvrt_camera_parent_class)->finalize(object);
+}
+
+static void ouvrt_camera_class_init(OuvrtCameraClass *klass)
 {
+	G_OBJECT_CLASS(klass)->finalize = ouvrt_camera_finalize;
 }
 
 /*
@@ -21,4 +58,12 @@ static void ouvrt_camera_class_init(OuvrtCameraClass *klass G_GNUC_UNUSED)
 static void ouvrt_camera_init(OuvrtCamera *camera)
 {
 	camera->dev.type = DEVICE_TYPE_CAMERA;
+	g_mutex_init(&camera->tracker_lock);
+	camera->tracker = NULL;
+	camera->tracker_camera = -1;
+	camera->undistort = NULL;
+	memset(&camera->capture_latency, 0, sizeof(camera->capture_latency));
+	camera->capture_latency.name = "capture";
+	camera->dev.latency = &camera->capture_latency;
+	camera->dev.num_latency = 1;
 }
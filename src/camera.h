@@ -9,10 +9,12 @@
 #include <glib-object.h>
 
 #include "device.h"
+#include "latency.h"
 #include "tracker.h"
 #include "math.h"
 
 struct debug_gst;
+struct undistort_map;
 
 #define OUVRT_TYPE_CAMERA		(ouvrt_camera_get_type())
 #define OUVRT_CAMERA(obj)		(G_TYPE_CHECK_INSTANCE_CAST((obj), \
@@ -31,16 +33,26 @@ typedef struct _OuvrtCameraClass	OuvrtCameraClass;
 
 struct _OuvrtCamera {
 	OuvrtDevice dev;
+	/* Held while a frame is processed with the tracker */
+	GMutex tracker_lock;
 	OuvrtTracker *tracker;
+	/* Index of this camera in the tracker */
+	int tracker_camera;
 
 	int width;
 	int height;
 	int framerate;
 	dmat3 camera_matrix;
 	double dist_coeffs[5];
+	/* Precomputed from camera_matrix and dist_coeffs, or NULL */
+	struct undistort_map *undistort;
 	int sizeimage;
 	int sequence;
 	struct debug_gst *debug;
+	/* Stream blobs, pose, and IMU samples along with the debug frames */
+	gboolean debug_attachment;
+	/* Time from exposure to dequeueing the frame */
+	struct latency_stage capture_latency;
 };
 
 struct _OuvrtCameraClass {
@@ -49,4 +61,6 @@ struct _OuvrtCameraClass {
 
 GType ouvrt_camera_get_type(void);
 
+void ouvrt_camera_set_tracker(OuvrtCamera *camera, OuvrtTracker *tracker);
+
 #endif /* __CAMERA_H__ */
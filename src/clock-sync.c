@@ -0,0 +1,154 @@
+/*
+ * Device clock to host monotonic clock synchronisation
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * Device timestamps arrive over USB with a variable delay, but the delay
+ * rarely drops below a constant minimum. The offset between host arrival
+ * time and device time is therefore tracked as its lower envelope: the
+ * minimum of each window is stored, and a line fitted through the window
+ * minima gives offset and drift.
+ */
+#include <math.h>
+#include <string.h>
+
+#include "clock-sync.h"
+
+/* Length of a minimum delay window in seconds */
+#define WINDOW_LENGTH		1.0
+/* Ignore drift estimates beyond 1000 ppm, no crystal is that bad */
+#define MAX_DRIFT		1e-3
+/* Offset changes beyond this indicate a device reset, start again */
+#define MAX_OFFSET_JUMP		1.0
+
+void clock_sync_init(struct clock_sync *cs, unsigned int bits,
+		     double frequency)
+{
+	memset(cs, 0, sizeof(*cs));
+	cs->mask = bits < 32 ? (1U << bits) - 1 : 0xffffffff;
+	cs->period = 1.0 / frequency;
+}
+
+/*
+ * Returns the signed number of ticks since the last update, assuming the
+ * counter did not advance by more than half its range.
+ */
+static int64_t clock_sync_delta(struct clock_sync *cs, uint32_t ticks)
+{
+	int64_t delta = (ticks - cs->last_ticks) & cs->mask;
+
+	if (delta > cs->mask / 2)
+		delta -= (int64_t)cs->mask + 1;
+
+	return delta;
+}
+
+static inline double clock_sync_model(struct clock_sync *cs,
+				      double device_time)
+{
+	return cs->offset + cs->drift * (device_time - cs->reference);
+}
+
+/*
+ * Fits offset and drift through the stored window minima, relative to the
+ * newest window.
+ */
+static void clock_sync_fit(struct clock_sync *cs)
+{
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	struct clock_sync_window *w;
+	double reference, x, d;
+	unsigned int i, n = cs->num_windows;
+
+	w = &cs->windows[(cs->window_head - 1) % CLOCK_SYNC_WINDOWS];
+	reference = w->device_time;
+	for (i = 0; i < n; i++) {
+		w = &cs->windows[(cs->window_head - 1 - i) % CLOCK_SYNC_WINDOWS];
+		x = w->device_time - reference;
+		sx += x;
+		sy += w->offset;
+		sxx += x * x;
+		sxy += x * w->offset;
+	}
+
+	cs->reference = reference;
+	cs->drift = 0;
+	d = n * sxx - sx * sx;
+	if (n > 1 && d > 0)
+		cs->drift = (n * sxy - sx * sy) / d;
+	if (fabs(cs->drift) > MAX_DRIFT)
+		cs->drift = 0;
+	cs->offset = (sy - cs->drift * sx) / n;
+}
+
+/*
+ * Unwraps the device counter value received at the given host time and
+ * updates the offset and drift estimates.
+ *
+ * Returns the device time in the host monotonic clock.
+ */
+double clock_sync_update(struct clock_sync *cs, uint32_t ticks,
+			 double host_time)
+{
+	double device_time, offset, error;
+
+	if (cs->valid)
+		cs->ticks += clock_sync_delta(cs, ticks);
+	else
+		cs->ticks = ticks & cs->mask;
+	cs->last_ticks = ticks;
+
+	device_time = cs->ticks * cs->period;
+	offset = host_time - device_time;
+
+	error = cs->valid ? offset - clock_sync_model(cs, device_time) : 0;
+	if (!cs->valid || fabs(error) > MAX_OFFSET_JUMP) {
+		cs->valid = true;
+		cs->num_windows = 0;
+		cs->window_head = 0;
+		cs->window.device_time = device_time;
+		cs->window.offset = offset;
+		cs->window_start = device_time;
+		cs->reference = device_time;
+		cs->offset = offset;
+		cs->drift = 0;
+		return host_time;
+	}
+
+	/* A faster transfer than ever seen before, shift the model down */
+	if (error < 0)
+		cs->offset += error;
+
+	if (offset < cs->window.offset) {
+		cs->window.device_time = device_time;
+		cs->window.offset = offset;
+	}
+
+	if (device_time - cs->window_start >= WINDOW_LENGTH) {
+		cs->windows[cs->window_head % CLOCK_SYNC_WINDOWS] = cs->window;
+		cs->window_head++;
+		if (cs->num_windows < CLOCK_SYNC_WINDOWS)
+			cs->num_windows++;
+		clock_sync_fit(cs);
+
+		cs->window_start = device_time;
+		cs->window.device_time = device_time;
+		cs->window.offset = offset;
+	}
+
+	return device_time + clock_sync_model(cs, device_time);
+}
+
+/*
+ * Converts a device counter value close to the last update, for example an
+ * event timestamp reported alongside a sample, to the host monotonic clock
+ * without updating the estimates.
+ */
+double clock_sync_convert(struct clock_sync *cs, uint32_t ticks)
+{
+	double device_time;
+
+	device_time = (cs->ticks + clock_sync_delta(cs, ticks)) * cs->period;
+
+	return device_time + clock_sync_model(cs, device_time);
+}
@@ -0,0 +1,68 @@
+/*
+ * Device clock to host monotonic clock synchronisation
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __CLOCK_SYNC_H__
+#define __CLOCK_SYNC_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Number of minimum delay windows used for the drift estimate */
+#define CLOCK_SYNC_WINDOWS	16
+
+/*
+ * Minimum observed offset between host arrival time and device time over
+ * one window.
+ */
+struct clock_sync_window {
+	double device_time;
+	double offset;
+};
+
+/*
+ * Unwraps a free-running device counter and estimates its offset and drift
+ * against the host monotonic clock, assuming that the lowest observed
+ * transfer delay is constant. The host time of a device time t is modeled as
+ * t + offset + drift * (t - reference).
+ */
+struct clock_sync {
+	uint32_t mask;
+	double period;
+	bool valid;
+	uint32_t last_ticks;
+	int64_t ticks;
+
+	struct clock_sync_window windows[CLOCK_SYNC_WINDOWS];
+	unsigned int num_windows;
+	unsigned int window_head;
+	struct clock_sync_window window;
+	double window_start;
+
+	double reference;
+	double offset;
+	double drift;
+};
+
+/*
+ * Returns the current time of the host monotonic clock in seconds, the
+ * common time base for all device and camera timestamps.
+ */
+static inline double clock_sync_host_time(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	return tp.tv_sec + 1e-9 * tp.tv_nsec;
+}
+
+void clock_sync_init(struct clock_sync *cs, unsigned int bits,
+		     double frequency);
+double clock_sync_update(struct clock_sync *cs, uint32_t ticks,
+			 double host_time);
+double clock_sync_convert(struct clock_sync *cs, uint32_t ticks);
+
+#endif /* __CLOCK_SYNC_H__ */
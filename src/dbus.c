@@ -2,6 +2,13 @@
  * D-Bus interface implementation
  * Copyright 2015 Philipp Zabel
  * SPDX-License-Identifier:	GPL-2.0+
+ *
+ * Properties that the daemon updates at runtime are not set on the
+ * interface skeletons directly, but queued and applied in batches, so that
+ * each interface emits at most one PropertiesChanged signal per
+ * PROPERTY_UPDATE_INTERVAL, no matter how often the underlying state
+ * changes. This is only meant for low-rate state such as statistics. Poses
+ * and other high-rate data are published through shared memory only.
  */
 #include <glib.h>
 #include <gio/gio.h>
@@ -9,10 +16,14 @@
 
 #include "camera.h"
 #include "camera-dk2.h"
+#include "debug-gst.h"
 #include "device.h"
 #include "gdbus-generated.h"
+#include "imu.h"
+#include "latency.h"
 #include "ouvrtd.h"
 #include "rift-dk2.h"
+#include "tracker.h"
 
 static GDBusObjectManagerServer *manager = NULL;
 
@@ -42,12 +53,236 @@ static void sender_vanished_handler(GDBusConnection *connection G_GNUC_UNUSED,
 	g_print("Watched name %s disappeared from the bus\n", name);
 }
 
+/* Minimum interval between batched property updates, in milliseconds */
+#define PROPERTY_UPDATE_INTERVAL	250
+
+/*
+ * A property change queued for the next batched update.
+ */
+struct ouvrt_dbus_property_update {
+	GObject *iface;
+	const gchar *name;
+	GValue value;
+};
+
+/* Protects the queued property updates and the update source */
+static GMutex property_lock;
+static GList *property_updates;
+static guint property_source;
+static gint64 property_last_update;
+
+static void ouvrt_dbus_property_update_free(gpointer data)
+{
+	struct ouvrt_dbus_property_update *u = data;
+
+	g_value_unset(&u->value);
+	g_object_unref(u->iface);
+	g_free(u);
+}
+
+/*
+ * GSourceFunc that applies all queued property changes. The skeletons
+ * collect the changes made during a single main loop iteration, so flushing
+ * each changed interface afterwards emits a single PropertiesChanged signal
+ * per interface.
+ */
+static gboolean ouvrt_dbus_update_properties(gpointer user_data G_GNUC_UNUSED)
+{
+	struct ouvrt_dbus_property_update *u;
+	GList *updates, *ifaces = NULL, *link;
+
+	g_mutex_lock(&property_lock);
+	updates = property_updates;
+	property_updates = NULL;
+	property_source = 0;
+	property_last_update = g_get_monotonic_time();
+	g_mutex_unlock(&property_lock);
+
+	for (link = updates; link; link = link->next) {
+		u = link->data;
+		g_object_set_property(u->iface, u->name, &u->value);
+		if (!g_list_find(ifaces, u->iface))
+			ifaces = g_list_prepend(ifaces, u->iface);
+	}
+
+	for (link = ifaces; link; link = link->next)
+		g_dbus_interface_skeleton_flush(
+				G_DBUS_INTERFACE_SKELETON(link->data));
+
+	g_list_free(ifaces);
+	g_list_free_full(updates, ouvrt_dbus_property_update_free);
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * Queues a change of the named property of an interface skeleton, replacing
+ * a change of the same property that is still queued. The change is applied
+ * from the main loop, right away if the last batch was applied more than
+ * PROPERTY_UPDATE_INTERVAL ago, otherwise when the interval has passed. The
+ * update source has low priority, so that device hotplug is handled first.
+ * May be called from any thread.
+ */
+static void ouvrt_dbus_queue_property(gpointer iface, const gchar *name,
+				      const GValue *value)
+{
+	struct ouvrt_dbus_property_update *u = NULL;
+	gint64 delay;
+	GList *link;
+
+	g_mutex_lock(&property_lock);
+
+	for (link = property_updates; link; link = link->next) {
+		struct ouvrt_dbus_property_update *queued = link->data;
+
+		if (queued->iface == iface &&
+		    g_strcmp0(queued->name, name) == 0) {
+			u = queued;
+			g_value_unset(&u->value);
+			break;
+		}
+	}
+	if (!u) {
+		u = g_new0(struct ouvrt_dbus_property_update, 1);
+		u->iface = g_object_ref(iface);
+		u->name = g_intern_string(name);
+		property_updates = g_list_append(property_updates, u);
+	}
+	g_value_init(&u->value, G_VALUE_TYPE(value));
+	g_value_copy(value, &u->value);
+
+	if (!property_source) {
+		delay = property_last_update + PROPERTY_UPDATE_INTERVAL * 1000 -
+			g_get_monotonic_time();
+		delay = CLAMP(delay / 1000, 0, PROPERTY_UPDATE_INTERVAL);
+		property_source = g_timeout_add_full(G_PRIORITY_LOW, delay,
+						     ouvrt_dbus_update_properties,
+						     NULL, NULL);
+	}
+
+	g_mutex_unlock(&property_lock);
+}
+
+/*
+ * Queues a change of a GVariant property, taking ownership of a floating
+ * variant.
+ */
+static void ouvrt_dbus_queue_property_variant(gpointer iface,
+					      const gchar *name,
+					      GVariant *variant)
+{
+	GValue value = G_VALUE_INIT;
+
+	g_value_init(&value, G_TYPE_VARIANT);
+	g_value_set_variant(&value, variant);
+	ouvrt_dbus_queue_property(iface, name, &value);
+	g_value_unset(&value);
+}
+
+/* Interval between updates of the Latency properties */
+#define LATENCY_UPDATE_INTERVAL	1
+
+/*
+ * An interface whose Latency property is updated periodically.
+ */
+struct ouvrt_dbus_latency {
+	OuvrtDevice *dev;
+	GObject *iface;
+	gboolean tracker;
+};
+
+/*
+ * Appends the latency summaries of the given stages since the last update
+ * to the builder.
+ */
+static void ouvrt_dbus_add_latency(GVariantBuilder *builder,
+				   struct latency_stage *stages, int num)
+{
+	struct latency_summary summary;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		latency_histogram_window(&stages[i].hist, &summary);
+		g_variant_builder_add(builder, "{s(udddd)}", stages[i].name,
+				      summary.count, summary.mean, summary.p50,
+				      summary.p99, summary.max);
+	}
+}
+
+/*
+ * Returns the latency summaries of the last interval as a floating variant
+ * for the Latency property of a Tracker1 or Camera1 interface.
+ */
+static GVariant *ouvrt_dbus_latency_variant(struct ouvrt_dbus_latency *l)
+{
+	OuvrtTracker *tracker;
+	GVariantBuilder builder;
+
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{s(udddd)}"));
+	ouvrt_dbus_add_latency(&builder, l->dev->latency, l->dev->num_latency);
+	if (l->tracker) {
+		tracker = ouvrtd_device_get_tracker(l->dev);
+		if (tracker) {
+			ouvrt_dbus_add_latency(&builder,
+					       ouvrt_tracker_get_latency(tracker),
+					       TRACKER_NUM_LATENCY);
+		}
+	}
+
+	return g_variant_builder_end(&builder);
+}
+
+/*
+ * GSourceFunc that queues an update of the Latency property with the
+ * latencies of the last interval. Stops once the device has been removed.
+ */
+static gboolean ouvrt_dbus_update_latency(gpointer user_data)
+{
+	struct ouvrt_dbus_latency *l = user_data;
+
+	if (!g_list_find(device_list, l->dev))
+		return G_SOURCE_REMOVE;
+
+	ouvrt_dbus_queue_property_variant(l->iface, "latency",
+					  ouvrt_dbus_latency_variant(l));
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void ouvrt_dbus_latency_free(gpointer data)
+{
+	struct ouvrt_dbus_latency *l = data;
+
+	g_object_unref(l->iface);
+	g_object_unref(l->dev);
+	g_free(l);
+}
+
+/*
+ * Starts periodic updates of the Latency property of the interface.
+ */
+static void ouvrt_dbus_watch_latency(OuvrtDevice *dev, gpointer iface,
+				     gboolean tracker)
+{
+	struct ouvrt_dbus_latency *l = g_new(struct ouvrt_dbus_latency, 1);
+
+	l->dev = g_object_ref(dev);
+	l->iface = g_object_ref(iface);
+	l->tracker = tracker;
+	/* Set the initial value right away, before the interface is exported */
+	g_object_set(iface, "latency", ouvrt_dbus_latency_variant(l), NULL);
+	g_timeout_add_seconds_full(G_PRIORITY_LOW, LATENCY_UPDATE_INTERVAL,
+				   ouvrt_dbus_update_latency, l,
+				   ouvrt_dbus_latency_free);
+}
+
 static gboolean ouvrt_tracker1_on_handle_acquire(OuvrtTracker1 *object,
 						 GDBusMethodInvocation *invocation,
 						 GUnixFDList *fd_list,
 						 gpointer user_data)
 {
 	OuvrtDevice *dev = OUVRT_DEVICE(user_data);
+	OuvrtTracker *tracker;
 	GError *error = NULL;
 	const gchar *sender;
 	int fd;
@@ -72,14 +307,26 @@ static gboolean ouvrt_tracker1_on_handle_acquire(OuvrtTracker1 *object,
 
 	(void)watcher_id;
 
-	/* FIXME */
-	fd = 1; /* stdout */
+	tracker = ouvrtd_device_get_tracker(dev);
+	fd = tracker ? ouvrt_tracker_get_pose_shm_fd(tracker) : -1;
+	if (fd == -1) {
+		g_dbus_method_invocation_return_dbus_error(invocation,
+				"de.phfuenf.ouvrt.Error.NotSupported",
+				"No pose output for this device");
+		return TRUE;
+	}
 
-	fd_list = NULL;
+	/* The fd list duplicates the file descriptor */
 	fd_list = g_unix_fd_list_new();
-	g_unix_fd_list_append(fd_list, fd, &error);
+	if (g_unix_fd_list_append(fd_list, fd, &error) < 0) {
+		g_dbus_method_invocation_return_gerror(invocation, error);
+		g_error_free(error);
+		g_object_unref(fd_list);
+		return TRUE;
+	}
 
 	ouvrt_tracker1_complete_acquire(object, invocation, fd_list);
+	g_object_unref(fd_list);
 
 	return TRUE;
 }
@@ -101,6 +348,38 @@ static gboolean ouvrt_tracker1_on_handle_release(OuvrtTracker1 *object,
 	return TRUE;
 }
 
+/*
+ * Returns the pose of the device predicted to the requested time.
+ */
+static gboolean ouvrt_tracker1_on_handle_predict_pose(OuvrtTracker1 *object,
+						      GDBusMethodInvocation *invocation,
+						      gdouble timestamp,
+						      gpointer user_data)
+{
+	OuvrtDevice *dev = OUVRT_DEVICE(user_data);
+	OuvrtTracker *tracker;
+	struct dpose pose;
+
+	tracker = ouvrtd_device_get_tracker(dev);
+	if (!tracker) {
+		g_dbus_method_invocation_return_dbus_error(invocation,
+				"de.phfuenf.ouvrt.Error.NotSupported",
+				"No pose output for this device");
+		return TRUE;
+	}
+
+	ouvrt_tracker_predict_pose(tracker, timestamp, &pose);
+
+	ouvrt_tracker1_complete_predict_pose(object, invocation,
+			g_variant_new("(dddd)", pose.rotation.x,
+				      pose.rotation.y, pose.rotation.z,
+				      pose.rotation.w),
+			g_variant_new("(ddd)", pose.translation.x,
+				      pose.translation.y, pose.translation.z));
+
+	return TRUE;
+}
+
 /*
  * Signal change notification for the Tracker1 tracking property.
  */
@@ -159,8 +438,10 @@ static void ouvrt_tracker1_on_flicker_changed(GObject *object,
  */
 static void ouvrt_dbus_export_tracker1_interface(OuvrtDevice *dev)
 {
+	static unsigned int num_trackers;
 	OuvrtObjectSkeleton *object;
 	OuvrtTracker1 *tracker;
+	gchar *path;
 
 	g_print("Exporting Tracker1 interface for device %s\n", dev->devnode);
 
@@ -172,12 +453,18 @@ static void ouvrt_dbus_export_tracker1_interface(OuvrtDevice *dev)
 			 G_CALLBACK(ouvrt_tracker1_on_handle_acquire), dev);
 	g_signal_connect(tracker, "handle-release",
 			 G_CALLBACK(ouvrt_tracker1_on_handle_release), dev);
+	g_signal_connect(tracker, "handle-predict-pose",
+			 G_CALLBACK(ouvrt_tracker1_on_handle_predict_pose),
+			 dev);
 	g_signal_connect(tracker, "notify::tracking",
 			 G_CALLBACK(ouvrt_tracker1_on_tracking_changed), dev);
 	g_signal_connect(tracker, "notify::flicker",
 			 G_CALLBACK(ouvrt_tracker1_on_flicker_changed), dev);
 
-	object = ouvrt_object_skeleton_new("/de/phfuenf/ouvrt/tracker0");
+	path = g_strdup_printf("/de/phfuenf/ouvrt/tracker%u", num_trackers++);
+	object = ouvrt_object_skeleton_new(path);
+	g_free(path);
+	ouvrt_dbus_watch_latency(dev, tracker, TRUE);
 	ouvrt_object_skeleton_set_tracker1(object, tracker);
 	g_object_unref(tracker);
 
@@ -213,6 +500,25 @@ static void ouvrt_camera1_on_sync_exposure_changed(GObject *object,
 	}
 }
 
+/*
+ * Signal change notification for the Camera1 debug-attachment property.
+ */
+static void ouvrt_camera1_on_debug_attachment_changed(GObject *object,
+						      GParamSpec *spec,
+						      gpointer user_data)
+{
+	OuvrtCamera1 *camera1 = OUVRT_CAMERA1(object);
+	OuvrtCamera *camera = OUVRT_CAMERA(user_data);
+
+	(void)spec;
+
+	camera->debug_attachment =
+		ouvrt_camera1_get_debug_attachment(camera1);
+	debug_gst_set_attachment(camera->debug, camera->debug_attachment);
+	g_print("Debug attachment %s\n",
+		camera->debug_attachment ? "enabled" : "disabled");
+}
+
 /*
  * Exports a Camera1 interface via D-Bus.
  */
@@ -240,16 +546,28 @@ static void ouvrt_dbus_export_camera1_interface(OuvrtDevice *dev)
 					   camera->dist_coeffs[4]);
 	ouvrt_camera1_set_distortion_coefficients(camera1, variant);
 
-	caps = "video/x-raw,format=GRAY8,width=752,height=480,framerate=60/1";
+	/* Without debug output, there is no socket for clients to connect to */
+	if (!debug_gst_enabled)
+		caps = "";
+	else if (debug_gst_rle)
+		caps = "application/x-ouvrt-rle,width=752,height=480,framerate=60/1";
+	else
+		caps = "video/x-raw,format=GRAY8,width=752,height=480,framerate=60/1";
 	ouvrt_camera1_set_gst_shm_caps(camera1, caps);
-	ouvrt_camera1_set_gst_shm_socket(camera1, "/tmp/ouvrtd-gst");
+	ouvrt_camera1_set_gst_shm_socket(camera1, debug_gst_enabled ?
+					 "/tmp/ouvrtd-gst" : "");
+	ouvrt_camera1_set_debug_attachment(camera1, camera->debug_attachment);
 	ouvrt_camera1_set_sync_exposure(camera1, FALSE);
 
+	g_signal_connect(camera1, "notify::debug-attachment",
+			 G_CALLBACK(ouvrt_camera1_on_debug_attachment_changed),
+			 dev);
 	g_signal_connect(camera1, "notify::sync-exposure",
 			 G_CALLBACK(ouvrt_camera1_on_sync_exposure_changed),
 			 dev);
 
 	object = ouvrt_object_skeleton_new("/de/phfuenf/ouvrt/camera0");
+	ouvrt_dbus_watch_latency(dev, camera1, FALSE);
 	ouvrt_object_skeleton_set_camera1(object, camera1);
 	g_object_unref(camera1);
 
@@ -265,7 +583,8 @@ static void ouvrt_dbus_export_device_interface(gpointer data,
 
 	g_print("TODO: register %s with DBus\n", dev->devnode);
 
-	if (dev->type == DEVICE_TYPE_HMD) {
+	if (dev->type == DEVICE_TYPE_HMD ||
+	    dev->type == DEVICE_TYPE_CONTROLLER) {
 		/* Export a Tracker1 interface */
 		ouvrt_dbus_export_tracker1_interface(dev);
 	}
@@ -2,8 +2,14 @@
  * GStreamer debug video output
  * Copyright 2015 Philipp Zabel
  * SPDX-License-Identifier:	GPL-2.0+
+ *
+ * Each buffer contains the frame, either as raw GRAY8 image or, if
+ * debug_gst_rle is set, as run-length compressed debug frame whose header
+ * contains its size. If the debug attachment is enabled, the frame is
+ * followed by a struct ouvrt_debug_attachment.
  */
 #include <gst/gst.h>
+#include <gst/allocators/allocators.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,11 +18,23 @@
 
 #include "debug.h"
 #include "debug-gst.h"
+#include "debug-rle.h"
+
+/* Debug output can be disabled at runtime with --headless */
+gboolean debug_gst_enabled = TRUE;
+
+/* Stream run-length compressed instead of raw GRAY8 frames */
+gboolean debug_gst_rle = FALSE;
 
 struct debug_gst {
 	GstElement *pipeline;
 	GstElement *appsrc;
+	GstAllocator *dmabuf_allocator;
 	gboolean connected;
+	gboolean attach;
+	int width;
+	int height;
+	uint8_t *rle;
 };
 
 /*
@@ -51,7 +69,10 @@ static void debug_gst_client_disconnected(GstElement *sink G_GNUC_UNUSED,
 }
 
 /*
- * Enables GStreamer debug output of GRAY8 frames into a shmsink.
+ * Enables GStreamer debug output of GRAY8 or run-length compressed frames
+ * into a shmsink.
+ *
+ * Returns NULL, without touching the socket, if debug output is disabled.
  */
 struct debug_gst *debug_gst_new(int width, int height, int framerate)
 {
@@ -59,6 +80,24 @@ struct debug_gst *debug_gst_new(int width, int height, int framerate)
 	GstElement *pipeline, *src, *sink;
 	GstCaps *caps;
 
+	if (!debug_gst_enabled)
+		return NULL;
+
+	gst = malloc(sizeof(*gst));
+	if (!gst)
+		return NULL;
+
+	/* The caps announce compressed frames, so the encoder must work */
+	gst->rle = NULL;
+	if (debug_gst_rle) {
+		gst->rle = malloc(debug_rle_max_size(width, height));
+		if (!gst->rle) {
+			printf("debug: failed to allocate RLE buffer\n");
+			free(gst);
+			return NULL;
+		}
+	}
+
 	unlink("/tmp/ouvrtd-gst");
 
 	pipeline = gst_pipeline_new(NULL);
@@ -68,13 +107,21 @@ struct debug_gst *debug_gst_new(int width, int height, int framerate)
 	if (src == NULL || sink == NULL)
 		g_error("Could not create elements");
 
-	caps = gst_caps_new_simple("video/x-raw",
-		"format", G_TYPE_STRING, "GRAY8",
-		"framerate", GST_TYPE_FRACTION, framerate, 1,
-		"pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
-		"width", G_TYPE_INT, width,
-		"height", G_TYPE_INT, height,
-		NULL);
+	if (debug_gst_rle) {
+		caps = gst_caps_new_simple("application/x-ouvrt-rle",
+			"framerate", GST_TYPE_FRACTION, framerate, 1,
+			"width", G_TYPE_INT, width,
+			"height", G_TYPE_INT, height,
+			NULL);
+	} else {
+		caps = gst_caps_new_simple("video/x-raw",
+			"format", G_TYPE_STRING, "GRAY8",
+			"framerate", GST_TYPE_FRACTION, framerate, 1,
+			"pixel-aspect-ratio", GST_TYPE_FRACTION, 1, 1,
+			"width", G_TYPE_INT, width,
+			"height", G_TYPE_INT, height,
+			NULL);
+	}
 
 	g_object_set(src, "caps", caps, NULL);
 	g_object_set(src, "stream-type", 0, NULL);
@@ -85,12 +132,13 @@ struct debug_gst *debug_gst_new(int width, int height, int framerate)
 	gst_bin_add_many(GST_BIN(pipeline), src, sink, NULL);
 	gst_element_link_many(src, sink, NULL);
 
-	gst = malloc(sizeof(*gst));
-	if (!gst)
-		return NULL;
 	gst->pipeline = pipeline;
 	gst->appsrc = src;
+	gst->dmabuf_allocator = gst_dmabuf_allocator_new();
 	gst->connected = FALSE;
+	gst->attach = FALSE;
+	gst->width = width;
+	gst->height = height;
 
 	g_signal_connect(G_OBJECT(sink), "client-connected",
 			 G_CALLBACK(debug_gst_client_connected), gst);
@@ -104,39 +152,130 @@ struct debug_gst *debug_gst_new(int width, int height, int framerate)
 
 struct debug_gst *debug_gst_unref(struct debug_gst *gst)
 {
+	if (!gst)
+		return NULL;
+
 	gst_element_set_state(gst->pipeline, GST_STATE_NULL);
 	gst_object_unref(gst->pipeline);
+	gst_object_unref(gst->dmabuf_allocator);
+	free(gst->rle);
 	free(gst);
 
 	return NULL;
 }
 
 /*
- * Allocates a GstBuffer that wraps the frame and pushes it into the
- * GStreamer pipeline.
+ * Returns whether a client is connected to the debug stream, so that the
+ * caller can skip preparing frames that nobody is going to look at.
+ */
+gboolean debug_gst_connected(struct debug_gst *gst)
+{
+	return gst && gst->connected;
+}
+
+/*
+ * Enables or disables the debug attachment with blobs, pose, IMU samples,
+ * and timestamps after each frame.
+ */
+void debug_gst_set_attachment(struct debug_gst *gst, gboolean enable)
+{
+	if (gst)
+		g_atomic_int_set(&gst->attach, enable);
+}
+
+/*
+ * Returns whether frames are streamed with debug attachment, so that the
+ * caller can skip collecting data that is not going to be sent.
+ */
+gboolean debug_gst_attachment_enabled(struct debug_gst *gst)
+{
+	return gst && gst->connected && g_atomic_int_get(&gst->attach);
+}
+
+/*
+ * Allocates a GstBuffer that wraps the frame, or the DMABUF it was exported
+ * to if dmabuf_fd is not -1, or a compressed copy of the frame, optionally
+ * followed by a separately allocated debug attachment, and pushes it into
+ * the GStreamer pipeline.
  */
 void debug_gst_frame_push(struct debug_gst *gst, void *src, size_t size,
-			  size_t attach_offset, struct blobservation *ob,
+			  int dmabuf_fd, struct blobservation *ob,
+			  struct imu_ring_reader *imu,
 			  dquat *rot, dvec3 *trans, double timestamps[3])
 {
-	struct ouvrt_debug_attachment *attach = src + attach_offset;
-	unsigned int num;
+	struct imu_sample samples[32];
+	struct ouvrt_debug_attachment *attach;
+	GstMemory *frame_mem = NULL;
+	GstMemory *attach_mem;
+	unsigned int num, i;
+	void *rle;
+	size_t attach_size;
+	gboolean with_attachment;
 	GstBuffer *buf;
+	int fd;
 	int ret;
 
-	if (!gst->connected)
+	if (!gst || !gst->connected)
 		return;
 
+	/* The attachment can be toggled via D-Bus while the frame is built */
+	with_attachment = g_atomic_int_get(&gst->attach);
+
+	if (gst->rle) {
+		/* Only copy the compressed size, the scratch buffer is reused */
+		size = debug_rle_encode(src, gst->width, gst->height,
+					DEBUG_RLE_THRESHOLD, gst->rle);
+		if (with_attachment) {
+			((struct debug_rle_header *)gst->rle)->flags |=
+				DEBUG_RLE_FLAG_ATTACHMENT;
+		}
+		rle = g_malloc(size);
+		memcpy(rle, gst->rle, size);
+		frame_mem = gst_memory_new_wrapped(0, rle, size, 0, size,
+						   rle, g_free);
+	} else if (dmabuf_fd != -1) {
+		/* The allocator takes ownership of the file descriptor */
+		fd = dup(dmabuf_fd);
+		if (fd != -1) {
+			frame_mem = gst_dmabuf_allocator_alloc(
+					gst->dmabuf_allocator, fd, size);
+		}
+	}
+	if (!frame_mem && !gst->rle) {
+		frame_mem = gst_memory_new_wrapped(GST_MEMORY_FLAG_READONLY,
+						   src, size, 0, size,
+						   NULL, NULL);
+	}
+	if (!frame_mem)
+		return;
+
+	buf = gst_buffer_new();
+	gst_buffer_append_memory(buf, frame_mem);
+
+	if (!with_attachment)
+		goto push;
+
+	attach_size = sizeof(*attach);
+	if (ob)
+		attach_size += ob->num_blobs * sizeof(struct blob);
+	attach = g_malloc0(attach_size);
+	attach_mem = gst_memory_new_wrapped(0, attach, attach_size, 0,
+					    attach_size, attach, g_free);
+
 	if (ob) {
-		/* Copy blobs and flicker history */
-		memcpy(&attach->blobservation, ob, sizeof(*ob));
+		/* Copy blobs */
+		attach->num_blobs = ob->num_blobs;
+		memcpy(attach->blobs, ob->blobs,
+		       ob->num_blobs * sizeof(struct blob));
 
 		/* Copy rotation and translation */
 		memcpy(&attach->rot, rot, sizeof(dquat));
 		memcpy(&attach->trans, trans, sizeof(dvec3));
 
 		/* Copy raw IMU sensor readings */
-		num = debug_imu_fifo_out(attach->imu_samples, 32);
+		num = imu ? imu_ring_read(imu, samples, 32) : 0;
+		for (i = 0; i < num; i++)
+			attach->imu_samples[i].sample = samples[i];
 		attach->num_imu_samples = num;
 
 		if (timestamps) {
@@ -145,11 +284,9 @@ void debug_gst_frame_push(struct debug_gst *gst, void *src, size_t size,
 		}
 	}
 
-	buf = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, src,
-					  size, 0, size, NULL, NULL);
-	if (!buf)
-		return;
+	gst_buffer_append_memory(buf, attach_mem);
 
+push:
 //	GST_BUFFER_TIMESTAMP(buffer) = ...
 //	GST_BUFFER_DURATION(buffer) = ...
 	g_signal_emit_by_name(gst->appsrc, "push-buffer", buf, &ret);
@@ -6,15 +6,76 @@
 #ifndef __DEBUG_GST_H__
 #define __DEBUG_GST_H__
 
+#include <glib.h>
+#include <stddef.h>
+
 #include "blobwatch.h"
+#include "imu-ring.h"
 
 struct debug_gst;
 
+#ifdef HAVE_DEBUG_GST
+
+extern gboolean debug_gst_enabled;
+extern gboolean debug_gst_rle;
+
 void debug_gst_init(int argc, char *argv[]);
 struct debug_gst *debug_gst_new(int width, int height, int framerate);
 struct debug_gst *debug_gst_unref(struct debug_gst *gst);
+gboolean debug_gst_connected(struct debug_gst *gst);
+void debug_gst_set_attachment(struct debug_gst *gst, gboolean enable);
+gboolean debug_gst_attachment_enabled(struct debug_gst *gst);
 void debug_gst_frame_push(struct debug_gst *gst, void *frame, size_t size,
-			  size_t attach_offset, struct blobservation *ob,
+			  int dmabuf_fd, struct blobservation *ob,
+			  struct imu_ring_reader *imu,
 			  dquat *rot, dvec3 *trans, double timestamps[3]);
 
+#else
+
+/* Built with --disable-debug-gst, there is never a debug stream */
+#define debug_gst_enabled	FALSE
+#define debug_gst_rle		FALSE
+
+static inline struct debug_gst *
+debug_gst_new(int width G_GNUC_UNUSED, int height G_GNUC_UNUSED,
+	      int framerate G_GNUC_UNUSED)
+{
+	return NULL;
+}
+
+static inline struct debug_gst *
+debug_gst_unref(struct debug_gst *gst G_GNUC_UNUSED)
+{
+	return NULL;
+}
+
+static inline gboolean debug_gst_connected(struct debug_gst *gst G_GNUC_UNUSED)
+{
+	return FALSE;
+}
+
+static inline void debug_gst_set_attachment(struct debug_gst *gst G_GNUC_UNUSED,
+					    gboolean enable G_GNUC_UNUSED)
+{
+}
+
+static inline gboolean
+debug_gst_attachment_enabled(struct debug_gst *gst G_GNUC_UNUSED)
+{
+	return FALSE;
+}
+
+static inline void
+debug_gst_frame_push(struct debug_gst *gst G_GNUC_UNUSED,
+		     void *frame G_GNUC_UNUSED, size_t size G_GNUC_UNUSED,
+		     int dmabuf_fd G_GNUC_UNUSED,
+		     struct blobservation *ob G_GNUC_UNUSED,
+		     struct imu_ring_reader *imu G_GNUC_UNUSED,
+		     dquat *rot G_GNUC_UNUSED, dvec3 *trans G_GNUC_UNUSED,
+		     double timestamps[3] G_GNUC_UNUSED)
+{
+}
+
+#endif /* HAVE_DEBUG_GST */
+
 #endif /* __DEBUG_GST_H__ */
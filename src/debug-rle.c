@@ -0,0 +1,117 @@
+/*
+ * Run-length compressed debug frames
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+#include <string.h>
+
+#include "debug-rle.h"
+
+/*
+ * Returns the worst case size of a compressed frame, with every other pixel
+ * above the threshold.
+ */
+size_t debug_rle_max_size(int width, int height)
+{
+	return sizeof(struct debug_rle_header) +
+	       (size_t)(width + 1) / 2 * height *
+	       sizeof(struct debug_rle_extent) + (size_t)width * height;
+}
+
+/*
+ * Compresses a GRAY8 frame into out, which must have room for
+ * debug_rle_max_size bytes. Extents are first collected at the start of the
+ * output, the pixel values at the end, and then moved right behind the
+ * extents.
+ *
+ * Returns the compressed size.
+ */
+size_t debug_rle_encode(const uint8_t *frame, int width, int height,
+			uint8_t threshold, uint8_t *out)
+{
+	struct debug_rle_header *header = (struct debug_rle_header *)out;
+	struct debug_rle_extent *extents = (struct debug_rle_extent *)
+					   (header + 1);
+	uint8_t *pixels = out + debug_rle_max_size(width, height) -
+			  (size_t)width * height;
+	unsigned int n = 0;
+	size_t num_pixels = 0;
+	const uint8_t *line;
+	int x, y, start;
+
+	for (y = 0; y < height; y++) {
+		line = frame + y * width;
+		for (x = 0; x < width; x++) {
+			if (line[x] <= threshold)
+				continue;
+
+			start = x;
+			while (x < width && line[x] > threshold)
+				x++;
+
+			extents[n].x = start;
+			extents[n].y = y;
+			extents[n].length = x - start;
+			extents[n].reserved = 0;
+			n++;
+
+			memcpy(pixels + num_pixels, line + start, x - start);
+			num_pixels += x - start;
+		}
+	}
+
+	memmove(extents + n, pixels, num_pixels);
+
+	memcpy(header->magic, DEBUG_RLE_MAGIC, 4);
+	header->width = width;
+	header->height = height;
+	header->size = sizeof(*header) + n * sizeof(*extents) + num_pixels;
+	header->num_extents = n;
+	header->flags = 0;
+	header->reserved = 0;
+
+	return header->size;
+}
+
+/*
+ * Decompresses a compressed frame of the given size into a width x height
+ * GRAY8 frame.
+ *
+ * Returns 0 on success, or -1 if the data is corrupted or does not match
+ * the frame size.
+ */
+int debug_rle_decode(const uint8_t *data, size_t size, uint8_t *frame,
+		     int width, int height)
+{
+	const struct debug_rle_header *header = (const void *)data;
+	const struct debug_rle_extent *extents = (const void *)(header + 1);
+	const uint8_t *pixels, *end;
+	unsigned int i;
+
+	if (size < sizeof(*header) ||
+	    memcmp(header->magic, DEBUG_RLE_MAGIC, 4) != 0 ||
+	    header->size < sizeof(*header) || header->size > size ||
+	    header->width != width || header->height != height)
+		return -1;
+
+	/* All extents must lie within the compressed frame */
+	if ((size_t)header->num_extents * sizeof(*extents) >
+	    header->size - sizeof(*header))
+		return -1;
+
+	pixels = (const uint8_t *)(extents + header->num_extents);
+	end = data + header->size;
+
+	memset(frame, 0, (size_t)width * height);
+	for (i = 0; i < header->num_extents; i++) {
+		const struct debug_rle_extent *e = &extents[i];
+
+		if (e->y >= height || e->x + e->length > width ||
+		    e->length > end - pixels)
+			return -1;
+		memcpy(frame + e->y * width + e->x, pixels, e->length);
+		pixels += e->length;
+	}
+
+	return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * Run-length compressed debug frames
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ *
+ * Tracking camera frames are almost entirely black. Instead of the full
+ * GRAY8 image, a compressed debug frame only contains the extents of
+ * horizontally adjacent pixels that exceed a threshold: a header, followed
+ * by num_extents extents, followed by the pixel values of all extents in
+ * order. Pixels below the threshold decode as black.
+ */
+#ifndef __DEBUG_RLE_H__
+#define __DEBUG_RLE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEBUG_RLE_MAGIC		"ORLE"
+/* Low enough to keep the dim halos around the LED blobs */
+#define DEBUG_RLE_THRESHOLD	0x20
+
+/* The frame is followed by a struct ouvrt_debug_attachment */
+#define DEBUG_RLE_FLAG_ATTACHMENT	0x1
+
+struct debug_rle_header {
+	char magic[4];
+	uint16_t width;
+	uint16_t height;
+	/* Total size in bytes, including this header */
+	uint32_t size;
+	uint32_t num_extents;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+struct debug_rle_extent {
+	uint16_t x;
+	uint16_t y;
+	uint16_t length;
+	uint16_t reserved;
+};
+
+size_t debug_rle_max_size(int width, int height);
+size_t debug_rle_encode(const uint8_t *frame, int width, int height,
+			uint8_t threshold, uint8_t *out);
+int debug_rle_decode(const uint8_t *data, size_t size, uint8_t *frame,
+		     int width, int height);
+
+#endif /* __DEBUG_RLE_H__ */
@@ -18,18 +18,19 @@
 
 extern int debug_mode;
 
+/*
+ * Debug information attached to each frame, followed by num_blobs blobs.
+ */
 struct ouvrt_debug_attachment {
-	struct blobservation blobservation;
 	dquat rot;
 	dvec3 trans;
 	int num_imu_samples;
 	struct imu_state imu_samples[32];
 	double timestamps[4];
+	int num_blobs;
+	struct blob blobs[];
 };
 
 int debug_parse_arg(const char *arg);
 
-unsigned int debug_imu_fifo_in(struct imu_state *samples, unsigned int n);
-unsigned int debug_imu_fifo_out(struct imu_state *samples, unsigned int n);
-
 #endif /* __DEBUG_H__ */
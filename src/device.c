@@ -3,12 +3,16 @@
  * Copyright 2015 Philipp Zabel
  * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
  */
+#include <errno.h>
 #include <glib.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 
 #include "device.h"
+#include "hid-io.h"
+#include "thread-policy.h"
 
 struct _OuvrtDevicePrivate {
 	GThread *thread;
@@ -39,6 +43,7 @@ static void ouvrt_device_finalize(GObject *object)
 	free(dev->devnode);
 	free(dev->name);
 	free(dev->serial);
+	free(dev->version);
 	G_OBJECT_CLASS(ouvrt_device_parent_class)->finalize(object);
 }
 
@@ -57,8 +62,12 @@ static void ouvrt_device_init(OuvrtDevice *self)
 	self->devnode = NULL;
 	self->name = NULL;
 	self->serial = NULL;
+	self->version = NULL;
 	self->active = FALSE;
 	self->fd = -1;
+	self->stop_fd = -1;
+	self->latency = NULL;
+	self->num_latency = 0;
 	self->priv = ouvrt_device_get_instance_private(self);
 	self->priv->thread = NULL;
 }
@@ -70,33 +79,58 @@ static gpointer device_start_routine(gpointer data)
 {
 	OuvrtDevice *dev = OUVRT_DEVICE(data);
 
+	thread_policy_apply(dev->name, "device");
 	OUVRT_DEVICE_GET_CLASS(dev)->thread(dev);
 
 	return NULL;
 }
 
 /*
- * Starts the device and its worker thread.
+ * Starts the device and its worker thread, or registers it with the shared
+ * HID thread.
  */
 int ouvrt_device_start(OuvrtDevice *dev)
 {
+	OuvrtDeviceClass *klass = OUVRT_DEVICE_GET_CLASS(dev);
 	int ret;
 
 	if (dev->active)
 		return 0;
 
-	ret = OUVRT_DEVICE_GET_CLASS(dev)->start(dev);
+	ret = klass->start(dev);
 	if (ret < 0)
 		return ret;
 
 	dev->active = TRUE;
-	dev->priv->thread = g_thread_new(NULL, device_start_routine, dev);
+	if (klass->hid_report) {
+		ret = hid_io_add(dev);
+		if (ret < 0) {
+			g_print("%s: Failed to add HID device: %d\n",
+				dev->name, ret);
+			dev->active = FALSE;
+			klass->stop(dev);
+			return ret;
+		}
+	} else {
+		dev->stop_fd = eventfd(0, EFD_CLOEXEC);
+		if (dev->stop_fd == -1) {
+			ret = -errno;
+			g_print("%s: Failed to create eventfd: %d\n",
+				dev->name, errno);
+			dev->active = FALSE;
+			klass->stop(dev);
+			return ret;
+		}
+		dev->priv->thread = g_thread_new("device",
+						 device_start_routine, dev);
+	}
 
 	return 0;
 }
 
 /*
- * Stops the device and its worker thread.
+ * Stops the device and its worker thread. The thread is woken up through
+ * the stop eventfd, so this does not have to wait for a poll timeout.
  */
 void ouvrt_device_stop(OuvrtDevice *dev)
 {
@@ -105,8 +139,15 @@ void ouvrt_device_stop(OuvrtDevice *dev)
 
 	dev->active = FALSE;
 
-	g_thread_join(dev->priv->thread);
-	dev->priv->thread = NULL;
+	if (dev->priv->thread) {
+		eventfd_write(dev->stop_fd, 1);
+		g_thread_join(dev->priv->thread);
+		dev->priv->thread = NULL;
+		close(dev->stop_fd);
+		dev->stop_fd = -1;
+	} else {
+		hid_io_remove(dev);
+	}
 
 	OUVRT_DEVICE_GET_CLASS(dev)->stop(dev);
 }
@@ -27,6 +27,8 @@ enum device_type {
 #define OUVRT_DEVICE_GET_CLASS(obj)	(G_TYPE_INSTANCE_GET_CLASS((obj), \
 					 OUVRT_TYPE_DEVICE, OuvrtDeviceClass))
 
+struct latency_stage;
+
 typedef struct _OuvrtDevice		OuvrtDevice;
 typedef struct _OuvrtDeviceClass	OuvrtDeviceClass;
 typedef struct _OuvrtDevicePrivate	OuvrtDevicePrivate;
@@ -38,8 +40,18 @@ struct _OuvrtDevice {
 	char *devnode;
 	char *name;
 	char *serial;
+	/* Firmware version, identifies cached calibration data */
+	char *version;
 	gboolean active;
 	int fd;
+	/*
+	 * Eventfd that becomes readable when the device is stopped, to be
+	 * polled by the device thread along with its data fd
+	 */
+	int stop_fd;
+	/* Latency histograms of device specific stages, owned by the device */
+	struct latency_stage *latency;
+	int num_latency;
 
 	OuvrtDevicePrivate *priv;
 };
@@ -50,6 +62,29 @@ struct _OuvrtDeviceClass {
 	int (*start)(OuvrtDevice *dev);
 	void (*thread)(OuvrtDevice *dev);
 	void (*stop)(OuvrtDevice *dev);
+	/*
+	 * HID devices can implement hid_report instead of thread, to have
+	 * their reports read by the shared HID thread. hid_timeout is
+	 * called if no report was received for a second. hid_hangup is
+	 * called once if the device went away, after which no callbacks
+	 * are called anymore.
+	 */
+	void (*hid_report)(OuvrtDevice *dev, const unsigned char *buf,
+			   size_t len, double time);
+	void (*hid_timeout)(OuvrtDevice *dev);
+	void (*hid_hangup)(OuvrtDevice *dev);
+	/*
+	 * If set, hid_keepalive is called from the shared HID thread every
+	 * hid_keepalive_interval seconds, driven by a timer.
+	 */
+	void (*hid_keepalive)(OuvrtDevice *dev);
+	double hid_keepalive_interval;
+	/*
+	 * Prepares the device for the replay of a recorded session instead of
+	 * start, without accessing the hardware. Calibration data is taken
+	 * from the recording.
+	 */
+	int (*replay_start)(OuvrtDevice *dev);
 };
 
 GType ouvrt_device_get_type(void);
@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <linux/uvcvideo.h>
 #include <linux/usb/video.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -18,9 +19,12 @@
 #define ESP570_SELECTOR_UNKNOWN_3	3
 #define ESP570_SELECTOR_EEPROM		5
 
+/* Serializes SET_CUR / GET_CUR pairs issued from different threads */
+static pthread_mutex_t xu_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Calls SET_CUR and then GET_CUR on a given selector of the DK2 camera UVC
- * extension unit.
+ * extension unit. The pair is atomic with respect to other threads.
  */
 static int uvc_xu_set_get_cur(int fd, int selector, unsigned char *buf,
 			      uint8_t len)
@@ -33,21 +37,26 @@ static int uvc_xu_set_get_cur(int fd, int selector, unsigned char *buf,
 		.data = buf,
 	};
 
+	pthread_mutex_lock(&xu_lock);
+
 	xu.query = UVC_SET_CUR;
 	ret = ioctl(fd, UVCIOC_CTRL_QUERY, &xu);
 	if (ret == -1) {
 		printf("uvc: SET_CUR error: %d\n", errno);
-		return ret;
+		goto out;
 	}
 
 	xu.query = UVC_GET_CUR;
 	ret = ioctl(fd, UVCIOC_CTRL_QUERY, &xu);
 	if (ret == -1) {
 		printf("uvc: GET_CUR error: %d\n", errno);
-		return ret;
+		goto out;
 	}
 
-	return 0;
+	ret = 0;
+out:
+	pthread_mutex_unlock(&xu_lock);
+	return ret;
 }
 
 /*
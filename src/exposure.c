@@ -0,0 +1,139 @@
+/*
+ * Camera exposure timing model
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <string.h>
+
+#include "exposure.h"
+
+/*
+ * Maximum delay between the first report of an exposure and the camera
+ * frame timestamp, well below the 16.7 ms frame period at 60 Hz.
+ */
+#define MAX_PAIRING_DELAY	0.010
+/* Allow the frame timestamp to precede the exposure report slightly */
+#define PAIRING_SLACK		0.002
+/* Number of consistent pairings required to lock the offset */
+#define LOCK_CONFIDENCE		3
+
+void exposure_timing_init(struct exposure_timing *et)
+{
+	memset(et, 0, sizeof(*et));
+}
+
+/*
+ * Records an exposure reported by the tracked device. The same exposure is
+ * reported repeatedly until the next one happens, only the first report is
+ * stored.
+ */
+void exposure_timing_push(struct exposure_timing *et, uint16_t count,
+			  double device_time, int led_phase, double host_time)
+{
+	struct exposure *last;
+
+	if (et->head) {
+		last = &et->exposures[(et->head - 1) % EXPOSURE_RING_SIZE];
+		if (last->count == count)
+			return;
+	}
+
+	last = &et->exposures[et->head % EXPOSURE_RING_SIZE];
+	last->count = count;
+	last->device_time = device_time;
+	last->led_phase = led_phase;
+	last->host_time = host_time;
+	et->head++;
+}
+
+/*
+ * Returns the stored exposure with the given count, or NULL.
+ */
+static struct exposure *exposure_find(struct exposure_timing *et,
+				      uint16_t count)
+{
+	struct exposure *e;
+	unsigned int i;
+
+	for (i = 1; i <= EXPOSURE_RING_SIZE && i <= et->head; i++) {
+		e = &et->exposures[(et->head - i) % EXPOSURE_RING_SIZE];
+		if (e->count == count)
+			return e;
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns the latest exposure that was reported shortly before host_time,
+ * or NULL.
+ */
+static struct exposure *exposure_pair(struct exposure_timing *et,
+				      double host_time)
+{
+	struct exposure *e;
+	unsigned int i;
+	double delay;
+
+	for (i = 1; i <= EXPOSURE_RING_SIZE && i <= et->head; i++) {
+		e = &et->exposures[(et->head - i) % EXPOSURE_RING_SIZE];
+		delay = host_time - e->host_time;
+		if (delay < -PAIRING_SLACK)
+			continue;
+		if (delay > MAX_PAIRING_DELAY)
+			return NULL;
+		return e;
+	}
+
+	return NULL;
+}
+
+/*
+ * Looks up the exposure of the camera frame with the given V4L2 sequence
+ * number and monotonic timestamp.
+ *
+ * Returns true and stores the exposure if the frame could be mapped to an
+ * exposure with confidence.
+ */
+bool exposure_timing_lookup(struct exposure_timing *et, uint32_t sequence,
+			    double host_time, struct exposure *exposure)
+{
+	struct exposure *e;
+	uint16_t offset;
+
+	if (et->locked) {
+		e = exposure_find(et, sequence - et->offset);
+		if (e) {
+			et->confidence = LOCK_CONFIDENCE;
+			*exposure = *e;
+			return true;
+		}
+
+		/* Exposures stopped matching frames, for example without sync */
+		if (--et->confidence > 0)
+			return false;
+		et->locked = false;
+	}
+
+	e = exposure_pair(et, host_time);
+	if (!e) {
+		et->confidence = 0;
+		return false;
+	}
+
+	offset = sequence - e->count;
+	if (et->confidence && offset == et->offset) {
+		et->confidence++;
+	} else {
+		et->offset = offset;
+		et->confidence = 1;
+	}
+
+	if (et->confidence < LOCK_CONFIDENCE)
+		return false;
+
+	et->locked = true;
+	*exposure = *e;
+
+	return true;
+}
@@ -0,0 +1,48 @@
+/*
+ * Camera exposure timing model
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __EXPOSURE_H__
+#define __EXPOSURE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Must be a power of two, holds about a quarter second of exposures */
+#define EXPOSURE_RING_SIZE	16
+
+/*
+ * A single camera exposure as reported by the tracked device: exposure
+ * counter, exposure time in the device clock used for IMU sample times,
+ * and the phase of the LED blinking pattern. host_time is the monotonic
+ * clock time at which the exposure was first reported.
+ */
+struct exposure {
+	uint16_t count;
+	int led_phase;
+	double device_time;
+	double host_time;
+};
+
+/*
+ * Maps camera frame sequence numbers to reported exposures. Before the
+ * offset between sequence numbers and exposure counts is known, frames are
+ * paired with exposures by host arrival time. The offset is locked after
+ * a few consistent pairings and dropped again if it stops matching.
+ */
+struct exposure_timing {
+	struct exposure exposures[EXPOSURE_RING_SIZE];
+	unsigned int head;
+	bool locked;
+	uint16_t offset;
+	int confidence;
+};
+
+void exposure_timing_init(struct exposure_timing *et);
+void exposure_timing_push(struct exposure_timing *et, uint16_t count,
+			  double device_time, int led_phase, double host_time);
+bool exposure_timing_lookup(struct exposure_timing *et, uint32_t sequence,
+			    double host_time, struct exposure *exposure);
+
+#endif /* __EXPOSURE_H__ */
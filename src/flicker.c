@@ -15,11 +15,39 @@
 
 #include <stdio.h>
 
+#define NUM_PATTERNS	1024
+#define PATTERN_MASK	0x3ff
+
+/* Minimum number of observed bits to identify a partially known pattern */
+#define MIN_KNOWN_BITS	8
+
+/*
+ * LED ID and confidence (2 for an exact match, 1 for a single bit error)
+ * for a 10-bit blinking pattern, rotated into phase.
+ */
+struct pattern_match {
+	int8_t id;
+	int8_t confidence;
+};
+
 /*
  * LED pattern detector internal state
  */
 struct flicker {
 	int phase;
+	/* LED pattern phase reported by the device for the next frame */
+	int led_phase;
+	int led_phase_offset;
+	/* LEDs that can be seen with the predicted pose */
+	uint64_t visible;
+	/*
+	 * Copy of the LED patterns the lookup tables were built for, so that
+	 * changes are noticed even if the LEDs are updated in place
+	 */
+	uint16_t patterns[MAX_LEDS];
+	int num_leds;
+	struct pattern_match match[NUM_PATTERNS];
+	int8_t phase_lut[NUM_PATTERNS];
 };
 
 /*
@@ -36,122 +64,249 @@ struct flicker *flicker_new()
 
 	memset(fl, 0, sizeof(*fl));
 	fl->phase = -1;
+	fl->led_phase = -1;
+	fl->visible = ~0ULL;
+	/* No lookup tables yet */
+	fl->num_leds = -1;
+	/*
+	 * Assuming the LEDs show pattern bit led_phase, the newest pattern bit
+	 * is rotated into place by led_phase + 1. This is corrected by phase
+	 * voting if it turns out to be wrong.
+	 */
+	fl->led_phase_offset = 1;
 
 	return fl;
 }
 
-static int hamming_distance(uint16_t a, uint16_t b)
+/*
+ * Frees the flicker structure.
+ */
+void flicker_free(struct flicker *fl)
 {
-	uint16_t tmp = a ^ b;
-	int distance = 0;
-	int bit;
-
-	for (bit = 1 << 9; bit; bit >>= 1)
-		if (tmp & bit)
-			distance++;
+	free(fl);
+}
 
-	return distance;
+static inline uint16_t pattern_rotate(uint16_t pattern, int phase)
+{
+	return ((pattern >> (10 - phase)) | (pattern << phase)) & PATTERN_MASK;
 }
 
-static int pattern_find_id(uint16_t *patterns, int num_patterns,
-			   uint16_t pattern, int8_t *id)
+/*
+ * Builds the lookup tables for all 10-bit patterns: the first LED whose
+ * pattern differs in at most one bit from the given, already rotated,
+ * pattern, and the first rotation of the unrotated pattern that exactly
+ * matches any LED pattern.
+ */
+static void flicker_build_tables(struct flicker *fl, struct leds *leds)
 {
-	int i;
+	int pattern, i, phase;
+
+	for (pattern = 0; pattern < NUM_PATTERNS; pattern++) {
+		struct pattern_match *m = &fl->match[pattern];
 
-	for (i = 0; i < num_patterns; i++) {
-		if (pattern == patterns[i]) {
-			*id = i;
-			return 2;
+		m->id = -1;
+		m->confidence = -2;
+		for (i = 0; i < leds->num; i++) {
+			int distance = __builtin_popcount(pattern ^
+							  leds->patterns[i]);
+			if (distance < 2) {
+				m->id = i;
+				m->confidence = 2 - distance;
+				break;
+			}
 		}
-		if (hamming_distance(pattern, patterns[i]) < 2) {
-			*id = i;
-			return 1;
+
+		fl->phase_lut[pattern] = -1;
+		for (phase = 1; phase < 10; phase++) {
+			uint16_t rotated = pattern_rotate(pattern, phase);
+
+			for (i = 0; i < leds->num; i++) {
+				if (rotated == leds->patterns[i])
+					break;
+			}
+			if (i < leds->num) {
+				fl->phase_lut[pattern] = phase;
+				break;
+			}
 		}
 	}
 
-	return -2;
+	memcpy(fl->patterns, leds->patterns,
+	       leds->num * sizeof(*leds->patterns));
+	fl->num_leds = leds->num;
+}
+
+/*
+ * Sets the LED pattern phase reported by the device for the next frame, or
+ * -1 if it is unknown and has to be determined from the blob patterns.
+ */
+void flicker_set_led_phase(struct flicker *fl, int led_phase)
+{
+	fl->led_phase = led_phase;
+}
+
+/*
+ * Restricts the LED IDs assigned to blobs to the given mask, for example to
+ * the LEDs that face the camera with the predicted pose. ~0ULL allows all.
+ */
+void flicker_set_visible(struct flicker *fl, uint64_t visible)
+{
+	fl->visible = visible;
 }
 
-static int pattern_get_phase(uint16_t *patterns, int num_patterns, uint16_t pattern)
+/*
+ * Advances the blinking pattern of blob b over the given number of frames
+ * in which it was not observed. The pattern bits of these frames are marked
+ * as unknown.
+ */
+void flicker_skip_frames(struct blob *b, int frames)
 {
-	int i, j;
+	if (frames <= 0)
+		return;
 
-	for (i = 1; i < 10; i++) {
-		pattern = ((pattern & 0x1ff) << 1) | (pattern >> 9);
-		for (j = 0; j < num_patterns; j++)
-			if (pattern == patterns[j])
-				return i;
+	if (frames < 10) {
+		b->pattern >>= frames;
+		b->pattern_known >>= frames;
+	} else {
+		b->pattern = 0;
+		b->pattern_known = 0;
 	}
-
-	return -1;
 }
 
 /*
- * Records blob blinking patterns and compares against the blinking patterns
- * stored in the Rift DK2 to determine the corresponding LED IDs.
+ * Finds the LED whose pattern matches all known bits of the rotated pattern.
+ * Patterns with unknown bits are only identified if the match is unique.
  */
-void flicker_process(struct flicker *fl, struct blob *blobs, int num_blobs,
-		     int skipped, struct leds *leds)
+static struct pattern_match flicker_match(struct flicker *fl,
+					  uint16_t pattern, uint16_t known)
 {
-	struct blob *b;
-	int success = 0;
-	int phase = fl->phase;
+	struct pattern_match m = { .id = -1, .confidence = 0 };
+	int i;
 
-	if (skipped) {
-		if (skipped == 1) {
-			/* Assume state unchanged */
-			for (b = blobs; b < blobs + num_blobs; b++) {
-				b->pattern = ((b->pattern >> 1) & 0x1ff) |
-					     (b->pattern & (1 << 9));
-				b->age++;
-			}
-			if (phase >= 0)
-				phase = (phase + 1) % 10;
-		} else {
-			/* Reset */
-			printf("flicker: Skipped %d frames, reset\n", skipped);
-			for (b = blobs; b < blobs + num_blobs; b++) {
-				b->pattern = 0;
-				b->age = 0;
-			}
-			phase = -1;
-		}
+	if (known == PATTERN_MASK)
+		return fl->match[pattern];
+
+	for (i = 0; i < fl->num_leds; i++) {
+		if ((pattern ^ fl->patterns[i]) & known)
+			continue;
+		if (m.id >= 0)
+			return (struct pattern_match){ .id = -1,
+						       .confidence = 0 };
+		m.id = i;
+		m.confidence = 1;
 	}
+	if (m.id < 0)
+		m.confidence = -1;
+
+	return m;
+}
+
+/*
+ * Records the blinking patterns of the blobs observed in this frame. skipped
+ * is the number of LED pattern phases that passed without a frame since the
+ * previous call. Their pattern bits are marked as unknown, so that the
+ * remaining bits can still be used for identification.
+ */
+static void flicker_record(struct blob *blobs, int num_blobs, int skipped)
+{
+	struct blob *b;
 
 	for (b = blobs; b < blobs + num_blobs; b++) {
-		uint16_t pattern;
+		uint16_t pattern, known;
+		bool level_known;
+		int level;
 
 		/* Update pattern only if blob was observed previously */
 		if (b->age < 1)
 			continue;
 
+		flicker_skip_frames(b, skipped);
+
+		/*
+		 * The brightness level of the last observation is the newest
+		 * known bit. A new track starts out with a dark LED.
+		 */
+		if (b->pattern_known) {
+			level = 31 - __builtin_clz(b->pattern_known);
+			level = (b->pattern >> level) & 1;
+			level_known = true;
+		} else {
+			level = 0;
+			level_known = b->age == 1;
+		}
+
 		/*
 		 * Interpret brightness change of more than 10% as rising
 		 * or falling edge. Right shift the pattern and add the
 		 * new brightness level as MSB.
 		 */
 		pattern = (b->pattern >> 1) & 0x1ff;
+		known = ((b->pattern_known >> 1) & 0x1ff) | (1 << 9);
 		if (b->area * 10 > b->last_area * 11)
 			pattern |= (1 << 9);
 		else if (b->area * 11 < b->last_area * 10)
 			pattern |= (0 << 9);
+		else if (level_known)
+			pattern |= level << 9;
 		else
-			pattern |= b->pattern & (1 << 9);
+			known &= ~(1 << 9);
 		b->pattern = pattern;
+		b->pattern_known = known;
+	}
+}
+
+/*
+ * Compares the recorded blob blinking patterns against the given LED
+ * patterns to determine the corresponding LED IDs. The blinking phase is
+ * tracked per flicker structure, so blobs of devices that blink out of
+ * phase can be identified with separate flicker structures. skipped is the
+ * number of LED pattern phases that passed without a call since the
+ * previous one. Only blobs whose pattern was recorded in this frame are
+ * identified.
+ */
+void flicker_identify(struct flicker *fl, struct blob *blobs, int num_blobs,
+		      int skipped, struct leds *leds)
+{
+	struct blob *b;
+	int success = 0;
+	int phase = fl->phase;
+
+	if (!leds)
+		return;
+
+	/* Rebuild the lookup tables when the LED patterns change */
+	if (fl->num_leds != leds->num ||
+	    memcmp(fl->patterns, leds->patterns,
+		   leds->num * sizeof(*leds->patterns)) != 0)
+		flicker_build_tables(fl, leds);
+
+	if (skipped > 0 && phase >= 0)
+		phase = (phase + skipped) % 10;
+
+	/* Use the reported phase if available */
+	if (fl->led_phase >= 0)
+		phase = (fl->led_phase + fl->led_phase_offset) % 10;
+
+	for (b = blobs; b < blobs + num_blobs; b++) {
+		struct pattern_match m;
+
+		if (b->age < 1)
+			continue;
 
 		/*
-		 * Determine LED ID only if a full pattern was recorded and
-		 * consensus about the blinking phase is established
+		 * Determine LED ID only if enough of the pattern was recorded
+		 * and consensus about the blinking phase is established
 		 */
-		if (b->age < 9 || phase < 0)
+		if (__builtin_popcount(b->pattern_known) < MIN_KNOWN_BITS ||
+		    phase < 0)
 			continue;
 
 		/* Rotate the pattern bits according to the phase */
-		pattern = ((pattern >> (10 - phase)) | (pattern << phase)) &
-			  0x3ff;
-
-		success += pattern_find_id(leds->patterns, leds->num, pattern,
-					   &b->led_id);
+		m = flicker_match(fl, pattern_rotate(b->pattern, phase),
+				  pattern_rotate(b->pattern_known, phase));
+		if (m.id >= 0 && (fl->visible & (1ULL << m.id)))
+			b->led_id = m.id;
+		success += m.confidence;
 	}
 
 	if (success < 0 || phase < 0) {
@@ -161,8 +316,12 @@ void flicker_process(struct flicker *fl, struct blob *blobs, int num_blobs,
 		int i;
 
 		for (b = blobs; b < blobs + num_blobs; b++) {
-			int phase = pattern_get_phase(leds->patterns, leds->num,
-						      b->pattern);
+			int phase;
+
+			if (b->pattern_known != PATTERN_MASK)
+				continue;
+			phase = fl->phase_lut[b->pattern];
+
 			if (phase >= 0)
 				phase_error[phase]++;
 		}
@@ -179,8 +338,29 @@ void flicker_process(struct flicker *fl, struct blob *blobs, int num_blobs,
 			       success, phase, max_phase);
 		if (max_error)
 			phase = max_phase;
+		if (max_error && fl->led_phase >= 0) {
+			fl->led_phase_offset = (max_phase - fl->led_phase +
+						10) % 10;
+		}
 	}
 
 	if (phase >= 0)
 		fl->phase = (phase + 1) % 10;
 }
+
+/*
+ * Records blob blinking patterns and compares against the blinking patterns
+ * stored in the Rift DK2 to determine the corresponding LED IDs. skipped is
+ * the number of LED pattern phases that passed without a frame since the
+ * previous call. Their pattern bits are marked as unknown, so that the
+ * remaining bits can still be used for identification.
+ */
+void flicker_process(struct flicker *fl, struct blob *blobs, int num_blobs,
+		     int skipped, struct leds *leds)
+{
+	if (!leds)
+		return;
+
+	flicker_record(blobs, num_blobs, skipped);
+	flicker_identify(fl, blobs, num_blobs, skipped, leds);
+}
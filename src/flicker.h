@@ -14,6 +14,12 @@ struct blob;
 struct leds;
 
 struct flicker *flicker_new();
+void flicker_free(struct flicker *fl);
+void flicker_set_led_phase(struct flicker *fl, int led_phase);
+void flicker_set_visible(struct flicker *fl, uint64_t visible);
+void flicker_skip_frames(struct blob *b, int frames);
+void flicker_identify(struct flicker *fl, struct blob *blobs, int num_blobs,
+		      int skipped, struct leds *leds);
 void flicker_process(struct flicker *fl, struct blob *blobs, int num_blobs,
 		     int skipped, struct leds *leds);
 
@@ -0,0 +1,650 @@
+/*
+ * IMU and camera pose sensor fusion
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * A complementary filter: gyroscope samples are integrated at full IMU rate,
+ * the accelerometer slowly pulls the orientation towards gravity, and every
+ * camera pose pulls orientation, position, and velocity towards the optical
+ * measurement. The world frame is the camera frame.
+ *
+ * The time offset between camera exposures and IMU samples, and the rotation
+ * between the LED model and the IMU frame, are calibrated online: the
+ * angular speed differentiated from consecutive camera poses is correlated
+ * with the gyroscope at a range of time offsets, and the rotation that best
+ * aligns the optical angular velocities with the gyroscope is found with
+ * Horn's quaternion method. Until then, the offset is assumed to be zero and
+ * the frames to coincide.
+ */
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include "fusion.h"
+#include "math.h"
+
+#define GRAVITY			9.80665
+
+/* Accelerometer tilt correction rate in 1/s */
+#define TILT_GAIN		0.5
+/*
+ * Fraction of the camera pose error corrected per camera frame, and velocity
+ * correction per meter of position error. At 60 Hz, the position observer is
+ * slightly underdamped with a natural frequency of about 11 rad/s.
+ */
+#define CAMERA_ROTATION_GAIN	0.1
+#define CAMERA_POSITION_GAIN	0.2
+#define CAMERA_VELOCITY_GAIN	2.0
+/* Stop integrating position without camera poses after this many samples */
+#define MAX_SAMPLES_SINCE_POSE	500
+/* Low-pass filter factor for the differentiated angular velocity */
+#define ANGULAR_ACCELERATION_FILTER	0.05
+/* Maximum prediction interval in seconds, beyond that the pose is held */
+#define MAX_PREDICTION		0.1
+
+/* Spacing of the candidate time offsets in seconds, centered around zero */
+#define OFFSET_STEP		0.001
+#define OFFSET_MIN		(-(FUSION_OFFSET_STEPS - 1) / 2 * OFFSET_STEP)
+#define OFFSET_MAX		(-OFFSET_MIN)
+/* Weight of older calibration data decays by this factor per camera pose */
+#define CALIBRATION_FORGETTING	0.998
+/* Camera poses further apart are not differentiated, in seconds */
+#define MAX_CALIBRATION_INTERVAL	0.05
+/* The angular speed must vary by at least 0.3 rad/s to find the offset */
+#define MIN_SPEED_VARIANCE	0.09
+#define MIN_OFFSET_CORRELATION	0.9
+/* Minimum angular speed in rad/s, and number of pairs, for the rotation */
+#define MIN_CALIBRATION_SPEED	0.3
+#define MIN_CALIBRATION_PAIRS	100.0
+#define ROTATION_ITERATIONS	8
+
+void fusion_init(struct fusion *fusion)
+{
+	memset(fusion, 0, sizeof(*fusion));
+	fusion->state.pose.rotation.w = 1.0;
+	fusion->gravity.z = GRAVITY;
+	fusion->calibration.rotation.w = 1.0;
+}
+
+/*
+ * Remembers the fused pose and the raw gyroscope sample at the given IMU
+ * sample time, so that delayed camera poses can be brought up to date, and
+ * compared with the optical rotation.
+ */
+static void fusion_store_history(struct fusion *fusion, double time,
+				 const dvec3 *gyro)
+{
+	struct fusion_history_entry *entry;
+
+	entry = &fusion->history[fusion->history_head % FUSION_HISTORY];
+	entry->time = time;
+	entry->rotation = fusion->state.pose.rotation;
+	entry->position = fusion->position;
+	entry->angular_velocity = *gyro;
+	fusion->history_head++;
+}
+
+/*
+ * Moves a camera pose measured at the given time forward to the latest IMU
+ * sample, applying the motion integrated from the IMU since then.
+ *
+ * Returns false if the time is not covered by the pose history.
+ */
+static bool fusion_propagate_pose(struct fusion *fusion, double time,
+				  dquat *rot, dvec3 *trans)
+{
+	const dquat *q = &fusion->state.pose.rotation;
+	struct fusion_history_entry *entry = NULL;
+	unsigned int i;
+	dquat inv, dq;
+
+	for (i = 1; i <= FUSION_HISTORY && i <= fusion->history_head; i++) {
+		entry = &fusion->history[(fusion->history_head - i) %
+					 FUSION_HISTORY];
+		if (entry->time <= time)
+			break;
+		entry = NULL;
+	}
+	if (!entry)
+		return false;
+
+	/* Body frame rotation since the exposure: dq = conj(q_then) * q_now */
+	inv.w = entry->rotation.w;
+	inv.x = -entry->rotation.x;
+	inv.y = -entry->rotation.y;
+	inv.z = -entry->rotation.z;
+	dquat_mult(&dq, &inv, q);
+	dquat_mult(rot, rot, &dq);
+	dquat_normalize(rot);
+
+	trans->x += fusion->position.x - entry->position.x;
+	trans->y += fusion->position.y - entry->position.y;
+	trans->z += fusion->position.z - entry->position.z;
+
+	return true;
+}
+
+/*
+ * Collects the times of the gyroscope samples in the history that lie in the
+ * interval (t0, t1], in ascending order, and the prefix sums of their angular
+ * velocities, starting with sums[0] = 0.
+ *
+ * Returns the number of samples, -EAGAIN if the history does not reach t1
+ * yet, or -ERANGE if it does not reach back to t0 anymore.
+ */
+static int fusion_gyro_window(struct fusion *fusion, double t0, double t1,
+			      double *times, dvec3 *sums)
+{
+	unsigned int num = fusion->history_head;
+	struct fusion_history_entry *entry;
+	bool covered = false;
+	unsigned int i;
+	int n = 0;
+
+	if (num > FUSION_HISTORY)
+		num = FUSION_HISTORY;
+	if (!num || fusion->history[(fusion->history_head - 1) %
+				    FUSION_HISTORY].time < t1)
+		return -EAGAIN;
+
+	sums[0] = (dvec3){ 0, 0, 0 };
+	for (i = fusion->history_head - num; i != fusion->history_head; i++) {
+		entry = &fusion->history[i % FUSION_HISTORY];
+		if (entry->time <= t0) {
+			covered = true;
+			continue;
+		}
+		if (entry->time > t1)
+			break;
+		times[n] = entry->time;
+		sums[n + 1] = dvec3_add(&sums[n], &entry->angular_velocity);
+		n++;
+	}
+
+	return covered ? n : -ERANGE;
+}
+
+/*
+ * Calculates the mean gyroscope angular velocity over the interval (t0, t1]
+ * from the samples collected by fusion_gyro_window. *lo and *hi must index
+ * samples at or before t0 and t1, respectively, and are moved forward.
+ *
+ * Returns false if there are no samples in the interval.
+ */
+static bool fusion_gyro_mean(const double *times, const dvec3 *sums, int n,
+			     double t0, double t1, int *lo, int *hi,
+			     dvec3 *mean)
+{
+	dvec3 sum;
+
+	while (*lo < n && times[*lo] <= t0)
+		(*lo)++;
+	while (*hi < n && times[*hi] <= t1)
+		(*hi)++;
+	if (*hi == *lo)
+		return false;
+
+	sum = dvec3_sub(&sums[*hi], &sums[*lo]);
+	*mean = dvec3_scale(&sum, 1.0 / (*hi - *lo));
+
+	return true;
+}
+
+/*
+ * Calculates the mean angular velocity in the body frame that rotates q0
+ * into q1 within dt.
+ */
+static void optical_angular_velocity(const dquat *q0, const dquat *q1,
+				     double dt, dvec3 *w)
+{
+	dquat inv = { -q0->x, -q0->y, -q0->z, q0->w };
+	double s, k;
+	dquat dq;
+
+	dquat_mult(&dq, &inv, q1);
+	if (dq.w < 0) {
+		dq.w = -dq.w;
+		dq.x = -dq.x;
+		dq.y = -dq.y;
+		dq.z = -dq.z;
+	}
+
+	s = sqrt(dq.x * dq.x + dq.y * dq.y + dq.z * dq.z);
+	k = s > 1e-12 ? 2 * atan2(s, dq.w) / (s * dt) : 2 / dt;
+	*w = (dvec3){ k * dq.x, k * dq.y, k * dq.z };
+}
+
+/*
+ * Finds the candidate time offset at which the optical and gyroscope
+ * angular speeds correlate best, with sub-step precision.
+ */
+static void fusion_estimate_time_offset(struct fusion_calibration *c)
+{
+	double corr[FUSION_OFFSET_STEPS];
+	double var_x, var_y, cov, den;
+	int i, best = 0;
+
+	var_x = c->sxx / c->n - (c->sx / c->n) * (c->sx / c->n);
+	if (var_x < MIN_SPEED_VARIANCE)
+		return;
+
+	for (i = 0; i < FUSION_OFFSET_STEPS; i++) {
+		var_y = c->syy[i] / c->n - (c->sy[i] / c->n) *
+					   (c->sy[i] / c->n);
+		cov = c->sxy[i] / c->n - (c->sx / c->n) * (c->sy[i] / c->n);
+		corr[i] = var_y > 0 ? cov / sqrt(var_x * var_y) : 0;
+		if (corr[i] > corr[best])
+			best = i;
+	}
+
+	if (corr[best] < MIN_OFFSET_CORRELATION ||
+	    best == 0 || best == FUSION_OFFSET_STEPS - 1)
+		return;
+
+	/* Parabolic interpolation of the correlation peak */
+	den = corr[best - 1] - 2 * corr[best] + corr[best + 1];
+	c->time_offset = OFFSET_MIN + best * OFFSET_STEP;
+	if (den < 0) {
+		c->time_offset += 0.5 * (corr[best - 1] - corr[best + 1]) /
+				  den * OFFSET_STEP;
+	}
+	c->time_offset_valid = true;
+}
+
+/*
+ * Finds the rotation that maps the optical angular velocities onto the
+ * gyroscope angular velocities, as the eigenvector of Horn's symmetric
+ * matrix N with the largest eigenvalue. The eigenvalues of N lie within
+ * [-S_norm, S_norm], so a few power iterations on N + S_norm I refine the
+ * previous estimate.
+ */
+static void fusion_estimate_rotation(struct fusion_calibration *c)
+{
+	const double *S = c->S;
+	double N[4][4] = {
+		{ S[0] + S[4] + S[8], S[5] - S[7], S[6] - S[2], S[1] - S[3] },
+		{ S[5] - S[7], S[0] - S[4] - S[8], S[1] + S[3], S[6] + S[2] },
+		{ S[6] - S[2], S[1] + S[3], -S[0] + S[4] - S[8], S[5] + S[7] },
+		{ S[1] - S[3], S[6] + S[2], S[5] + S[7], -S[0] - S[4] + S[8] },
+	};
+	double q[4] = { c->rotation.w, c->rotation.x, c->rotation.y,
+			c->rotation.z };
+	double p[4], norm;
+	int i, j, iter;
+
+	for (iter = 0; iter < ROTATION_ITERATIONS; iter++) {
+		norm = 0;
+		for (i = 0; i < 4; i++) {
+			p[i] = c->S_norm * q[i];
+			for (j = 0; j < 4; j++)
+				p[i] += N[i][j] * q[j];
+			norm += p[i] * p[i];
+		}
+		if (norm < 1e-24)
+			return;
+		norm = 1.0 / sqrt(norm);
+		for (i = 0; i < 4; i++)
+			q[i] = p[i] * norm;
+	}
+
+	c->rotation = (dquat){ q[1], q[2], q[3], q[0] };
+	c->rotation_valid = true;
+}
+
+/*
+ * Compares the angular velocity between two poses of the same camera,
+ * measured at exposure times t0 < t1 in the IMU clock, with the gyroscope
+ * samples in the history, to update the time offset and rotation estimates.
+ *
+ * Returns false if the history does not cover t1 with all candidate time
+ * offsets yet, so that the pair should be tried again later.
+ */
+static bool fusion_calibrate_pair(struct fusion *fusion, const dquat *q0,
+				  double t0, const dquat *q1, double t1)
+{
+	struct fusion_calibration *c = &fusion->calibration;
+	double times[FUSION_HISTORY], y[FUSION_OFFSET_STEPS];
+	dvec3 sums[FUSION_HISTORY + 1], w, gyro;
+	double x, offset;
+	int i, n, lo = 0, hi = 0;
+
+	n = fusion_gyro_window(fusion, t0 + OFFSET_MIN, t1 + OFFSET_MAX,
+			       times, sums);
+	if (n == -EAGAIN)
+		return false;
+	if (n < 0)
+		return true;
+
+	optical_angular_velocity(q0, q1, t1 - t0, &w);
+	x = sqrt(dvec3_dot(&w, &w));
+
+	for (i = 0; i < FUSION_OFFSET_STEPS; i++) {
+		offset = OFFSET_MIN + i * OFFSET_STEP;
+		if (!fusion_gyro_mean(times, sums, n, t0 + offset,
+				      t1 + offset, &lo, &hi, &gyro))
+			return true;
+		y[i] = sqrt(dvec3_dot(&gyro, &gyro));
+	}
+
+	c->n = CALIBRATION_FORGETTING * c->n + 1;
+	c->sx = CALIBRATION_FORGETTING * c->sx + x;
+	c->sxx = CALIBRATION_FORGETTING * c->sxx + x * x;
+	for (i = 0; i < FUSION_OFFSET_STEPS; i++) {
+		c->sy[i] = CALIBRATION_FORGETTING * c->sy[i] + y[i];
+		c->syy[i] = CALIBRATION_FORGETTING * c->syy[i] + y[i] * y[i];
+		c->sxy[i] = CALIBRATION_FORGETTING * c->sxy[i] + x * y[i];
+	}
+	fusion_estimate_time_offset(c);
+
+	if (!c->time_offset_valid || x < MIN_CALIBRATION_SPEED)
+		return true;
+
+	lo = hi = 0;
+	if (!fusion_gyro_mean(times, sums, n, t0 + c->time_offset,
+			      t1 + c->time_offset, &lo, &hi, &gyro))
+		return true;
+
+	c->S[0] = CALIBRATION_FORGETTING * c->S[0] + w.x * gyro.x;
+	c->S[1] = CALIBRATION_FORGETTING * c->S[1] + w.x * gyro.y;
+	c->S[2] = CALIBRATION_FORGETTING * c->S[2] + w.x * gyro.z;
+	c->S[3] = CALIBRATION_FORGETTING * c->S[3] + w.y * gyro.x;
+	c->S[4] = CALIBRATION_FORGETTING * c->S[4] + w.y * gyro.y;
+	c->S[5] = CALIBRATION_FORGETTING * c->S[5] + w.y * gyro.z;
+	c->S[6] = CALIBRATION_FORGETTING * c->S[6] + w.z * gyro.x;
+	c->S[7] = CALIBRATION_FORGETTING * c->S[7] + w.z * gyro.y;
+	c->S[8] = CALIBRATION_FORGETTING * c->S[8] + w.z * gyro.z;
+	c->S_norm = CALIBRATION_FORGETTING * c->S_norm +
+		    x * sqrt(dvec3_dot(&gyro, &gyro));
+	c->num_pairs = CALIBRATION_FORGETTING * c->num_pairs + 1;
+	if (c->num_pairs >= MIN_CALIBRATION_PAIRS)
+		fusion_estimate_rotation(c);
+
+	return true;
+}
+
+/*
+ * Uses the pending pose pair of a camera for calibration, unless the
+ * gyroscope history does not cover it yet.
+ */
+static void fusion_calibrate_pending(struct fusion *fusion,
+				     struct fusion_calibration_camera *cc)
+{
+	if (fusion_calibrate_pair(fusion, &cc->pending_rotation,
+				  cc->pending_time, &cc->last_rotation,
+				  cc->last_time))
+		cc->pending = false;
+}
+
+/*
+ * Pairs the given camera pose, measured at an exposure time in the IMU
+ * clock, with the previous pose of the same camera for calibration. The
+ * gyroscope history usually lags behind the exposure time plus the largest
+ * candidate time offset, in which case the pair is kept pending until
+ * further IMU samples have come in.
+ */
+static void fusion_calibrate(struct fusion *fusion, int camera,
+			     const dquat *rot, double time)
+{
+	struct fusion_calibration_camera *cc;
+
+	if (camera < 0 || camera >= FUSION_MAX_CAMERAS)
+		return;
+	cc = &fusion->calibration.cameras[camera];
+
+	/* Give up on the previous pair if the history is still behind */
+	if (cc->pending)
+		fusion_calibrate_pending(fusion, cc);
+	cc->pending = false;
+
+	if (cc->has_last && time > cc->last_time &&
+	    time - cc->last_time <= MAX_CALIBRATION_INTERVAL) {
+		cc->pending = true;
+		cc->pending_time = cc->last_time;
+		cc->pending_rotation = cc->last_rotation;
+	}
+
+	cc->has_last = true;
+	cc->last_time = time;
+	cc->last_rotation = *rot;
+
+	if (cc->pending)
+		fusion_calibrate_pending(fusion, cc);
+}
+
+/*
+ * Integrates a single IMU sample into the fused state.
+ */
+void fusion_update_imu(struct fusion *fusion, const struct imu_sample *sample)
+{
+	const struct fusion_calibration *c = &fusion->calibration;
+	struct fusion_calibration_camera *cc;
+	dquat *q = &fusion->state.pose.rotation;
+	dvec3 w, a, a_world, lin, e, g, gyro;
+	double dt, norm_a, norm_g;
+	dquat dq, inv;
+	int i;
+
+	a = dvec3_from_vec3(&sample->acceleration);
+	w = dvec3_from_vec3(&sample->angular_velocity);
+	gyro = w;
+
+	/* Rotate the measurements from the IMU into the LED model frame */
+	if (c->rotation_valid) {
+		inv = (dquat){ -c->rotation.x, -c->rotation.y,
+			       -c->rotation.z, c->rotation.w };
+		dquat_rotate(&a, &inv, &a);
+		dquat_rotate(&w, &inv, &w);
+	}
+
+	fusion->state.sample = *sample;
+
+	if (!fusion->has_imu) {
+		/* Until there is a camera pose, the world is the IMU frame */
+		fusion->has_imu = true;
+		fusion->last_time = sample->time;
+		fusion->mean_acceleration = a;
+		dquat_rotate(&fusion->angular_velocity, q, &w);
+		if (!fusion->has_pose)
+			fusion->gravity = a;
+		return;
+	}
+
+	dt = sample->time - fusion->last_time;
+	fusion->last_time = sample->time;
+	if (dt <= 0.0 || dt > 0.1)
+		return;
+
+	fusion->mean_acceleration.x += 0.01 * (a.x - fusion->mean_acceleration.x);
+	fusion->mean_acceleration.y += 0.01 * (a.y - fusion->mean_acceleration.y);
+	fusion->mean_acceleration.z += 0.01 * (a.z - fusion->mean_acceleration.z);
+
+	/* Integrate angular velocity, given in the IMU frame */
+	e = (dvec3){ w.x * dt, w.y * dt, w.z * dt };
+	dquat_from_rotation_vector(&dq, &e);
+	dquat_mult(q, q, &dq);
+	dquat_normalize(q);
+
+	dquat_rotate(&a_world, q, &a);
+
+	/*
+	 * If the measured acceleration is close to gravity, rotate the
+	 * orientation a little so that it lines up with the gravity vector.
+	 */
+	norm_a = sqrt(a_world.x * a_world.x + a_world.y * a_world.y +
+		      a_world.z * a_world.z);
+	g = fusion->gravity;
+	norm_g = sqrt(g.x * g.x + g.y * g.y + g.z * g.z);
+	if (norm_a > 0 && fabs(norm_a - norm_g) < 0.1 * norm_g) {
+		double k = TILT_GAIN * dt / (norm_a * norm_g);
+
+		e.x = k * (a_world.y * g.z - a_world.z * g.y);
+		e.y = k * (a_world.z * g.x - a_world.x * g.z);
+		e.z = k * (a_world.x * g.y - a_world.y * g.x);
+		dquat_from_rotation_vector(&dq, &e);
+		dquat_mult(q, &dq, q);
+		dquat_normalize(q);
+	}
+
+	lin.x = a_world.x - g.x;
+	lin.y = a_world.y - g.y;
+	lin.z = a_world.z - g.z;
+
+	/*
+	 * Double integration of noisy accelerometer data diverges quickly,
+	 * so only keep integrating position while camera poses come in.
+	 */
+	if (fusion->has_pose &&
+	    fusion->samples_since_pose < MAX_SAMPLES_SINCE_POSE) {
+		fusion->position.x += (fusion->velocity.x + 0.5 * lin.x * dt) * dt;
+		fusion->position.y += (fusion->velocity.y + 0.5 * lin.y * dt) * dt;
+		fusion->position.z += (fusion->velocity.z + 0.5 * lin.z * dt) * dt;
+		fusion->velocity.x += lin.x * dt;
+		fusion->velocity.y += lin.y * dt;
+		fusion->velocity.z += lin.z * dt;
+		fusion->samples_since_pose++;
+	} else {
+		memset(&fusion->velocity, 0, sizeof(fusion->velocity));
+	}
+
+	fusion->state.pose.translation = fusion->position;
+	fusion_store_history(fusion, sample->time, &gyro);
+
+	/* Calibrate with camera poses the history has caught up with */
+	for (i = 0; i < FUSION_MAX_CAMERAS; i++) {
+		cc = &fusion->calibration.cameras[i];
+		if (cc->pending && sample->time >= cc->last_time + OFFSET_MAX)
+			fusion_calibrate_pending(fusion, cc);
+	}
+	dquat_rotate(&w, q, &w);
+
+	/* Differentiate the world frame angular velocity, heavily filtered */
+	e.x = (w.x - fusion->angular_velocity.x) / dt;
+	e.y = (w.y - fusion->angular_velocity.y) / dt;
+	e.z = (w.z - fusion->angular_velocity.z) / dt;
+	fusion->angular_velocity = w;
+	fusion->angular_acceleration.x += ANGULAR_ACCELERATION_FILTER *
+				(e.x - fusion->angular_acceleration.x);
+	fusion->angular_acceleration.y += ANGULAR_ACCELERATION_FILTER *
+				(e.y - fusion->angular_acceleration.y);
+	fusion->angular_acceleration.z += ANGULAR_ACCELERATION_FILTER *
+				(e.z - fusion->angular_acceleration.z);
+
+	fusion->state.angular_velocity = vec3_from_dvec3(&w);
+	fusion->state.angular_acceleration =
+				vec3_from_dvec3(&fusion->angular_acceleration);
+	fusion->state.linear_velocity = vec3_from_dvec3(&fusion->velocity);
+	fusion->state.linear_acceleration = vec3_from_dvec3(&lin);
+}
+
+/*
+ * Corrects the fused state with a pose measured by the given camera of the
+ * tracker. If time is not negative, it is the exposure time of the camera
+ * frame in the IMU clock. The pose is then used to calibrate the camera to
+ * IMU time offset, and propagated from the corrected exposure time to the
+ * latest IMU sample first.
+ */
+void fusion_update_pose(struct fusion *fusion, int camera, const dquat *rot,
+			const dvec3 *trans, double time)
+{
+	dquat *q = &fusion->state.pose.rotation;
+	dquat target = *rot;
+	dvec3 position = *trans;
+	dvec3 e;
+	double dot, k;
+
+	if (time >= 0) {
+		fusion_calibrate(fusion, camera, rot, time);
+		if (fusion->calibration.time_offset_valid)
+			time += fusion->calibration.time_offset;
+	}
+	if (fusion->has_pose && time >= 0)
+		fusion_propagate_pose(fusion, time, &target, &position);
+	rot = &target;
+	trans = &position;
+
+	if (!fusion->has_pose) {
+		/*
+		 * Adopt the camera frame as world frame. Assuming the device
+		 * is mostly at rest, express gravity in that frame.
+		 */
+		*q = *rot;
+		fusion->position = *trans;
+		memset(&fusion->velocity, 0, sizeof(fusion->velocity));
+		dquat_rotate(&fusion->gravity, q, &fusion->mean_acceleration);
+		fusion->has_pose = true;
+	} else if (fusion->samples_since_pose >= MAX_SAMPLES_SINCE_POSE) {
+		/* Position was held for too long, reacquire it */
+		*q = *rot;
+		fusion->position = *trans;
+		memset(&fusion->velocity, 0, sizeof(fusion->velocity));
+	} else {
+		/* Normalized linear interpolation towards the camera pose */
+		dot = q->w * target.w + q->x * target.x + q->y * target.y +
+		      q->z * target.z;
+		k = CAMERA_ROTATION_GAIN;
+		if (dot < 0)
+			k = -k;
+		q->w = (1 - CAMERA_ROTATION_GAIN) * q->w + k * target.w;
+		q->x = (1 - CAMERA_ROTATION_GAIN) * q->x + k * target.x;
+		q->y = (1 - CAMERA_ROTATION_GAIN) * q->y + k * target.y;
+		q->z = (1 - CAMERA_ROTATION_GAIN) * q->z + k * target.z;
+		dquat_normalize(q);
+
+		e.x = trans->x - fusion->position.x;
+		e.y = trans->y - fusion->position.y;
+		e.z = trans->z - fusion->position.z;
+		fusion->position.x += CAMERA_POSITION_GAIN * e.x;
+		fusion->position.y += CAMERA_POSITION_GAIN * e.y;
+		fusion->position.z += CAMERA_POSITION_GAIN * e.z;
+		fusion->velocity.x += CAMERA_VELOCITY_GAIN * e.x;
+		fusion->velocity.y += CAMERA_VELOCITY_GAIN * e.y;
+		fusion->velocity.z += CAMERA_VELOCITY_GAIN * e.z;
+	}
+
+	fusion->samples_since_pose = 0;
+	fusion->state.pose.translation = fusion->position;
+}
+
+/*
+ * Returns the current fused state.
+ */
+void fusion_get_state(struct fusion *fusion, struct imu_state *state)
+{
+	*state = fusion->state;
+}
+
+/*
+ * Extrapolates the pose of the given state to a time, using its angular and
+ * linear velocity and acceleration. Both are given in the world frame.
+ * Predictions further than MAX_PREDICTION into the future are clamped, and
+ * times before the state are not extrapolated backwards.
+ */
+void fusion_predict_pose(const struct imu_state *state, double time,
+			 struct dpose *pose)
+{
+	const vec3 *w = &state->angular_velocity;
+	const vec3 *alpha = &state->angular_acceleration;
+	const vec3 *v = &state->linear_velocity;
+	const vec3 *a = &state->linear_acceleration;
+	double dt = time - state->sample.time;
+	dvec3 e;
+	dquat dq;
+
+	*pose = state->pose;
+
+	if (dt <= 0.0)
+		return;
+	if (dt > MAX_PREDICTION)
+		dt = MAX_PREDICTION;
+
+	e.x = (w->x + 0.5 * alpha->x * dt) * dt;
+	e.y = (w->y + 0.5 * alpha->y * dt) * dt;
+	e.z = (w->z + 0.5 * alpha->z * dt) * dt;
+	dquat_from_rotation_vector(&dq, &e);
+	dquat_mult(&pose->rotation, &dq, &pose->rotation);
+	dquat_normalize(&pose->rotation);
+
+	pose->translation.x += (v->x + 0.5 * a->x * dt) * dt;
+	pose->translation.y += (v->y + 0.5 * a->y * dt) * dt;
+	pose->translation.z += (v->z + 0.5 * a->z * dt) * dt;
+}
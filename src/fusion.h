@@ -0,0 +1,106 @@
+/*
+ * IMU and camera pose sensor fusion
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __FUSION_H__
+#define __FUSION_H__
+
+#include <stdbool.h>
+
+#include "imu.h"
+#include "math.h"
+
+/* Must be a power of two, holds 256 ms of fused poses at 1 kHz */
+#define FUSION_HISTORY	256
+
+/* Candidate camera to IMU time offsets, -20 ms to 20 ms in 1 ms steps */
+#define FUSION_OFFSET_STEPS	41
+
+/* Cameras whose poses are differentiated separately, as TRACKER_MAX_CAMERAS */
+#define FUSION_MAX_CAMERAS	4
+
+struct fusion_history_entry {
+	double time;
+	dquat rotation;
+	dvec3 position;
+	/* Raw gyroscope sample, in the IMU frame */
+	dvec3 angular_velocity;
+};
+
+/*
+ * Previous poses of a single camera. Only poses from the same camera are
+ * differentiated, so that errors in the extrinsics calibration between
+ * cameras do not show up as angular velocity.
+ */
+struct fusion_calibration_camera {
+	bool has_last;
+	double last_time;
+	dquat last_rotation;
+	/*
+	 * Pose before the last one, if the pair still waits for the gyroscope
+	 * history to cover the whole range of candidate time offsets
+	 */
+	bool pending;
+	double pending_time;
+	dquat pending_rotation;
+};
+
+/*
+ * Online calibration of the camera to IMU time offset and of the rotation
+ * from the LED model frame into the IMU frame, from the angular velocities
+ * observed optically and by the gyroscope.
+ */
+struct fusion_calibration {
+	struct fusion_calibration_camera cameras[FUSION_MAX_CAMERAS];
+
+	/*
+	 * Exponentially weighted sums for the correlation between optical
+	 * and gyroscope angular speed, per candidate time offset
+	 */
+	double n;
+	double sx;
+	double sxx;
+	double sy[FUSION_OFFSET_STEPS];
+	double syy[FUSION_OFFSET_STEPS];
+	double sxy[FUSION_OFFSET_STEPS];
+
+	/* Correlation matrix of optical and gyroscope angular velocities */
+	double S[9];
+	double S_norm;
+	double num_pairs;
+
+	/* Added to camera exposure times to get the matching IMU time */
+	double time_offset;
+	bool time_offset_valid;
+	/* Rotates vectors from the LED model frame into the IMU frame */
+	dquat rotation;
+	bool rotation_valid;
+};
+
+struct fusion {
+	struct imu_state state;
+	dvec3 position;
+	dvec3 velocity;
+	dvec3 gravity;
+	dvec3 mean_acceleration;
+	dvec3 angular_velocity;
+	dvec3 angular_acceleration;
+	double last_time;
+	unsigned int samples_since_pose;
+	bool has_imu;
+	bool has_pose;
+	unsigned int history_head;
+	struct fusion_history_entry history[FUSION_HISTORY];
+	struct fusion_calibration calibration;
+};
+
+void fusion_init(struct fusion *fusion);
+void fusion_update_imu(struct fusion *fusion, const struct imu_sample *sample);
+void fusion_update_pose(struct fusion *fusion, int camera, const dquat *rot,
+			const dvec3 *trans, double time);
+void fusion_get_state(struct fusion *fusion, struct imu_state *state);
+void fusion_predict_pose(const struct imu_state *state, double time,
+			 struct dpose *pose);
+
+#endif /* __FUSION_H__ */
@@ -0,0 +1,344 @@
+/*
+ * Shared HID report reader
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * Instead of a thread per device that wakes up for every single report,
+ * all HID devices that implement the hid_report callback are read by a
+ * single thread. It waits for any of the device file descriptors to become
+ * readable and then drains each readable descriptor until it would block,
+ * so that reports that arrived together are handled in one wakeup.
+ * Devices that need to send periodic keepalive reports get a timerfd in
+ * the same epoll set, so the thread only wakes up for reports, keepalives,
+ * and report timeouts.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <stdbool.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "clock-sync.h"
+#include "device.h"
+#include "hid-io.h"
+#include "recording.h"
+#include "thread-policy.h"
+
+#define MAX_EVENTS		16
+#define MAX_REPORT_SIZE		64
+/* Devices that did not send any report for this long time out */
+#define REPORT_TIMEOUT		1.0
+
+struct hid_io_source {
+	OuvrtDevice *dev;
+	int fd;
+	/* Keepalive timer, or -1 */
+	int timer_fd;
+	double deadline;
+};
+
+/* Protects sources, held while reports are dispatched */
+static GMutex hid_io_lock;
+static GList *hid_io_sources;
+static GThread *hid_io_thread;
+static int hid_io_epfd = -1;
+
+/*
+ * Returns the registered source for the device or keepalive timer file
+ * descriptor, or NULL.
+ */
+static struct hid_io_source *hid_io_find(int fd)
+{
+	struct hid_io_source *source;
+	GList *l;
+
+	for (l = hid_io_sources; l; l = l->next) {
+		source = l->data;
+		if (source->fd == fd || source->timer_fd == fd)
+			return source;
+	}
+
+	return NULL;
+}
+
+/*
+ * Acknowledges the keepalive timer expiration and sends the keepalive.
+ */
+static void hid_io_keepalive(struct hid_io_source *source)
+{
+	uint64_t expirations;
+
+	if (read(source->timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	OUVRT_DEVICE_GET_CLASS(source->dev)->hid_keepalive(source->dev);
+}
+
+/*
+ * Creates the keepalive timer and adds it to the epoll set.
+ *
+ * Returns 0 on success, negative values on error.
+ */
+static int hid_io_add_timer(struct hid_io_source *source, double interval)
+{
+	struct itimerspec its;
+	struct epoll_event event;
+	int ret;
+
+	source->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_NONBLOCK | TFD_CLOEXEC);
+	if (source->timer_fd == -1)
+		return -errno;
+
+	its.it_interval.tv_sec = (time_t)interval;
+	its.it_interval.tv_nsec = (long)((interval - (time_t)interval) * 1e9);
+	its.it_value = its.it_interval;
+	event.events = EPOLLIN;
+	event.data.fd = source->timer_fd;
+	if (timerfd_settime(source->timer_fd, 0, &its, NULL) == -1 ||
+	    epoll_ctl(hid_io_epfd, EPOLL_CTL_ADD, source->timer_fd,
+		      &event) == -1) {
+		ret = -errno;
+		close(source->timer_fd);
+		source->timer_fd = -1;
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Removes the device and its keepalive timer from the epoll set and from
+ * the list of sources, and frees the source.
+ */
+static void hid_io_source_free(struct hid_io_source *source)
+{
+	epoll_ctl(hid_io_epfd, EPOLL_CTL_DEL, source->fd, NULL);
+	if (source->timer_fd != -1) {
+		epoll_ctl(hid_io_epfd, EPOLL_CTL_DEL, source->timer_fd, NULL);
+		close(source->timer_fd);
+	}
+	hid_io_sources = g_list_remove(hid_io_sources, source);
+	g_free(source);
+}
+
+/*
+ * Reads all pending reports from the device and dispatches them to its
+ * report handler.
+ *
+ * Returns false if the device hung up.
+ */
+static bool hid_io_drain(struct hid_io_source *source)
+{
+	OuvrtDevice *dev = source->dev;
+	OuvrtDeviceClass *klass = OUVRT_DEVICE_GET_CLASS(dev);
+	unsigned char buf[MAX_REPORT_SIZE];
+	double time;
+	int ret;
+
+	for (;;) {
+		ret = read(source->fd, buf, sizeof(buf));
+		if (ret == -1) {
+			/* hidraw returns EIO after the device is gone */
+			if (errno == EIO || errno == ENODEV)
+				return false;
+			if (errno != EAGAIN && errno != EINTR)
+				g_print("%s: Read error: %d\n", dev->name,
+					errno);
+			return true;
+		}
+		if (ret == 0)
+			return false;
+
+		time = clock_sync_host_time();
+		source->deadline = time + REPORT_TIMEOUT;
+		recording_write_hid_report(dev, buf, ret, time);
+		klass->hid_report(dev, buf, ret, time);
+	}
+}
+
+/*
+ * Notifies devices that have not sent any reports for a while.
+ */
+static void hid_io_check_timeouts(void)
+{
+	struct hid_io_source *source;
+	OuvrtDeviceClass *klass;
+	double now = clock_sync_host_time();
+	GList *l;
+
+	for (l = hid_io_sources; l; l = l->next) {
+		source = l->data;
+		if (now < source->deadline)
+			continue;
+
+		source->deadline = now + REPORT_TIMEOUT;
+		klass = OUVRT_DEVICE_GET_CLASS(source->dev);
+		if (klass->hid_timeout)
+			klass->hid_timeout(source->dev);
+	}
+}
+
+/*
+ * Returns the time in milliseconds until the next device times out.
+ */
+static int hid_io_next_timeout(void)
+{
+	struct hid_io_source *source;
+	double now = clock_sync_host_time();
+	double next = now + REPORT_TIMEOUT;
+	GList *l;
+
+	for (l = hid_io_sources; l; l = l->next) {
+		source = l->data;
+		if (source->deadline < next)
+			next = source->deadline;
+	}
+
+	if (next <= now)
+		return 0;
+
+	return (int)(1000 * (next - now)) + 1;
+}
+
+/*
+ * Waits for reports from all registered devices and dispatches them.
+ */
+static gpointer hid_io_thread_func(gpointer data G_GNUC_UNUSED)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct hid_io_source *source;
+	OuvrtDeviceClass *klass;
+	OuvrtDevice *dev;
+	bool hangup;
+	int timeout;
+	int i, n;
+
+	thread_policy_apply(NULL, "hid-io");
+
+	for (;;) {
+		g_mutex_lock(&hid_io_lock);
+		timeout = hid_io_next_timeout();
+		g_mutex_unlock(&hid_io_lock);
+
+		n = epoll_wait(hid_io_epfd, events, MAX_EVENTS, timeout);
+		if (n == -1 && errno != EINTR) {
+			g_print("HID: epoll_wait failed: %d\n", errno);
+			break;
+		}
+
+		g_mutex_lock(&hid_io_lock);
+		for (i = 0; i < n; i++) {
+			/* The device may have been removed in the meantime */
+			source = hid_io_find(events[i].data.fd);
+			if (!source)
+				continue;
+
+			if (events[i].data.fd == source->timer_fd) {
+				hid_io_keepalive(source);
+				continue;
+			}
+
+			hangup = events[i].events & (EPOLLERR | EPOLLHUP);
+			if ((events[i].events & EPOLLIN) && !hid_io_drain(source))
+				hangup = true;
+			if (!hangup)
+				continue;
+
+			/*
+			 * Stop reading, timing out, and sending keepalives.
+			 * The device is stopped when udev reports its removal.
+			 */
+			dev = source->dev;
+			g_print("%s: Device hung up\n", dev->name);
+			hid_io_source_free(source);
+			klass = OUVRT_DEVICE_GET_CLASS(dev);
+			if (klass->hid_hangup)
+				klass->hid_hangup(dev);
+		}
+		hid_io_check_timeouts();
+		g_mutex_unlock(&hid_io_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts reading reports from the device in the shared HID thread. The
+ * device file descriptor is switched to non-blocking mode.
+ */
+int hid_io_add(OuvrtDevice *dev)
+{
+	OuvrtDeviceClass *klass;
+	struct hid_io_source *source;
+	struct epoll_event event;
+	int flags;
+	int ret = 0;
+
+	flags = fcntl(dev->fd, F_GETFL);
+	if (flags == -1 || fcntl(dev->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return -errno;
+
+	g_mutex_lock(&hid_io_lock);
+
+	if (hid_io_epfd == -1) {
+		hid_io_epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (hid_io_epfd == -1) {
+			ret = -errno;
+			goto out;
+		}
+	}
+
+	source = g_new0(struct hid_io_source, 1);
+	source->dev = dev;
+	source->fd = dev->fd;
+	source->timer_fd = -1;
+	source->deadline = clock_sync_host_time() + REPORT_TIMEOUT;
+
+	event.events = EPOLLIN;
+	event.data.fd = dev->fd;
+	if (epoll_ctl(hid_io_epfd, EPOLL_CTL_ADD, dev->fd, &event) == -1) {
+		ret = -errno;
+		g_free(source);
+		goto out;
+	}
+
+	klass = OUVRT_DEVICE_GET_CLASS(dev);
+	if (klass->hid_keepalive) {
+		ret = hid_io_add_timer(source, klass->hid_keepalive_interval);
+		if (ret < 0) {
+			epoll_ctl(hid_io_epfd, EPOLL_CTL_DEL, dev->fd, NULL);
+			g_free(source);
+			goto out;
+		}
+	}
+
+	hid_io_sources = g_list_prepend(hid_io_sources, source);
+
+	if (!hid_io_thread)
+		hid_io_thread = g_thread_new("hid-io", hid_io_thread_func, NULL);
+
+out:
+	g_mutex_unlock(&hid_io_lock);
+
+	return ret;
+}
+
+/*
+ * Stops reading reports from the device. When this returns, the report
+ * handlers of the device are not running anymore.
+ */
+void hid_io_remove(OuvrtDevice *dev)
+{
+	struct hid_io_source *source;
+
+	g_mutex_lock(&hid_io_lock);
+
+	source = hid_io_find(dev->fd);
+	if (source)
+		hid_io_source_free(source);
+
+	g_mutex_unlock(&hid_io_lock);
+}
@@ -0,0 +1,14 @@
+/*
+ * Shared HID report reader
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __HID_IO_H__
+#define __HID_IO_H__
+
+#include "device.h"
+
+int hid_io_add(OuvrtDevice *dev);
+void hid_io_remove(OuvrtDevice *dev);
+
+#endif /* __HID_IO_H__ */
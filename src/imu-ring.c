@@ -0,0 +1,91 @@
+/*
+ * Lock-free single-producer/multi-consumer IMU sample ring
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * Every entry is protected by its own sequence counter: it is odd while the
+ * writer updates the entry, and 2 * (n + 1) once sample number n is stored.
+ * Readers copy an entry and then check that the counter did not change, so
+ * they can detect entries that were overwritten during the copy.
+ */
+#include <string.h>
+
+#include "imu-ring.h"
+
+void imu_ring_init(struct imu_ring *ring)
+{
+	memset(ring, 0, sizeof(*ring));
+}
+
+/*
+ * Appends a sample, overwriting the oldest one if the ring is full. Must only
+ * be called from a single thread.
+ */
+void imu_ring_push(struct imu_ring *ring, const struct imu_sample *sample)
+{
+	uint64_t head = ring->head;
+	struct imu_ring_entry *entry = &ring->entries[head % IMU_RING_SIZE];
+
+	__atomic_store_n(&entry->seq, 2 * head + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	entry->sample = *sample;
+	__atomic_store_n(&entry->seq, 2 * head + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Starts reading at the next sample that will be pushed.
+ */
+void imu_ring_reader_init(struct imu_ring_reader *reader,
+			  struct imu_ring *ring)
+{
+	reader->ring = ring;
+	reader->tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	reader->overflows = 0;
+}
+
+/*
+ * Copies up to n samples that were pushed since the last call.
+ *
+ * Returns the number of samples copied.
+ */
+unsigned int imu_ring_read(struct imu_ring_reader *reader,
+			   struct imu_sample *samples, unsigned int n)
+{
+	struct imu_ring *ring = reader->ring;
+	struct imu_ring_entry *entry;
+	unsigned int count = 0;
+	uint64_t head, seq;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	while (count < n && reader->tail < head) {
+		if (head - reader->tail > IMU_RING_SIZE) {
+			reader->overflows += head - reader->tail -
+					     IMU_RING_SIZE;
+			reader->tail = head - IMU_RING_SIZE;
+		}
+
+		entry = &ring->entries[reader->tail % IMU_RING_SIZE];
+		seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+		if (seq == 2 * reader->tail + 2) {
+			samples[count] = entry->sample;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) ==
+			    seq) {
+				count++;
+				reader->tail++;
+				continue;
+			}
+		}
+
+		/* The writer lapped us, skip ahead */
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head - reader->tail <= IMU_RING_SIZE) {
+			reader->overflows++;
+			reader->tail++;
+		}
+	}
+
+	return count;
+}
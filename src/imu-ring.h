@@ -0,0 +1,45 @@
+/*
+ * Lock-free single-producer/multi-consumer IMU sample ring
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __IMU_RING_H__
+#define __IMU_RING_H__
+
+#include <stdint.h>
+
+#include "imu.h"
+
+/* Must be a power of two, holds 256 ms of samples at 1 kHz */
+#define IMU_RING_SIZE	256
+
+struct imu_ring_entry {
+	uint64_t seq;
+	struct imu_sample sample;
+};
+
+/*
+ * The ring is written by a single device thread. Each consumer keeps its
+ * own read position in a struct imu_ring_reader, so readers never block the
+ * writer or each other. A reader that falls more than IMU_RING_SIZE samples
+ * behind skips ahead and counts the lost samples.
+ */
+struct imu_ring {
+	struct imu_ring_entry entries[IMU_RING_SIZE];
+	uint64_t head;
+};
+
+struct imu_ring_reader {
+	struct imu_ring *ring;
+	uint64_t tail;
+	uint64_t overflows;
+};
+
+void imu_ring_init(struct imu_ring *ring);
+void imu_ring_push(struct imu_ring *ring, const struct imu_sample *sample);
+void imu_ring_reader_init(struct imu_ring_reader *reader,
+			  struct imu_ring *ring);
+unsigned int imu_ring_read(struct imu_ring_reader *reader,
+			   struct imu_sample *samples, unsigned int n);
+
+#endif /* __IMU_RING_H__ */
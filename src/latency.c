@@ -0,0 +1,150 @@
+/*
+ * Latency histograms
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * Recording a latency is a handful of relaxed atomic additions, so that the
+ * histograms can stay enabled in production. Percentiles are estimated by
+ * linear interpolation inside the bucket that contains them.
+ */
+#include <stdbool.h>
+#include <time.h>
+
+#include "latency.h"
+
+/* Bucket upper bounds in µs, the last bucket is unbounded */
+static const uint32_t latency_bounds[LATENCY_NUM_BUCKETS - 1] = {
+	10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 100000,
+};
+
+/*
+ * Returns the CLOCK_MONOTONIC time in ns.
+ */
+uint64_t latency_now_ns(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+/*
+ * Records a single duration in ns.
+ */
+void latency_histogram_add(struct latency_histogram *hist, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	uint64_t max;
+	int i;
+
+	for (i = 0; i < LATENCY_NUM_BUCKETS - 1; i++) {
+		if (us <= latency_bounds[i])
+			break;
+	}
+
+	__atomic_add_fetch(&hist->buckets[i], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->sum_ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+	while (ns > max &&
+	       !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Estimates the latency in µs below which the given fraction of the window
+ * samples lie.
+ */
+static double latency_percentile(const uint64_t *counts, uint64_t total,
+				 double fraction, double max)
+{
+	double rank = fraction * total;
+	double lower = 0.0, upper;
+	uint64_t seen = 0;
+	int i;
+
+	for (i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+		upper = i < LATENCY_NUM_BUCKETS - 1 ? latency_bounds[i] : max;
+		if (upper > max)
+			upper = max;
+		if (counts[i] && seen + counts[i] >= rank) {
+			return lower + (upper - lower) *
+			       (rank - seen) / counts[i];
+		}
+		seen += counts[i];
+		if (i < LATENCY_NUM_BUCKETS - 1)
+			lower = latency_bounds[i];
+	}
+
+	return max;
+}
+
+/*
+ * Summarizes the latencies recorded since the previous call and starts a
+ * new window. Must only be called from a single thread.
+ */
+void latency_histogram_window(struct latency_histogram *hist,
+			      struct latency_summary *summary)
+{
+	uint64_t counts[LATENCY_NUM_BUCKETS];
+	uint64_t count, sum_ns, total = 0;
+	int i;
+
+	for (i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+		count = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		counts[i] = count - hist->window_buckets[i];
+		hist->window_buckets[i] = count;
+		total += counts[i];
+	}
+	count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	sum_ns = __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED);
+
+	summary->count = total;
+	summary->max = __atomic_exchange_n(&hist->max_ns, 0,
+					   __ATOMIC_RELAXED) / 1000.0;
+	if (count > hist->window_count) {
+		summary->mean = (sum_ns - hist->window_sum_ns) / 1000.0 /
+				(count - hist->window_count);
+	} else {
+		summary->mean = 0.0;
+	}
+	summary->p50 = latency_percentile(counts, total, 0.5, summary->max);
+	summary->p99 = latency_percentile(counts, total, 0.99, summary->max);
+
+	hist->window_count = count;
+	hist->window_sum_ns = sum_ns;
+}
+
+/*
+ * Writes the cumulative histogram in Prometheus text exposition format,
+ * in seconds. The HELP and TYPE lines have to be written by the caller,
+ * once per metric.
+ */
+void latency_histogram_write_prometheus(const struct latency_histogram *hist,
+					FILE *f, const char *metric,
+					const char *device, const char *stage)
+{
+	uint64_t cumulative = 0;
+	int i;
+
+	for (i = 0; i < LATENCY_NUM_BUCKETS; i++) {
+		cumulative += __atomic_load_n(&hist->buckets[i],
+					      __ATOMIC_RELAXED);
+		if (i < LATENCY_NUM_BUCKETS - 1) {
+			fprintf(f, "%s_bucket{device=\"%s\",stage=\"%s\",le=\"%g\"} %llu\n",
+				metric, device, stage, latency_bounds[i] * 1e-6,
+				(unsigned long long)cumulative);
+		} else {
+			fprintf(f, "%s_bucket{device=\"%s\",stage=\"%s\",le=\"+Inf\"} %llu\n",
+				metric, device, stage,
+				(unsigned long long)cumulative);
+		}
+	}
+	fprintf(f, "%s_sum{device=\"%s\",stage=\"%s\"} %.9f\n", metric, device,
+		stage, __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED) * 1e-9);
+	fprintf(f, "%s_count{device=\"%s\",stage=\"%s\"} %llu\n", metric,
+		device, stage, (unsigned long long)cumulative);
+}
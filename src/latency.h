@@ -0,0 +1,59 @@
+/*
+ * Latency histograms
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Buckets with upper bounds from 10 µs to 100 ms, plus one for the rest */
+#define LATENCY_NUM_BUCKETS	13
+
+/*
+ * Histogram of the durations of a single processing stage, written by the
+ * thread that runs the stage and read by the main thread. The counters only
+ * ever increase, the rolling window is tracked by the reader.
+ */
+struct latency_histogram {
+	uint64_t buckets[LATENCY_NUM_BUCKETS];
+	uint64_t count;
+	uint64_t sum_ns;
+	/* Maximum since the last latency_histogram_window call */
+	uint64_t max_ns;
+	/* Counters at the last latency_histogram_window call */
+	uint64_t window_buckets[LATENCY_NUM_BUCKETS];
+	uint64_t window_count;
+	uint64_t window_sum_ns;
+};
+
+/*
+ * A named histogram, such as a processing stage of a device or tracker.
+ */
+struct latency_stage {
+	const char *name;
+	struct latency_histogram hist;
+};
+
+/*
+ * Latencies in µs observed since the previous window.
+ */
+struct latency_summary {
+	uint32_t count;
+	double mean;
+	double p50;
+	double p99;
+	double max;
+};
+
+uint64_t latency_now_ns(void);
+void latency_histogram_add(struct latency_histogram *hist, uint64_t ns);
+void latency_histogram_window(struct latency_histogram *hist,
+			      struct latency_summary *summary);
+void latency_histogram_write_prometheus(const struct latency_histogram *hist,
+					FILE *f, const char *metric,
+					const char *device, const char *stage);
+
+#endif /* __LATENCY_H__ */
@@ -0,0 +1,21 @@
+/*
+ * Lighthouse base station calibration
+ * Copyright 2016 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+
+ */
+#ifndef __LIGHTHOUSE_H__
+#define __LIGHTHOUSE_H__
+
+struct lighthouse_rotor_calibration {
+	float tilt;
+	float phase;
+	float curve;
+	float gibphase;
+	float gibmag;
+};
+
+struct lighthouse_base_calibration {
+	struct lighthouse_rotor_calibration rotor[2];
+};
+
+#endif /* __LIGHTHOUSE_H__ */
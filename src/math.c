@@ -62,11 +62,27 @@ void dquat_from_axis_angle(dquat *q, dvec3 *axis, double angle)
 	q->z = sin_half_angle * axis->z;
 }
 
-void vec3_normalize(vec3 *v)
+/*
+ * Converts a rotation vector, the rotation axis scaled by the rotation angle,
+ * into a quaternion.
+ */
+void dquat_from_rotation_vector(dquat *q, const dvec3 *v)
 {
-	float scale = 1.0f / sqrt(v->x * v->x + v->y * v->y + v->z * v->z);
+	double angle = sqrt(v->x * v->x + v->y * v->y + v->z * v->z);
+	double s;
+
+	if (angle < 1e-12) {
+		/* First order approximation */
+		q->w = 1.0;
+		q->x = 0.5 * v->x;
+		q->y = 0.5 * v->y;
+		q->z = 0.5 * v->z;
+		return;
+	}
 
-	v->x *= scale;
-	v->y *= scale;
-	v->z *= scale;
+	s = sin(angle * 0.5) / angle;
+	q->w = cos(angle * 0.5);
+	q->x = s * v->x;
+	q->y = s * v->y;
+	q->z = s * v->z;
 }
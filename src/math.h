@@ -2,10 +2,16 @@
  * Math helpers
  * Copyright 2015 Philipp Zabel
  * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * The fixed-size vector, quaternion, and matrix operations are inline, so
+ * that the compiler can keep the operands in registers and vectorize loops
+ * over arrays of points. Since this header shadows <math.h> for the tools,
+ * which are built with -I src, it uses the compiler builtins instead.
  */
 #ifndef __MATH_H__
 #define __MATH_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef struct {
@@ -20,12 +26,253 @@ typedef struct {
 	double x, y, z, w;
 } dquat;
 
+/* Row-major 3x3 matrix */
 typedef struct {
 	double m[9];
 } dmat3;
 
 float f16_to_float(uint16_t f16);
 void dquat_from_axis_angle(dquat *quat, dvec3 *axis, double angle);
-void vec3_normalize(vec3 *v);
+void dquat_from_rotation_vector(dquat *quat, const dvec3 *v);
+
+static inline dvec3 dvec3_from_vec3(const vec3 *v)
+{
+	return (dvec3){ v->x, v->y, v->z };
+}
+
+static inline vec3 vec3_from_dvec3(const dvec3 *v)
+{
+	return (vec3){ v->x, v->y, v->z };
+}
+
+static inline dvec3 dvec3_add(const dvec3 *a, const dvec3 *b)
+{
+	return (dvec3){ a->x + b->x, a->y + b->y, a->z + b->z };
+}
+
+static inline dvec3 dvec3_sub(const dvec3 *a, const dvec3 *b)
+{
+	return (dvec3){ a->x - b->x, a->y - b->y, a->z - b->z };
+}
+
+static inline dvec3 dvec3_scale(const dvec3 *v, double s)
+{
+	return (dvec3){ s * v->x, s * v->y, s * v->z };
+}
+
+static inline double dvec3_dot(const dvec3 *a, const dvec3 *b)
+{
+	return a->x * b->x + a->y * b->y + a->z * b->z;
+}
+
+static inline dvec3 dvec3_cross(const dvec3 *a, const dvec3 *b)
+{
+	return (dvec3){ a->y * b->z - a->z * b->y,
+			a->z * b->x - a->x * b->z,
+			a->x * b->y - a->y * b->x };
+}
+
+/*
+ * Scales v to unit length.
+ *
+ * Returns false, leaving v unchanged, if it is too short to be normalized.
+ */
+static inline bool dvec3_normalize(dvec3 *v)
+{
+	double norm = __builtin_sqrt(dvec3_dot(v, v));
+
+	if (norm < 1e-12)
+		return false;
+	v->x /= norm;
+	v->y /= norm;
+	v->z /= norm;
+
+	return true;
+}
+
+static inline void vec3_normalize(vec3 *v)
+{
+	float scale = 1.0f / __builtin_sqrtf(v->x * v->x + v->y * v->y +
+					     v->z * v->z);
+
+	v->x *= scale;
+	v->y *= scale;
+	v->z *= scale;
+}
+
+/*
+ * Calculates the Hamilton product r = a * b. r may alias a or b.
+ */
+static inline void dquat_mult(dquat *r, const dquat *a, const dquat *b)
+{
+	dquat q;
+
+	q.w = a->w * b->w - a->x * b->x - a->y * b->y - a->z * b->z;
+	q.x = a->w * b->x + a->x * b->w + a->y * b->z - a->z * b->y;
+	q.y = a->w * b->y - a->x * b->z + a->y * b->w + a->z * b->x;
+	q.z = a->w * b->z + a->x * b->y - a->y * b->x + a->z * b->w;
+	*r = q;
+}
+
+static inline void dquat_normalize(dquat *q)
+{
+	double scale = 1.0 / __builtin_sqrt(q->w * q->w + q->x * q->x +
+					    q->y * q->y + q->z * q->z);
+
+	q->w *= scale;
+	q->x *= scale;
+	q->y *= scale;
+	q->z *= scale;
+}
+
+/*
+ * Rotates the vector v by the unit quaternion q. r may alias v.
+ */
+static inline void dquat_rotate(dvec3 *r, const dquat *q, const dvec3 *v)
+{
+	/* t = 2 * cross(q.xyz, v), r = v + w * t + cross(q.xyz, t) */
+	double tx = 2 * (q->y * v->z - q->z * v->y);
+	double ty = 2 * (q->z * v->x - q->x * v->z);
+	double tz = 2 * (q->x * v->y - q->y * v->x);
+	dvec3 u = *v;
+
+	r->x = u.x + q->w * tx + q->y * tz - q->z * ty;
+	r->y = u.y + q->w * ty + q->z * tx - q->x * tz;
+	r->z = u.z + q->w * tz + q->x * ty - q->y * tx;
+}
+
+/*
+ * Converts the unit quaternion q into the rotation matrix m.
+ */
+static inline void dmat3_from_dquat(dmat3 *m, const dquat *q)
+{
+	double x = q->x, y = q->y, z = q->z, w = q->w;
+	double *R = m->m;
+
+	R[0] = 1 - 2 * (y * y + z * z);
+	R[1] = 2 * (x * y - z * w);
+	R[2] = 2 * (x * z + y * w);
+	R[3] = 2 * (x * y + z * w);
+	R[4] = 1 - 2 * (x * x + z * z);
+	R[5] = 2 * (y * z - x * w);
+	R[6] = 2 * (x * z - y * w);
+	R[7] = 2 * (y * z + x * w);
+	R[8] = 1 - 2 * (x * x + y * y);
+}
+
+/*
+ * Converts the rotation matrix m into the unit quaternion q, using the
+ * numerically stable branch for the largest diagonal element.
+ */
+static inline void dquat_from_dmat3(dquat *q, const dmat3 *m)
+{
+	const double *R = m->m;
+	double trace = R[0] + R[4] + R[8];
+	double s;
+
+	if (trace > 0) {
+		s = 0.5 / __builtin_sqrt(trace + 1.0);
+		q->w = 0.25 / s;
+		q->x = (R[7] - R[5]) * s;
+		q->y = (R[2] - R[6]) * s;
+		q->z = (R[3] - R[1]) * s;
+	} else if (R[0] > R[4] && R[0] > R[8]) {
+		s = 2.0 * __builtin_sqrt(1.0 + R[0] - R[4] - R[8]);
+		q->w = (R[7] - R[5]) / s;
+		q->x = 0.25 * s;
+		q->y = (R[1] + R[3]) / s;
+		q->z = (R[2] + R[6]) / s;
+	} else if (R[4] > R[8]) {
+		s = 2.0 * __builtin_sqrt(1.0 + R[4] - R[0] - R[8]);
+		q->w = (R[2] - R[6]) / s;
+		q->x = (R[1] + R[3]) / s;
+		q->y = 0.25 * s;
+		q->z = (R[5] + R[7]) / s;
+	} else {
+		s = 2.0 * __builtin_sqrt(1.0 + R[8] - R[0] - R[4]);
+		q->w = (R[3] - R[1]) / s;
+		q->x = (R[2] + R[6]) / s;
+		q->y = (R[5] + R[7]) / s;
+		q->z = 0.25 * s;
+	}
+}
+
+/*
+ * Calculates the matrix product r = a * b. r may alias a or b.
+ */
+static inline void dmat3_mult(dmat3 *r, const dmat3 *a, const dmat3 *b)
+{
+	dmat3 p;
+	int i, j;
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			p.m[3 * i + j] = a->m[3 * i] * b->m[j] +
+					 a->m[3 * i + 1] * b->m[3 + j] +
+					 a->m[3 * i + 2] * b->m[6 + j];
+		}
+	}
+	*r = p;
+}
+
+static inline dvec3 dmat3_mult_dvec3(const dmat3 *m, const dvec3 *v)
+{
+	const double *R = m->m;
+
+	return (dvec3){ R[0] * v->x + R[1] * v->y + R[2] * v->z,
+			R[3] * v->x + R[4] * v->y + R[5] * v->z,
+			R[6] * v->x + R[7] * v->y + R[8] * v->z };
+}
+
+/*
+ * Applies the rigid transform [R|t] to the point p.
+ */
+static inline dvec3 dmat3_transform(const dmat3 *R, const dvec3 *t,
+				    const dvec3 *p)
+{
+	dvec3 r = dmat3_mult_dvec3(R, p);
+
+	return dvec3_add(&r, t);
+}
+
+/*
+ * Transforms the points by the pose [R|t] into the camera frame and projects
+ * them through the camera matrix A, with radial-tangential distortion
+ * coefficients k, into the image. The image coordinates are stored into u
+ * and v, the camera frame depth into z. Points with z <= 0 are behind the
+ * camera and their image coordinates are meaningless, they have to be
+ * rejected by the caller. The loop body is free of branches, so that the
+ * compiler can vectorize it.
+ */
+static inline void project_points(const vec3 *points, int num_points,
+				  const dmat3 *R, const dvec3 *t,
+				  const dmat3 *A, const double k[5],
+				  double *restrict u, double *restrict v,
+				  double *restrict z)
+{
+	const double fx = A->m[0], cx = A->m[2];
+	const double fy = A->m[4], cy = A->m[5];
+	const double *r = R->m;
+	int i;
+
+	for (i = 0; i < num_points; i++) {
+		double px = points[i].x, py = points[i].y, pz = points[i].z;
+		double X = r[0] * px + r[1] * py + r[2] * pz + t->x;
+		double Y = r[3] * px + r[4] * py + r[5] * pz + t->y;
+		double Z = r[6] * px + r[7] * py + r[8] * pz + t->z;
+		double x = X / Z;
+		double y = Y / Z;
+		double r2 = x * x + y * y;
+		double radial = 1 + ((k[4] * r2 + k[1]) * r2 + k[0]) * r2;
+		double xd = x * radial + 2 * k[2] * x * y +
+			    k[3] * (r2 + 2 * x * x);
+		double yd = y * radial + k[2] * (r2 + 2 * y * y) +
+			    2 * k[3] * x * y;
+
+		u[i] = fx * xd + cx;
+		v[i] = fy * yd + cy;
+		z[i] = Z;
+	}
+}
 
 #endif /* __MATH_H__ */
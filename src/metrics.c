@@ -0,0 +1,85 @@
+/*
+ * Latency metrics in Prometheus text format
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ *
+ * The latency histograms of all devices and their trackers are periodically
+ * written to a file, which can be picked up by the textfile collector of
+ * the Prometheus node exporter.
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "latency.h"
+#include "metrics.h"
+#include "ouvrtd.h"
+#include "tracker.h"
+
+#define METRICS_INTERVAL	10
+#define METRICS_NAME		"ouvrt_latency_seconds"
+
+static char *metrics_filename;
+
+static void metrics_write_stages(FILE *f, const char *device,
+				 struct latency_stage *stages, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++) {
+		latency_histogram_write_prometheus(&stages[i].hist, f,
+						   METRICS_NAME, device,
+						   stages[i].name);
+	}
+}
+
+/*
+ * GSourceFunc that atomically replaces the metrics file.
+ */
+static gboolean metrics_update(gpointer user_data G_GNUC_UNUSED)
+{
+	GError *error = NULL;
+	OuvrtTracker *tracker;
+	OuvrtDevice *dev;
+	char *buf = NULL;
+	size_t size = 0;
+	GList *link;
+	FILE *f;
+
+	f = open_memstream(&buf, &size);
+	if (!f)
+		return G_SOURCE_CONTINUE;
+
+	fprintf(f, "# HELP " METRICS_NAME " Processing stage latencies.\n");
+	fprintf(f, "# TYPE " METRICS_NAME " histogram\n");
+	for (link = device_list; link; link = link->next) {
+		dev = link->data;
+		metrics_write_stages(f, dev->name, dev->latency,
+				     dev->num_latency);
+		tracker = ouvrtd_device_get_tracker(dev);
+		if (tracker) {
+			metrics_write_stages(f, dev->name,
+					     ouvrt_tracker_get_latency(tracker),
+					     TRACKER_NUM_LATENCY);
+		}
+	}
+	fclose(f);
+
+	if (!g_file_set_contents(metrics_filename, buf, size, &error)) {
+		g_print("Metrics: Failed to write '%s': %s\n",
+			metrics_filename, error->message);
+		g_error_free(error);
+	}
+	free(buf);
+
+	return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Starts writing latency metrics to the given file every ten seconds.
+ */
+void metrics_start(const char *filename)
+{
+	metrics_filename = g_strdup(filename);
+	g_timeout_add_seconds(METRICS_INTERVAL, metrics_update, NULL);
+}
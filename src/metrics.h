@@ -0,0 +1,11 @@
+/*
+ * Latency metrics in Prometheus text format
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+void metrics_start(const char *filename);
+
+#endif /* __METRICS_H__ */
@@ -12,10 +12,12 @@
 #include <string.h>
 
 #include "esp570.h"
+#include "mt9v034.h"
 #define i2c_read	esp570_i2c_read
 #define i2c_write	esp570_i2c_write
 
 #define MT9V034_CHIP_VERSION			0x00
+#define MT9V034_ROW_START			0x02
 #define MT9V034_WINDOW_HEIGHT			0x03
 #define MT9V034_WINDOW_WIDTH			0x04
 #define MT9V034_HORIZONTAL_BLANKING		0x05
@@ -31,7 +33,7 @@
 #define MT9V034_MAX_TOTAL_SHUTTER_WIDTH		0xbd
 #define MT9V034_FINE_SHUTTER_WIDTH_TOTAL	0xd5
 
-#define MT9V034_ANALOG_GAIN_MIN			16
+#define MT9V034_ROW_START_DEFAULT		4
 
 #define MT9V034_CHIP_CONTROL_MASTER_MODE	(1 << 3)
 #define MT9V034_CHIP_CONTROL_SNAPSHOT_MODE	(3 << 3)
@@ -98,7 +100,8 @@ int mt9v034_sensor_enable_sync(int fd)
 			    MT9V034_CHIP_CONTROL_SEQUENTIAL);
 
 	/* Set integration time in number of rows + number of clock cycles */
-	i2c_write(fd, addr, MT9V034_COARSE_SHUTTER_WIDTH_TOTAL, 11);
+	i2c_write(fd, addr, MT9V034_COARSE_SHUTTER_WIDTH_TOTAL,
+			    MT9V034_SYNC_EXPOSURE_ROWS);
 	i2c_write(fd, addr, MT9V034_FINE_SHUTTER_WIDTH_TOTAL, 111);
 	/* Switch to snapshot mode, exposure controlled by Rift DK2 HMD */
 	i2c_read(fd, addr, MT9V034_CHIP_CONTROL, &chip_control);
@@ -143,3 +146,67 @@ int mt9v034_sensor_disable_sync(int fd)
 
 	return 0;
 }
+
+/*
+ * Sets the analog gain, clamped to the valid range, for example to pick up
+ * dim LEDs. Unity gain is MT9V034_ANALOG_GAIN_MIN.
+ *
+ * Returns the gain that was set, or a negative error code.
+ */
+int mt9v034_sensor_set_analog_gain(int fd, int gain)
+{
+	uint8_t addr = 0x4c << 1;
+	int ret;
+
+	if (gain < MT9V034_ANALOG_GAIN_MIN)
+		gain = MT9V034_ANALOG_GAIN_MIN;
+	if (gain > MT9V034_ANALOG_GAIN_MAX)
+		gain = MT9V034_ANALOG_GAIN_MAX;
+
+	ret = i2c_write(fd, addr, MT9V034_ANALOG_GAIN, gain);
+	if (ret < 0)
+		return ret;
+
+	return gain;
+}
+
+/*
+ * Sets the integration time in number of rows, keeping the fine shutter
+ * width. In synchronized exposure mode, the integration starts with the
+ * exposure signal from the Rift DK2.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int mt9v034_sensor_set_exposure_rows(int fd, int rows)
+{
+	uint8_t addr = 0x4c << 1;
+
+	if (rows < 1)
+		return -EINVAL;
+
+	return i2c_write(fd, addr, MT9V034_COARSE_SHUTTER_WIDTH_TOTAL, rows);
+}
+
+/*
+ * Restricts the readout to the image rows [y, y + height) of the full
+ * window, which reduces readout time and USB bandwidth. Since the image is
+ * read out flipped, the sensor row start is counted from the bottom of the
+ * pixel array. The frames keep their width and only contain the window rows.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int mt9v034_sensor_set_window(int fd, int y, int height)
+{
+	uint8_t addr = 0x4c << 1;
+	int ret;
+
+	if (y < 0 || height < 1 || y + height > MT9V034_MAX_HEIGHT)
+		return -EINVAL;
+
+	ret = i2c_write(fd, addr, MT9V034_ROW_START, MT9V034_ROW_START_DEFAULT +
+			MT9V034_MAX_HEIGHT - y - height);
+	if (ret < 0)
+		return ret;
+
+	return i2c_write(fd, addr, MT9V034_WINDOW_HEIGHT, height);
+}
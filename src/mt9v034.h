@@ -6,8 +6,22 @@
 #ifndef __MT9V034_H__
 #define __MT9V034_H__
 
+/* Analog gain range, 16 is unity gain */
+#define MT9V034_ANALOG_GAIN_MIN			16
+#define MT9V034_ANALOG_GAIN_MAX			64
+
+/* Full pixel array readout window */
+#define MT9V034_MAX_WIDTH			752
+#define MT9V034_MAX_HEIGHT			480
+
+/* Integration time in rows used in synchronized exposure mode */
+#define MT9V034_SYNC_EXPOSURE_ROWS		11
+
 int mt9v034_sensor_setup(int fd);
 int mt9v034_sensor_enable_sync(int fd);
 int mt9v034_sensor_disable_sync(int fd);
+int mt9v034_sensor_set_analog_gain(int fd, int gain);
+int mt9v034_sensor_set_exposure_rows(int fd, int rows);
+int mt9v034_sensor_set_window(int fd, int y, int height);
 
 #endif /* __MT9V034_H__ */
@@ -0,0 +1,345 @@
+/*
+ * ouvrt client library
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * Trackers are discovered with the generated GDBus object manager client,
+ * whose change notifications are dispatched from a private main context
+ * in ouvrt_client_update, so that the application's main loop, if there is
+ * one, is not involved. The shared memory region returned by Tracker1.Acquire
+ * is mapped read-only and read without locks: the reader copies the newest
+ * entry and only checks afterwards that the daemon has not wrapped around
+ * the ring to overwrite it.
+ */
+#include <errno.h>
+#include <glib.h>
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gdbus-generated.h"
+#include "ouvrt-client.h"
+#include "pose-shm.h"
+
+#define OUVRT_BUS_NAME		"de.phfuenf.ouvrt.Ouvrtd"
+#define OUVRT_OBJECT_PATH	"/de/phfuenf/ouvrt"
+
+/*
+ * The reader only retries if the daemon published more than a whole ring of
+ * entries during a single copy, so this is never reached in practice.
+ */
+#define MAX_READ_ATTEMPTS	4
+
+struct ouvrt_client {
+	GMainContext *context;
+	GDBusObjectManager *manager;
+	GPtrArray *paths;
+};
+
+struct ouvrt_client_tracker {
+	OuvrtTracker1 *proxy;
+	const struct ouvrt_pose_shm *map;
+};
+
+/*
+ * Collects the object paths of all objects that implement Tracker1.
+ */
+static void ouvrt_client_collect_trackers(struct ouvrt_client *client)
+{
+	GList *objects, *link;
+	GDBusObject *object;
+
+	g_ptr_array_set_size(client->paths, 0);
+
+	objects = g_dbus_object_manager_get_objects(client->manager);
+	for (link = objects; link; link = link->next) {
+		object = link->data;
+		if (!ouvrt_object_peek_tracker1(OUVRT_OBJECT(object)))
+			continue;
+		g_ptr_array_add(client->paths,
+				g_strdup(g_dbus_object_get_object_path(object)));
+	}
+	g_list_free_full(objects, g_object_unref);
+}
+
+/*
+ * Connects to ouvrtd on the session bus and lists its trackers.
+ *
+ * Returns a newly allocated client, or NULL if the session bus is not
+ * available. The daemon does not have to be running yet.
+ */
+struct ouvrt_client *ouvrt_client_new(void)
+{
+	struct ouvrt_client *client;
+	GError *error = NULL;
+
+	client = g_new0(struct ouvrt_client, 1);
+	client->context = g_main_context_new();
+	client->paths = g_ptr_array_new_with_free_func(g_free);
+
+	/* Change notifications are dispatched from the private context */
+	g_main_context_push_thread_default(client->context);
+	client->manager = ouvrt_object_manager_client_new_for_bus_sync(
+				G_BUS_TYPE_SESSION,
+				G_DBUS_OBJECT_MANAGER_CLIENT_FLAGS_NONE,
+				OUVRT_BUS_NAME, OUVRT_OBJECT_PATH,
+				NULL, &error);
+	g_main_context_pop_thread_default(client->context);
+	if (!client->manager) {
+		g_warning("ouvrt-client: Failed to connect: %s",
+			  error->message);
+		g_error_free(error);
+		ouvrt_client_free(client);
+		return NULL;
+	}
+
+	ouvrt_client_collect_trackers(client);
+
+	return client;
+}
+
+void ouvrt_client_free(struct ouvrt_client *client)
+{
+	if (!client)
+		return;
+
+	if (client->manager)
+		g_object_unref(client->manager);
+	g_ptr_array_free(client->paths, TRUE);
+	g_main_context_unref(client->context);
+	g_free(client);
+}
+
+/*
+ * Processes pending D-Bus notifications about trackers that appeared or
+ * vanished, for example because ouvrtd was started or devices were plugged
+ * in. Does not block.
+ *
+ * Returns the number of trackers.
+ */
+int ouvrt_client_update(struct ouvrt_client *client)
+{
+	while (g_main_context_iteration(client->context, FALSE))
+		;
+
+	ouvrt_client_collect_trackers(client);
+
+	return client->paths->len;
+}
+
+/*
+ * Returns the D-Bus object path of the tracker with the given index, valid
+ * until the next call to ouvrt_client_update, or NULL if the index is out
+ * of range.
+ */
+const char *ouvrt_client_get_tracker_path(struct ouvrt_client *client,
+					  int index)
+{
+	if (index < 0 || (guint)index >= client->paths->len)
+		return NULL;
+
+	return g_ptr_array_index(client->paths, index);
+}
+
+/*
+ * Maps the shared memory region behind fd read-only and checks its header.
+ *
+ * Returns the mapping, or NULL if it does not look like a pose ring.
+ */
+static const struct ouvrt_pose_shm *ouvrt_client_map(int fd)
+{
+	size_t size = sizeof(struct ouvrt_pose_shm);
+	const struct ouvrt_pose_shm *map;
+	struct stat st;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)size)
+		return NULL;
+
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	if (map->magic != OUVRT_POSE_SHM_MAGIC ||
+	    map->version != OUVRT_POSE_SHM_VERSION ||
+	    map->size != size ||
+	    map->num_entries != OUVRT_POSE_SHM_ENTRIES) {
+		munmap((void *)map, size);
+		return NULL;
+	}
+
+	return map;
+}
+
+/*
+ * Acquires the tracker with the given object path, which enables it in the
+ * daemon, and maps its pose output.
+ *
+ * Returns the tracker, or NULL on error.
+ */
+struct ouvrt_client_tracker *
+ouvrt_client_acquire_tracker(struct ouvrt_client *client, const char *path)
+{
+	struct ouvrt_client_tracker *tracker;
+	GUnixFDList *fd_list = NULL;
+	GDBusObject *object;
+	GError *error = NULL;
+	OuvrtTracker1 *proxy;
+	int fd;
+
+	object = g_dbus_object_manager_get_object(client->manager, path);
+	if (!object)
+		return NULL;
+	proxy = ouvrt_object_get_tracker1(OUVRT_OBJECT(object));
+	g_object_unref(object);
+	if (!proxy)
+		return NULL;
+
+	if (!ouvrt_tracker1_call_acquire_sync(proxy, NULL, &fd_list, NULL,
+					      &error)) {
+		g_warning("ouvrt-client: Failed to acquire %s: %s", path,
+			  error->message);
+		g_error_free(error);
+		g_object_unref(proxy);
+		return NULL;
+	}
+
+	fd = g_unix_fd_list_get(fd_list, 0, &error);
+	g_object_unref(fd_list);
+	if (fd < 0) {
+		g_warning("ouvrt-client: No pose output for %s: %s", path,
+			  error->message);
+		g_error_free(error);
+		goto err_release;
+	}
+
+	tracker = g_new0(struct ouvrt_client_tracker, 1);
+	tracker->proxy = proxy;
+	tracker->map = ouvrt_client_map(fd);
+	close(fd);
+	if (!tracker->map) {
+		g_warning("ouvrt-client: Invalid pose output for %s", path);
+		g_free(tracker);
+		goto err_release;
+	}
+
+	return tracker;
+
+err_release:
+	ouvrt_tracker1_call_release_sync(proxy, NULL, NULL);
+	g_object_unref(proxy);
+	return NULL;
+}
+
+/*
+ * Unmaps the pose output and releases the tracker in the daemon. No pose
+ * reader may be running anymore.
+ */
+void ouvrt_client_release_tracker(struct ouvrt_client_tracker *tracker)
+{
+	if (!tracker)
+		return;
+
+	munmap((void *)tracker->map, sizeof(*tracker->map));
+	ouvrt_tracker1_call_release_sync(tracker->proxy, NULL, NULL);
+	g_object_unref(tracker->proxy);
+	g_free(tracker);
+}
+
+/*
+ * Copies the newest entry of the pose ring. Instead of waiting for the
+ * seqlock, the entry at head - 1 is copied and accepted if the daemon has
+ * not started to overwrite its slot in the meantime, which only happens
+ * after num_entries - 1 further entries. The acquire fence after the copy
+ * pairs with the release fence the daemon issues before writing an entry,
+ * so if the copy saw any part of a newer entry in the same slot, the
+ * second load of head sees that entry as well.
+ *
+ * Returns 0 on success, -EAGAIN if no pose was published yet, or -EBUSY if
+ * the reader was overtaken repeatedly.
+ */
+static int ouvrt_client_read_entry(const struct ouvrt_pose_shm *map,
+				   struct ouvrt_pose_shm_entry *entry)
+{
+	uint64_t head, now;
+	int i;
+
+	for (i = 0; i < MAX_READ_ATTEMPTS; i++) {
+		head = __atomic_load_n(&map->head, __ATOMIC_ACQUIRE);
+		if (head == 0)
+			return -EAGAIN;
+
+		memcpy(entry, &map->entries[(head - 1) % OUVRT_POSE_SHM_ENTRIES],
+		       sizeof(*entry));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		now = __atomic_load_n(&map->head, __ATOMIC_RELAXED);
+		if (now - head < OUVRT_POSE_SHM_ENTRIES - 1)
+			return 0;
+	}
+
+	return -EBUSY;
+}
+
+/*
+ * Reads the latest pose published by the daemon, at IMU sample rate.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int ouvrt_client_tracker_get_pose(struct ouvrt_client_tracker *tracker,
+				  struct ouvrt_client_pose *pose)
+{
+	struct ouvrt_pose_shm_entry entry;
+	int ret;
+
+	ret = ouvrt_client_read_entry(tracker->map, &entry);
+	if (ret < 0)
+		return ret;
+
+	pose->timestamp = entry.timestamp;
+	memcpy(pose->rotation, entry.rotation, sizeof(pose->rotation));
+	memcpy(pose->translation, entry.translation, sizeof(pose->translation));
+
+	return 0;
+}
+
+/*
+ * Predicts the pose at the given time in seconds of the CLOCK_MONOTONIC
+ * clock, for example the expected photon time of a frame, from the latest
+ * published pose. This is the same prediction as done by the
+ * Tracker1.PredictPose method, without the D-Bus round trip.
+ *
+ * Returns 0 on success or a negative error code.
+ */
+int ouvrt_client_tracker_predict_pose(struct ouvrt_client_tracker *tracker,
+				      double time,
+				      struct ouvrt_client_pose *pose)
+{
+	struct ouvrt_pose_shm_entry entry;
+	int ret;
+
+	ret = ouvrt_client_read_entry(tracker->map, &entry);
+	if (ret < 0)
+		return ret;
+
+	ouvrt_pose_shm_predict(&entry, time, pose->rotation, pose->translation);
+	pose->timestamp = time;
+
+	return 0;
+}
+
+/*
+ * Returns the current time in seconds of the CLOCK_MONOTONIC clock, which
+ * is the time base of all poses.
+ */
+double ouvrt_client_get_time(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	return tp.tv_sec + tp.tv_nsec * 1e-9;
+}
@@ -0,0 +1,52 @@
+/*
+ * ouvrt client library
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * Discovers the trackers exported by ouvrtd on the session bus, acquires
+ * their shared memory pose output, and reads poses from it without any
+ * system calls. All functions except the pose readers must be called from
+ * the same thread. The pose readers may be called from any thread, also
+ * concurrently.
+ */
+#ifndef __OUVRT_CLIENT_H__
+#define __OUVRT_CLIENT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ouvrt_client;
+struct ouvrt_client_tracker;
+
+struct ouvrt_client_pose {
+	/* Time of the pose in seconds of the CLOCK_MONOTONIC clock */
+	double timestamp;
+	/* Orientation quaternion x, y, z, w */
+	double rotation[4];
+	/* Position in meters */
+	double translation[3];
+};
+
+struct ouvrt_client *ouvrt_client_new(void);
+void ouvrt_client_free(struct ouvrt_client *client);
+int ouvrt_client_update(struct ouvrt_client *client);
+const char *ouvrt_client_get_tracker_path(struct ouvrt_client *client,
+					  int index);
+
+struct ouvrt_client_tracker *
+ouvrt_client_acquire_tracker(struct ouvrt_client *client, const char *path);
+void ouvrt_client_release_tracker(struct ouvrt_client_tracker *tracker);
+int ouvrt_client_tracker_get_pose(struct ouvrt_client_tracker *tracker,
+				  struct ouvrt_client_pose *pose);
+int ouvrt_client_tracker_predict_pose(struct ouvrt_client_tracker *tracker,
+				      double time,
+				      struct ouvrt_client_pose *pose);
+
+double ouvrt_client_get_time(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __OUVRT_CLIENT_H__ */
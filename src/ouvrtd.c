@@ -6,7 +6,9 @@
 #include <errno.h>
 #include <getopt.h>
 #include <glib.h>
+#ifdef HAVE_DEBUG_GST
 #include <gst/gst.h>
+#endif
 #include <libudev.h>
 #include <locale.h>
 #include <poll.h>
@@ -17,10 +19,18 @@
 
 #include "dbus.h"
 #include "debug.h"
+#include "debug-gst.h"
 #include "device.h"
 #include "gdbus-generated.h"
+#include "metrics.h"
+#include "ouvrtd.h"
+#include "recording.h"
+#include "replay.h"
 #include "rift-dk2.h"
 #include "camera-dk2.h"
+#include "camera-v4l2.h"
+#include "thread-policy.h"
+#include "tracker.h"
 #include "vive-headset-imu.h"
 #include "vive-headset-mainboard.h"
 #include "vive-headset-lighthouse.h"
@@ -91,24 +101,168 @@ static const struct device_match device_matches[NUM_MATCHES] = {
 	},
 };
 
+/* Maximum number of devices that are started concurrently */
+#define START_THREADS	8
+
 GList *device_list = NULL;
 static int num_devices;
 
 /*
- * Compares the device's serial against a given serial.
+ * Starts devices in parallel, as their start functions block for a while on
+ * EEPROM reads and HID feature reports
+ */
+static GThreadPool *ouvrtd_start_pool;
+
+/*
+ * Returns the pose tracker of the device, or NULL.
+ */
+OuvrtTracker *ouvrtd_device_get_tracker(OuvrtDevice *dev)
+{
+	if (OUVRT_IS_RIFT_DK2(dev))
+		return OUVRT_RIFT_DK2(dev)->tracker;
+	if (OUVRT_IS_VIVE_HEADSET_IMU(dev))
+		return OUVRT_VIVE_HEADSET_IMU(dev)->tracker;
+	if (OUVRT_IS_VIVE_CONTROLLER(dev))
+		return OUVRT_VIVE_CONTROLLER(dev)->tracker;
+	return NULL;
+}
+
+/*
+ * Returns TRUE if any camera is attached to the given tracker.
+ */
+static gboolean ouvrtd_tracker_has_camera(OuvrtTracker *tracker)
+{
+	GList *link;
+
+	for (link = device_list; link; link = link->next) {
+		if (OUVRT_IS_CAMERA(link->data) &&
+		    OUVRT_CAMERA(link->data)->tracker == tracker)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Stops tracking the Rift DK2 with the cameras of other Rift DK2 devices.
  */
-static gint ouvrt_device_cmp_serial(OuvrtDevice *dev, const char *serial)
+static void ouvrtd_rift_unlink(OuvrtRiftDK2 *rift)
 {
-	return g_strcmp0(dev->serial, serial);
+	GList *link;
+
+	for (link = device_list; link; link = link->next) {
+		if (OUVRT_IS_RIFT_DK2(link->data) && link->data != rift) {
+			ouvrt_tracker_remove_object(
+				OUVRT_RIFT_DK2(link->data)->tracker,
+				rift->tracker);
+		}
+	}
+}
+
+/*
+ * Attaches a camera to the pose tracker of a Rift DK2.
+ */
+static void ouvrtd_camera_attach(OuvrtCameraDK2 *camera, OuvrtRiftDK2 *rift)
+{
+	g_print("Associate %s and %s\n", OUVRT_DEVICE(camera)->name,
+		OUVRT_DEVICE(rift)->name);
+
+	ouvrt_camera_set_tracker(&camera->v4l2.camera, rift->tracker);
+	ouvrtd_rift_unlink(rift);
+}
+
+/*
+ * Connects a newly added device to already known devices, such as the Rift
+ * DK2 and its tracking cameras. A camera is attached to the Rift DK2 with the
+ * same serial number or, if there is none, to the first Rift DK2, so that
+ * additional cameras all observe the same headset. A Rift DK2 without any
+ * camera is tracked with the cameras of the first Rift DK2 that has some.
+ */
+void ouvrtd_device_associate(OuvrtDevice *d)
+{
+	OuvrtRiftDK2 *rift = NULL;
+	OuvrtCameraDK2 *camera;
+	OuvrtDevice *dev;
+	GList *link;
+
+	if (OUVRT_IS_CAMERA_DK2(d)) {
+		camera = OUVRT_CAMERA_DK2(d);
+		for (link = device_list; link; link = link->next) {
+			dev = link->data;
+			if (!OUVRT_IS_RIFT_DK2(dev))
+				continue;
+			if (!rift || (d->serial &&
+				      g_strcmp0(dev->serial, d->serial) == 0))
+				rift = OUVRT_RIFT_DK2(dev);
+		}
+		if (rift)
+			ouvrtd_camera_attach(camera, rift);
+	}
+
+	if (OUVRT_IS_RIFT_DK2(d)) {
+		rift = OUVRT_RIFT_DK2(d);
+		for (link = device_list; link; link = link->next) {
+			dev = link->data;
+			if (!OUVRT_IS_CAMERA_DK2(dev))
+				continue;
+			camera = OUVRT_CAMERA_DK2(dev);
+			if (!camera->v4l2.camera.tracker)
+				ouvrtd_camera_attach(camera, rift);
+		}
+		if (ouvrtd_tracker_has_camera(rift->tracker))
+			return;
+		for (link = device_list; link; link = link->next) {
+			dev = link->data;
+			if (!OUVRT_IS_RIFT_DK2(dev) ||
+			    !ouvrtd_tracker_has_camera(OUVRT_RIFT_DK2(dev)->tracker))
+				continue;
+			if (ouvrt_tracker_add_object(OUVRT_RIFT_DK2(dev)->tracker,
+						     rift->tracker) == 0) {
+				g_print("Track %s with the cameras of %s\n",
+					d->name, dev->name);
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * GSourceFunc that drops the start pool's device reference on the main
+ * loop. If the device was removed while it was starting, this stops it.
+ */
+static gboolean ouvrtd_device_started(gpointer data)
+{
+	g_object_unref(OUVRT_DEVICE(data));
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * GFunc that starts a device in a worker thread of the start pool.
+ */
+static void ouvrtd_device_start_func(gpointer data,
+				     gpointer user_data G_GNUC_UNUSED)
+{
+	OuvrtDevice *dev = OUVRT_DEVICE(data);
+	int ret;
+
+	ret = ouvrt_device_start(dev);
+	if (ret < 0)
+		g_print("%s: Failed to start: %d\n", dev->name, ret);
+
+	g_idle_add(ouvrtd_device_started, dev);
 }
 
 /*
  * Check if an added device matches the table of known hardware, if yes create
- * a new device structure and start the device.
+ * a new device structure and start the device. Association only depends on
+ * the device type and serial number, so it is done right away, before the
+ * device is started in the start pool.
  */
 static void ouvrtd_device_add(struct udev_device *dev)
 {
-	const char *devnode, *vid, *pid, *serial, *subsystem, *interface;
+	const char *devnode, *vid, *pid, *serial, *version, *subsystem;
+	const char *interface;
 	struct udev_device *parent;
 	OuvrtDevice *d;
 	int i, iface;
@@ -151,6 +305,7 @@ static void ouvrtd_device_add(struct udev_device *dev)
 
 	devnode = udev_device_get_devnode(dev);
 	serial = udev_device_get_sysattr_value(parent, "serial");
+	version = udev_device_get_sysattr_value(parent, "bcdDevice");
 	g_print("udev: Found %s: %s\n", device_matches[i].name, devnode);
 
 	d = device_matches[i].new(devnode);
@@ -160,40 +315,14 @@ static void ouvrtd_device_add(struct udev_device *dev)
 		d->name = strdup(device_matches[i].name);
 	if (serial && d->serial == NULL)
 		d->serial = strdup(serial);
-	if (d->serial) {
-		GList *link;
-
+	if (version && d->version == NULL)
+		d->version = strdup(version);
+	if (d->serial)
 		g_print("%s: Serial %s\n", device_matches[i].name, d->serial);
-
-		link = g_list_find_custom(device_list, d->serial,
-					  (GCompareFunc)ouvrt_device_cmp_serial);
-		if (link) {
-			OuvrtRiftDK2 *rift = NULL;
-			OuvrtCameraDK2 *camera = NULL;
-
-			if (OUVRT_IS_RIFT_DK2(d) &&
-			    OUVRT_IS_CAMERA_DK2(link->data)) {
-				g_print("Associate %s and %s\n", d->devnode,
-					OUVRT_DEVICE(link->data)->devnode);
-				rift = OUVRT_RIFT_DK2(d);
-				camera = OUVRT_CAMERA_DK2(link->data);
-			}
-			if (OUVRT_IS_CAMERA_DK2(d) &&
-			    OUVRT_IS_RIFT_DK2(link->data)) {
-				camera = OUVRT_CAMERA_DK2(d);
-				rift = OUVRT_RIFT_DK2(link->data);
-			}
-			if (rift && camera) {
-				g_print("Associate %s and %s\n", d->devnode,
-					OUVRT_DEVICE(link->data)->devnode);
-
-				camera->v4l2.camera.tracker = rift->tracker;
-			}
-		}
-	}
+	ouvrtd_device_associate(d);
 
 	device_list = g_list_append(device_list, d);
-	ouvrt_device_start(d);
+	g_thread_pool_push(ouvrtd_start_pool, g_object_ref(d), NULL);
 }
 
 /*
@@ -221,6 +350,8 @@ static int ouvrtd_device_remove(struct udev_device *dev)
 
 	g_print("Removing device: %s\n", devnode);
 	device_list = g_list_remove_link(device_list, link);
+	if (OUVRT_IS_RIFT_DK2(link->data))
+		ouvrtd_rift_unlink(OUVRT_RIFT_DK2(link->data));
 	g_object_unref(OUVRT_DEVICE(link->data));
 	g_list_free_1(link);
 	num_devices--;
@@ -358,8 +489,11 @@ static void ouvrtd_signal_handler(int sig)
 	signal(sig, SIG_IGN);
 	g_print(" - stopping all devices\n");
 
+	/* Let devices that are still starting finish first */
+	g_thread_pool_free(ouvrtd_start_pool, TRUE, TRUE);
 	g_list_foreach(device_list, (GFunc)ouvrt_device_stop,
 		       NULL); /* user_data */
+	recording_stop();
 
 	exit(0);
 }
@@ -368,20 +502,45 @@ static void ouvrtd_usage(void)
 {
 	g_print("ouvrtd [OPTIONS...] ...\n\n"
 		"Positional tracking daemon for Oculus VR Rift DK2.\n\n"
-		"  -h --help          Show this help\n");
+		"  -h --help          Show this help\n"
+		"  -b --buffers=N     Number of V4L2 capture buffers (3-32)\n"
+		"  -c --compress      Stream run-length compressed debug frames\n"
+		"  -d --dmabuf        Export V4L2 capture buffers as DMABUFs\n"
+		"  -H --headless      Do not start the GStreamer debug output\n"
+		"  -m --metrics=FILE  Write latency metrics in Prometheus format\n"
+		"  -t --threads=N     Number of blob detection threads (1-16)\n"
+		"  -l --led-cone=DEG  Half angle of the LED visibility cone (10-90)\n"
+		"  -p --policy=[DEVICE/]ROLE:PRIO[:CPUS]\n"
+		"                     Run hid-io, device, or tracking threads with\n"
+		"                     SCHED_FIFO priority PRIO (0: default) on CPUS\n"
+		"  -r --record=FILE   Record HID reports and camera frames\n"
+		"  -R --replay=FILE   Replay a recorded session and exit\n"
+		"  -w --window        Read out only sensor rows around tracked objects\n");
 }
 
 static const struct option ouvrtd_options[] = {
 	{ "help", no_argument, NULL, 'h' },
+	{ "buffers", required_argument, NULL, 'b' },
+	{ "compress", no_argument, NULL, 'c' },
+	{ "dmabuf", no_argument, NULL, 'd' },
+	{ "headless", no_argument, NULL, 'H' },
+	{ "metrics", required_argument, NULL, 'm' },
+	{ "threads", required_argument, NULL, 't' },
+	{ "led-cone", required_argument, NULL, 'l' },
+	{ "policy", required_argument, NULL, 'p' },
+	{ "record", required_argument, NULL, 'r' },
+	{ "replay", required_argument, NULL, 'R' },
+	{ "window", no_argument, NULL, 'w' },
 	{ NULL }
 };
 
 /*
- * Main function. Initialize GStreamer for debugging purposes and udev for
- * device detection.
+ * Main function. Initialize GStreamer for debugging purposes, unless running
+ * headless, and udev for device detection.
  */
 int main(int argc, char *argv[])
 {
+	const char *record = NULL, *replay = NULL, *metrics = NULL;
 	struct udev *udev;
 	GMainLoop *loop;
 	guint owner_id;
@@ -390,13 +549,65 @@ int main(int argc, char *argv[])
 
 	setlocale(LC_CTYPE, "");
 
-	gst_init(&argc, &argv);
-
 	do {
-		ret = getopt_long(argc, argv, "h", ouvrtd_options, &longind);
+		ret = getopt_long(argc, argv, "hb:cdHm:t:l:p:r:R:w", ouvrtd_options, &longind);
 		switch (ret) {
 		case -1:
 			break;
+		case 'b':
+			camera_v4l2_num_buffers = atoi(optarg);
+			if (camera_v4l2_num_buffers < 3 ||
+			    camera_v4l2_num_buffers > 32) {
+				ouvrtd_usage();
+				exit(1);
+			}
+			break;
+		case 'c':
+#ifdef HAVE_DEBUG_GST
+			debug_gst_rle = TRUE;
+#endif
+			break;
+		case 'd':
+			camera_v4l2_export_dmabuf = TRUE;
+			break;
+		case 'H':
+#ifdef HAVE_DEBUG_GST
+			debug_gst_enabled = FALSE;
+#endif
+			break;
+		case 'm':
+			metrics = optarg;
+			break;
+		case 't':
+			tracker_blob_threads = atoi(optarg);
+			if (tracker_blob_threads < 1 ||
+			    tracker_blob_threads > 16) {
+				ouvrtd_usage();
+				exit(1);
+			}
+			break;
+		case 'l':
+			tracker_led_cone = atof(optarg);
+			if (tracker_led_cone < 10 || tracker_led_cone > 90) {
+				ouvrtd_usage();
+				exit(1);
+			}
+			break;
+		case 'p':
+			if (thread_policy_parse(optarg) < 0) {
+				ouvrtd_usage();
+				exit(1);
+			}
+			break;
+		case 'r':
+			record = optarg;
+			break;
+		case 'R':
+			replay = optarg;
+			break;
+		case 'w':
+			camera_v4l2_sensor_window = TRUE;
+			break;
 		case 'h':
 		default:
 			ouvrtd_usage();
@@ -404,6 +615,21 @@ int main(int argc, char *argv[])
 		}
 	} while (ret != -1);
 
+#ifdef HAVE_DEBUG_GST
+	/* GStreamer options are not parsed, use the GST_* variables instead */
+	if (debug_gst_enabled)
+		gst_init(NULL, NULL);
+#endif
+
+	if (replay)
+		return replay_run(replay) < 0 ? 1 : 0;
+
+	if (record && recording_start(record) < 0)
+		exit(1);
+
+	ouvrtd_start_pool = g_thread_pool_new(ouvrtd_device_start_func, NULL,
+					      START_THREADS, FALSE, NULL);
+
 	signal(SIGINT, ouvrtd_signal_handler);
 
 	udev = udev_new();
@@ -412,6 +638,8 @@ int main(int argc, char *argv[])
 
 	loop = g_main_loop_new(NULL, TRUE);
 	owner_id = ouvrt_dbus_own_name();
+	if (metrics)
+		metrics_start(metrics);
 
 	ouvrtd_startup(udev);
 	g_main_loop_run(loop);
@@ -8,6 +8,12 @@
 
 #include <glib.h>
 
+#include "device.h"
+#include "tracker.h"
+
 extern GList *device_list;
 
+OuvrtTracker *ouvrtd_device_get_tracker(OuvrtDevice *dev);
+void ouvrtd_device_associate(OuvrtDevice *d);
+
 #endif /* __OUVRTD_H__ */
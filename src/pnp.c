@@ -0,0 +1,776 @@
+/*
+ * Perspective-n-Point pose estimation for LED constellations
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * The constellation has at most MAX_LEDS points, so all working memory is
+ * kept on the stack. With a valid pose from the previous frame, that pose is
+ * refined directly with a few Levenberg-Marquardt steps. Otherwise, or if the
+ * refined pose does not explain enough of the observed blobs, an initial pose
+ * is found by RANSAC over minimal P3P solutions.
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "blobwatch.h"
+#include "leds.h"
+#include "math.h"
+#include "pnp.h"
+#include "undistort.h"
+
+#define RANSAC_ITERATIONS	50
+#define REPROJECTION_ERROR	1.0	/* pixels */
+#define LM_ITERATIONS		10
+/* Maximum reprojection error of a predicted pose to skip RANSAC */
+#define PREDICTION_ERROR	8.0	/* pixels */
+
+struct pnp_point {
+	dvec3 object;
+	/* undistorted, normalized image coordinates */
+	double u;
+	double v;
+};
+
+struct pnp_pose {
+	dmat3 R;
+	dvec3 t;
+};
+
+/*
+ * Transforms an object point into camera coordinates.
+ */
+static inline dvec3 pose_transform(const struct pnp_pose *pose,
+				   const dvec3 *p)
+{
+	return dmat3_transform(&pose->R, &pose->t, p);
+}
+
+static void pose_from_dquat(struct pnp_pose *pose, const dquat *q,
+			    const dvec3 *t)
+{
+	dmat3_from_dquat(&pose->R, q);
+	pose->t = *t;
+}
+
+static void pose_to_dquat(const struct pnp_pose *pose, dquat *q, dvec3 *t)
+{
+	dquat_from_dmat3(q, &pose->R);
+	*t = pose->t;
+}
+
+/*
+ * Applies a small rotation, given as rotation vector w, and a translation dt
+ * to the camera frame: R' = exp([w]x) R, t' = exp([w]x) t + dt.
+ */
+static void pose_update(struct pnp_pose *pose, const double delta[6])
+{
+	double theta = sqrt(delta[0] * delta[0] + delta[1] * delta[1] +
+			    delta[2] * delta[2]);
+	const dvec3 dt = { delta[3], delta[4], delta[5] };
+	double kx, ky, kz, s, c;
+	double *E;
+	dmat3 e;
+
+	E = e.m;
+	if (theta < 1e-12) {
+		E[0] = 1;         E[1] = -delta[2]; E[2] = delta[1];
+		E[3] = delta[2];  E[4] = 1;         E[5] = -delta[0];
+		E[6] = -delta[1]; E[7] = delta[0];  E[8] = 1;
+	} else {
+		kx = delta[0] / theta;
+		ky = delta[1] / theta;
+		kz = delta[2] / theta;
+		s = sin(theta);
+		c = 1 - cos(theta);
+		E[0] = 1 - c * (ky * ky + kz * kz);
+		E[1] = -s * kz + c * kx * ky;
+		E[2] = s * ky + c * kx * kz;
+		E[3] = s * kz + c * kx * ky;
+		E[4] = 1 - c * (kx * kx + kz * kz);
+		E[5] = -s * kx + c * ky * kz;
+		E[6] = -s * ky + c * kx * kz;
+		E[7] = s * kx + c * ky * kz;
+		E[8] = 1 - c * (kx * kx + ky * ky);
+	}
+
+	dmat3_mult(&pose->R, &e, &pose->R);
+	pose->t = dmat3_transform(&e, &dt, &pose->t);
+}
+
+/*
+ * Returns the squared reprojection error of a point in normalized image
+ * coordinates, or HUGE_VAL if the point is behind the camera.
+ */
+static inline double reprojection_error2(const struct pnp_pose *pose,
+					 const struct pnp_point *p)
+{
+	dvec3 c = pose_transform(pose, &p->object);
+	double du, dv;
+
+	if (c.z <= 0)
+		return HUGE_VAL;
+
+	du = c.x / c.z - p->u;
+	dv = c.y / c.z - p->v;
+
+	return du * du + dv * dv;
+}
+
+/*
+ * Returns the number of points with a reprojection error below the
+ * threshold and marks them in the inlier mask.
+ */
+static int count_inliers(const struct pnp_pose *pose,
+			 const struct pnp_point *points, int num_points,
+			 double threshold2, uint64_t *mask, double *error)
+{
+	double err, sum = 0.0;
+	int i, count = 0;
+
+	*mask = 0;
+	for (i = 0; i < num_points; i++) {
+		err = reprojection_error2(pose, &points[i]);
+		if (err < threshold2) {
+			*mask |= 1ULL << i;
+			sum += err;
+			count++;
+		}
+	}
+	if (error)
+		*error = sum;
+
+	return count;
+}
+
+/*
+ * Evaluates the polynomial c[0] + c[1] x + ... + c[degree] x^degree.
+ */
+static inline double poly_eval(const double *c, int degree, double x)
+{
+	double y = c[degree];
+	int i;
+
+	for (i = degree - 1; i >= 0; i--)
+		y = y * x + c[i];
+
+	return y;
+}
+
+/*
+ * Finds the real roots of a polynomial of degree up to four, in ascending
+ * order. The roots of the derivative split the real line into monotonic
+ * intervals, each of which is searched for a sign change by bisection.
+ *
+ * Returns the number of roots found.
+ */
+static int poly_real_roots(const double *c, int degree, double *roots)
+{
+	double d[4] = { 0 }, crit[4], bounds[6];
+	double bound, lo, hi, mid, plo, pmid;
+	int num_crit, num_roots = 0;
+	int i, j;
+
+	while (degree > 0 && fabs(c[degree]) < 1e-14)
+		degree--;
+	if (degree == 0)
+		return 0;
+	if (degree == 1) {
+		roots[0] = -c[0] / c[1];
+		return 1;
+	}
+
+	for (i = 0; i < degree; i++)
+		d[i] = (i + 1) * c[i + 1];
+	num_crit = poly_real_roots(d, degree - 1, crit);
+
+	/* Cauchy bound on the magnitude of all roots */
+	bound = 0.0;
+	for (i = 0; i < degree; i++)
+		bound = fmax(bound, fabs(c[i] / c[degree]));
+	bound += 1.0;
+
+	bounds[0] = -bound;
+	for (i = 0, j = 1; i < num_crit; i++) {
+		if (crit[i] > -bound && crit[i] < bound)
+			bounds[j++] = crit[i];
+	}
+	bounds[j++] = bound;
+
+	for (i = 0; i < j - 1; i++) {
+		lo = bounds[i];
+		hi = bounds[i + 1];
+		plo = poly_eval(c, degree, lo);
+		if ((plo < 0) == (poly_eval(c, degree, hi) < 0))
+			continue;
+		while (hi - lo > 1e-12 * fmax(1.0, fabs(lo))) {
+			mid = 0.5 * (lo + hi);
+			pmid = poly_eval(c, degree, mid);
+			if ((pmid < 0) == (plo < 0)) {
+				lo = mid;
+				plo = pmid;
+			} else {
+				hi = mid;
+			}
+		}
+		roots[num_roots++] = 0.5 * (lo + hi);
+	}
+
+	return num_roots;
+}
+
+/*
+ * Computes the rigid transform that maps three object points onto three
+ * camera frame points, by aligning the orthonormal frames they span.
+ */
+static bool align_triangles(const dvec3 obj[3], const dvec3 cam[3],
+			    struct pnp_pose *pose)
+{
+	dvec3 ow[3], oc[3], d, cw, cc;
+	double *R = pose->R.m;
+	int i, j;
+
+	ow[0] = dvec3_sub(&obj[1], &obj[0]);
+	d = dvec3_sub(&obj[2], &obj[0]);
+	ow[2] = dvec3_cross(&ow[0], &d);
+	oc[0] = dvec3_sub(&cam[1], &cam[0]);
+	d = dvec3_sub(&cam[2], &cam[0]);
+	oc[2] = dvec3_cross(&oc[0], &d);
+	if (!dvec3_normalize(&ow[0]) || !dvec3_normalize(&ow[2]) ||
+	    !dvec3_normalize(&oc[0]) || !dvec3_normalize(&oc[2]))
+		return false;
+	ow[1] = dvec3_cross(&ow[2], &ow[0]);
+	oc[1] = dvec3_cross(&oc[2], &oc[0]);
+
+	/* R = Fc Fw^T, with frame vectors as columns */
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			R[3 * i + j] = (&oc[0].x)[i] * (&ow[0].x)[j] +
+				       (&oc[1].x)[i] * (&ow[1].x)[j] +
+				       (&oc[2].x)[i] * (&ow[2].x)[j];
+		}
+	}
+
+	cw.x = (obj[0].x + obj[1].x + obj[2].x) / 3;
+	cw.y = (obj[0].y + obj[1].y + obj[2].y) / 3;
+	cw.z = (obj[0].z + obj[1].z + obj[2].z) / 3;
+	cc.x = (cam[0].x + cam[1].x + cam[2].x) / 3;
+	cc.y = (cam[0].y + cam[1].y + cam[2].y) / 3;
+	cc.z = (cam[0].z + cam[1].z + cam[2].z) / 3;
+	pose->t.x = cc.x - (R[0] * cw.x + R[1] * cw.y + R[2] * cw.z);
+	pose->t.y = cc.y - (R[3] * cw.x + R[4] * cw.y + R[5] * cw.z);
+	pose->t.z = cc.z - (R[6] * cw.x + R[7] * cw.y + R[8] * cw.z);
+
+	return true;
+}
+
+/*
+ * Solves the perspective-three-point problem following Grunert's method as
+ * described by Haralick et al.: the distances along the viewing rays follow
+ * from the real roots of a quartic polynomial.
+ *
+ * Returns the number of solutions, up to four.
+ */
+static int p3p(const struct pnp_point *p[3], struct pnp_pose poses[4])
+{
+	dvec3 f[3], d, obj[3], cam[3];
+	double a2, b2, c2, ca, cb, cg, p_, q_;
+	double A[5], v_roots[4];
+	double u, v, den, s1, s2, s3;
+	int i, n, num_poses = 0;
+
+	for (i = 0; i < 3; i++) {
+		f[i] = (dvec3){ p[i]->u, p[i]->v, 1.0 };
+		dvec3_normalize(&f[i]);
+		obj[i] = p[i]->object;
+	}
+
+	d = dvec3_sub(&obj[1], &obj[2]);
+	a2 = dvec3_dot(&d, &d);
+	d = dvec3_sub(&obj[0], &obj[2]);
+	b2 = dvec3_dot(&d, &d);
+	d = dvec3_sub(&obj[0], &obj[1]);
+	c2 = dvec3_dot(&d, &d);
+	if (a2 < 1e-12 || b2 < 1e-12 || c2 < 1e-12)
+		return 0;
+
+	ca = dvec3_dot(&f[1], &f[2]);
+	cb = dvec3_dot(&f[0], &f[2]);
+	cg = dvec3_dot(&f[0], &f[1]);
+
+	p_ = (a2 - c2) / b2;
+	q_ = (a2 + c2) / b2;
+
+	A[4] = (p_ - 1) * (p_ - 1) - 4 * c2 / b2 * ca * ca;
+	A[3] = 4 * (p_ * (1 - p_) * cb - (1 - q_) * ca * cg +
+		    2 * c2 / b2 * ca * ca * cb);
+	A[2] = 2 * (p_ * p_ - 1 + 2 * p_ * p_ * cb * cb +
+		    2 * (b2 - c2) / b2 * ca * ca -
+		    4 * q_ * ca * cb * cg +
+		    2 * (b2 - a2) / b2 * cg * cg);
+	A[1] = 4 * (-p_ * (1 + p_) * cb + 2 * a2 / b2 * cg * cg * cb -
+		    (1 - q_) * ca * cg);
+	A[0] = (1 + p_) * (1 + p_) - 4 * a2 / b2 * cg * cg;
+
+	n = poly_real_roots(A, 4, v_roots);
+
+	for (i = 0; i < n; i++) {
+		v = v_roots[i];
+		if (v <= 0)
+			continue;
+		den = 2 * (cg - v * ca);
+		if (fabs(den) < 1e-12)
+			continue;
+		u = ((p_ - 1) * v * v - 2 * p_ * cb * v + 1 + p_) / den;
+		if (u <= 0)
+			continue;
+		den = 1 + v * v - 2 * v * cb;
+		if (den <= 1e-12)
+			continue;
+		s1 = sqrt(b2 / den);
+		s2 = u * s1;
+		s3 = v * s1;
+
+		cam[0] = (dvec3){ s1 * f[0].x, s1 * f[0].y, s1 * f[0].z };
+		cam[1] = (dvec3){ s2 * f[1].x, s2 * f[1].y, s2 * f[1].z };
+		cam[2] = (dvec3){ s3 * f[2].x, s3 * f[2].y, s3 * f[2].z };
+
+		if (align_triangles(obj, cam, &poses[num_poses]))
+			num_poses++;
+	}
+
+	return num_poses;
+}
+
+/*
+ * Solves the symmetric positive definite 6x6 system H x = g in place using
+ * a Cholesky decomposition.
+ */
+static bool cholesky_solve6(double H[6][6], double g[6], double x[6])
+{
+	double sum;
+	int i, j, k;
+
+	for (i = 0; i < 6; i++) {
+		for (j = 0; j <= i; j++) {
+			sum = H[i][j];
+			for (k = 0; k < j; k++)
+				sum -= H[i][k] * H[j][k];
+			if (i == j) {
+				if (sum <= 1e-18)
+					return false;
+				H[i][i] = sqrt(sum);
+			} else {
+				H[i][j] = sum / H[j][j];
+			}
+		}
+	}
+
+	for (i = 0; i < 6; i++) {
+		sum = g[i];
+		for (k = 0; k < i; k++)
+			sum -= H[i][k] * x[k];
+		x[i] = sum / H[i][i];
+	}
+	for (i = 5; i >= 0; i--) {
+		sum = x[i];
+		for (k = i + 1; k < 6; k++)
+			sum -= H[k][i] * x[k];
+		x[i] = sum / H[i][i];
+	}
+
+	return true;
+}
+
+/*
+ * Returns the sum of squared reprojection errors of the masked points.
+ */
+static double pose_error(const struct pnp_pose *pose,
+			 const struct pnp_point *points, int num_points,
+			 uint64_t mask)
+{
+	double sum = 0.0;
+	int i;
+
+	for (i = 0; i < num_points; i++) {
+		if (mask & (1ULL << i))
+			sum += reprojection_error2(pose, &points[i]);
+	}
+
+	return sum;
+}
+
+/*
+ * Minimizes the reprojection error of the masked points with a few
+ * Levenberg-Marquardt iterations, starting from the given pose.
+ */
+static void refine_pose(struct pnp_pose *pose, const struct pnp_point *points,
+			int num_points, uint64_t mask)
+{
+	double H[6][6], g[6], delta[6], J[2][6];
+	double error, new_error, lambda = 1e-3;
+	double iz, x, y, r[2];
+	struct pnp_pose new_pose;
+	dvec3 c;
+	int iter, i, j, k, l;
+
+	error = pose_error(pose, points, num_points, mask);
+
+	for (iter = 0; iter < LM_ITERATIONS; iter++) {
+		memset(H, 0, sizeof(H));
+		memset(g, 0, sizeof(g));
+
+		for (i = 0; i < num_points; i++) {
+			if (!(mask & (1ULL << i)))
+				continue;
+
+			c = pose_transform(pose, &points[i].object);
+			if (c.z <= 0)
+				continue;
+			iz = 1.0 / c.z;
+			x = c.x * iz;
+			y = c.y * iz;
+			r[0] = x - points[i].u;
+			r[1] = y - points[i].v;
+
+			/* d(proj)/dc * dc/d(rotation, translation) */
+			J[0][0] = -x * y;
+			J[0][1] = 1 + x * x;
+			J[0][2] = -y;
+			J[0][3] = iz;
+			J[0][4] = 0;
+			J[0][5] = -x * iz;
+			J[1][0] = -1 - y * y;
+			J[1][1] = x * y;
+			J[1][2] = x;
+			J[1][3] = 0;
+			J[1][4] = iz;
+			J[1][5] = -y * iz;
+
+			for (k = 0; k < 2; k++) {
+				for (j = 0; j < 6; j++) {
+					g[j] -= J[k][j] * r[k];
+					for (l = 0; l <= j; l++)
+						H[j][l] += J[k][j] * J[k][l];
+				}
+			}
+		}
+
+		for (j = 0; j < 6; j++) {
+			for (l = 0; l < j; l++)
+				H[l][j] = H[j][l];
+			H[j][j] *= 1.0 + lambda;
+		}
+
+		if (!cholesky_solve6(H, g, delta))
+			break;
+
+		new_pose = *pose;
+		pose_update(&new_pose, delta);
+		new_error = pose_error(&new_pose, points, num_points, mask);
+		if (new_error < error) {
+			*pose = new_pose;
+			if (error - new_error < 1e-10 * error)
+				break;
+			error = new_error;
+			lambda *= 0.1;
+		} else {
+			lambda *= 10.0;
+		}
+	}
+}
+
+static inline uint32_t xorshift32(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+
+	return x;
+}
+
+/*
+ * Finds an initial pose by repeatedly solving P3P for three random points and
+ * scoring each of the up to four solutions by its number of inliers.
+ *
+ * Returns the number of inliers of the best pose.
+ */
+static int ransac_p3p(const struct pnp_point *points, int num_points,
+		      double threshold2, struct pnp_pose *best,
+		      uint64_t *best_mask)
+{
+	const struct pnp_point *sample[3];
+	struct pnp_pose poses[4];
+	double err, best_err = HUGE_VAL;
+	uint32_t seed = 0x9e3779b9;
+	int idx[3], best_inliers = 0, inliers;
+	int iter, i, j, n;
+	uint64_t mask;
+
+	for (iter = 0; iter < RANSAC_ITERATIONS; iter++) {
+		for (i = 0; i < 3; i++) {
+again:
+			idx[i] = xorshift32(&seed) % num_points;
+			for (j = 0; j < i; j++) {
+				if (idx[j] == idx[i])
+					goto again;
+			}
+			sample[i] = &points[idx[i]];
+		}
+
+		n = p3p(sample, poses);
+
+		for (i = 0; i < n; i++) {
+			inliers = count_inliers(&poses[i], points, num_points,
+						threshold2, &mask, &err);
+			if (inliers > best_inliers ||
+			    (inliers == best_inliers && err < best_err)) {
+				*best = poses[i];
+				*best_mask = mask;
+				best_inliers = inliers;
+				best_err = err;
+			}
+		}
+
+		if (best_inliers == num_points)
+			break;
+	}
+
+	return best_inliers;
+}
+
+/*
+ * Projects the LED positions into the distorted camera image, given the pose
+ * of the constellation. LEDs that are behind the camera, or whose direction
+ * is further than the cone from pointing at the camera, are marked as not
+ * visible. min_cos is the cosine of the cone's half angle, between 0, which
+ * only culls LEDs facing away from the camera, and 1.
+ *
+ * Returns the mask of visible LEDs.
+ */
+uint64_t project_leds(vec3 *positions, vec3 *directions, int num_leds,
+		      dmat3 *camera_matrix, double dist_coeffs[5],
+		      dquat *rot, dvec3 *trans, double min_cos,
+		      struct led_projection *proj)
+{
+	double u[MAX_LEDS], v[MAX_LEDS], z[MAX_LEDS];
+	struct pnp_pose pose;
+	uint64_t visible = 0;
+	dvec3 p, c, n;
+	double facing;
+	int i;
+
+	if (num_leds > MAX_LEDS)
+		num_leds = MAX_LEDS;
+
+	pose_from_dquat(&pose, rot, trans);
+	project_points(positions, num_leds, &pose.R, &pose.t, camera_matrix,
+		       dist_coeffs, u, v, z);
+
+	for (i = 0; i < num_leds; i++) {
+		proj[i].visible = false;
+		if (z[i] <= 0)
+			continue;
+
+		/* Rotate the LED direction into the camera frame */
+		p = dvec3_from_vec3(&positions[i]);
+		c = pose_transform(&pose, &p);
+		p = dvec3_from_vec3(&directions[i]);
+		n = dmat3_mult_dvec3(&pose.R, &p);
+		facing = -dvec3_dot(&n, &c);
+		if (facing <= 0 || facing * facing < min_cos * min_cos *
+						     dvec3_dot(&n, &n) *
+						     dvec3_dot(&c, &c))
+			continue;
+
+		proj[i].x = u[i];
+		proj[i].y = v[i];
+		proj[i].visible = true;
+		visible |= 1ULL << i;
+	}
+
+	return visible;
+}
+
+/*
+ * Estimates the pose from points in normalized image coordinates, either by
+ * refining the pose passed in rot/trans or by RANSAC P3P.
+ *
+ * Returns the number of inliers on success, negative values if no pose could
+ * be found. On failure, rot and trans are left unchanged.
+ */
+static int solve_pose(const struct pnp_point *points, int num_points,
+		      double threshold2, dquat *rot, dvec3 *trans,
+		      bool use_extrinsic_guess)
+{
+	struct pnp_pose pose;
+	double qnorm;
+	uint64_t mask;
+	int inliers = 0;
+
+	if (num_points < 4)
+		return -1;
+
+	qnorm = rot->x * rot->x + rot->y * rot->y + rot->z * rot->z +
+		rot->w * rot->w;
+	if (use_extrinsic_guess && trans->z > 0 && fabs(qnorm - 1.0) < 1e-3) {
+		/*
+		 * Tracking: refine the previous pose on all points, then
+		 * again on the inliers only. Fall back to RANSAC if the
+		 * previous pose does not explain the majority of points.
+		 */
+		pose_from_dquat(&pose, rot, trans);
+		refine_pose(&pose, points, num_points, (1ULL << num_points) - 1);
+		inliers = count_inliers(&pose, points, num_points, threshold2,
+					&mask, NULL);
+		if (inliers < 4 || 2 * inliers <= num_points)
+			inliers = 0;
+	}
+
+	if (!inliers) {
+		inliers = ransac_p3p(points, num_points, threshold2, &pose,
+				     &mask);
+		if (inliers < 4)
+			return -1;
+	}
+
+	refine_pose(&pose, points, num_points, mask);
+	inliers = count_inliers(&pose, points, num_points, threshold2, &mask,
+				NULL);
+
+	pose_to_dquat(&pose, rot, trans);
+
+	return inliers;
+}
+
+/*
+ * Converts the identified blobs to points in normalized image coordinates,
+ * using the undistortion map if given. Only the first blob for each LED ID
+ * is used.
+ *
+ * Returns the number of points.
+ */
+static int blobs_to_points(const struct blob *blobs, int num_blobs,
+			   const vec3 *leds, int num_leds,
+			   const dmat3 *camera_matrix,
+			   const double dist_coeffs[5],
+			   const struct undistort_map *undistort,
+			   struct pnp_point *points)
+{
+	uint64_t taken = 0;
+	int num_points = 0;
+	int i, id;
+
+	for (i = 0; i < num_blobs && num_points < MAX_LEDS; i++) {
+		id = blobs[i].led_id;
+		if (id < 0 || id >= num_leds)
+			continue;
+		if (taken & (1ULL << id))
+			continue;
+		taken |= (1ULL << id);
+
+		points[num_points].object.x = leds[id].x;
+		points[num_points].object.y = leds[id].y;
+		points[num_points].object.z = leds[id].z;
+		if (undistort) {
+			undistort_map_lookup(undistort, blobs[i].cx,
+					     blobs[i].cy,
+					     &points[num_points].u,
+					     &points[num_points].v);
+		} else {
+			undistort_point(camera_matrix, dist_coeffs,
+					blobs[i].cx, blobs[i].cy,
+					&points[num_points].u,
+					&points[num_points].v);
+		}
+		num_points++;
+	}
+
+	return num_points;
+}
+
+/*
+ * Estimates the pose of the LED constellation from identified blobs. If
+ * use_extrinsic_guess is set and rot/trans contain a valid pose, it is used
+ * as starting point for the refinement. Blob centroids are converted to
+ * normalized image coordinates once, using the undistortion map if given,
+ * so that the solver only has to deal with a pinhole model.
+ *
+ * Returns the number of inliers on success, negative values if no pose could
+ * be found. On failure, rot and trans are left unchanged.
+ */
+int estimate_initial_pose(struct blob *blobs, int num_blobs,
+			  vec3 *leds, int num_leds,
+			  dmat3 *camera_matrix, double dist_coeffs[5],
+			  const struct undistort_map *undistort,
+			  dquat *rot, dvec3 *trans, bool use_extrinsic_guess)
+{
+	struct pnp_point points[MAX_LEDS];
+	double threshold2;
+	int num_points;
+
+	num_points = blobs_to_points(blobs, num_blobs, leds, num_leds,
+				     camera_matrix, dist_coeffs, undistort,
+				     points);
+
+	threshold2 = REPROJECTION_ERROR / camera_matrix->m[0];
+	threshold2 *= threshold2;
+
+	return solve_pose(points, num_points, threshold2, rot, trans,
+			  use_extrinsic_guess);
+}
+
+/*
+ * Updates the predicted pose in rot/trans from blobs that were labelled by
+ * projecting the LEDs with that prediction. If the prediction explains the
+ * majority of the blobs within PREDICTION_ERROR pixels, it is refined once
+ * on those inliers only, so the cost per frame does not depend on how far
+ * the labels are off. Unlike estimate_initial_pose, this never falls back
+ * to RANSAC.
+ *
+ * Returns the number of inliers on success, negative values if the
+ * prediction does not match the blobs. On failure, rot and trans are left
+ * unchanged.
+ */
+int estimate_tracked_pose(struct blob *blobs, int num_blobs,
+			  vec3 *leds, int num_leds,
+			  dmat3 *camera_matrix, double dist_coeffs[5],
+			  const struct undistort_map *undistort,
+			  dquat *rot, dvec3 *trans)
+{
+	struct pnp_point points[MAX_LEDS];
+	double gate2, threshold2;
+	struct pnp_pose pose;
+	int num_points, inliers;
+	uint64_t mask;
+
+	num_points = blobs_to_points(blobs, num_blobs, leds, num_leds,
+				     camera_matrix, dist_coeffs, undistort,
+				     points);
+	if (num_points < 4 || trans->z <= 0)
+		return -1;
+
+	gate2 = PREDICTION_ERROR / camera_matrix->m[0];
+	gate2 *= gate2;
+	threshold2 = REPROJECTION_ERROR / camera_matrix->m[0];
+	threshold2 *= threshold2;
+
+	pose_from_dquat(&pose, rot, trans);
+	inliers = count_inliers(&pose, points, num_points, gate2, &mask, NULL);
+	if (inliers < 4 || 2 * inliers <= num_points)
+		return -1;
+
+	refine_pose(&pose, points, num_points, mask);
+	inliers = count_inliers(&pose, points, num_points, threshold2, &mask,
+				NULL);
+	if (inliers < 4)
+		return -1;
+
+	pose_to_dquat(&pose, rot, trans);
+
+	return inliers;
+}
@@ -0,0 +1,38 @@
+/*
+ * Perspective-n-Point pose estimation for LED constellations
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __PNP_H__
+#define __PNP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "math.h"
+
+struct blob;
+struct undistort_map;
+
+struct led_projection {
+	double x;
+	double y;
+	bool visible;
+};
+
+uint64_t project_leds(vec3 *positions, vec3 *directions, int num_leds,
+		      dmat3 *camera_matrix, double dist_coeffs[5],
+		      dquat *rot, dvec3 *trans, double min_cos,
+		      struct led_projection *proj);
+int estimate_initial_pose(struct blob *blobs, int num_blobs,
+			  vec3 *leds, int num_leds,
+			  dmat3 *camera_matrix, double dist_coeffs[5],
+			  const struct undistort_map *undistort,
+			  dquat *rot, dvec3 *trans, bool use_extrinsic_guess);
+int estimate_tracked_pose(struct blob *blobs, int num_blobs,
+			  vec3 *leds, int num_leds,
+			  dmat3 *camera_matrix, double dist_coeffs[5],
+			  const struct undistort_map *undistort,
+			  dquat *rot, dvec3 *trans);
+
+#endif /* __PNP_H__ */
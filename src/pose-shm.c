@@ -0,0 +1,144 @@
+/*
+ * Shared memory pose output
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "imu.h"
+#include "pose-shm.h"
+
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE	0x0010
+#endif
+
+struct pose_shm {
+	int fd;
+	struct ouvrt_pose_shm *map;
+};
+
+/*
+ * Creates a sealed memfd for the pose ring and maps it. Clients that receive
+ * the file descriptor can only map it read-only.
+ *
+ * Returns the newly allocated pose_shm structure, or NULL on error.
+ */
+struct pose_shm *pose_shm_new(void)
+{
+	size_t size = sizeof(struct ouvrt_pose_shm);
+	struct pose_shm *shm;
+	int ret;
+
+	shm = malloc(sizeof(*shm));
+	if (!shm)
+		return NULL;
+
+	shm->fd = memfd_create("ouvrt-pose", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (shm->fd == -1) {
+		printf("pose-shm: memfd_create error: %d\n", errno);
+		goto err_free;
+	}
+
+	ret = ftruncate(shm->fd, size);
+	if (ret < 0) {
+		printf("pose-shm: ftruncate error: %d\n", errno);
+		goto err_close;
+	}
+
+	shm->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			shm->fd, 0);
+	if (shm->map == MAP_FAILED) {
+		printf("pose-shm: mmap error: %d\n", errno);
+		goto err_close;
+	}
+
+	shm->map->magic = OUVRT_POSE_SHM_MAGIC;
+	shm->map->version = OUVRT_POSE_SHM_VERSION;
+	shm->map->size = size;
+	shm->map->num_entries = OUVRT_POSE_SHM_ENTRIES;
+
+	/* Keep our writable mapping, but make the region read-only for all */
+	ret = fcntl(shm->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+		    F_SEAL_FUTURE_WRITE | F_SEAL_SEAL);
+	if (ret < 0)
+		printf("pose-shm: Failed to seal memfd: %d\n", errno);
+
+	return shm;
+
+err_close:
+	close(shm->fd);
+err_free:
+	free(shm);
+	return NULL;
+}
+
+void pose_shm_free(struct pose_shm *shm)
+{
+	if (!shm)
+		return;
+
+	munmap(shm->map, sizeof(*shm->map));
+	close(shm->fd);
+	free(shm);
+}
+
+/*
+ * Returns the memfd file descriptor, to be handed out to clients.
+ */
+int pose_shm_get_fd(struct pose_shm *shm)
+{
+	return shm ? shm->fd : -1;
+}
+
+/*
+ * Appends a new pose estimate to the ring. Must only be called from one
+ * thread at a time.
+ */
+void pose_shm_publish(struct pose_shm *shm, const struct imu_state *state)
+{
+	struct ouvrt_pose_shm *map;
+	struct ouvrt_pose_shm_entry *entry;
+	uint64_t head, seq;
+
+	if (!shm)
+		return;
+
+	map = shm->map;
+	head = map->head;
+	seq = map->seq;
+	entry = &map->entries[head % OUVRT_POSE_SHM_ENTRIES];
+
+	__atomic_store_n(&map->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	entry->timestamp = state->sample.time;
+	entry->rotation[0] = state->pose.rotation.x;
+	entry->rotation[1] = state->pose.rotation.y;
+	entry->rotation[2] = state->pose.rotation.z;
+	entry->rotation[3] = state->pose.rotation.w;
+	entry->translation[0] = state->pose.translation.x;
+	entry->translation[1] = state->pose.translation.y;
+	entry->translation[2] = state->pose.translation.z;
+	entry->linear_velocity[0] = state->linear_velocity.x;
+	entry->linear_velocity[1] = state->linear_velocity.y;
+	entry->linear_velocity[2] = state->linear_velocity.z;
+	entry->angular_velocity[0] = state->angular_velocity.x;
+	entry->angular_velocity[1] = state->angular_velocity.y;
+	entry->angular_velocity[2] = state->angular_velocity.z;
+	entry->linear_acceleration[0] = state->linear_acceleration.x;
+	entry->linear_acceleration[1] = state->linear_acceleration.y;
+	entry->linear_acceleration[2] = state->linear_acceleration.z;
+	entry->angular_acceleration[0] = state->angular_acceleration.x;
+	entry->angular_acceleration[1] = state->angular_acceleration.y;
+	entry->angular_acceleration[2] = state->angular_acceleration.z;
+	__atomic_store_n(&map->head, head + 1, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&map->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,119 @@
+/*
+ * Shared memory pose output
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * This header describes the layout of the shared memory region returned by
+ * Tracker1.Acquire and may be used by clients directly. The daemon publishes
+ * entries with a seqlock: seq is odd while an entry is being written. To read
+ * the latest pose, load seq, retry while it is odd, copy the entry at index
+ * (head - 1) % OUVRT_POSE_SHM_ENTRIES, and accept the copy only if seq is
+ * unchanged afterwards. Readers that must not spin can instead load head,
+ * copy the entry at (head - 1) % OUVRT_POSE_SHM_ENTRIES, and accept the copy
+ * if head has advanced by less than OUVRT_POSE_SHM_ENTRIES - 1 afterwards,
+ * as libouvrt-client does. All values are in native byte order.
+ *
+ * Entries are published at IMU sample rate. To render at the expected photon
+ * time instead, pass the entry to ouvrt_pose_shm_predict.
+ */
+#ifndef __POSE_SHM_H__
+#define __POSE_SHM_H__
+
+#include <math.h>
+#include <stdint.h>
+
+#define OUVRT_POSE_SHM_MAGIC	0x7472766f	/* "ovrt" */
+#define OUVRT_POSE_SHM_VERSION	2
+#define OUVRT_POSE_SHM_ENTRIES	16
+/* Maximum prediction interval in seconds, beyond that the pose is held */
+#define OUVRT_POSE_SHM_MAX_PREDICTION	0.1
+
+struct ouvrt_pose_shm_entry {
+	/* Time of the pose estimate in seconds */
+	double timestamp;
+	/* Orientation quaternion x, y, z, w */
+	double rotation[4];
+	/* Position in meters */
+	double translation[3];
+	/* Linear velocity in m/s */
+	double linear_velocity[3];
+	/* Angular velocity in rad/s */
+	double angular_velocity[3];
+	/* Linear acceleration without gravity in m/s² */
+	double linear_acceleration[3];
+	/* Angular acceleration in rad/s² */
+	double angular_acceleration[3];
+};
+
+struct ouvrt_pose_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t num_entries;
+	uint64_t seq;
+	/* Number of entries written so far */
+	uint64_t head;
+	struct ouvrt_pose_shm_entry entries[OUVRT_POSE_SHM_ENTRIES];
+};
+
+/*
+ * Extrapolates the pose of an entry to the given time in seconds of the
+ * CLOCK_MONOTONIC clock, using its velocities and accelerations, which are
+ * all given in the world frame. This is the same prediction as done by the
+ * Tracker1.PredictPose method.
+ */
+static inline void
+ouvrt_pose_shm_predict(const struct ouvrt_pose_shm_entry *entry, double time,
+		       double rotation[4], double translation[3])
+{
+	const double *q = entry->rotation;
+	double dt = time - entry->timestamp;
+	double e[3], dq[4], angle, s, norm;
+	int i;
+
+	for (i = 0; i < 4; i++)
+		rotation[i] = q[i];
+	for (i = 0; i < 3; i++)
+		translation[i] = entry->translation[i];
+
+	if (dt <= 0.0)
+		return;
+	if (dt > OUVRT_POSE_SHM_MAX_PREDICTION)
+		dt = OUVRT_POSE_SHM_MAX_PREDICTION;
+
+	for (i = 0; i < 3; i++) {
+		e[i] = (entry->angular_velocity[i] +
+			0.5 * entry->angular_acceleration[i] * dt) * dt;
+		translation[i] += (entry->linear_velocity[i] +
+				   0.5 * entry->linear_acceleration[i] * dt) * dt;
+	}
+
+	/* Rotation vector to quaternion x, y, z, w */
+	angle = sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
+	s = angle < 1e-12 ? 0.5 : sin(0.5 * angle) / angle;
+	dq[0] = s * e[0];
+	dq[1] = s * e[1];
+	dq[2] = s * e[2];
+	dq[3] = angle < 1e-12 ? 1.0 : cos(0.5 * angle);
+
+	/* World frame rotation: rotation = dq * q */
+	rotation[0] = dq[3] * q[0] + dq[0] * q[3] + dq[1] * q[2] - dq[2] * q[1];
+	rotation[1] = dq[3] * q[1] - dq[0] * q[2] + dq[1] * q[3] + dq[2] * q[0];
+	rotation[2] = dq[3] * q[2] + dq[0] * q[1] - dq[1] * q[0] + dq[2] * q[3];
+	rotation[3] = dq[3] * q[3] - dq[0] * q[0] - dq[1] * q[1] - dq[2] * q[2];
+
+	norm = sqrt(rotation[0] * rotation[0] + rotation[1] * rotation[1] +
+		    rotation[2] * rotation[2] + rotation[3] * rotation[3]);
+	for (i = 0; i < 4; i++)
+		rotation[i] /= norm;
+}
+
+struct pose_shm;
+struct imu_state;
+
+struct pose_shm *pose_shm_new(void);
+void pose_shm_free(struct pose_shm *shm);
+int pose_shm_get_fd(struct pose_shm *shm);
+void pose_shm_publish(struct pose_shm *shm, const struct imu_state *state);
+
+#endif /* __POSE_SHM_H__ */
@@ -0,0 +1,143 @@
+/*
+ * Session recording reader
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "recording-reader.h"
+
+/*
+ * Maps a recording into memory and checks its header.
+ *
+ * Returns 0 on success, negative values on error.
+ */
+int recording_reader_open(struct recording_reader *reader,
+			  const char *filename)
+{
+	const struct recording_header *header;
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		printf("Replay: Failed to open '%s': %d\n", filename, errno);
+		return -errno;
+	}
+
+	if (fstat(fd, &st) == -1 ||
+	    (size_t)st.st_size < sizeof(struct recording_header)) {
+		printf("Replay: '%s' is not a recording\n", filename);
+		close(fd);
+		return -EINVAL;
+	}
+
+	reader->size = st.st_size;
+	reader->map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (reader->map == MAP_FAILED) {
+		printf("Replay: mmap error: %d\n", errno);
+		return -errno;
+	}
+
+	header = (const struct recording_header *)reader->map;
+	if (memcmp(header->magic, RECORDING_MAGIC, 8) != 0 ||
+	    header->version != RECORDING_VERSION) {
+		printf("Replay: '%s' is not a version %d recording\n",
+		       filename, RECORDING_VERSION);
+		munmap((void *)reader->map, reader->size);
+		return -EINVAL;
+	}
+
+	reader->offset = sizeof(*header);
+
+	return 0;
+}
+
+/*
+ * Returns the next record, whose payload directly follows it, or NULL at
+ * the end of the recording.
+ */
+const struct recording_record *
+recording_reader_next(struct recording_reader *reader)
+{
+	const struct recording_record *record;
+	size_t remaining = reader->size - reader->offset;
+
+	if (remaining < sizeof(*record))
+		return NULL;
+
+	record = (const struct recording_record *)(reader->map +
+						   reader->offset);
+	if (remaining - sizeof(*record) < record->size)
+		return NULL;
+
+	reader->offset += sizeof(*record) + RECORDING_ALIGN(record->size);
+	if (reader->offset > reader->size)
+		reader->offset = reader->size;
+
+	return record;
+}
+
+void recording_reader_close(struct recording_reader *reader)
+{
+	munmap((void *)reader->map, reader->size);
+}
+
+/*
+ * Decompresses a recorded camera frame of the given payload size into out,
+ * which must have room for frame->size bytes.
+ *
+ * Returns 0 on success, or -1 if the frame data is corrupted.
+ */
+int recording_frame_decode(const struct recording_frame *frame, size_t size,
+			   uint8_t *out)
+{
+	const uint8_t *src = frame->data;
+	const uint8_t *end;
+	uint8_t *dst = out;
+	uint8_t *dst_end = out + frame->size;
+	size_t n;
+
+	if (size < sizeof(*frame))
+		return -1;
+	end = src + size - sizeof(*frame);
+
+	if (frame->compression == RECORDING_COMPRESSION_NONE) {
+		if ((size_t)(end - src) != frame->size)
+			return -1;
+		memcpy(out, src, frame->size);
+		return 0;
+	}
+
+	if (frame->compression != RECORDING_COMPRESSION_PACKBITS)
+		return -1;
+
+	while (src < end) {
+		if (*src < 128) {
+			n = *src++ + 1;
+			if (n > (size_t)(end - src) ||
+			    n > (size_t)(dst_end - dst))
+				return -1;
+			memcpy(dst, src, n);
+			src += n;
+		} else if (*src > 128) {
+			n = 257 - *src++;
+			if (src == end || n > (size_t)(dst_end - dst))
+				return -1;
+			memset(dst, *src++, n);
+		} else {
+			src++;
+			continue;
+		}
+		dst += n;
+	}
+
+	return dst == dst_end ? 0 : -1;
+}
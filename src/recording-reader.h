@@ -0,0 +1,89 @@
+/*
+ * Session recording format and reader
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * A recording is a file header followed by a sequence of records, which are
+ * only ever appended. Each record consists of a struct recording_record and
+ * its payload, padded to a multiple of 8 bytes so that records stay aligned
+ * when the file is mapped into memory. A truncated last record, for example
+ * after a crash, is ignored. All values are in native byte order.
+ *
+ * The reader does not depend on GLib, so that the tools can use it.
+ */
+#ifndef __RECORDING_READER_H__
+#define __RECORDING_READER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RECORDING_MAGIC		"OUVRTREC"
+#define RECORDING_VERSION	1
+
+/* Records and their payloads are padded to multiples of 8 bytes */
+#define RECORDING_ALIGN(x)	(((x) + 7) & ~(size_t)7)
+
+struct recording_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+enum recording_type {
+	/* Payload: GType name, device name, and serial, zero terminated */
+	RECORDING_DEVICE = 1,
+	/* Payload: zero terminated calibration kind, then calibration data */
+	RECORDING_CALIBRATION = 2,
+	/* Payload: HID report as read from hidraw */
+	RECORDING_HID_REPORT = 3,
+	/* Payload: struct recording_frame, sequence is the V4L2 sequence */
+	RECORDING_FRAME = 4,
+};
+
+struct recording_record {
+	uint16_t type;
+	/* Index of the device, in order of their RECORDING_DEVICE records */
+	uint16_t device;
+	/* Payload size in bytes, without padding */
+	uint32_t size;
+	uint32_t sequence;
+	uint32_t reserved;
+	/* CLOCK_MONOTONIC time in seconds */
+	double time;
+};
+
+enum recording_compression {
+	RECORDING_COMPRESSION_NONE = 0,
+	/* PackBits run-length encoding, camera frames are mostly black */
+	RECORDING_COMPRESSION_PACKBITS = 1,
+};
+
+struct recording_frame {
+	uint16_t width;
+	uint16_t height;
+	uint16_t pixel_stride;
+	uint16_t compression;
+	/* Uncompressed frame size in bytes */
+	uint32_t size;
+	uint32_t reserved;
+	uint8_t data[];
+};
+
+/*
+ * A recording mapped into memory for reading.
+ */
+struct recording_reader {
+	const uint8_t *map;
+	size_t size;
+	size_t offset;
+};
+
+int recording_reader_open(struct recording_reader *reader,
+			  const char *filename);
+const struct recording_record *
+recording_reader_next(struct recording_reader *reader);
+void recording_reader_close(struct recording_reader *reader);
+int recording_frame_decode(const struct recording_frame *frame, size_t size,
+			   uint8_t *out);
+
+#endif /* __RECORDING_READER_H__ */
@@ -0,0 +1,248 @@
+/*
+ * Session recording
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib-object.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "recording.h"
+
+/* Protects the recording file and the device table */
+static GMutex recording_lock;
+static int recording_fd = -1;
+/* Maps devices to their index + 1 */
+static GHashTable *recording_devices;
+static unsigned int recording_num_devices;
+
+/*
+ * Opens the recording file, overwriting any previous recording.
+ *
+ * Returns 0 on success, negative values on error.
+ */
+int recording_start(const char *filename)
+{
+	struct recording_header header = {
+		.magic = RECORDING_MAGIC,
+		.version = RECORDING_VERSION,
+	};
+	int fd;
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+		  0644);
+	if (fd == -1) {
+		g_print("Recording: Failed to open '%s': %d\n", filename,
+			errno);
+		return -errno;
+	}
+
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+		g_print("Recording: Write error: %d\n", errno);
+		close(fd);
+		return -EIO;
+	}
+
+	g_mutex_lock(&recording_lock);
+	recording_fd = fd;
+	recording_devices = g_hash_table_new(g_direct_hash, g_direct_equal);
+	recording_num_devices = 0;
+	g_mutex_unlock(&recording_lock);
+
+	g_print("Recording session to '%s'\n", filename);
+
+	return 0;
+}
+
+/*
+ * Closes the recording file.
+ */
+void recording_stop(void)
+{
+	g_mutex_lock(&recording_lock);
+	if (recording_fd != -1) {
+		close(recording_fd);
+		recording_fd = -1;
+		g_hash_table_destroy(recording_devices);
+		recording_devices = NULL;
+	}
+	g_mutex_unlock(&recording_lock);
+}
+
+/*
+ * Appends a record with a payload made of two parts. Must be called with the
+ * recording lock held.
+ */
+static void recording_append(uint16_t type, unsigned int device,
+			     uint32_t sequence, double time,
+			     const void *data1, size_t size1,
+			     const void *data2, size_t size2)
+{
+	static const uint8_t padding[8];
+	struct recording_record record = {
+		.type = type,
+		.device = device,
+		.size = size1 + size2,
+		.sequence = sequence,
+		.time = time,
+	};
+	struct iovec iov[4] = {
+		{ .iov_base = &record, .iov_len = sizeof(record) },
+		{ .iov_base = (void *)data1, .iov_len = size1 },
+		{ .iov_base = (void *)data2, .iov_len = size2 },
+		{ .iov_base = (void *)padding,
+		  .iov_len = RECORDING_ALIGN(record.size) - record.size },
+	};
+	size_t total = sizeof(record) + RECORDING_ALIGN(record.size);
+
+	/* With O_APPEND, every record is written in one piece */
+	if (writev(recording_fd, iov, 4) != (ssize_t)total) {
+		g_print("Recording: Write error: %d, stopping\n", errno);
+		close(recording_fd);
+		recording_fd = -1;
+	}
+}
+
+/*
+ * Returns the index of the device in the recording, writing a device record
+ * the first time the device is seen. Must be called with the recording lock
+ * held.
+ */
+static unsigned int recording_device_index(OuvrtDevice *dev)
+{
+	unsigned int index;
+	GString *payload;
+
+	index = GPOINTER_TO_UINT(g_hash_table_lookup(recording_devices, dev));
+	if (index)
+		return index - 1;
+
+	index = recording_num_devices++;
+	g_hash_table_insert(recording_devices, dev, GUINT_TO_POINTER(index + 1));
+
+	payload = g_string_new(G_OBJECT_TYPE_NAME(dev));
+	g_string_append_c(payload, '\0');
+	g_string_append(payload, dev->name ? dev->name : "");
+	g_string_append_c(payload, '\0');
+	g_string_append(payload, dev->serial ? dev->serial : "");
+	g_string_append_c(payload, '\0');
+	recording_append(RECORDING_DEVICE, index, 0, 0, payload->str,
+			 payload->len, NULL, 0);
+	g_string_free(payload, TRUE);
+
+	return index;
+}
+
+/*
+ * Records the calibration data of the given kind that a device obtained from
+ * the calibration cache or from the hardware.
+ */
+void recording_write_calibration(OuvrtDevice *dev, const char *kind,
+				 const void *data, size_t size)
+{
+	g_mutex_lock(&recording_lock);
+	if (recording_fd != -1) {
+		recording_append(RECORDING_CALIBRATION,
+				 recording_device_index(dev), 0, 0,
+				 kind, strlen(kind) + 1, data, size);
+	}
+	g_mutex_unlock(&recording_lock);
+}
+
+/*
+ * Records a HID report received at the given time.
+ */
+void recording_write_hid_report(OuvrtDevice *dev, const unsigned char *buf,
+				size_t len, double time)
+{
+	if (recording_fd == -1)
+		return;
+
+	g_mutex_lock(&recording_lock);
+	if (recording_fd != -1) {
+		recording_append(RECORDING_HID_REPORT,
+				 recording_device_index(dev), 0, time,
+				 buf, len, NULL, 0);
+	}
+	g_mutex_unlock(&recording_lock);
+}
+
+/*
+ * Compresses size bytes from src into dst with PackBits run-length encoding.
+ * dst must have room for size + (size + 127) / 128 bytes.
+ *
+ * Returns the compressed size.
+ */
+static size_t packbits_encode(const uint8_t *src, size_t size, uint8_t *dst)
+{
+	const uint8_t *end = src + size;
+	uint8_t *out = dst;
+	const uint8_t *literal;
+	size_t run;
+
+	while (src < end) {
+		for (run = 1; src + run < end && run < 128 &&
+			      src[run] == src[0]; run++)
+			;
+		if (run >= 3) {
+			*out++ = 257 - run;
+			*out++ = src[0];
+			src += run;
+			continue;
+		}
+
+		/* Collect literals until the next run of three */
+		literal = src;
+		while (src < end && src - literal < 128) {
+			if (src + 2 < end && src[0] == src[1] &&
+			    src[0] == src[2])
+				break;
+			src++;
+		}
+		*out++ = src - literal - 1;
+		memcpy(out, literal, src - literal);
+		out += src - literal;
+	}
+
+	return out - dst;
+}
+
+/*
+ * Records a camera frame, compressed with PackBits.
+ */
+void recording_write_frame(OuvrtDevice *dev, const uint8_t *frame,
+			   int width, int height, int pixel_stride,
+			   uint32_t sequence, double time)
+{
+	struct recording_frame header = {
+		.width = width,
+		.height = height,
+		.pixel_stride = pixel_stride,
+		.compression = RECORDING_COMPRESSION_PACKBITS,
+		.size = width * height * pixel_stride,
+	};
+	uint8_t *data;
+	size_t size;
+
+	if (recording_fd == -1)
+		return;
+
+	/* Compress outside of the lock */
+	data = g_malloc(header.size + (header.size + 127) / 128);
+	size = packbits_encode(frame, header.size, data);
+
+	g_mutex_lock(&recording_lock);
+	if (recording_fd != -1) {
+		recording_append(RECORDING_FRAME, recording_device_index(dev),
+				 sequence, time, &header, sizeof(header),
+				 data, size);
+	}
+	g_mutex_unlock(&recording_lock);
+
+	g_free(data);
+}
@@ -0,0 +1,26 @@
+/*
+ * Session recording
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __RECORDING_H__
+#define __RECORDING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "device.h"
+#include "recording-reader.h"
+
+int recording_start(const char *filename);
+void recording_stop(void);
+
+void recording_write_calibration(OuvrtDevice *dev, const char *kind,
+				 const void *data, size_t size);
+void recording_write_hid_report(OuvrtDevice *dev, const unsigned char *buf,
+				size_t len, double time);
+void recording_write_frame(OuvrtDevice *dev, const uint8_t *frame,
+			   int width, int height, int pixel_stride,
+			   uint32_t sequence, double time);
+
+#endif /* __RECORDING_H__ */
@@ -0,0 +1,321 @@
+/*
+ * Deterministic replay of recorded sessions
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ *
+ * Feeds the HID reports and camera frames of a recording through the device
+ * report handlers and the tracker in recorded order, with the recorded
+ * timestamps, as fast as possible. No hardware is accessed, calibration data
+ * is taken from the recording. This allows to reproduce tracking problems
+ * and to compare the tracker output before and after a change.
+ */
+#include <glib.h>
+#include <glib-object.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blobwatch.h"
+#include "camera.h"
+#include "camera-dk2.h"
+#include "imu.h"
+#include "ouvrtd.h"
+#include "recording.h"
+#include "replay.h"
+#include "rift-dk2.h"
+#include "tracker.h"
+#include "vive-controller.h"
+#include "vive-headset-imu.h"
+#include "vive-headset-lighthouse.h"
+#include "vive-headset-mainboard.h"
+
+static struct recording_reader replay_reader;
+static bool replay_running;
+/* Replayed devices by recorded index, NULL for unknown types */
+static GPtrArray *replay_devices;
+
+/*
+ * Returns true while a recording is being replayed.
+ */
+bool replay_active(void)
+{
+	return replay_running;
+}
+
+/*
+ * Copies size bytes of calibration data of the given kind that was recorded
+ * for the device.
+ *
+ * Returns 0 on success, or -1 if there is no such calibration record.
+ */
+int replay_get_calibration(OuvrtDevice *dev, const char *kind, void *data,
+			   size_t size)
+{
+	struct recording_reader reader = replay_reader;
+	const struct recording_record *record;
+	const char *payload;
+	size_t len = strlen(kind) + 1;
+	unsigned int index;
+
+	for (index = 0; index < replay_devices->len; index++) {
+		if (g_ptr_array_index(replay_devices, index) == dev)
+			break;
+	}
+	if (index == replay_devices->len)
+		return -1;
+
+	reader.offset = sizeof(struct recording_header);
+	while ((record = recording_reader_next(&reader))) {
+		payload = (const char *)(record + 1);
+		if (record->type == RECORDING_CALIBRATION &&
+		    record->device == index && record->size == len + size &&
+		    memcmp(payload, kind, len) == 0) {
+			memcpy(data, payload + len, size);
+			return 0;
+		}
+	}
+
+	g_print("Replay: No %s calibration recorded for %s\n", kind,
+		dev->name);
+
+	return -1;
+}
+
+/*
+ * Creates a device of the recorded type without opening any hardware.
+ */
+static void replay_add_device(const struct recording_record *record)
+{
+	const char *type_name = (const char *)(record + 1);
+	const char *name, *serial;
+	const char *end = type_name + record->size;
+	OuvrtDeviceClass *klass;
+	OuvrtDevice *dev = NULL;
+	GType type;
+
+	name = memchr(type_name, '\0', record->size);
+	serial = name ? memchr(name + 1, '\0', end - name - 1) : NULL;
+	if (!serial || !memchr(serial + 1, '\0', end - serial - 1)) {
+		g_print("Replay: Invalid device record\n");
+		g_ptr_array_add(replay_devices, NULL);
+		return;
+	}
+	name++;
+	serial++;
+
+	type = g_type_from_name(type_name);
+	if (type && g_type_is_a(type, OUVRT_TYPE_DEVICE))
+		dev = g_object_new(type, NULL);
+	g_ptr_array_add(replay_devices, dev);
+	if (!dev) {
+		g_print("Replay: Skipping unknown device type %s\n", type_name);
+		return;
+	}
+
+	dev->name = strdup(name);
+	if (serial[0])
+		dev->serial = strdup(serial);
+	g_print("Replay: Found %s: %s\n", dev->name, serial);
+
+	ouvrtd_device_associate(dev);
+	device_list = g_list_append(device_list, dev);
+
+	klass = OUVRT_DEVICE_GET_CLASS(dev);
+	if (klass->replay_start && klass->replay_start(dev) < 0)
+		g_print("%s: Failed to prepare replay\n", dev->name);
+}
+
+/*
+ * Returns the replayed device with the given recorded index, or NULL.
+ */
+static OuvrtDevice *replay_get_device(unsigned int index)
+{
+	if (index >= replay_devices->len)
+		return NULL;
+
+	return g_ptr_array_index(replay_devices, index);
+}
+
+/*
+ * Runs blob detection and pose estimation on a recorded camera frame, the
+ * same way the V4L2 capture thread does.
+ *
+ * Returns 0 on success, or -1 if the frame data is corrupted or does not
+ * match the camera's format.
+ */
+static int replay_frame(OuvrtCamera *camera,
+			const struct recording_record *record,
+			uint8_t **buf, size_t *buf_size)
+{
+	const struct recording_frame *frame = (const void *)(record + 1);
+	struct blobservation *ob = NULL;
+	dquat rot;
+	dvec3 trans;
+	int skipped;
+
+	if (record->size < sizeof(*frame))
+		return -1;
+
+	/*
+	 * The frame has to match the camera's configured format and fit into
+	 * the decoded data, as blob detection reads width * height pixels.
+	 */
+	if (frame->width != camera->width || frame->height != camera->height ||
+	    frame->pixel_stride == 0 ||
+	    (size_t)frame->width * frame->height * frame->pixel_stride >
+	    frame->size)
+		return -1;
+
+	if (*buf_size < frame->size) {
+		g_free(*buf);
+		*buf = g_malloc(frame->size);
+		*buf_size = frame->size;
+	}
+	if (recording_frame_decode(frame, record->size, *buf) < 0)
+		return -1;
+
+	skipped = record->sequence - camera->sequence - 1;
+	if (skipped < 0)
+		skipped = 0;
+	camera->sequence = record->sequence;
+
+	if (!camera->tracker)
+		return 0;
+
+	ouvrt_tracker_process_frame(camera->tracker, camera->tracker_camera,
+				    *buf, frame->width, frame->height,
+				    frame->pixel_stride, record->sequence,
+				    record->time, skipped, &ob);
+	if (ob) {
+		ouvrt_tracker_process_blobs(camera->tracker,
+					    camera->tracker_camera, ob->blobs,
+					    ob->num_blobs,
+					    &camera->camera_matrix,
+					    camera->dist_coeffs,
+					    camera->undistort, &rot, &trans);
+	}
+
+	return 0;
+}
+
+/*
+ * Prints the final fused pose of each replayed tracker, for comparison
+ * between runs.
+ */
+static void replay_print_poses(void)
+{
+	struct imu_state state;
+	OuvrtTracker *tracker;
+	OuvrtDevice *dev;
+	unsigned int i;
+
+	for (i = 0; i < replay_devices->len; i++) {
+		dev = g_ptr_array_index(replay_devices, i);
+		if (!dev)
+			continue;
+
+		tracker = ouvrtd_device_get_tracker(dev);
+		if (!tracker)
+			continue;
+
+		ouvrt_tracker_get_state(tracker, &state);
+		g_print("%s: Final pose rotation [%f %f %f %f] translation [%f %f %f]\n",
+			dev->name, state.pose.rotation.x,
+			state.pose.rotation.y, state.pose.rotation.z,
+			state.pose.rotation.w, state.pose.translation.x,
+			state.pose.translation.y, state.pose.translation.z);
+	}
+}
+
+/*
+ * Replays a recorded session and frees the replayed devices afterwards.
+ *
+ * Returns 0 on success, negative values on error.
+ */
+int replay_run(const char *filename)
+{
+	const struct recording_record *record;
+	unsigned int num_reports = 0, num_frames = 0, num_errors = 0;
+	double first_time = 0.0, last_time = 0.0;
+	struct timespec start, end;
+	OuvrtDeviceClass *klass;
+	OuvrtDevice *dev;
+	uint8_t *frame = NULL;
+	size_t frame_size = 0;
+	double elapsed;
+	int ret;
+
+	ret = recording_reader_open(&replay_reader, filename);
+	if (ret < 0)
+		return ret;
+
+	/* Register all device types so that they can be found by name */
+	g_type_ensure(OUVRT_TYPE_RIFT_DK2);
+	g_type_ensure(OUVRT_TYPE_CAMERA_DK2);
+	g_type_ensure(OUVRT_TYPE_VIVE_HEADSET_IMU);
+	g_type_ensure(OUVRT_TYPE_VIVE_HEADSET_LIGHTHOUSE);
+	g_type_ensure(OUVRT_TYPE_VIVE_HEADSET_MAINBOARD);
+	g_type_ensure(OUVRT_TYPE_VIVE_CONTROLLER);
+
+	replay_devices = g_ptr_array_new();
+	replay_running = true;
+	g_print("Replaying session from '%s'\n", filename);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while ((record = recording_reader_next(&replay_reader))) {
+		if (record->type == RECORDING_DEVICE) {
+			replay_add_device(record);
+			continue;
+		}
+
+		if (record->type != RECORDING_HID_REPORT &&
+		    record->type != RECORDING_FRAME)
+			continue;
+
+		if (first_time == 0.0)
+			first_time = record->time;
+		last_time = record->time;
+
+		dev = replay_get_device(record->device);
+		if (!dev)
+			continue;
+
+		if (record->type == RECORDING_HID_REPORT) {
+			klass = OUVRT_DEVICE_GET_CLASS(dev);
+			if (klass->hid_report) {
+				klass->hid_report(dev,
+						  (const unsigned char *)(record + 1),
+						  record->size, record->time);
+				num_reports++;
+			}
+		} else if (OUVRT_IS_CAMERA(dev)) {
+			if (replay_frame(OUVRT_CAMERA(dev), record, &frame,
+					 &frame_size) < 0)
+				num_errors++;
+			else
+				num_frames++;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_nsec - start.tv_nsec) * 1e-9;
+
+	g_print("Replay: %u reports, %u frames, %u corrupted frames\n",
+		num_reports, num_frames, num_errors);
+	g_print("Replay: %.3f s of session replayed in %.3f s\n",
+		last_time - first_time, elapsed);
+	replay_print_poses();
+
+	g_free(frame);
+	g_list_free_full(device_list, g_object_unref);
+	device_list = NULL;
+	g_ptr_array_free(replay_devices, TRUE);
+	replay_devices = NULL;
+	replay_running = false;
+	recording_reader_close(&replay_reader);
+
+	return 0;
+}
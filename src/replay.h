@@ -0,0 +1,19 @@
+/*
+ * Deterministic replay of recorded sessions
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ */
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "device.h"
+
+int replay_run(const char *filename);
+bool replay_active(void);
+int replay_get_calibration(OuvrtDevice *dev, const char *kind, void *data,
+			   size_t size);
+
+#endif /* __REPLAY_H__ */
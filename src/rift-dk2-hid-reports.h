@@ -124,8 +124,7 @@ struct rift_dk2_sensor_message {
 	__u8 frame_id;				/* frame id pixel readback */
 	__u8 led_pattern_phase;
 	__le16 exposure_count;
-	__le16 exposure_timestamp;
-	__le16 reserved;
+	__le32 exposure_timestamp;		/* µs, same clock as timestamp */
 } __attribute__((packed));
 
 #endif /* __RIFT_DK2_HID_REPORTS__ */
@@ -5,7 +5,6 @@
  */
 #include <asm/byteorder.h>
 #include <errno.h>
-#include <poll.h>
 #include <pthread.h>
 #include <string.h>
 #include <stdint.h>
@@ -17,21 +16,26 @@
 #include "rift-dk2.h"
 #include "rift-dk2-hid-reports.h"
 #include "debug.h"
+#include "calibration-cache.h"
+#include "calibration-data.h"
+#include "clock-sync.h"
 #include "device.h"
 #include "hidraw.h"
 #include "imu.h"
+#include "latency.h"
 #include "math.h"
 #include "leds.h"
 #include "tracker.h"
 
-/* temporary global */
-gboolean rift_dk2_flicker = false;
-
 struct _OuvrtRiftDK2Private {
 	int report_rate;
 	int report_interval;
 	gboolean flicker;
 	uint32_t last_sample_timestamp;
+	struct clock_sync clock;
+	GThread *calibration_validation;
+	/* Deviation of the sensor report interval from the configured rate */
+	struct latency_stage report_jitter;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(OuvrtRiftDK2, ouvrt_rift_dk2, OUVRT_TYPE_DEVICE)
@@ -112,7 +116,8 @@ static int rift_dk2_set_report_rate(OuvrtRiftDK2 *rift, int report_rate)
  * left  |/
  *    x--+
  */
-static int rift_dk2_get_positions(OuvrtRiftDK2 *rift)
+static int rift_dk2_get_positions(OuvrtRiftDK2 *rift,
+				  struct rift_dk2_calibration *cal)
 {
 	struct rift_dk2_position_report report = {
 		.id = RIFT_DK2_POSITION_REPORT_ID,
@@ -146,15 +151,15 @@ static int rift_dk2_get_positions(OuvrtRiftDK2 *rift)
 		pos.z = 1e-6f * (int32_t)__le32_to_cpu(report.pos[2]);
 
 		if (type == 0) {
-			rift->leds.positions[index] = pos;
+			cal->leds.positions[index] = pos;
 
 			/* Direction, magnitude in unknown units */
 			dir.x = 1e-6f * (int16_t)__le16_to_cpu(report.dir[0]);
 			dir.y = 1e-6f * (int16_t)__le16_to_cpu(report.dir[1]);
 			dir.z = 1e-6f * (int16_t)__le16_to_cpu(report.dir[2]);
-			rift->leds.directions[index] = dir;
+			cal->leds.directions[index] = dir;
 		} else if (type == 1) {
-			rift->imu.position = pos;
+			cal->imu.position = pos;
 		}
 
 		/* Break out before reading the first report again */
@@ -166,7 +171,7 @@ static int rift_dk2_get_positions(OuvrtRiftDK2 *rift)
 			return ret;
 	}
 
-	rift->leds.num = num - 1;
+	cal->leds.num = num - 1;
 
 	return 0;
 }
@@ -174,7 +179,8 @@ static int rift_dk2_get_positions(OuvrtRiftDK2 *rift)
 /*
  * Obtains the blinking patterns of the 40 IR LEDs from the Rift DK2.
  */
-static int rift_dk2_get_led_patterns(OuvrtRiftDK2 *rift)
+static int rift_dk2_get_led_patterns(OuvrtRiftDK2 *rift,
+				     struct rift_dk2_calibration *cal)
 {
 	struct rift_dk2_led_pattern_report report = {
 		.id = RIFT_DK2_LED_PATTERN_REPORT_ID,
@@ -231,7 +237,7 @@ static int rift_dk2_get_led_patterns(OuvrtRiftDK2 *rift)
 		pattern |= pattern >> 8;
 		pattern = (pattern >> 1) & 0x3ff;
 
-		rift->leds.patterns[index] = pattern;
+		cal->leds.patterns[index] = pattern;
 
 		/* Break out before reading the first report again */
 		if (i + 1 == num)
@@ -328,15 +334,21 @@ static int rift_dk2_send_display(OuvrtRiftDK2 *rift, bool low_persistence,
 /*
  * Unpacks three big-endian signed 21-bit values packed into 8 bytes
  * and stores them in a floating point vector after multiplying by 10⁻⁴.
+ * The packed values are loaded with a single, possibly unaligned, 64-bit
+ * load and byte swap, and sign extended by arithmetic shifts, without any
+ * branches.
  */
-static void unpack_3x21bit(__be64 *buf, vec3 *v)
+static void unpack_3x21bit(const void *buf, vec3 *v)
 {
-	uint32_t xy = __be32_to_cpup((__be32 *)buf);
-	uint32_t yz = __be32_to_cpup((__be32 *)(buf + 4));
+	__be64 raw;
+	uint64_t xyz;
+
+	memcpy(&raw, buf, sizeof(raw));
+	xyz = __be64_to_cpu(raw);
 
-	v->x = 0.0001f * ((int32_t)xy >> 11);
-	v->y = 0.0001f * ((int32_t)((xy << 21) | (yz >> 11)) >> 11);
-	v->z = 0.0001f * ((int32_t)(yz << 10) >> 11);
+	v->x = 0.0001f * ((int64_t)xyz >> 43);
+	v->y = 0.0001f * ((int64_t)(xyz << 21) >> 43);
+	v->z = 0.0001f * ((int64_t)(xyz << 42) >> 43);
 }
 
 /*
@@ -357,7 +369,7 @@ static void unpack_3x21bit(__be64 *buf, vec3 *v)
  */
 static void rift_dk2_decode_sensor_message(OuvrtRiftDK2 *rift,
 					   const unsigned char *buf,
-					   size_t len)
+					   size_t len, double host_time)
 {
 	struct rift_dk2_sensor_message *message = (void *)buf;
 	uint8_t num_samples;
@@ -372,7 +384,8 @@ static void rift_dk2_decode_sensor_message(OuvrtRiftDK2 *rift,
 	uint16_t exposure_count;
 	uint32_t exposure_timestamp;
 
-	struct imu_state state;
+	struct imu_sample sample;
+	double sample_time;
 	int32_t dt;
 	int i;
 
@@ -383,13 +396,20 @@ static void rift_dk2_decode_sensor_message(OuvrtRiftDK2 *rift,
 	sample_count = __le16_to_cpu(message->sample_count);
 	/* 10⁻²°C */
 	temperature = __le16_to_cpu(message->temperature);
-	state.sample.temperature = 0.01f * temperature;
+	sample.temperature = 0.01f * temperature;
 
 	sample_timestamp = __le32_to_cpu(message->timestamp);
 	/* µs, wraps every ~72 min */
-	state.sample.time = 1e-6 * sample_timestamp;
+	sample_time = clock_sync_update(&rift->priv->clock, sample_timestamp,
+					host_time);
 
 	dt = sample_timestamp - rift->priv->last_sample_timestamp;
+	if (rift->priv->last_sample_timestamp) {
+		int jitter = abs(dt - rift->priv->report_interval);
+
+		latency_histogram_add(&rift->priv->report_jitter.hist,
+				      1000ULL * jitter);
+	}
 	rift->priv->last_sample_timestamp = sample_timestamp;
 	if ((dt < rift->priv->report_interval - 1) ||
 	    (dt > rift->priv->report_interval + 1) ||
@@ -401,9 +421,9 @@ static void rift_dk2_decode_sensor_message(OuvrtRiftDK2 *rift,
 	mag[0] = __le16_to_cpu(message->mag[0]);
 	mag[1] = __le16_to_cpu(message->mag[1]);
 	mag[2] = __le16_to_cpu(message->mag[2]);
-	state.sample.magnetic_field.x = 0.0001f * mag[0];
-	state.sample.magnetic_field.y = 0.0001f * mag[1];
-	state.sample.magnetic_field.z = 0.0001f * mag[2];
+	sample.magnetic_field.x = 0.0001f * mag[0];
+	sample.magnetic_field.y = 0.0001f * mag[1];
+	sample.magnetic_field.z = 0.0001f * mag[2];
 
 	frame_count = __le16_to_cpu(message->frame_count);
 	frame_timestamp = __le32_to_cpu(message->frame_timestamp);
@@ -416,23 +436,79 @@ static void rift_dk2_decode_sensor_message(OuvrtRiftDK2 *rift,
 	for (i = 0; i < num_samples; i++) {
 		/* 10⁻⁴ m/s² */
 		unpack_3x21bit(&message->sample[i].accel,
-			       &state.sample.acceleration);
+			       &sample.acceleration);
 		/* 10⁻⁴ rad/s */
 		unpack_3x21bit(&message->sample[i].gyro,
-			       &state.sample.angular_velocity);
+			       &sample.angular_velocity);
+		/* Samples are 1 ms apart */
+		sample.time = sample_time + 1e-3 * i;
+
+		ouvrt_tracker_push_imu_sample(rift->tracker, &sample);
+	}
 
-		debug_imu_fifo_in(&state, 1);
+	/* Only report exposures if the LEDs are blinking in sync */
+	if (rift->priv->flicker) {
+		ouvrt_tracker_add_exposure(rift->tracker, exposure_count,
+				clock_sync_convert(&rift->priv->clock,
+						   exposure_timestamp),
+				led_pattern_phase, host_time);
 	}
 
-	(void)exposure_timestamp;
-	(void)exposure_count;
-	(void)led_pattern_phase;
 	(void)frame_id;
 	(void)frame_timestamp;
 	(void)frame_count;
 	(void)sample_count;
 }
 
+/*
+ * Reads the factory calibrated LED and IMU positions and the LED blinking
+ * patterns.
+ */
+static int rift_dk2_read_calibration(OuvrtDevice *dev, void *data)
+{
+	OuvrtRiftDK2 *rift = OUVRT_RIFT_DK2(dev);
+	struct rift_dk2_calibration *cal = data;
+	int ret;
+
+	ret = rift_dk2_get_positions(rift, cal);
+	if (ret < 0) {
+		g_print("Rift DK2: Error reading factory calibrated positions\n");
+		return ret;
+	}
+
+	ret = rift_dk2_get_led_patterns(rift, cal);
+	if (ret < 0) {
+		g_print("Rift DK2: Error reading IR LED blinking patterns\n");
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Obtains the LED model and IMU position from the calibration cache or from
+ * the device.
+ */
+static int rift_dk2_get_calibration(OuvrtRiftDK2 *rift)
+{
+	struct rift_dk2_calibration cal;
+	int ret;
+
+	ret = calibration_cache_get(&rift->dev, "rift-dk2", rift->dev.version,
+				    &cal, sizeof(cal),
+				    rift_dk2_read_calibration,
+				    &rift->priv->calibration_validation);
+	if (ret < 0)
+		return ret;
+
+	rift->leds = cal.leds;
+	rift->imu = cal.imu;
+	if (rift->leds.num != 40)
+		g_print("Rift DK2: Reported %d IR LEDs\n", rift->leds.num);
+
+	return 0;
+}
+
 /*
  * Enables the IR tracking LEDs and registers them with the tracker.
  */
@@ -452,19 +528,9 @@ static int rift_dk2_start(OuvrtDevice *dev)
 		rift->dev.fd = fd;
 	}
 
-	ret = rift_dk2_get_positions(rift);
-	if (ret < 0) {
-		g_print("Rift DK2: Error reading factory calibrated positions\n");
-		return ret;
-	}
-
-	ret = rift_dk2_get_led_patterns(rift);
-	if (ret < 0) {
-		g_print("Rift DK2: Error reading IR LED blinking patterns\n");
+	ret = rift_dk2_get_calibration(rift);
+	if (ret < 0)
 		return ret;
-	}
-	if (rift->leds.num != 40)
-		g_print("Rift DK2: Reported %d IR LEDs\n", rift->leds.num);
 
 	ret = rift_dk2_get_config(rift);
 	if (ret < 0)
@@ -484,56 +550,63 @@ static int rift_dk2_start(OuvrtDevice *dev)
 
 	ouvrt_tracker_register_leds(rift->tracker, &rift->leds);
 
+	g_print("Rift DK2: Sending keepalive\n");
+	rift_dk2_send_keepalive(rift);
+
 	return 0;
 }
 
 /*
- * Keeps the Rift active.
+ * Registers the recorded LED model with the tracker.
  */
-static void rift_dk2_thread(OuvrtDevice *dev)
+static int rift_dk2_replay_start(OuvrtDevice *dev)
 {
 	OuvrtRiftDK2 *rift = OUVRT_RIFT_DK2(dev);
-	unsigned char buf[64];
-	struct pollfd fds;
-	int count;
 	int ret;
 
-	g_print("Rift DK2: Sending keepalive\n");
-	rift_dk2_send_keepalive(rift);
-	count = 0;
-
-	while (dev->active) {
-		fds.fd = dev->fd;
-		fds.events = POLLIN;
-		fds.revents = 0;
-
-		ret = poll(&fds, 1, 1000);
-		if (ret == -1 || ret == 0 ||
-		    count > 9 * rift->priv->report_rate) {
-			if (ret == -1 || ret == 0)
-				g_print("Rift DK2: Resending keepalive\n");
-			rift_dk2_send_keepalive(rift);
-			count = 0;
-			continue;
-		}
+	ret = rift_dk2_get_calibration(rift);
+	if (ret < 0)
+		return ret;
 
-		if (fds.events & (POLLERR | POLLHUP | POLLNVAL))
-			break;
+	ouvrt_tracker_register_leds(rift->tracker, &rift->leds);
 
-		ret = read(dev->fd, buf, sizeof(buf));
-		if (ret == -1) {
-			g_print("%s: Read error: %d\n", dev->name, errno);
-			continue;
-		}
-		if (ret < 64) {
-			g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-				dev->name, ret, buf[0]);
-			continue;
-		}
+	return 0;
+}
 
-		rift_dk2_decode_sensor_message(rift, buf, sizeof(buf));
-		count++;
+/*
+ * Handles sensor reports.
+ */
+static void rift_dk2_hid_report(OuvrtDevice *dev, const unsigned char *buf,
+				size_t len, double time)
+{
+	OuvrtRiftDK2 *rift = OUVRT_RIFT_DK2(dev);
+
+	if (len < 64) {
+		g_print("%s: Error, invalid %zu-byte report 0x%02x\n",
+			dev->name, len, buf[0]);
+		return;
 	}
+
+	rift_dk2_decode_sensor_message(rift, buf, len, time);
+}
+
+/*
+ * Resends the keepalive if the Rift stopped sending reports.
+ */
+static void rift_dk2_hid_timeout(OuvrtDevice *dev)
+{
+	OuvrtRiftDK2 *rift = OUVRT_RIFT_DK2(dev);
+
+	g_print("Rift DK2: Resending keepalive\n");
+	rift_dk2_send_keepalive(rift);
+}
+
+/*
+ * Keeps the Rift active, called by the HID thread's keepalive timer.
+ */
+static void rift_dk2_hid_keepalive(OuvrtDevice *dev)
+{
+	rift_dk2_send_keepalive(OUVRT_RIFT_DK2(dev));
 }
 
 /*
@@ -548,6 +621,8 @@ static void rift_dk2_stop(OuvrtDevice *dev)
 	};
 	int fd = rift->dev.fd;
 
+	calibration_cache_join(&rift->priv->calibration_validation);
+
 	ouvrt_tracker_unregister_leds(rift->tracker, &rift->leds);
 	g_object_unref(rift->tracker);
 	rift->tracker = NULL;
@@ -566,6 +641,7 @@ static void ouvrt_rift_dk2_finalize(GObject *object)
 {
 	OuvrtRiftDK2 *rift = OUVRT_RIFT_DK2(object);
 
+	calibration_cache_join(&rift->priv->calibration_validation);
 	g_object_unref(rift->tracker);
 	G_OBJECT_CLASS(ouvrt_rift_dk2_parent_class)->finalize(object);
 }
@@ -574,16 +650,31 @@ static void ouvrt_rift_dk2_class_init(OuvrtRiftDK2Class *klass)
 {
 	G_OBJECT_CLASS(klass)->finalize = ouvrt_rift_dk2_finalize;
 	OUVRT_DEVICE_CLASS(klass)->start = rift_dk2_start;
-	OUVRT_DEVICE_CLASS(klass)->thread = rift_dk2_thread;
 	OUVRT_DEVICE_CLASS(klass)->stop = rift_dk2_stop;
+	OUVRT_DEVICE_CLASS(klass)->hid_report = rift_dk2_hid_report;
+	OUVRT_DEVICE_CLASS(klass)->hid_timeout = rift_dk2_hid_timeout;
+	OUVRT_DEVICE_CLASS(klass)->hid_keepalive = rift_dk2_hid_keepalive;
+	/* Renew the keepalive a second before it times out */
+	OUVRT_DEVICE_CLASS(klass)->hid_keepalive_interval =
+		RIFT_DK2_KEEPALIVE_TIMEOUT_MS / 1000.0 - 1.0;
+	OUVRT_DEVICE_CLASS(klass)->replay_start = rift_dk2_replay_start;
 }
 
 static void ouvrt_rift_dk2_init(OuvrtRiftDK2 *self)
 {
 	self->dev.type = DEVICE_TYPE_HMD;
+	self->tracker = ouvrt_tracker_new();
 	self->priv = ouvrt_rift_dk2_get_instance_private(self);
 	self->priv->flicker = false;
 	self->priv->last_sample_timestamp = 0;
+	self->priv->calibration_validation = NULL;
+	memset(&self->priv->report_jitter, 0,
+	       sizeof(self->priv->report_jitter));
+	self->priv->report_jitter.name = "report-jitter";
+	self->dev.latency = &self->priv->report_jitter;
+	self->dev.num_latency = 1;
+	/* Sample timestamps count µs */
+	clock_sync_init(&self->priv->clock, 32, 1000000);
 }
 
 /*
@@ -601,7 +692,6 @@ OuvrtDevice *rift_dk2_new(const char *devnode)
 		return NULL;
 
 	rift->dev.devnode = g_strdup(devnode);
-	rift->tracker = ouvrt_tracker_new();
 
 	return &rift->dev;
 }
@@ -612,7 +702,7 @@ void ouvrt_rift_dk2_set_flicker(OuvrtRiftDK2 *rift, gboolean flicker)
 		return;
 
 	rift->priv->flicker = flicker;
-	rift_dk2_flicker = flicker;
+	ouvrt_tracker_set_flicker(rift->tracker, flicker);
 
 	if (rift->dev.active)
 		rift_dk2_send_tracking(rift, flicker);
@@ -9,6 +9,7 @@
 #include <glib.h>
 #include <glib-object.h>
 
+#include "calibration-data.h"
 #include "device.h"
 #include "leds.h"
 #include "math.h"
@@ -30,10 +31,6 @@
 
 #define MAX_POSITIONS	(MAX_LEDS + 1)
 
-struct imu {
-	vec3 position;
-};
-
 typedef struct _OuvrtRiftDK2		OuvrtRiftDK2;
 typedef struct _OuvrtRiftDK2Class	OuvrtRiftDK2Class;
 typedef struct _OuvrtRiftDK2Private	OuvrtRiftDK2Private;
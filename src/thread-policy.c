@@ -0,0 +1,165 @@
+/*
+ * Scheduling policy and CPU affinity of worker threads
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * Worker threads have a role: "hid-io" for the shared HID thread, "device"
+ * for the thread of a device that reads its own reports or frames, and
+ * "tracking" for the frame processing thread of a camera. Policies are given
+ * for a role, or for a role of a single device as "DEVICE/ROLE", which
+ * takes precedence. Each thread applies its policy to itself when it
+ * starts. Threads it creates, such as the blob detection workers, inherit
+ * the scheduling policy and affinity.
+ */
+#define _GNU_SOURCE
+#include <glib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread-policy.h"
+
+#define MAX_POLICIES	16
+
+struct thread_policy {
+	char *key;
+	/* SCHED_FIFO priority, or 0 to keep SCHED_OTHER */
+	int priority;
+	gboolean has_cpus;
+	cpu_set_t cpus;
+};
+
+static struct thread_policy policies[MAX_POLICIES];
+static int num_policies;
+
+/*
+ * Parses a CPU list such as "2" or "0,2-3" into the CPU set.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int thread_policy_parse_cpus(const char *list, cpu_set_t *cpus)
+{
+	const char *p = list;
+	char *end;
+	long first, last;
+
+	CPU_ZERO(cpus);
+	do {
+		first = strtol(p, &end, 10);
+		if (end == p || first < 0)
+			return -1;
+		last = first;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first)
+				return -1;
+		}
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; first++)
+			CPU_SET(first, cpus);
+		p = end + 1;
+	} while (*end == ',');
+
+	return *end == '\0' ? 0 : -1;
+}
+
+/*
+ * Adds a policy given as "[DEVICE/]ROLE:PRIORITY[:CPUS]". A priority of 1 to
+ * 99 selects SCHED_FIFO, 0 keeps the default scheduling policy. CPUS is an
+ * optional list of CPUs the thread is pinned to. Must be called before any
+ * worker threads are started.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int thread_policy_parse(const char *spec)
+{
+	struct thread_policy *policy;
+	const char *colon;
+	char *end;
+
+	colon = strchr(spec, ':');
+	if (!colon || colon == spec || num_policies == MAX_POLICIES)
+		return -1;
+
+	policy = &policies[num_policies];
+	policy->priority = strtol(colon + 1, &end, 10);
+	if (end == colon + 1 || policy->priority < 0 ||
+	    policy->priority > 99)
+		return -1;
+
+	policy->has_cpus = FALSE;
+	if (*end == ':') {
+		if (thread_policy_parse_cpus(end + 1, &policy->cpus) < 0)
+			return -1;
+		policy->has_cpus = TRUE;
+	} else if (*end != '\0') {
+		return -1;
+	}
+
+	policy->key = g_strndup(spec, colon - spec);
+	num_policies++;
+
+	return 0;
+}
+
+static struct thread_policy *thread_policy_find(const char *device,
+						const char *role)
+{
+	struct thread_policy *fallback = NULL;
+	size_t len = device ? strlen(device) : 0;
+	int i;
+
+	for (i = 0; i < num_policies; i++) {
+		const char *key = policies[i].key;
+
+		if (strcmp(key, role) == 0)
+			fallback = &policies[i];
+		else if (device && strncmp(key, device, len) == 0 &&
+			 key[len] == '/' && strcmp(key + len + 1, role) == 0)
+			return &policies[i];
+	}
+
+	return fallback;
+}
+
+/*
+ * Names the calling thread after its role and applies the matching policy
+ * to it, if there is one. device is the name of the device the thread
+ * belongs to, or NULL for shared threads.
+ */
+void thread_policy_apply(const char *device, const char *role)
+{
+	struct thread_policy *policy;
+	struct sched_param param;
+	int ret;
+
+	pthread_setname_np(pthread_self(), role);
+
+	policy = thread_policy_find(device, role);
+	if (!policy)
+		return;
+
+	if (policy->priority) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = policy->priority;
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (ret) {
+			g_print("%s: Failed to set SCHED_FIFO priority %d: %s\n",
+				device ? device : role, policy->priority,
+				strerror(ret));
+		}
+	}
+
+	if (policy->has_cpus) {
+		ret = pthread_setaffinity_np(pthread_self(),
+					     sizeof(policy->cpus),
+					     &policy->cpus);
+		if (ret) {
+			g_print("%s: Failed to set %s thread affinity: %s\n",
+				device ? device : role, role, strerror(ret));
+		}
+	}
+}
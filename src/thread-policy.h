@@ -0,0 +1,12 @@
+/*
+ * Scheduling policy and CPU affinity of worker threads
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __THREAD_POLICY_H__
+#define __THREAD_POLICY_H__
+
+int thread_policy_parse(const char *spec);
+void thread_policy_apply(const char *device, const char *role);
+
+#endif /* __THREAD_POLICY_H__ */
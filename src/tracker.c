@@ -3,23 +3,157 @@
  * Copyright 2015 Philipp Zabel
  * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
  */
+#include <limits.h>
+#include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "blobwatch.h"
 #include "debug.h"
+#include "exposure.h"
+#include "flicker.h"
+#include "fusion.h"
+#include "imu.h"
+#include "imu-ring.h"
+#include "latency.h"
 #include "leds.h"
 #include "math.h"
-#include "opencv.h"
+#include "pnp.h"
+#include "pose-shm.h"
 #include "tracker.h"
 
-struct _OuvrtTrackerPrivate {
+/* Scan the whole frame for new blobs twice per second at 60 Hz */
+#define FULL_SCAN_INTERVAL	30
+
+/* Keep tracks of blobs that were occluded for up to two frames */
+#define TRACK_HISTORY		2
+
+/* Maximum distance between a blob and its projected LED in pixels */
+#define LABEL_GATE		8
+
+/* Number of consistent pose pairs averaged into the camera extrinsics */
+#define EXTRINSICS_SAMPLES	30
+
+/* Maximum age of another camera's pose to be used as reference in s */
+#define POSE_MAX_AGE		0.05
+
+/*
+ * Rows above and below the projected LEDs that are kept in the readout
+ * window, once the objects have been tracked for WINDOW_STABLE_FRAMES
+ */
+#define WINDOW_MARGIN		48
+#define WINDOW_STABLE_FRAMES	30
+
+/* Maximum deviation of a sample from the running extrinsics mean in m */
+#define EXTRINSICS_GATE		0.05
+
+/* Exposure counter steps up to this are trusted as elapsed LED phases */
+#define MAX_EXPOSURE_ELAPSED	60
+
+/* Frame intervals longer than this are gaps in the stream, in s */
+#define MAX_FRAME_PERIOD	0.1
+
+/*
+ * Pose tracking state of an object in a camera. While lost, blobs are
+ * identified by their flicker IDs and the pose is searched for with RANSAC.
+ * While tracking, blobs are labelled by projecting the LEDs with the
+ * predicted pose, which is then only refined. A failed refinement falls
+ * back to RANSAC for the same frame.
+ */
+enum tracker_state {
+	TRACKER_STATE_LOST,
+	TRACKER_STATE_TRACKING,
+};
+
+/*
+ * Per-camera tracking state. Each camera thread only touches its own entry,
+ * except for the exposure timing and extrinsics, which are protected by the
+ * tracker lock.
+ */
+struct tracker_camera {
+	bool active;
 	struct blobwatch *bw;
+	struct exposure_timing exposure_timing;
+	/* Exposure time of the current frame in the IMU clock, or -1 */
+	double exposure_time;
+	/* Exposure counter of the last frame mapped to a reported exposure */
+	bool has_exposure_count;
+	uint16_t exposure_count;
+	/* Timestamp of the last frame and time between frames, in s */
+	double last_frame_time;
+	double frame_period;
+	/* LED pattern phases elapsed up to the current frame */
+	uint32_t led_phases;
+	/* Pose of the tracked object in the camera frame, if tracking */
+	enum tracker_state state;
+	struct dpose pose;
+	/* LEDs facing the camera with the predicted pose, if tracking */
+	uint64_t visible;
+	/*
+	 * Flicker detector with the LED patterns and blinking phase of an
+	 * object other than the tracker's own, and the camera's led_phases
+	 * when it was last used
+	 */
+	struct flicker *fl;
+	uint32_t fl_phases;
+	/* Pose of the camera in the world frame */
+	bool calibrated;
+	struct dpose extrinsics;
+	/* Running sums of consistent extrinsics samples during calibration */
+	int num_samples;
+	dvec3 sum_translation;
+	dquat sum_rotation;
+	/* Rows expected to contain all tracked LEDs in the next frame */
+	int height;
+	int stable_frames;
+	int window_y0;
+	int window_y1;
+	/* Scratch space for blob association, never shrunk */
+	struct blob *subset;
+	int8_t *owner;
+	int *index;
+	bool *taken;
+	int max_blobs;
+};
+
+struct _OuvrtTrackerPrivate {
 	struct leds *leds;
+	/* Whether the LEDs blink their patterns, set from the device thread */
+	gint flicker;
+	struct tracker_camera cameras[TRACKER_MAX_CAMERAS];
+	/*
+	 * Objects tracked by this tracker's cameras. The first one is the
+	 * tracker itself, the others are trackers of further devices that
+	 * have no cameras of their own.
+	 */
+	OuvrtTracker *objects[TRACKER_MAX_OBJECTS];
+	int num_objects;
+	/*
+	 * Protects fusion, exposure timing, extrinsics, and the object list,
+	 * which are updated from IMU and camera threads
+	 */
+	GMutex lock;
+	struct fusion fusion;
+	/* Exposure time and source camera of the last fused camera pose */
+	double pose_time;
+	int pose_camera;
+	struct imu_ring imu_ring;
+	struct pose_shm *pose_shm;
+	struct latency_stage latency[TRACKER_NUM_LATENCY];
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(OuvrtTracker, ouvrt_tracker, G_TYPE_OBJECT)
 
+/* Number of blob detection threads per camera, can be changed with --threads */
+int tracker_blob_threads = 1;
+
+/*
+ * Half angle in degrees of the cone around each LED's direction in which the
+ * LED is expected to be seen, can be changed with --led-cone
+ */
+double tracker_led_cone = 75.0;
+
 void ouvrt_tracker_register_leds(OuvrtTracker *tracker, struct leds *leds)
 {
 	if (!tracker || tracker->priv->leds)
@@ -36,42 +170,973 @@ void ouvrt_tracker_unregister_leds(OuvrtTracker *tracker, struct leds *leds)
 	tracker->priv->leds = NULL;
 }
 
-void ouvrt_tracker_process_frame(OuvrtTracker *tracker, uint8_t *frame,
-				 int width, int height, int skipped,
+/*
+ * Enables or disables LED identification by blinking pattern for the blob
+ * trackers of all cameras, starting with their next frame.
+ */
+void ouvrt_tracker_set_flicker(OuvrtTracker *tracker, gboolean flicker)
+{
+	if (!tracker)
+		return;
+
+	g_atomic_int_set(&tracker->priv->flicker, flicker);
+}
+
+/*
+ * Adds the tracker of another device as an object to be tracked with this
+ * tracker's cameras. Its LED model and sensor fusion are used, its poses
+ * are expressed in this tracker's world frame.
+ *
+ * Returns 0 on success, or -1 if there are already TRACKER_MAX_OBJECTS
+ * objects.
+ */
+int ouvrt_tracker_add_object(OuvrtTracker *tracker, OuvrtTracker *object)
+{
+	OuvrtTrackerPrivate *priv = tracker->priv;
+	int ret = -1;
+	int i;
+
+	if (object == tracker || object->priv->num_objects > 1)
+		return -1;
+
+	g_mutex_lock(&priv->lock);
+	for (i = 1; i < priv->num_objects; i++) {
+		if (priv->objects[i] == object)
+			break;
+	}
+	if (i < priv->num_objects) {
+		ret = 0;
+	} else if (priv->num_objects < TRACKER_MAX_OBJECTS) {
+		priv->objects[priv->num_objects++] = g_object_ref(object);
+		ret = 0;
+	}
+	g_mutex_unlock(&priv->lock);
+
+	return ret;
+}
+
+/*
+ * Stops tracking the given object with this tracker's cameras.
+ */
+void ouvrt_tracker_remove_object(OuvrtTracker *tracker, OuvrtTracker *object)
+{
+	OuvrtTrackerPrivate *priv;
+	int i;
+
+	if (!tracker || !object)
+		return;
+
+	priv = tracker->priv;
+
+	g_mutex_lock(&priv->lock);
+	for (i = 1; i < priv->num_objects; i++) {
+		if (priv->objects[i] != object)
+			continue;
+		memmove(&priv->objects[i], &priv->objects[i + 1],
+			(priv->num_objects - i - 1) * sizeof(priv->objects[0]));
+		priv->num_objects--;
+		g_mutex_unlock(&priv->lock);
+		g_object_unref(object);
+		return;
+	}
+	g_mutex_unlock(&priv->lock);
+}
+
+/*
+ * Composes two rigid transformations, r = a * b.
+ */
+static void dpose_mult(struct dpose *r, const struct dpose *a,
+		       const struct dpose *b)
+{
+	dvec3 t;
+
+	dquat_rotate(&t, &a->rotation, &b->translation);
+	r->translation.x = t.x + a->translation.x;
+	r->translation.y = t.y + a->translation.y;
+	r->translation.z = t.z + a->translation.z;
+	dquat_mult(&r->rotation, &a->rotation, &b->rotation);
+}
+
+/*
+ * Inverts a rigid transformation.
+ */
+static void dpose_invert(struct dpose *r, const struct dpose *a)
+{
+	dquat q = { -a->rotation.x, -a->rotation.y, -a->rotation.z,
+		    a->rotation.w };
+	dvec3 t;
+
+	dquat_rotate(&t, &q, &a->translation);
+	r->rotation = q;
+	r->translation.x = -t.x;
+	r->translation.y = -t.y;
+	r->translation.z = -t.z;
+}
+
+/*
+ * Adds a camera to the tracker and returns its index, or -1 if there are
+ * already TRACKER_MAX_CAMERAS cameras. The first camera defines the world
+ * frame, the extrinsics of all further cameras are calibrated automatically
+ * while the tracked object is seen by an already calibrated camera.
+ */
+int ouvrt_tracker_add_camera(OuvrtTracker *tracker)
+{
+	OuvrtTrackerPrivate *priv = tracker->priv;
+	struct tracker_camera *cam;
+	bool reference = true;
+	int i, index = -1;
+
+	g_mutex_lock(&priv->lock);
+	for (i = 0; i < TRACKER_MAX_CAMERAS; i++) {
+		if (priv->cameras[i].active && priv->cameras[i].calibrated)
+			reference = false;
+		else if (!priv->cameras[i].active && index < 0)
+			index = i;
+	}
+	if (index >= 0) {
+		cam = &priv->cameras[index];
+		memset(cam, 0, sizeof(*cam));
+		cam->active = true;
+		cam->exposure_time = -1;
+		exposure_timing_init(&cam->exposure_timing);
+		cam->extrinsics.rotation.w = 1.0;
+		cam->calibrated = reference;
+	}
+	g_mutex_unlock(&priv->lock);
+
+	if (index < 0)
+		g_print("Tracker: too many cameras\n");
+
+	return index;
+}
+
+/*
+ * Removes a camera from the tracker. Its index can be reused by a camera
+ * added later.
+ */
+void ouvrt_tracker_remove_camera(OuvrtTracker *tracker, int camera)
+{
+	OuvrtTrackerPrivate *priv;
+	struct tracker_camera *cam;
+	struct blobwatch *bw;
+
+	if (!tracker || camera < 0 || camera >= TRACKER_MAX_CAMERAS)
+		return;
+
+	priv = tracker->priv;
+	cam = &priv->cameras[camera];
+
+	g_mutex_lock(&priv->lock);
+	bw = cam->bw;
+	cam->bw = NULL;
+	cam->active = false;
+	if (priv->pose_camera == camera)
+		priv->pose_camera = -1;
+	g_mutex_unlock(&priv->lock);
+
+	blobwatch_free(bw);
+	flicker_free(cam->fl);
+	cam->fl = NULL;
+	g_free(cam->subset);
+	g_free(cam->owner);
+	g_free(cam->index);
+	g_free(cam->taken);
+	cam->subset = NULL;
+	cam->owner = NULL;
+	cam->index = NULL;
+	cam->taken = NULL;
+	cam->max_blobs = 0;
+}
+
+/*
+ * Records an exposure reported by the tracked device: the exposure counter,
+ * the exposure time in the host monotonic clock, and the LED pattern phase.
+ * host_time is the time the report was received. This is called from the
+ * device thread. All cameras are synchronized to the same exposures, but
+ * each camera maps them to its own frame sequence numbers.
+ */
+void ouvrt_tracker_add_exposure(OuvrtTracker *tracker, uint16_t count,
+				double device_time, int led_phase,
+				double host_time)
+{
+	OuvrtTrackerPrivate *priv;
+	int i;
+
+	if (!tracker)
+		return;
+
+	priv = tracker->priv;
+
+	g_mutex_lock(&priv->lock);
+	for (i = 0; i < TRACKER_MAX_CAMERAS; i++) {
+		if (!priv->cameras[i].active)
+			continue;
+		exposure_timing_push(&priv->cameras[i].exposure_timing, count,
+				     device_time, led_phase, host_time);
+	}
+	g_mutex_unlock(&priv->lock);
+}
+
+/*
+ * Detects blobs in the frame of the given camera with the given V4L2
+ * sequence number and monotonic timestamp. If the frame can be mapped to a
+ * reported exposure, its LED pattern phase is passed to the flicker
+ * detector, and its exposure time is used to align the pose with the IMU
+ * samples. The exposure counter then also tells how many LED pattern phases
+ * passed since the last frame, otherwise the number of skipped frames given
+ * by the camera is used. Each camera has its own blob tracker, so frames of
+ * different cameras can be processed in parallel.
+ */
+void ouvrt_tracker_process_frame(OuvrtTracker *tracker, int camera,
+				 uint8_t *frame, int width, int height,
+				 int pixel_stride, uint32_t sequence,
+				 double timestamp, int skipped,
 				 struct blobservation **ob)
 {
 	OuvrtTrackerPrivate *priv = tracker->priv;
+	struct tracker_camera *cam;
+	struct exposure exposure;
+	uint64_t start, duration;
+	uint16_t elapsed;
+	bool found;
+
+	*ob = NULL;
+	if (camera < 0 || camera >= TRACKER_MAX_CAMERAS)
+		return;
+	cam = &priv->cameras[camera];
+
+	if (cam->bw == NULL) {
+		cam->bw = blobwatch_new(width, height);
+		if (cam->bw == NULL)
+			return;
+		cam->height = height;
+		cam->window_y0 = 0;
+		cam->window_y1 = height;
+		blobwatch_set_roi(cam->bw, true, FULL_SCAN_INTERVAL);
+		blobwatch_set_track_history(cam->bw, TRACK_HISTORY);
+		blobwatch_set_auto_threshold(cam->bw, true);
+		if (blobwatch_set_threads(cam->bw, tracker_blob_threads) < 0) {
+			g_print("Tracker: failed to start detection threads\n");
+			blobwatch_set_threads(cam->bw, 1);
+		}
+	}
+
+	g_mutex_lock(&priv->lock);
+	found = exposure_timing_lookup(&cam->exposure_timing, sequence,
+				       timestamp, &exposure);
+	g_mutex_unlock(&priv->lock);
+
+	cam->exposure_time = found ? exposure.device_time : -1;
+	blobwatch_set_flicker(cam->bw, g_atomic_int_get(&priv->flicker));
+	blobwatch_set_led_phase(cam->bw, found ? exposure.led_phase : -1);
+	if (found) {
+		elapsed = (uint16_t)(exposure.count - cam->exposure_count);
+		if (cam->has_exposure_count && elapsed >= 1 &&
+		    elapsed <= MAX_EXPOSURE_ELAPSED)
+			skipped = elapsed - 1;
+		cam->exposure_count = exposure.count;
+	}
+	cam->has_exposure_count = found;
+
+	if (cam->last_frame_time > 0 && timestamp > cam->last_frame_time &&
+	    timestamp - cam->last_frame_time < MAX_FRAME_PERIOD * (skipped + 1))
+		cam->frame_period = (timestamp - cam->last_frame_time) /
+				    (skipped + 1);
+	cam->last_frame_time = timestamp;
+	cam->led_phases += skipped + 1;
+
+	start = latency_now_ns();
+	blobwatch_process(cam->bw, frame, width, height, pixel_stride,
+			  skipped, priv->leds, ob);
+	duration = latency_now_ns() - start;
 
-	if (priv->bw == NULL)
-		priv->bw = blobwatch_new(width, height);
+	/* Flicker detection runs as part of blob processing */
+	if (*ob) {
+		duration -= (*ob)->flicker_ns;
+		if ((*ob)->flicker_ns) {
+			latency_histogram_add(&priv->latency[TRACKER_LATENCY_FLICKER].hist,
+					      (*ob)->flicker_ns);
+		}
+	}
+	latency_histogram_add(&priv->latency[TRACKER_LATENCY_DETECT].hist,
+			      duration);
+}
+
+/*
+ * Assigns LED IDs to blobs by matching them to the nearest LED projected with
+ * the last known pose. Pairs are assigned greedily in order of increasing
+ * distance, so every LED is assigned to at most one blob. Blobs without a
+ * projected LED nearby keep the ID from the flicker detector, unless that ID
+ * was taken by another blob. blob_taken is scratch space for num_blobs
+ * flags.
+ */
+static void label_blobs(struct blob *blobs, int num_blobs,
+			struct led_projection *proj, int num_leds,
+			bool *blob_taken)
+{
+	uint64_t led_taken = 0;
+	int best_blob, best_led;
+	double dx, dy, dist2, best_dist2;
+	int i, j;
+
+	memset(blob_taken, 0, num_blobs * sizeof(bool));
+
+	for (;;) {
+		best_dist2 = LABEL_GATE * LABEL_GATE;
+		best_blob = -1;
+		best_led = -1;
 
-	blobwatch_process(priv->bw, frame, width, height, skipped,
-			  priv->leds, ob);
+		for (i = 0; i < num_blobs; i++) {
+			if (blob_taken[i])
+				continue;
+			for (j = 0; j < num_leds; j++) {
+				if (!proj[j].visible ||
+				    (led_taken & (1ULL << j)))
+					continue;
+				dx = blobs[i].cx - proj[j].x;
+				dy = blobs[i].cy - proj[j].y;
+				dist2 = dx * dx + dy * dy;
+				if (dist2 < best_dist2) {
+					best_dist2 = dist2;
+					best_blob = i;
+					best_led = j;
+				}
+			}
+		}
+		if (best_blob < 0)
+			break;
+
+		blobs[best_blob].led_id = best_led;
+		blob_taken[best_blob] = true;
+		led_taken |= 1ULL << best_led;
+	}
+
+	for (i = 0; i < num_blobs; i++) {
+		if (!blob_taken[i] && blobs[i].led_id >= 0 &&
+		    (led_taken & (1ULL << blobs[i].led_id)))
+			blobs[i].led_id = -1;
+	}
 }
 
-void ouvrt_tracker_process_blobs(OuvrtTracker *tracker,
+/*
+ * Accumulates an estimate of the camera's pose in the world frame from the
+ * object pose in the camera frame and the fused object pose in the world
+ * frame. Samples that deviate too far from the running mean restart the
+ * calibration. Called with the tracker lock held.
+ */
+static void tracker_camera_calibrate(struct tracker_camera *cam, int index,
+				     const struct dpose *world_pose)
+{
+	struct dpose inverse, sample;
+	double n, dx, dy, dz;
+
+	dpose_invert(&inverse, &cam->pose);
+	dpose_mult(&sample, world_pose, &inverse);
+
+	if (cam->num_samples) {
+		n = cam->num_samples;
+		dx = sample.translation.x - cam->sum_translation.x / n;
+		dy = sample.translation.y - cam->sum_translation.y / n;
+		dz = sample.translation.z - cam->sum_translation.z / n;
+		if (dx * dx + dy * dy + dz * dz >
+		    EXTRINSICS_GATE * EXTRINSICS_GATE)
+			cam->num_samples = 0;
+	}
+	if (cam->num_samples == 0) {
+		memset(&cam->sum_translation, 0, sizeof(cam->sum_translation));
+		memset(&cam->sum_rotation, 0, sizeof(cam->sum_rotation));
+	}
+
+	/* Keep all quaternions in the same hemisphere before averaging */
+	if (cam->num_samples &&
+	    sample.rotation.x * cam->sum_rotation.x +
+	    sample.rotation.y * cam->sum_rotation.y +
+	    sample.rotation.z * cam->sum_rotation.z +
+	    sample.rotation.w * cam->sum_rotation.w < 0) {
+		sample.rotation.x = -sample.rotation.x;
+		sample.rotation.y = -sample.rotation.y;
+		sample.rotation.z = -sample.rotation.z;
+		sample.rotation.w = -sample.rotation.w;
+	}
+
+	cam->sum_translation.x += sample.translation.x;
+	cam->sum_translation.y += sample.translation.y;
+	cam->sum_translation.z += sample.translation.z;
+	cam->sum_rotation.x += sample.rotation.x;
+	cam->sum_rotation.y += sample.rotation.y;
+	cam->sum_rotation.z += sample.rotation.z;
+	cam->sum_rotation.w += sample.rotation.w;
+
+	if (++cam->num_samples < EXTRINSICS_SAMPLES)
+		return;
+
+	n = cam->num_samples;
+	cam->extrinsics.translation.x = cam->sum_translation.x / n;
+	cam->extrinsics.translation.y = cam->sum_translation.y / n;
+	cam->extrinsics.translation.z = cam->sum_translation.z / n;
+	cam->extrinsics.rotation = cam->sum_rotation;
+	dquat_normalize(&cam->extrinsics.rotation);
+	cam->calibrated = true;
+
+	g_print("Tracker: camera %d calibrated at (%.3f, %.3f, %.3f)\n", index,
+		cam->extrinsics.translation.x, cam->extrinsics.translation.y,
+		cam->extrinsics.translation.z);
+}
+
+/*
+ * Sets the object's pose prior in the given camera frame from its fused
+ * world pose, if the camera is calibrated and the object was recently seen
+ * by the camera itself or by another one. Called with the object's lock held.
+ */
+static void tracker_object_predict(OuvrtTrackerPrivate *opriv, int camera,
+				   const struct dpose *extrinsics, bool other)
+{
+	struct tracker_camera *ocam = &opriv->cameras[camera];
+	struct dpose inverse;
+
+	if (!opriv->fusion.has_pose ||
+	    (ocam->state == TRACKER_STATE_LOST && !other))
+		return;
+
+	dpose_invert(&inverse, extrinsics);
+	dpose_mult(&ocam->pose, &inverse, &opriv->fusion.state.pose);
+	ocam->state = TRACKER_STATE_TRACKING;
+}
+
+/*
+ * Estimates how many pixels per frame the LEDs of a tracked object move in
+ * the given camera's image, from the angular and linear velocity measured by
+ * the IMU, the radius of the LED model, and the distance to the camera.
+ * Called with the object's lock held.
+ */
+static double tracker_object_image_motion(OuvrtTrackerPrivate *opriv,
+					  int camera, double focal_length,
+					  double frame_period)
+{
+	const struct imu_state *state = &opriv->fusion.state;
+	struct tracker_camera *ocam = &opriv->cameras[camera];
+	double z = ocam->pose.translation.z;
+	double radius2 = 0.0, speed;
+	const vec3 *p;
+	int i;
+
+	if (!opriv->fusion.has_imu || !opriv->leds ||
+	    ocam->state != TRACKER_STATE_TRACKING || z <= 0.0 ||
+	    frame_period <= 0.0)
+		return 0.0;
+
+	for (i = 0; i < opriv->leds->num; i++) {
+		p = &opriv->leds->positions[i];
+		radius2 = MAX(radius2, p->x * p->x + p->y * p->y +
+				       p->z * p->z);
+	}
+
+	p = &state->angular_velocity;
+	speed = sqrt(p->x * p->x + p->y * p->y + p->z * p->z) * sqrt(radius2);
+	p = &state->linear_velocity;
+	speed += sqrt(p->x * p->x + p->y * p->y + p->z * p->z);
+
+	return speed * focal_length / z * frame_period;
+}
+
+/*
+ * Identifies the blobs in the subset by their blinking patterns, using the
+ * LED model and blinking phase of an object other than the tracker's own.
+ * led_phases is the camera's LED pattern phase count of the current frame.
+ * Blobs that could not be identified are removed from the subset.
+ *
+ * Returns the number of identified blobs.
+ */
+static int tracker_object_identify(struct tracker_camera *ocam,
+				   struct leds *leds, uint32_t led_phases,
+				   struct blob *subset, int *index, int n)
+{
+	int skipped = 0;
+	int i, m;
+
+	if (!ocam->fl) {
+		ocam->fl = flicker_new();
+		if (!ocam->fl)
+			return 0;
+	} else {
+		skipped = (int)(led_phases - ocam->fl_phases) - 1;
+	}
+	ocam->fl_phases = led_phases;
+
+	flicker_identify(ocam->fl, subset, n, skipped, leds);
+
+	for (i = 0, m = 0; i < n; i++) {
+		if (subset[i].led_id < 0)
+			continue;
+		subset[m] = subset[i];
+		index[m++] = index[i];
+	}
+
+	return m;
+}
+
+/*
+ * Assigns each blob to the object with the nearest projected LED within
+ * the label gate, or -1 if there is none. This is cheap compared to pose
+ * estimation and lets every object solve for its pose using only its own
+ * blobs.
+ */
+static void partition_blobs(struct blob *blobs, int num_blobs,
+			    struct led_projection proj[][MAX_LEDS],
+			    const int *num_leds, int num_objects,
+			    int8_t *owner)
+{
+	double dx, dy, dist2, best_dist2;
+	int i, j, k;
+
+	for (i = 0; i < num_blobs; i++) {
+		best_dist2 = LABEL_GATE * LABEL_GATE;
+		owner[i] = -1;
+		for (j = 0; j < num_objects; j++) {
+			for (k = 0; k < num_leds[j]; k++) {
+				if (!proj[j][k].visible)
+					continue;
+				dx = blobs[i].cx - proj[j][k].x;
+				dy = blobs[i].cy - proj[j][k].y;
+				dist2 = dx * dx + dy * dy;
+				if (dist2 < best_dist2) {
+					best_dist2 = dist2;
+					owner[i] = j;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Labels the blobs seen by the given camera and updates the poses of all
+ * tracked objects from them. The resulting pose of the tracker's own object
+ * in the camera frame is returned in rot and trans.
+ *
+ * Blobs are first split between the objects by projecting each LED model
+ * with its last known pose. If the tracker's own object is not tracked in
+ * this camera, it takes the remaining blobs that the flicker detector has
+ * identified with its LED model. The blobs still left are decoded again for
+ * each further object that is not tracked, with that object's LED patterns
+ * and blinking phase, and the identified blobs are given to it. Each object
+ * then runs the solver on its own share of the blobs, so the cost grows
+ * with the number of blobs, not with the number of objects.
+ *
+ * Each camera solves for the pose on its own. Poses from calibrated cameras
+ * are transformed into the world frame and merged by the sensor fusion,
+ * which combines the constraints of all cameras over time. Poses from
+ * uncalibrated cameras are used to calibrate their extrinsics against the
+ * fused pose instead.
+ */
+void ouvrt_tracker_process_blobs(OuvrtTracker *tracker, int camera,
 				 struct blob *blobs, int num_blobs,
 				 dmat3 *camera_matrix, double dist_coeffs[5],
+				 const struct undistort_map *undistort,
 				 dquat *rot, dvec3 *trans)
 {
-	struct leds *leds = tracker->priv->leds;
+	OuvrtTrackerPrivate *priv = tracker->priv;
+	struct led_projection proj[TRACKER_MAX_OBJECTS][MAX_LEDS];
+	OuvrtTracker *objects[TRACKER_MAX_OBJECTS];
+	int num_leds[TRACKER_MAX_OBJECTS];
+	struct tracker_camera *cam, *ocam;
+	OuvrtTrackerPrivate *opriv;
+	struct dpose extrinsics, world_pose;
+	struct blob *subset;
+	int8_t *owner;
+	int *index;
+	bool calibrated, other, acquire, lost = false, fused = false;
+	uint64_t t0, t1, pnp_ns = 0, fusion_ns = 0, publish_ns = 0;
+	double motion = 0.0;
+	int num_objects, num_tracked = 0;
+	int y0 = INT_MAX, y1 = INT_MIN;
+	int i, j, n, ret;
+	double time, min_cos;
+
+	if (camera < 0 || camera >= TRACKER_MAX_CAMERAS)
+		return;
+	cam = &priv->cameras[camera];
+	min_cos = cos(tracker_led_cone * M_PI / 180.0);
+
+	if (num_blobs > cam->max_blobs) {
+		cam->max_blobs = MAX(num_blobs, 2 * cam->max_blobs);
+		cam->subset = g_renew(struct blob, cam->subset, cam->max_blobs);
+		cam->owner = g_renew(int8_t, cam->owner, cam->max_blobs);
+		cam->index = g_renew(int, cam->index, cam->max_blobs);
+		cam->taken = g_renew(bool, cam->taken, cam->max_blobs);
+	}
+	subset = cam->subset;
+	owner = cam->owner;
+	index = cam->index;
+
+	t0 = latency_now_ns();
+
+	g_mutex_lock(&priv->lock);
+	calibrated = cam->calibrated;
+	extrinsics = cam->extrinsics;
+	other = priv->pose_camera >= 0 && priv->pose_camera != camera &&
+		cam->exposure_time >= 0 &&
+		fabs(cam->exposure_time - priv->pose_time) < POSE_MAX_AGE;
+	num_objects = priv->num_objects;
+	for (i = 0; i < num_objects; i++)
+		objects[i] = g_object_ref(priv->objects[i]);
+	g_mutex_unlock(&priv->lock);
+
+	/*
+	 * Prefer the fused poses, which include the latest IMU samples and
+	 * the observations of the other cameras
+	 */
+	for (i = 0; i < num_objects; i++) {
+		opriv = objects[i]->priv;
+		ocam = &opriv->cameras[camera];
+		num_leds[i] = 0;
+		if (!opriv->leds)
+			continue;
+		num_tracked++;
+
+		if (calibrated) {
+			g_mutex_lock(&opriv->lock);
+			tracker_object_predict(opriv, camera, &extrinsics,
+					       i == 0 && other);
+			g_mutex_unlock(&opriv->lock);
+		}
+
+		if (ocam->state == TRACKER_STATE_TRACKING) {
+			ocam->visible = project_leds(opriv->leds->positions,
+						     opriv->leds->directions,
+						     opriv->leds->num,
+						     camera_matrix, dist_coeffs,
+						     &ocam->pose.rotation,
+						     &ocam->pose.translation,
+						     min_cos, proj[i]);
+			num_leds[i] = opriv->leds->num;
+		} else {
+			ocam->visible = ~0ULL;
+			if (i == 0)
+				lost = true;
+		}
+	}
+
+	if (num_tracked == 0)
+		goto out;
+
+	/*
+	 * Flicker IDs were decoded against the LED model of the tracker's
+	 * object, so only that object can use them directly. Other objects
+	 * decode the blobs left over with their own LED patterns below.
+	 */
+	partition_blobs(blobs, num_blobs, proj, num_leds, num_objects, owner);
+	for (j = 0; j < num_blobs; j++) {
+		if (owner[j] < 0 && blobs[j].led_id >= 0 && lost)
+			owner[j] = 0;
+	}
+	t1 = latency_now_ns();
+	latency_histogram_add(&priv->latency[TRACKER_LATENCY_ASSOCIATE].hist,
+			      t1 - t0);
+
+	for (i = 0; i < num_objects; i++) {
+		opriv = objects[i]->priv;
+		ocam = &opriv->cameras[camera];
+		if (!opriv->leds)
+			continue;
+
+		/* Other objects are acquired from the blobs nobody owns */
+		acquire = i != 0 && ocam->state == TRACKER_STATE_LOST;
+		for (j = 0, n = 0; j < num_blobs; j++) {
+			if (owner[j] != (acquire ? -1 : i))
+				continue;
+			subset[n] = blobs[j];
+			if (i != 0)
+				subset[n].led_id = -1;
+			index[n++] = j;
+		}
+		if (acquire) {
+			n = tracker_object_identify(ocam, opriv->leds,
+						    cam->led_phases, subset,
+						    index, n);
+			for (j = 0; j < n; j++)
+				owner[index[j]] = i;
+		}
+
+		t0 = latency_now_ns();
+		ret = -1;
+		if (ocam->state == TRACKER_STATE_TRACKING) {
+			label_blobs(subset, n, proj[i], opriv->leds->num,
+				    cam->taken);
+			ret = estimate_tracked_pose(subset, n,
+						    opriv->leds->positions,
+						    opriv->leds->num,
+						    camera_matrix, dist_coeffs,
+						    undistort,
+						    &ocam->pose.rotation,
+						    &ocam->pose.translation);
+			if (ret < 0) {
+				/*
+				 * Projected labels are unreliable, restore
+				 * the flicker IDs, but only of LEDs that can
+				 * face the camera, and only for the object
+				 * they were decoded for
+				 */
+				for (j = 0; j < n; j++) {
+					subset[j] = blobs[index[j]];
+					if (subset[j].led_id >= 0 &&
+					    (i != 0 ||
+					     !(ocam->visible &
+					       (1ULL << subset[j].led_id))))
+						subset[j].led_id = -1;
+				}
+			}
+		}
+		if (ret < 0) {
+			ret = estimate_initial_pose(subset, n,
+						    opriv->leds->positions,
+						    opriv->leds->num,
+						    camera_matrix, dist_coeffs,
+						    undistort,
+						    &ocam->pose.rotation,
+						    &ocam->pose.translation,
+						    false);
+		}
+		ocam->state = ret >= 0 ? TRACKER_STATE_TRACKING :
+					 TRACKER_STATE_LOST;
+		t1 = latency_now_ns();
+		pnp_ns += t1 - t0;
+
+		/* Blob labels refer to the LED model of the tracker's object */
+		if (i == 0) {
+			for (j = 0; j < n; j++)
+				blobs[index[j]].led_id = subset[j].led_id;
+		}
+
+		if (ocam->state == TRACKER_STATE_LOST)
+			continue;
+
+		/* Rows covered by the LEDs of tracked objects */
+		for (j = 0; j < num_leds[i]; j++) {
+			if (!proj[i][j].visible)
+				continue;
+			y0 = MIN(y0, (int)proj[i][j].y);
+			y1 = MAX(y1, (int)proj[i][j].y + 1);
+		}
+
+		/*
+		 * The exposure time is only known in the clock of the
+		 * tracker's own device, other objects are fused without
+		 * latency compensation.
+		 */
+		time = i == 0 ? cam->exposure_time : -1;
+
+		if (calibrated) {
+			g_mutex_lock(&opriv->lock);
+			t0 = latency_now_ns();
+			dpose_mult(&world_pose, &extrinsics, &ocam->pose);
+			fusion_update_pose(&opriv->fusion, camera,
+					   &world_pose.rotation,
+					   &world_pose.translation, time);
+			opriv->pose_time = time;
+			opriv->pose_camera = camera;
+			t1 = latency_now_ns();
+			pose_shm_publish(opriv->pose_shm, &opriv->fusion.state);
+			g_mutex_unlock(&opriv->lock);
+			fusion_ns += t1 - t0;
+			publish_ns += latency_now_ns() - t1;
+			fused = true;
+		} else if (i == 0 && other) {
+			g_mutex_lock(&priv->lock);
+			if (priv->fusion.has_pose) {
+				tracker_camera_calibrate(cam, camera,
+							 &priv->fusion.state.pose);
+			}
+			g_mutex_unlock(&priv->lock);
+		}
+	}
+
+	/* Widen the association gates by the motion expected in the next frame */
+	for (i = 0; i < num_objects; i++) {
+		opriv = objects[i]->priv;
+		g_mutex_lock(&opriv->lock);
+		motion = MAX(motion,
+			     tracker_object_image_motion(opriv, camera,
+							 camera_matrix->m[0],
+							 cam->frame_period));
+		g_mutex_unlock(&opriv->lock);
+	}
+
+	latency_histogram_add(&priv->latency[TRACKER_LATENCY_PNP].hist,
+			      pnp_ns);
+	if (fused) {
+		latency_histogram_add(&priv->latency[TRACKER_LATENCY_FUSION].hist,
+				      fusion_ns);
+		latency_histogram_add(&priv->latency[TRACKER_LATENCY_PUBLISH].hist,
+				      publish_ns);
+	}
+
+out:
+	for (i = 0; i < num_objects; i++)
+		g_object_unref(objects[i]);
+
+	/* Flicker IDs of the next frame are only assigned to facing LEDs */
+	if (cam->bw) {
+		blobwatch_set_visible_leds(cam->bw,
+					   cam->state == TRACKER_STATE_TRACKING ?
+					   cam->visible : ~0ULL);
+		blobwatch_set_image_motion(cam->bw, motion);
+	}
+
+	if (y0 < y1 && cam->stable_frames < WINDOW_STABLE_FRAMES)
+		cam->stable_frames++;
+	else if (y0 >= y1)
+		cam->stable_frames = 0;
+	if (y0 < y1 && cam->stable_frames == WINDOW_STABLE_FRAMES) {
+		cam->window_y0 = MAX(y0 - WINDOW_MARGIN, 0);
+		cam->window_y1 = MIN(y1 + WINDOW_MARGIN, cam->height);
+	} else {
+		cam->window_y0 = 0;
+		cam->window_y1 = cam->height;
+	}
+
+	*rot = cam->pose.rotation;
+	*trans = cam->pose.translation;
+}
+
+/*
+ * Returns the rows [y0, y1) of the given camera's frames that are expected
+ * to contain the LEDs of all objects tracked by this camera in the next
+ * frame. Until tracking is stable, this is the whole frame. Before the
+ * camera has seen any frames, the window is empty.
+ */
+void ouvrt_tracker_get_window(OuvrtTracker *tracker, int camera, int *y0,
+			      int *y1)
+{
+	struct tracker_camera *cam;
 
-	if (leds == NULL)
+	*y0 = 0;
+	*y1 = 0;
+	if (camera < 0 || camera >= TRACKER_MAX_CAMERAS)
 		return;
 
-	estimate_initial_pose(blobs, num_blobs, leds->positions, leds->num,
-			      camera_matrix, dist_coeffs, rot, trans,
-			      true);
+	cam = &tracker->priv->cameras[camera];
+	*y0 = cam->window_y0;
+	*y1 = cam->window_y1;
+}
+
+/*
+ * Stores an IMU sample of the tracked device in the sample ring and
+ * integrates it into the fused pose. This is called from the device thread
+ * at full IMU sample rate.
+ */
+void ouvrt_tracker_push_imu_sample(OuvrtTracker *tracker,
+				   struct imu_sample *sample)
+{
+	OuvrtTrackerPrivate *priv;
+
+	if (!tracker)
+		return;
+
+	priv = tracker->priv;
+	imu_ring_push(&priv->imu_ring, sample);
+
+	g_mutex_lock(&priv->lock);
+	fusion_update_imu(&priv->fusion, sample);
+	pose_shm_publish(priv->pose_shm, &priv->fusion.state);
+	g_mutex_unlock(&priv->lock);
+}
+
+/*
+ * Returns the latest fused pose and its derivatives.
+ */
+void ouvrt_tracker_get_state(OuvrtTracker *tracker, struct imu_state *state)
+{
+	OuvrtTrackerPrivate *priv = tracker->priv;
+
+	g_mutex_lock(&priv->lock);
+	fusion_get_state(&priv->fusion, state);
+	g_mutex_unlock(&priv->lock);
+}
+
+/*
+ * Returns the fused pose predicted to the given monotonic clock time, for
+ * example the expected display time of a frame.
+ */
+void ouvrt_tracker_predict_pose(OuvrtTracker *tracker, double time,
+				struct dpose *pose)
+{
+	struct imu_state state;
+
+	ouvrt_tracker_get_state(tracker, &state);
+	fusion_predict_pose(&state, time, pose);
+}
+
+/*
+ * Returns the ring of raw IMU samples, for consumers that want to read them
+ * at their own pace using a struct imu_ring_reader.
+ */
+struct imu_ring *ouvrt_tracker_get_imu_ring(OuvrtTracker *tracker)
+{
+	return &tracker->priv->imu_ring;
+}
+
+/*
+ * Returns the file descriptor of the shared memory pose ring, or -1.
+ */
+int ouvrt_tracker_get_pose_shm_fd(OuvrtTracker *tracker)
+{
+	return pose_shm_get_fd(tracker->priv->pose_shm);
+}
+
+/*
+ * Returns the TRACKER_NUM_LATENCY latency histograms of the tracking stages.
+ */
+struct latency_stage *ouvrt_tracker_get_latency(OuvrtTracker *tracker)
+{
+	return tracker->priv->latency;
+}
+
+static void ouvrt_tracker_finalize(GObject *object)
+{
+	OuvrtTracker *self = OUVRT_TRACKER(object);
+
+	int i;
+
+	for (i = 1; i < self->priv->num_objects; i++)
+		g_object_unref(self->priv->objects[i]);
+	for (i = 0; i < TRACKER_MAX_CAMERAS; i++) {
+		blobwatch_free(self->priv->cameras[i].bw);
+		flicker_free(self->priv->cameras[i].fl);
+		g_free(self->priv->cameras[i].subset);
+		g_free(self->priv->cameras[i].owner);
+		g_free(self->priv->cameras[i].index);
+		g_free(self->priv->cameras[i].taken);
+	}
+	pose_shm_free(self->priv->pose_shm);
+	g_mutex_clear(&self->priv->lock);
+	G_OBJECT_CLASS(ouvrt_tracker_parent_class)->finalize(object);
 }
 
-static void ouvrt_tracker_class_init(OuvrtTrackerClass *klass G_GNUC_UNUSED)
+static void ouvrt_tracker_class_init(OuvrtTrackerClass *klass)
 {
+	G_OBJECT_CLASS(klass)->finalize = ouvrt_tracker_finalize;
 }
 
 static void ouvrt_tracker_init(OuvrtTracker *self)
 {
 	self->priv = ouvrt_tracker_get_instance_private(self);
 	self->priv->leds = NULL;
+	memset(self->priv->cameras, 0, sizeof(self->priv->cameras));
+	self->priv->objects[0] = self;
+	self->priv->num_objects = 1;
+	g_mutex_init(&self->priv->lock);
+	fusion_init(&self->priv->fusion);
+	self->priv->pose_time = -1;
+	self->priv->pose_camera = -1;
+	imu_ring_init(&self->priv->imu_ring);
+	self->priv->pose_shm = pose_shm_new();
+	memset(self->priv->latency, 0, sizeof(self->priv->latency));
+	self->priv->latency[TRACKER_LATENCY_DETECT].name = "detect";
+	self->priv->latency[TRACKER_LATENCY_FLICKER].name = "flicker";
+	self->priv->latency[TRACKER_LATENCY_ASSOCIATE].name = "associate";
+	self->priv->latency[TRACKER_LATENCY_PNP].name = "pnp";
+	self->priv->latency[TRACKER_LATENCY_FUSION].name = "fusion";
+	self->priv->latency[TRACKER_LATENCY_PUBLISH].name = "publish";
 }
 
 OuvrtTracker *ouvrt_tracker_new(void)
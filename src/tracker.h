@@ -41,21 +41,70 @@ struct _OuvrtTrackerClass {
 
 GType ouvrt_tracker_get_type(void);
 
+/* Maximum number of cameras observing a single tracked object */
+#define TRACKER_MAX_CAMERAS	4
+
+/* Maximum number of objects tracked by the same cameras */
+#define TRACKER_MAX_OBJECTS	4
+
+/* Latency histograms of the tracking stages */
+enum tracker_latency {
+	TRACKER_LATENCY_DETECT,
+	TRACKER_LATENCY_FLICKER,
+	TRACKER_LATENCY_ASSOCIATE,
+	TRACKER_LATENCY_PNP,
+	TRACKER_LATENCY_FUSION,
+	TRACKER_LATENCY_PUBLISH,
+	TRACKER_NUM_LATENCY,
+};
+
 struct leds;
 struct blob;
+struct latency_stage;
+struct imu_sample;
+struct imu_state;
+struct imu_ring;
+struct dpose;
+struct undistort_map;
 struct blobservation;
 
 void ouvrt_tracker_register_leds(OuvrtTracker *tracker, struct leds *leds);
 void ouvrt_tracker_unregister_leds(OuvrtTracker *tracker, struct leds *leds);
+void ouvrt_tracker_set_flicker(OuvrtTracker *tracker, gboolean flicker);
 
-void ouvrt_tracker_process_frame(OuvrtTracker *tracker,
+int ouvrt_tracker_add_object(OuvrtTracker *tracker, OuvrtTracker *object);
+void ouvrt_tracker_remove_object(OuvrtTracker *tracker, OuvrtTracker *object);
+int ouvrt_tracker_add_camera(OuvrtTracker *tracker);
+void ouvrt_tracker_remove_camera(OuvrtTracker *tracker, int camera);
+
+void ouvrt_tracker_add_exposure(OuvrtTracker *tracker, uint16_t count,
+				double device_time, int led_phase,
+				double host_time);
+void ouvrt_tracker_process_frame(OuvrtTracker *tracker, int camera,
 				 uint8_t *frame, int width, int height,
-				 int skipped, struct blobservation **ob);
-void ouvrt_tracker_process_blobs(OuvrtTracker *tracker,
+				 int pixel_stride, uint32_t sequence,
+				 double timestamp, int skipped,
+				 struct blobservation **ob);
+void ouvrt_tracker_process_blobs(OuvrtTracker *tracker, int camera,
 				 struct blob *blobs, int num_blobs,
 				 dmat3 *camera_matrix, double dist_coeffs[5],
+				 const struct undistort_map *undistort,
 				 dquat *rot, dvec3 *trans);
+void ouvrt_tracker_get_window(OuvrtTracker *tracker, int camera, int *y0,
+			      int *y1);
+
+void ouvrt_tracker_push_imu_sample(OuvrtTracker *tracker,
+				   struct imu_sample *sample);
+void ouvrt_tracker_get_state(OuvrtTracker *tracker, struct imu_state *state);
+void ouvrt_tracker_predict_pose(OuvrtTracker *tracker, double time,
+				struct dpose *pose);
+struct imu_ring *ouvrt_tracker_get_imu_ring(OuvrtTracker *tracker);
+int ouvrt_tracker_get_pose_shm_fd(OuvrtTracker *tracker);
+struct latency_stage *ouvrt_tracker_get_latency(OuvrtTracker *tracker);
 
 OuvrtTracker *ouvrt_tracker_new();
 
+extern int tracker_blob_threads;
+extern double tracker_led_cone;
+
 #endif /* __TRACKER_H__ */
@@ -0,0 +1,142 @@
+/*
+ * Lens undistortion lookup table
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ *
+ * The inverse of the lens distortion model has no closed form. Instead of
+ * iterating it for every blob of every frame, it is evaluated once on a
+ * coarse grid over the image, and blob centroids are converted to
+ * normalized image coordinates by bilinear interpolation. The distortion
+ * is smooth enough that the interpolation error on an 8 pixel grid stays
+ * far below the centroid noise.
+ */
+#include <stdlib.h>
+
+#include "undistort.h"
+
+/* Grid spacing in pixels, must be a power of two */
+#define UNDISTORT_CELL_SHIFT	3
+#define UNDISTORT_CELL		(1 << UNDISTORT_CELL_SHIFT)
+
+struct undistort_map {
+	int grid_width;
+	int grid_height;
+	/* Normalized image coordinates u, v of each grid point */
+	double *uv;
+};
+
+/*
+ * Removes lens distortion from a pixel position and returns normalized image
+ * coordinates, iterating the inverse of the Brown-Conrady model with
+ * coefficients k1, k2, p1, p2, k3.
+ */
+void undistort_point(const dmat3 *A, const double k[5], double px, double py,
+		     double *u, double *v)
+{
+	const double fx = A->m[0], cx = A->m[2];
+	const double fy = A->m[4], cy = A->m[5];
+	double x0 = (px - cx) / fx;
+	double y0 = (py - cy) / fy;
+	double x = x0, y = y0;
+	double r2, icdist, dx, dy;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		r2 = x * x + y * y;
+		icdist = 1 / (1 + ((k[4] * r2 + k[1]) * r2 + k[0]) * r2);
+		dx = 2 * k[2] * x * y + k[3] * (r2 + 2 * x * x);
+		dy = k[2] * (r2 + 2 * y * y) + 2 * k[3] * x * y;
+		x = (x0 - dx) * icdist;
+		y = (y0 - dy) * icdist;
+	}
+
+	*u = x;
+	*v = y;
+}
+
+/*
+ * Precomputes the normalized image coordinates for a grid covering a
+ * width x height image with the given intrinsics.
+ *
+ * Returns the newly allocated map, or NULL.
+ */
+struct undistort_map *undistort_map_new(const dmat3 *camera_matrix,
+					const double dist_coeffs[5],
+					int width, int height)
+{
+	struct undistort_map *map;
+	double *uv;
+	int x, y;
+
+	map = malloc(sizeof(*map));
+	if (!map)
+		return NULL;
+
+	/* One extra grid point at the end to interpolate up to the border */
+	map->grid_width = (width + UNDISTORT_CELL - 1) / UNDISTORT_CELL + 1;
+	map->grid_height = (height + UNDISTORT_CELL - 1) / UNDISTORT_CELL + 1;
+	map->uv = malloc(map->grid_width * map->grid_height * 2 *
+			 sizeof(double));
+	if (!map->uv) {
+		free(map);
+		return NULL;
+	}
+
+	uv = map->uv;
+	for (y = 0; y < map->grid_height; y++) {
+		for (x = 0; x < map->grid_width; x++, uv += 2) {
+			undistort_point(camera_matrix, dist_coeffs,
+					x * UNDISTORT_CELL, y * UNDISTORT_CELL,
+					&uv[0], &uv[1]);
+		}
+	}
+
+	return map;
+}
+
+void undistort_map_free(struct undistort_map *map)
+{
+	if (!map)
+		return;
+
+	free(map->uv);
+	free(map);
+}
+
+/*
+ * Returns the normalized image coordinates of a pixel position by bilinear
+ * interpolation between the surrounding grid points. Positions outside of
+ * the image are extrapolated from the nearest grid cell.
+ */
+void undistort_map_lookup(const struct undistort_map *map, double px,
+			  double py, double *u, double *v)
+{
+	double fx = px / UNDISTORT_CELL;
+	double fy = py / UNDISTORT_CELL;
+	int x = (int)fx;
+	int y = (int)fy;
+	const double *p00, *p01, *p10, *p11;
+	double tx, ty;
+
+	if (fx < 0)
+		x = 0;
+	else if (x > map->grid_width - 2)
+		x = map->grid_width - 2;
+	if (fy < 0)
+		y = 0;
+	else if (y > map->grid_height - 2)
+		y = map->grid_height - 2;
+
+	tx = fx - x;
+	ty = fy - y;
+
+	p00 = map->uv + 2 * (y * map->grid_width + x);
+	p01 = p00 + 2;
+	p10 = p00 + 2 * map->grid_width;
+	p11 = p10 + 2;
+
+	*u = (1 - ty) * ((1 - tx) * p00[0] + tx * p01[0]) +
+	     ty * ((1 - tx) * p10[0] + tx * p11[0]);
+	*v = (1 - ty) * ((1 - tx) * p00[1] + tx * p01[1]) +
+	     ty * ((1 - tx) * p10[1] + tx * p11[1]);
+}
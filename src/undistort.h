@@ -0,0 +1,23 @@
+/*
+ * Lens undistortion lookup table
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	LGPL-2.0+ or BSL-1.0
+ */
+#ifndef __UNDISTORT_H__
+#define __UNDISTORT_H__
+
+#include "math.h"
+
+struct undistort_map;
+
+void undistort_point(const dmat3 *camera_matrix, const double dist_coeffs[5],
+		     double px, double py, double *u, double *v);
+
+struct undistort_map *undistort_map_new(const dmat3 *camera_matrix,
+					const double dist_coeffs[5],
+					int width, int height);
+void undistort_map_free(struct undistort_map *map);
+void undistort_map_lookup(const struct undistort_map *map, double px,
+			  double py, double *u, double *v);
+
+#endif /* __UNDISTORT_H__ */
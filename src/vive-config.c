@@ -4,22 +4,66 @@
  * SPDX-License-Identifier:	LGPL-2.0+
  */
 #include <errno.h>
+#include <math.h>
 #include <json-glib/json-glib.h>
 #include <string.h>
 #include <zlib.h>
 
 #include "device.h"
 #include "hidraw.h"
+#include "vive-config.h"
+#include "vive-hid-reports.h"
+
+#define STANDARD_GRAVITY	9.80665
 
 /*
- * Downloads configuration data stored in the Vive headset and controller.
+ * Configuration download locks, keyed by USB serial number. The headset IMU
+ * and Lighthouse receiver are interfaces of the same USB device and share
+ * the stateful feature report sequence.
  */
-char *ouvrt_vive_get_config(OuvrtDevice *dev)
+static GMutex config_locks_lock;
+static GHashTable *config_locks;
+
+/*
+ * Returns the configuration download lock of the USB device that dev is an
+ * interface of. The locks are never freed.
+ */
+static GMutex *ouvrt_vive_config_lock(OuvrtDevice *dev)
+{
+	const char *key = dev->serial ? dev->serial : "";
+	GMutex *lock;
+
+	g_mutex_lock(&config_locks_lock);
+	if (!config_locks) {
+		config_locks = g_hash_table_new_full(g_str_hash, g_str_equal,
+						     g_free, NULL);
+	}
+	lock = g_hash_table_lookup(config_locks, key);
+	if (!lock) {
+		lock = g_new(GMutex, 1);
+		g_mutex_init(lock);
+		g_hash_table_insert(config_locks, g_strdup(key), lock);
+	}
+	g_mutex_unlock(&config_locks_lock);
+
+	return lock;
+}
+
+/*
+ * Downloads the configuration data stored in the Vive headset and controller
+ * and parses it. The compressed data is inflated while the feature reports
+ * come in, so the JSON text is complete right after the last report.
+ *
+ * Returns the newly allocated JSON root node, or NULL on error.
+ */
+static JsonNode *ouvrt_vive_download_config(OuvrtDevice *dev)
 {
 	unsigned char buf[64];
-	unsigned char *config_json;
-	void *config_z;
+	unsigned char out[4096];
+	GString *config_json;
+	JsonNode *node;
 	z_stream strm;
+	int zret = Z_OK;
 	int count = 0;
 	int ret;
 
@@ -30,71 +74,194 @@ char *ouvrt_vive_get_config(OuvrtDevice *dev)
 		return NULL;
 	}
 
-	config_z = g_malloc(4096);
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = 0;
+	strm.next_in = Z_NULL;
+	strm.avail_out = sizeof(out);
+	ret = inflateInit(&strm);
+	if (ret != Z_OK) {
+		g_print("inflate_init failed: %d\n", ret);
+		return NULL;
+	}
+
+	config_json = g_string_sized_new(32768);
 
 	buf[0] = 0x11;
 	do {
-		ret = hid_get_feature_report_timeout(dev->fd, buf, sizeof(buf), 100);
+		ret = hid_get_feature_report_timeout(dev->fd, buf, sizeof(buf),
+						     100);
 		if (ret < 0) {
 			g_print("%s: Read error after %d bytes: %d\n",
 				dev->name, count, errno);
-			g_free(config_z);
-			return NULL;
+			goto err;
 		}
 
 		if (buf[1] > 62) {
 			g_print("%s: Invalid configuration data at %d\n",
 				dev->name, count);
-			g_free(config_z);
-			return NULL;
+			goto err;
 		}
 
-		if (count + buf[1] > 4096) {
-			g_print("%s: Configuration data too large\n",
-				dev->name);
-			g_free(config_z);
-			return NULL;
+		strm.avail_in = buf[1];
+		strm.next_in = buf + 2;
+		while (zret == Z_OK && (strm.avail_in || !strm.avail_out)) {
+			strm.avail_out = sizeof(out);
+			strm.next_out = out;
+			zret = inflate(&strm, Z_NO_FLUSH);
+			if (zret != Z_OK && zret != Z_STREAM_END &&
+			    zret != Z_BUF_ERROR) {
+				g_print("%s: Failed to inflate configuration data at %d: %d\n",
+					dev->name, count, zret);
+				goto err;
+			}
+			g_string_append_len(config_json, (const char *)out,
+					    sizeof(out) - strm.avail_out);
+			if (zret == Z_BUF_ERROR)
+				zret = Z_OK;
 		}
-
-		memcpy(config_z + count, buf + 2, buf[1]);
 		count += buf[1];
 	} while (buf[1]);
 
-	g_debug("%s: Read configuration data: %d bytes\n", dev->name,
-		count);
-
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.avail_in = 0;
-	strm.next_in = Z_NULL;
-	ret = inflateInit(&strm);
-	if (ret != Z_OK) {
-		g_print("inflate_init failed: %d\n", ret);
-		g_free(config_z);
+	inflateEnd(&strm);
+	if (zret != Z_STREAM_END) {
+		g_print("%s: Truncated configuration data: %d bytes\n",
+			dev->name, count);
+		g_string_free(config_json, TRUE);
 		return NULL;
 	}
 
-	config_json = g_malloc(32768);
+	g_debug("%s: Read configuration data: %d bytes, inflated: %zu bytes\n",
+		dev->name, count, config_json->len);
 
-	strm.avail_in = count;
-	strm.next_in = config_z;
-	strm.avail_out = 32768;
-	strm.next_out = config_json;
+	node = json_from_string(config_json->str, NULL);
+	g_string_free(config_json, TRUE);
+	if (!node) {
+		g_print("%s: Parsing JSON configuration data failed\n",
+			dev->name);
+	}
 
-	ret = inflate(&strm, Z_FINISH);
-	g_free(config_z);
-	if (ret != Z_STREAM_END) {
-		g_print("%s: Failed to inflate configuration data: %d\n",
-			dev->name, ret);
-		g_free(config_json);
-		return NULL;
+	return node;
+
+err:
+	inflateEnd(&strm);
+	g_string_free(config_json, TRUE);
+	return NULL;
+}
+
+/*
+ * Downloads and parses the configuration data, one interface of the same
+ * USB device at a time, as the chunks would interleave otherwise.
+ *
+ * Returns the newly allocated JSON root node, or NULL on error.
+ */
+JsonNode *ouvrt_vive_get_config(OuvrtDevice *dev)
+{
+	GMutex *lock = ouvrt_vive_config_lock(dev);
+	JsonNode *node;
+
+	g_mutex_lock(lock);
+	node = ouvrt_vive_download_config(dev);
+	g_mutex_unlock(lock);
+
+	return node;
+}
+
+/*
+ * Initializes the IMU configuration with the default ranges of ±4 g and
+ * ±500 °/s, and without calibration.
+ */
+void ouvrt_vive_imu_config_init(struct vive_imu_config *imu)
+{
+	imu->acc_range = 4 * STANDARD_GRAVITY;
+	imu->gyro_range = 500 * M_PI / 180;
+	imu->acc_bias = (vec3){ 0, 0, 0 };
+	imu->acc_scale = (vec3){ 1, 1, 1 };
+	imu->gyro_bias = (vec3){ 0, 0, 0 };
+	imu->gyro_scale = (vec3){ 1, 1, 1 };
+}
+
+/*
+ * Reads the accelerometer and gyroscope full scale range settings.
+ */
+int ouvrt_vive_get_imu_range(OuvrtDevice *dev, struct vive_imu_config *imu)
+{
+	struct vive_imu_range_modes_report report = {
+		.id = VIVE_IMU_RANGE_MODES_REPORT_ID,
+	};
+	int ret;
+
+	ret = hid_get_feature_report_timeout(dev->fd, &report, sizeof(report),
+					     100);
+	if (ret < 0) {
+		g_print("%s: Read error 0x01: %d\n", dev->name, errno);
+		return ret;
 	}
 
-	g_debug("%s: Inflated configuration data: %lu bytes\n",
-		dev->name, strm.total_out);
+	/* Both ranges are powers of two multiples of 250 °/s and 2 g */
+	if (report.gyro_range > 4 || report.accel_range > 4) {
+		g_print("%s: Invalid range modes: %d, %d\n", dev->name,
+			report.gyro_range, report.accel_range);
+		return -EINVAL;
+	}
+
+	imu->gyro_range = (250 << report.gyro_range) * M_PI / 180;
+	imu->acc_range = (2 << report.accel_range) * STANDARD_GRAVITY;
+
+	return 0;
+}
+
+static void json_object_get_vec3_member(JsonObject *object,
+					const char *member, vec3 *v)
+{
+	JsonArray *array;
+
+	if (!json_object_has_member(object, member))
+		return;
+
+	array = json_object_get_array_member(object, member);
+	if (json_array_get_length(array) != 3)
+		return;
+
+	v->x = json_array_get_double_element(array, 0);
+	v->y = json_array_get_double_element(array, 1);
+	v->z = json_array_get_double_element(array, 2);
+}
 
-	config_json[strm.total_out] = '\0';
+/*
+ * Reads the IMU factory calibration from the configuration data.
+ */
+void ouvrt_vive_parse_imu_config(JsonObject *object,
+				 struct vive_imu_config *imu)
+{
+	json_object_get_vec3_member(object, "acc_bias", &imu->acc_bias);
+	json_object_get_vec3_member(object, "acc_scale", &imu->acc_scale);
+	json_object_get_vec3_member(object, "gyro_bias", &imu->gyro_bias);
+	json_object_get_vec3_member(object, "gyro_scale", &imu->gyro_scale);
+}
+
+/*
+ * Converts raw accelerometer and gyroscope readings into calibrated
+ * acceleration in m/s² and angular velocity in rad/s.
+ */
+void vive_imu_scale_sample(const struct vive_imu_config *imu,
+			   const int16_t acc[3], const int16_t gyro[3],
+			   struct imu_sample *sample)
+{
+	const float acc_factor = imu->acc_range / 32768.0f;
+	const float gyro_factor = imu->gyro_range / 32768.0f;
 
-	return g_realloc(config_json, strm.total_out + 1);
+	sample->acceleration.x = (acc[0] * acc_factor - imu->acc_bias.x) *
+				 imu->acc_scale.x;
+	sample->acceleration.y = (acc[1] * acc_factor - imu->acc_bias.y) *
+				 imu->acc_scale.y;
+	sample->acceleration.z = (acc[2] * acc_factor - imu->acc_bias.z) *
+				 imu->acc_scale.z;
+	sample->angular_velocity.x = (gyro[0] * gyro_factor -
+				      imu->gyro_bias.x) * imu->gyro_scale.x;
+	sample->angular_velocity.y = (gyro[1] * gyro_factor -
+				      imu->gyro_bias.y) * imu->gyro_scale.y;
+	sample->angular_velocity.z = (gyro[2] * gyro_factor -
+				      imu->gyro_bias.z) * imu->gyro_scale.z;
 }
@@ -6,8 +6,33 @@
 #ifndef __VIVE_CONFIG_H__
 #define __VIVE_CONFIG_H__
 
+#include <json-glib/json-glib.h>
+#include <stdint.h>
+
 #include "device.h"
+#include "imu.h"
+#include "math.h"
+
+/*
+ * IMU measurement ranges and factory calibration: full scale ranges in m/s²
+ * and rad/s, and the bias and scale applied to the scaled measurements.
+ */
+struct vive_imu_config {
+	float acc_range;
+	float gyro_range;
+	vec3 acc_bias;
+	vec3 acc_scale;
+	vec3 gyro_bias;
+	vec3 gyro_scale;
+};
 
-char *ouvrt_vive_get_config(OuvrtDevice *dev);
+JsonNode *ouvrt_vive_get_config(OuvrtDevice *dev);
+void ouvrt_vive_imu_config_init(struct vive_imu_config *imu);
+int ouvrt_vive_get_imu_range(OuvrtDevice *dev, struct vive_imu_config *imu);
+void ouvrt_vive_parse_imu_config(JsonObject *object,
+				 struct vive_imu_config *imu);
+void vive_imu_scale_sample(const struct vive_imu_config *imu,
+			   const int16_t acc[3], const int16_t gyro[3],
+			   struct imu_sample *sample);
 
 #endif /* __VIVE_LIGHTHOUSE_CONFIG_H__ */
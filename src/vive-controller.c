@@ -5,8 +5,6 @@
  */
 #include <asm/byteorder.h>
 #include <errno.h>
-#include <poll.h>
-#include <pthread.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -17,14 +15,35 @@
 #include "vive-controller.h"
 #include "vive-config.h"
 #include "vive-hid-reports.h"
+#include "calibration-cache.h"
+#include "clock-sync.h"
 #include "device.h"
 #include "hidraw.h"
 #include "math.h"
 
+/*
+ * Configuration of the controller connected to the receiver, as read by the
+ * calibration thread.
+ */
+struct vive_controller_config {
+	char serial[32];
+	struct vive_imu_config imu;
+};
+
 struct _OuvrtViveControllerPrivate {
-	JsonNode *config;
-	const gchar *serial;
-	gboolean connected;
+	GMutex config_lock;
+	char serial[32];
+	struct vive_imu_config imu_config;
+	/* Set while the controller is connected and configured */
+	gint connected;
+	/* Set while the configuration is read in the background */
+	gint probing;
+	GThread *calibration_validation;
+	/* Host time at which the current report was received */
+	double report_time;
+	struct clock_sync clock;
+	/* Number of IMU messages since the last ping */
+	int imu_messages;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(OuvrtViveController, ouvrt_vive_controller, \
@@ -66,33 +85,75 @@ static int vive_controller_get_firmware_version(OuvrtViveController *self)
 }
 
 /*
- * Downloads the configuration data stored in the controller
+ * Downloads the configuration data stored in the connected controller.
  */
-static int vive_controller_get_config(OuvrtViveController *self)
+static int vive_controller_read_config(OuvrtDevice *dev, void *data)
 {
-	char *config_json;
+	OuvrtViveController *self = OUVRT_VIVE_CONTROLLER(dev);
+	struct vive_controller_config *config = data;
+	const gchar *serial;
 	JsonObject *object;
+	JsonNode *node;
+	int ret;
 
-	config_json = ouvrt_vive_get_config(&self->dev);
-	if (!config_json)
-		return -1;
+	ret = vive_controller_get_firmware_version(self);
+	if (ret < 0) {
+		g_atomic_int_set(&self->priv->probing, 0);
+		return ret;
+	}
 
-	self->priv->config = json_from_string(config_json, NULL);
-	g_free(config_json);
-	if (!self->priv->config) {
-		g_print("Vive Wireless Receiver %s: Parsing JSON configuration data failed\n",
-			self->dev.serial);
+	node = ouvrt_vive_get_config(dev);
+	if (!node) {
+		g_atomic_int_set(&self->priv->probing, 0);
 		return -1;
 	}
 
-	object = json_node_get_object(self->priv->config);
+	object = json_node_get_object(node);
+	serial = json_object_get_string_member(object, "device_serial_number");
+	g_strlcpy(config->serial, serial ? serial : "", sizeof(config->serial));
 
-	self->priv->serial = json_object_get_string_member(object,
-							   "device_serial_number");
+	ouvrt_vive_imu_config_init(&config->imu);
+	ouvrt_vive_get_imu_range(dev, &config->imu);
+	ouvrt_vive_parse_imu_config(object, &config->imu);
+	json_node_unref(node);
 
 	return 0;
 }
 
+/*
+ * Applies the controller configuration from the calibration thread.
+ */
+static void vive_controller_config_done(OuvrtDevice *dev, const void *data)
+{
+	OuvrtViveController *self = OUVRT_VIVE_CONTROLLER(dev);
+	const struct vive_controller_config *config = data;
+
+	g_mutex_lock(&self->priv->config_lock);
+	memcpy(self->priv->serial, config->serial, sizeof(config->serial));
+	self->priv->imu_config = config->imu;
+	g_mutex_unlock(&self->priv->config_lock);
+
+	g_print("Vive Wireless Receiver %s: Controller %s connected\n",
+		dev->serial, config->serial);
+	g_atomic_int_set(&self->priv->connected, 1);
+	g_atomic_int_set(&self->priv->probing, 0);
+}
+
+/*
+ * Starts reading the configuration of a newly connected controller in the
+ * background. The receiver may be paired with different controllers, so the
+ * configuration is not cached.
+ */
+static void vive_controller_get_config(OuvrtViveController *self)
+{
+	g_atomic_int_set(&self->priv->probing, 1);
+	calibration_cache_get_async(&self->dev, "vive-controller", NULL,
+				    sizeof(struct vive_controller_config),
+				    vive_controller_read_config,
+				    vive_controller_config_done,
+				    &self->priv->calibration_validation);
+}
+
 static int vive_controller_poweroff(OuvrtViveController *self)
 {
 	const struct vive_controller_poweroff_report report = {
@@ -158,8 +219,9 @@ vive_controller_decode_imu_message(OuvrtViveController *self,
 				   const struct vive_controller_message *msg)
 {
 	/* Time in 48 MHz ticks, but we are missing the low byte */
-	uint32_t time = (msg->timestamp_hi << 24) | (msg->timestamp_lo << 16) |
-			(msg->imu.timestamp_3 << 8);
+	uint32_t ticks = (msg->timestamp_hi << 24) | (msg->timestamp_lo << 16) |
+			 (msg->imu.timestamp_3 << 8);
+	struct imu_sample sample;
 	int16_t acc[3] = {
 		__le16_to_cpu(msg->imu.accel[0]),
 		__le16_to_cpu(msg->imu.accel[1]),
@@ -171,10 +233,16 @@ vive_controller_decode_imu_message(OuvrtViveController *self,
 		__le16_to_cpu(msg->imu.gyro[2]),
 	};
 
-	(void)self;
-	(void)time;
-	(void)acc;
-	(void)gyro;
+	sample.time = clock_sync_update(&self->priv->clock, ticks,
+					self->priv->report_time);
+	g_mutex_lock(&self->priv->config_lock);
+	vive_imu_scale_sample(&self->priv->imu_config, acc, gyro, &sample);
+	g_mutex_unlock(&self->priv->config_lock);
+	sample.magnetic_field = (vec3){ 0, 0, 0 };
+	sample.temperature = 0;
+
+	ouvrt_tracker_push_imu_sample(self->tracker, &sample);
+	self->priv->imu_messages++;
 }
 
 static void
@@ -193,12 +261,28 @@ vive_controller_decode_ping_message(OuvrtViveController *self,
 		__le16_to_cpu(msg->ping.gyro[1]),
 		__le16_to_cpu(msg->ping.gyro[2]),
 	};
+	struct imu_sample sample;
 
-	(void)self;
 	(void)charge_percent;
 	(void)charging;
-	(void)acc;
-	(void)gyro;
+
+	/*
+	 * Pings carry an IMU sample without timestamp. Only use it if
+	 * there is no regular IMU message stream, with the report
+	 * arrival time.
+	 */
+	if (!self->priv->imu_messages) {
+		sample.time = self->priv->report_time;
+		g_mutex_lock(&self->priv->config_lock);
+		vive_imu_scale_sample(&self->priv->imu_config, acc, gyro,
+				      &sample);
+		g_mutex_unlock(&self->priv->config_lock);
+		sample.magnetic_field = (vec3){ 0, 0, 0 };
+		sample.temperature = 0;
+
+		ouvrt_tracker_push_imu_sample(self->tracker, &sample);
+	}
+	self->priv->imu_messages = 0;
 }
 
 /*
@@ -234,7 +318,57 @@ vive_controller_decode_message(OuvrtViveController *self,
 }
 
 /*
- * Opens the Wireless Receiver HID device descriptor.
+ * Decodes a single Wireless Receiver report.
+ */
+static void vive_controller_hid_report(OuvrtDevice *dev,
+				       const unsigned char *buf, size_t len,
+				       double time)
+{
+	OuvrtViveController *self = OUVRT_VIVE_CONTROLLER(dev);
+
+	self->priv->report_time = time;
+
+	if (len == 30 && buf[0] == VIVE_CONTROLLER_REPORT1_ID) {
+		struct vive_controller_report1 *report = (void *)buf;
+
+		vive_controller_decode_message(self, &report->message);
+	} else if (len == 59 && buf[0] == VIVE_CONTROLLER_REPORT2_ID) {
+		struct vive_controller_report2 *report = (void *)buf;
+
+		vive_controller_decode_message(self, &report->message[0]);
+		vive_controller_decode_message(self, &report->message[1]);
+	} else if (len == 2 &&
+		   buf[0] == VIVE_CONTROLLER_DISCONNECT_REPORT_ID &&
+		   buf[1] == 0x01) {
+		g_mutex_lock(&self->priv->config_lock);
+		g_print("Vive Wireless Receiver %s: Controller %s disconnected\n",
+			dev->serial, self->priv->serial);
+		g_mutex_unlock(&self->priv->config_lock);
+		g_atomic_int_set(&self->priv->connected, 0);
+	} else {
+		g_print("Vive Wireless Receiver %s: Error, invalid %zu-byte report 0x%02x\n",
+			dev->serial, len, buf[0]);
+	}
+}
+
+/*
+ * Probes for a newly connected controller. The receiver reports when the
+ * controller disconnects, so this is only needed while there is none.
+ */
+static void vive_controller_hid_timeout(OuvrtDevice *dev)
+{
+	OuvrtViveController *self = OUVRT_VIVE_CONTROLLER(dev);
+
+	if (g_atomic_int_get(&self->priv->connected) ||
+	    g_atomic_int_get(&self->priv->probing))
+		return;
+
+	vive_controller_get_config(self);
+}
+
+/*
+ * Opens the Wireless Receiver HID device descriptor and starts looking for
+ * a connected controller.
  */
 static int vive_controller_start(OuvrtDevice *dev)
 {
@@ -250,107 +384,30 @@ static int vive_controller_start(OuvrtDevice *dev)
 		dev->fd = fd;
 	}
 
+	vive_controller_get_config(OUVRT_VIVE_CONTROLLER(dev));
+
 	return 0;
 }
 
 /*
- * Keeps the controller active.
+ * Applies the recorded controller configuration.
  */
-static void vive_controller_thread(OuvrtDevice *dev)
+static int vive_controller_replay_start(OuvrtDevice *dev)
 {
-	OuvrtViveController *self = OUVRT_VIVE_CONTROLLER(dev);
-	unsigned char buf[64];
-	struct pollfd fds;
-	int ret;
+	vive_controller_get_config(OUVRT_VIVE_CONTROLLER(dev));
 
-	ret = vive_controller_get_firmware_version(self);
-	if (ret < 0 && errno == EPIPE) {
-		g_print("Vive Wireless Receiver %s: No connected controller found\n",
-			dev->serial);
-	}
-	if (!ret) {
-		ret = vive_controller_get_config(self);
-		if (!ret) {
-			g_print("Vive Wireless Receiver %s: Controller %s connected\n",
-				dev->serial, self->priv->serial);
-			self->priv->connected = TRUE;
-		}
-	}
-
-	while (dev->active) {
-		fds.fd = dev->fd;
-		fds.events = POLLIN;
-		fds.revents = 0;
-
-		ret = poll(&fds, 1, 1000);
-		if (ret == -1) {
-			g_print("Vive Wireless Receiver %s: Poll failure: %d\n",
-				dev->serial, errno);
-			continue;
-		}
-
-		if (fds.revents & (POLLERR | POLLHUP | POLLNVAL))
-			break;
-
-		if (!(fds.revents & POLLIN)) {
-			if (self->priv->connected) {
-				g_print("Vive Wireless Receiver %s: Poll timeout\n",
-					dev->serial);
-				continue;
-			}
-		}
-
-		if (!self->priv->connected) {
-			ret = vive_controller_get_firmware_version(self);
-			if (ret < 0)
-				continue;
-
-			ret = vive_controller_get_config(self);
-			if (ret < 0)
-				continue;
-
-			g_print("Vive Wireless Receiver %s: Controller %s connected\n",
-				dev->serial, self->priv->serial);
-			self->priv->connected = TRUE;
-		}
-
-		ret = read(dev->fd, buf, sizeof(buf));
-		if (ret == -1) {
-			g_print("Vive Controller %s: Read error: %d\n",
-				self->priv->serial, errno);
-			continue;
-		}
-		if (ret == 30 && buf[0] == VIVE_CONTROLLER_REPORT1_ID) {
-			struct vive_controller_report1 *report = (void *)buf;
-
-			vive_controller_decode_message(self, &report->message);
-		} else if (ret == 59 && buf[0] == VIVE_CONTROLLER_REPORT2_ID) {
-			struct vive_controller_report2 *report = (void *)buf;
-
-			vive_controller_decode_message(self,
-						       &report->message[0]);
-			vive_controller_decode_message(self,
-						       &report->message[1]);
-		} else if (ret == 2 &&
-			   buf[0] == VIVE_CONTROLLER_DISCONNECT_REPORT_ID &&
-			   buf[1] == 0x01) {
-			g_print("Vive Wireless Receiver %s: Controller %s disconnected\n",
-				dev->serial, self->priv->serial);
-			self->priv->connected = FALSE;
-		} else {
-			g_print("Vive Controller %s: Error, invalid %d-byte report 0x%02x\n",
-				self->priv->serial, ret, buf[0]);
-		}
-	}
+	return 0;
 }
 
 /*
- * Powers off the controller.
+ * Waits for the background configuration readout and powers off the
+ * controller.
  */
 static void vive_controller_stop(OuvrtDevice *dev)
 {
 	OuvrtViveController *self = OUVRT_VIVE_CONTROLLER(dev);
 
+	calibration_cache_join(&self->priv->calibration_validation);
 	vive_controller_poweroff(self);
 }
 
@@ -359,6 +416,11 @@ static void vive_controller_stop(OuvrtDevice *dev)
  */
 static void ouvrt_vive_controller_finalize(GObject *object)
 {
+	OuvrtViveController *self = OUVRT_VIVE_CONTROLLER(object);
+
+	calibration_cache_join(&self->priv->calibration_validation);
+	g_mutex_clear(&self->priv->config_lock);
+	g_object_unref(self->tracker);
 	G_OBJECT_CLASS(ouvrt_vive_controller_parent_class)->finalize(object);
 }
 
@@ -366,17 +428,26 @@ static void ouvrt_vive_controller_class_init(OuvrtViveControllerClass *klass)
 {
 	G_OBJECT_CLASS(klass)->finalize = ouvrt_vive_controller_finalize;
 	OUVRT_DEVICE_CLASS(klass)->start = vive_controller_start;
-	OUVRT_DEVICE_CLASS(klass)->thread = vive_controller_thread;
 	OUVRT_DEVICE_CLASS(klass)->stop = vive_controller_stop;
+	OUVRT_DEVICE_CLASS(klass)->hid_report = vive_controller_hid_report;
+	OUVRT_DEVICE_CLASS(klass)->hid_timeout = vive_controller_hid_timeout;
+	OUVRT_DEVICE_CLASS(klass)->replay_start = vive_controller_replay_start;
 }
 
 static void ouvrt_vive_controller_init(OuvrtViveController *self)
 {
 	self->dev.type = DEVICE_TYPE_CONTROLLER;
+	self->tracker = ouvrt_tracker_new();
 	self->priv = ouvrt_vive_controller_get_instance_private(self);
 
-	self->priv->config = NULL;
-	self->priv->connected = FALSE;
+	g_mutex_init(&self->priv->config_lock);
+	self->priv->serial[0] = '\0';
+	self->priv->connected = 0;
+	self->priv->probing = 0;
+	self->priv->calibration_validation = NULL;
+	clock_sync_init(&self->priv->clock, 32, 48000000);
+	ouvrt_vive_imu_config_init(&self->priv->imu_config);
+	self->priv->imu_messages = 0;
 }
 
 /*
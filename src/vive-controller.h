@@ -10,6 +10,7 @@
 #include <glib-object.h>
 
 #include "device.h"
+#include "tracker.h"
 
 #define OUVRT_TYPE_VIVE_CONTROLLER	(ouvrt_vive_controller_get_type())
 #define OUVRT_VIVE_CONTROLLER(obj)	(G_TYPE_CHECK_INSTANCE_CAST((obj), \
@@ -35,6 +36,8 @@ struct _OuvrtViveControllerPrivate;
 struct _OuvrtViveController {
 	OuvrtDevice dev;
 
+	OuvrtTracker *tracker;
+
 	OuvrtViveControllerPrivate *priv;
 };
 
@@ -5,20 +5,29 @@
  */
 #include <asm/byteorder.h>
 #include <errno.h>
-#include <poll.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/fcntl.h>
 #include <unistd.h>
+#include <json-glib/json-glib.h>
 
 #include "vive-headset-imu.h"
+#include "vive-config.h"
 #include "vive-hid-reports.h"
+#include "calibration-cache.h"
+#include "clock-sync.h"
 #include "device.h"
 #include "hidraw.h"
 #include "imu.h"
 
 struct _OuvrtViveHeadsetIMUPrivate {
 	uint8_t sequence;
+	struct clock_sync clock;
+	/* Replaced by the calibration thread, protects imu_config */
+	GMutex config_lock;
+	struct vive_imu_config imu_config;
+	GThread *calibration_validation;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(OuvrtViveHeadsetIMU, ouvrt_vive_headset_imu, \
@@ -52,6 +61,10 @@ static int vive_headset_get_firmware_version(OuvrtViveHeadsetIMU *self)
 		report.hardware_revision, report.hardware_version_major,
 		report.hardware_version_minor, report.hardware_version_micro);
 
+	/* Identifies the cached calibration data */
+	free(self->dev.version);
+	self->dev.version = g_strdup_printf("%u", firmware_version);
+
 	return 0;
 }
 
@@ -66,58 +79,130 @@ static inline int oldest_sequence_index(uint8_t a, uint8_t b, uint8_t c)
 }
 
 /*
- * Decodes the periodic sensor message containing IMU sample(s).
+ * Decodes the periodic sensor message containing IMU sample(s), received at
+ * the given host time. All three samples are converted in a single pass
+ * without branches, then the new ones are scaled under a single acquisition
+ * of the configuration lock and pushed to the tracker in order.
  */
 static void vive_headset_imu_decode_message(OuvrtViveHeadsetIMU *self,
-					    const void *buf, size_t len)
+					    const void *buf, size_t len,
+					    double host_time)
 {
 	const struct vive_headset_imu_report *report = buf;
 	const struct vive_headset_imu_sample *sample = report->sample;
+	struct imu_sample imu_samples[3];
 	uint8_t last_seq = self->priv->sequence;
-	int i, j;
+	int16_t acc[3][3];
+	int16_t gyro[3][3];
+	uint32_t ticks[3];
+	uint8_t seq[3];
+	int index[3];
+	int i, j, n;
 
 	(void)len;
 
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < 3; j++) {
+			acc[i][j] = __le16_to_cpu(sample[i].acc[j]);
+			gyro[i][j] = __le16_to_cpu(sample[i].gyro[j]);
+		}
+		/* 48 MHz ticks, wraps every ~89 s */
+		ticks[i] = __le32_to_cpu(sample[i].time);
+		seq[i] = sample[i].seq;
+	}
+
 	/*
 	 * The three samples are updated round-robin. New messages
 	 * can contain already seen samples in any place, but the
 	 * sequence numbers should always be consecutive.
 	 * Start at the sample with the oldest sequence number.
 	 */
-	i = oldest_sequence_index(sample[0].seq, sample[1].seq, sample[2].seq);
-
-	/* From there, handle all new samples */
-	for (j = 3; j; --j, i = (i + 1) % 3) {
-		int16_t acc[3];
-		int16_t gyro[3];
-		uint32_t time;
-		uint8_t seq;
-
-		sample = report->sample + i;
-		seq = sample->seq;
+	i = oldest_sequence_index(seq[0], seq[1], seq[2]);
 
+	/* From there, collect all new samples */
+	for (j = 3, n = 0; j; --j, i = (i + 1) % 3) {
 		/* Skip already seen samples */
-		if (seq == last_seq ||
-		    seq == (uint8_t)(last_seq - 1) ||
-		    seq == (uint8_t)(last_seq - 2))
+		if (seq[i] == last_seq ||
+		    seq[i] == (uint8_t)(last_seq - 1) ||
+		    seq[i] == (uint8_t)(last_seq - 2))
 			continue;
+		index[n++] = i;
+	}
+	if (!n)
+		return;
 
-		acc[0] = __le16_to_cpu(sample->acc[0]);
-		acc[1] = __le16_to_cpu(sample->acc[1]);
-		acc[2] = __le16_to_cpu(sample->acc[2]);
-		gyro[0] = __le16_to_cpu(sample->gyro[0]);
-		gyro[1] = __le16_to_cpu(sample->gyro[1]);
-		gyro[2] = __le16_to_cpu(sample->gyro[2]);
-		time = __le32_to_cpu(sample->time);
+	g_mutex_lock(&self->priv->config_lock);
+	for (j = 0; j < n; j++) {
+		vive_imu_scale_sample(&self->priv->imu_config, acc[index[j]],
+				      gyro[index[j]], &imu_samples[j]);
+	}
+	g_mutex_unlock(&self->priv->config_lock);
 
-		(void)acc;
-		(void)gyro;
-		(void)time;
+	for (j = 0; j < n; j++) {
+		i = index[j];
+		imu_samples[j].time = clock_sync_update(&self->priv->clock,
+							ticks[i], host_time);
+		imu_samples[j].magnetic_field = (vec3){ 0, 0, 0 };
+		imu_samples[j].temperature = 0;
 
-		self->priv->sequence = seq;
+		ouvrt_tracker_push_imu_sample(self->tracker, &imu_samples[j]);
+
+		self->priv->sequence = seq[i];
 	}
 }
 
+/*
+ * Reads the IMU range settings and factory calibration.
+ */
+static int vive_headset_imu_read_config(OuvrtDevice *dev, void *data)
+{
+	struct vive_imu_config *imu = data;
+	JsonNode *node;
+
+	ouvrt_vive_imu_config_init(imu);
+	ouvrt_vive_get_imu_range(dev, imu);
+
+	node = ouvrt_vive_get_config(dev);
+	if (!node)
+		return -1;
+
+	ouvrt_vive_parse_imu_config(json_node_get_object(node), imu);
+	json_node_unref(node);
+
+	return 0;
+}
+
+/*
+ * Applies the IMU configuration, possibly from the calibration thread.
+ */
+static void vive_headset_imu_config_done(OuvrtDevice *dev, const void *data)
+{
+	OuvrtViveHeadsetIMU *self = OUVRT_VIVE_HEADSET_IMU(dev);
+
+	g_mutex_lock(&self->priv->config_lock);
+	self->priv->imu_config = *(const struct vive_imu_config *)data;
+	g_mutex_unlock(&self->priv->config_lock);
+}
+
+/*
+ * Obtains the IMU configuration from the calibration cache or from the
+ * device. If it is not cached, the default range settings are used until
+ * the configuration has been read in the background.
+ */
+static void vive_headset_imu_get_config(OuvrtViveHeadsetIMU *self)
+{
+	g_mutex_lock(&self->priv->config_lock);
+	ouvrt_vive_imu_config_init(&self->priv->imu_config);
+	g_mutex_unlock(&self->priv->config_lock);
+
+	calibration_cache_get_async(&self->dev, "vive-headset-imu",
+				    self->dev.version,
+				    sizeof(struct vive_imu_config),
+				    vive_headset_imu_read_config,
+				    vive_headset_imu_config_done,
+				    &self->priv->calibration_validation);
+}
+
 static int vive_headset_enable_lighthouse(OuvrtViveHeadsetIMU *self)
 {
 	unsigned char buf[5] = { 0x04 };
@@ -150,6 +235,8 @@ static int vive_headset_imu_start(OuvrtDevice *dev)
 		return ret;
 	}
 
+	vive_headset_imu_get_config(self);
+
 	ret = vive_headset_enable_lighthouse(self);
 	if (ret < 0) {
 		g_print("%s: Failed to enable Lighthouse Receiver\n",
@@ -161,55 +248,46 @@ static int vive_headset_imu_start(OuvrtDevice *dev)
 }
 
 /*
- * Handles IMU messages.
+ * Applies the recorded IMU configuration.
  */
-static void vive_headset_imu_thread(OuvrtDevice *dev)
+static int vive_headset_imu_replay_start(OuvrtDevice *dev)
 {
-	OuvrtViveHeadsetIMU *self = OUVRT_VIVE_HEADSET_IMU(dev);
-	unsigned char buf[64];
-	struct pollfd fds;
-	int ret;
-
-	while (dev->active) {
-		fds.fd = dev->fd;
-		fds.events = POLLIN;
-		fds.revents = 0;
+	vive_headset_imu_get_config(OUVRT_VIVE_HEADSET_IMU(dev));
 
-		ret = poll(&fds, 1, 1000);
-		if (ret == -1) {
-			g_print("%s: Poll failure: %d\n", dev->name, errno);
-			continue;
-		}
+	return 0;
+}
 
-		if (fds.events & (POLLERR | POLLHUP | POLLNVAL))
-			break;
+/*
+ * Handles IMU messages.
+ */
+static void vive_headset_imu_hid_report(OuvrtDevice *dev,
+					const unsigned char *buf, size_t len,
+					double time)
+{
+	OuvrtViveHeadsetIMU *self = OUVRT_VIVE_HEADSET_IMU(dev);
 
-		if (!(fds.revents & POLLIN)) {
-			g_print("%s: Poll timeout\n", dev->name);
-			continue;
-		}
+	if (len != 52 || buf[0] != VIVE_HEADSET_IMU_REPORT_ID) {
+		g_print("%s: Error, invalid %zu-byte report 0x%02x\n",
+			dev->name, len, buf[0]);
+		return;
+	}
 
-		ret = read(dev->fd, buf, sizeof(buf));
-		if (ret == -1) {
-			g_print("%s: Read error: %d\n", dev->name, errno);
-			continue;
-		}
-		if (ret != 52 || buf[0] != VIVE_HEADSET_IMU_REPORT_ID) {
-			g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-				dev->name, ret, buf[0]);
-			continue;
-		}
+	vive_headset_imu_decode_message(self, buf, 52, time);
+}
 
-		vive_headset_imu_decode_message(self, buf, 52);
-	}
+static void vive_headset_imu_hid_timeout(OuvrtDevice *dev)
+{
+	g_print("%s: Poll timeout\n", dev->name);
 }
 
 /*
- * Nothing to do here.
+ * Waits for the background calibration readout or validation.
  */
 static void vive_headset_imu_stop(OuvrtDevice *dev)
 {
-	(void)dev;
+	OuvrtViveHeadsetIMU *self = OUVRT_VIVE_HEADSET_IMU(dev);
+
+	calibration_cache_join(&self->priv->calibration_validation);
 }
 
 /*
@@ -217,6 +295,11 @@ static void vive_headset_imu_stop(OuvrtDevice *dev)
  */
 static void ouvrt_vive_headset_imu_finalize(GObject *object)
 {
+	OuvrtViveHeadsetIMU *self = OUVRT_VIVE_HEADSET_IMU(object);
+
+	calibration_cache_join(&self->priv->calibration_validation);
+	g_mutex_clear(&self->priv->config_lock);
+	g_object_unref(self->tracker);
 	G_OBJECT_CLASS(ouvrt_vive_headset_imu_parent_class)->finalize(object);
 }
 
@@ -224,14 +307,22 @@ static void ouvrt_vive_headset_imu_class_init(OuvrtViveHeadsetIMUClass *klass)
 {
 	G_OBJECT_CLASS(klass)->finalize = ouvrt_vive_headset_imu_finalize;
 	OUVRT_DEVICE_CLASS(klass)->start = vive_headset_imu_start;
-	OUVRT_DEVICE_CLASS(klass)->thread = vive_headset_imu_thread;
 	OUVRT_DEVICE_CLASS(klass)->stop = vive_headset_imu_stop;
+	OUVRT_DEVICE_CLASS(klass)->hid_report = vive_headset_imu_hid_report;
+	OUVRT_DEVICE_CLASS(klass)->hid_timeout = vive_headset_imu_hid_timeout;
+	OUVRT_DEVICE_CLASS(klass)->replay_start = vive_headset_imu_replay_start;
 }
 
 static void ouvrt_vive_headset_imu_init(OuvrtViveHeadsetIMU *self)
 {
 	self->dev.type = DEVICE_TYPE_HMD;
+	self->tracker = ouvrt_tracker_new();
 	self->priv = ouvrt_vive_headset_imu_get_instance_private(self);
+
+	clock_sync_init(&self->priv->clock, 32, 48000000);
+	g_mutex_init(&self->priv->config_lock);
+	ouvrt_vive_imu_config_init(&self->priv->imu_config);
+	self->priv->calibration_validation = NULL;
 }
 
 /*
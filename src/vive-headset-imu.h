@@ -10,6 +10,7 @@
 #include <glib-object.h>
 
 #include "device.h"
+#include "tracker.h"
 
 #define OUVRT_TYPE_VIVE_HEADSET_IMU	(ouvrt_vive_headset_imu_get_type())
 #define OUVRT_VIVE_HEADSET_IMU(obj)	(G_TYPE_CHECK_INSTANCE_CAST((obj), \
@@ -35,6 +36,8 @@ struct _OuvrtViveHeadsetIMUPrivate;
 struct _OuvrtViveHeadsetIMU {
 	OuvrtDevice dev;
 
+	OuvrtTracker *tracker;
+
 	OuvrtViveHeadsetIMUPrivate *priv;
 };
 
@@ -5,7 +5,6 @@
  */
 #include <asm/byteorder.h>
 #include <errno.h>
-#include <poll.h>
 #include <pthread.h>
 #include <string.h>
 #include <stdint.h>
@@ -18,25 +17,18 @@
 #include "vive-headset-lighthouse.h"
 #include "vive-hid-reports.h"
 #include "device.h"
+#include "lighthouse.h"
 #include "math.h"
 
+#define MAX_SENSORS		32
+/* Minimum time between two error reports in seconds */
+#define ERROR_REPORT_INTERVAL	10.0
+
 enum pulse_mode {
 	SYNC,
 	SWEEP
 };
 
-struct lighthouse_rotor_calibration {
-	float tilt;
-	float phase;
-	float curve;
-	float gibphase;
-	float gibmag;
-};
-
-struct lighthouse_base_calibration {
-	struct lighthouse_rotor_calibration rotor[2];
-};
-
 struct lighthouse_base {
 	int data_sync;
 	int data_word;
@@ -62,6 +54,18 @@ struct lighthouse_sensor {
 	struct lighthouse_pulse sweep;
 };
 
+/*
+ * Decoding errors are counted instead of printed immediately, so that pulse
+ * decoding never waits for terminal output.
+ */
+struct lighthouse_errors {
+	unsigned int unknown_pulses;
+	unsigned int irregular_syncs;
+	unsigned int missed_sync_bits;
+	unsigned int missed_syncs;
+	unsigned int unknown_sensors;
+};
+
 struct _OuvrtViveHeadsetLighthousePrivate {
 	gboolean base_visible;
 	struct lighthouse_base base[2];
@@ -69,9 +73,14 @@ struct _OuvrtViveHeadsetLighthousePrivate {
 	enum pulse_mode mode;
 	uint32_t seen_by;
 	uint32_t last_timestamp;
+	/* Channel of the last sync pulse, 0 if unknown */
+	char channel;
 	uint16_t duration;
-	struct lighthouse_sensor sensor[32];
+	struct lighthouse_sensor sensor[MAX_SENSORS];
 	struct lighthouse_pulse last_sync;
+
+	struct lighthouse_errors errors;
+	double errors_time;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(OuvrtViveHeadsetLighthouse, ouvrt_vive_headset_lighthouse, \
@@ -84,7 +93,11 @@ struct lighthouse_sync_pulse {
 	gboolean data;
 };
 
-static struct lighthouse_sync_pulse pulse_table[8] = {
+/*
+ * Sync pulse durations encode three bits in steps of 500 ticks, starting at
+ * 3000 ticks. Each entry is valid for ±250 ticks around its duration.
+ */
+static const struct lighthouse_sync_pulse pulse_table[8] = {
 	{ 3000, 0, 0, 0 },
 	{ 3500, 0, 1, 0 },
 	{ 4000, 0, 0, 1 },
@@ -108,6 +121,64 @@ struct lighthouse_ootx_report {
 	__le16 gibmag[2];
 } __attribute__((packed));
 
+/*
+ * Returns the decoded sync pulse for the duration, or NULL if the duration is
+ * not valid. The code is computed directly instead of searching the table.
+ */
+static inline const struct lighthouse_sync_pulse *
+lighthouse_decode_sync_pulse(uint16_t duration)
+{
+	unsigned int offset = duration - 2750;
+
+	if (offset >= 8 * 500 || offset % 500 == 0)
+		return NULL;
+
+	return &pulse_table[offset / 500];
+}
+
+/*
+ * Sync pulse timing in 48 MHz ticks since the previous sync pulse: a single
+ * base station on channel A flashes every 400000 ticks (120 Hz); with two
+ * base stations, channel C follows 20000 ticks after channel B. Each entry
+ * lists the channel that is expected to follow.
+ */
+static const struct lighthouse_channel_timing {
+	char channel;
+	int32_t dt;
+	char next;
+} channel_timing[3] = {
+	{ 'A', 400000, 'A' },
+	{ 'B', 380000, 'C' },
+	{ 'C',  20000, 'B' },
+};
+
+#define CHANNEL_TIMING_TOLERANCE	4000
+
+/*
+ * Returns the channel of a sync pulse, given the time since the previous
+ * sync pulse and the channel of that, or 0 if the timing is irregular. In
+ * the steady state, only the expected successor is checked.
+ */
+static char lighthouse_sync_channel(int32_t dt, char last)
+{
+	const struct lighthouse_channel_timing *t;
+	int i;
+
+	if (last) {
+		t = &channel_timing[last - 'A'];
+		t = &channel_timing[t->next - 'A'];
+		if (abs(dt - t->dt) < CHANNEL_TIMING_TOLERANCE)
+			return t->channel;
+	}
+
+	for (i = 0, t = channel_timing; i < 3; i++, t++) {
+		if (abs(dt - t->dt) < CHANNEL_TIMING_TOLERANCE)
+			return t->channel;
+	}
+
+	return 0;
+}
+
 static inline float __le16_to_float(__le16 le16)
 {
 	return f16_to_float(__le16_to_cpu(le16));
@@ -240,7 +311,7 @@ lighthouse_base_handle_ootx_data_word(OuvrtViveHeadsetLighthouse *self,
 
 static void
 lighthouse_base_handle_sync_pulse(OuvrtViveHeadsetLighthouse *self,
-				  struct lighthouse_sync_pulse *pulse,
+				  const struct lighthouse_sync_pulse *pulse,
 				  char channel)
 {
 	struct lighthouse_base *base = &self->priv->base[channel == 'C'];
@@ -258,8 +329,7 @@ lighthouse_base_handle_sync_pulse(OuvrtViveHeadsetLighthouse *self,
 				lighthouse_base_handle_ootx_data_word(self,
 								      base);
 			} else {
-				g_print("%s: Missed a sync bit, restarting\n",
-					self->dev.name);
+				self->priv->errors.missed_sync_bits++;
 				/* Missing sync bit, restart */
 				base->data_word = -1;
 			}
@@ -291,47 +361,35 @@ vive_headset_lighthouse_handle_sync_pulse(OuvrtViveHeadsetLighthouse *self,
 					  struct lighthouse_pulse *sync)
 {
 	OuvrtViveHeadsetLighthousePrivate *priv = self->priv;
-	struct lighthouse_sync_pulse *pulse;
+	const struct lighthouse_sync_pulse *pulse;
+	char channel;
 	int32_t dt;
-	int i;
 
 	if (!sync->duration)
 		return;
 
-	for (i = 0, pulse = pulse_table; i < 8; i++, pulse++) {
-		if (sync->duration > (pulse->duration - 250) &&
-		    sync->duration < (pulse->duration + 250)) {
-			break;
-		}
-	}
-	if (i == 8) {
-		g_print("%s: Unknown pulse length: %d\n", self->dev.name,
-			sync->duration);
+	pulse = lighthouse_decode_sync_pulse(sync->duration);
+	if (!pulse) {
+		priv->errors.unknown_pulses++;
 		return;
 	}
 
 	dt = sync->timestamp - priv->last_timestamp;
 
-	/* 48 MHz / 120 Hz = 400000 cycles per sync pulse */
-	if (dt > (400000 - 4000) && dt < (400000 + 4000)) {
-		/* Observing a single base station, channel A */
-		lighthouse_base_handle_sync_pulse(self, pulse, 'A');
-	} else if (dt > (380000 - 4000) && dt < (380000 + 4000)) {
-		/* Observing two base stations, this is channel B */
-		lighthouse_base_handle_sync_pulse(self, pulse, 'B');
-	} else if (dt > (20000 - 4000) && dt < (20000 + 4000)) {
-		/* Observing two base stations, this is channel C */
-		lighthouse_base_handle_sync_pulse(self, pulse, 'C');
-	} else {
+	channel = lighthouse_sync_channel(dt, priv->channel);
+	priv->channel = channel;
+	if (!channel) {
 		/* Irregular sync pulse */
 		if (priv->last_timestamp)
-			g_print("%s: Irregular sync pulse: %u -> %u (%+d)\n",
-				self->dev.name, priv->last_timestamp,
-				sync->timestamp, dt);
+			priv->errors.irregular_syncs++;
 		lighthouse_base_reset(&priv->base[0]);
 		lighthouse_base_reset(&priv->base[1]);
+		priv->last_timestamp = sync->timestamp;
+		return;
 	}
 
+	lighthouse_base_handle_sync_pulse(self, pulse, channel);
+
 	priv->last_timestamp = sync->timestamp;
 }
 
@@ -368,95 +426,98 @@ vive_headset_lighthouse_handle_pulse(OuvrtViveHeadsetLighthouse *self,
 		priv->mode = SYNC;
 	} else {
 		if (priv->mode == SYNC && dt <= priv->last_sync.duration)
-			g_print("%s: error, expected sync\n", self->dev.name);
+			priv->errors.missed_syncs++;
 		priv->mode = SWEEP;
 	}
 }
 
 /*
- * Decodes the periodic Lighthouse receiver message containing IR pulse
- * timing measurements.
+ * Handles the pulses of a single Lighthouse receiver message, after they have
+ * been unpacked into separate sensor id, duration, and timestamp arrays.
  */
 static void
-vive_headset_lighthouse_decode_pulse_report1(OuvrtViveHeadsetLighthouse *self,
-					     const void *buf)
+vive_headset_lighthouse_handle_pulses(OuvrtViveHeadsetLighthouse *self,
+				      const uint16_t *sensor_id,
+				      const uint16_t *duration,
+				      const uint32_t *timestamp,
+				      unsigned int num_pulses)
 {
-	const struct vive_headset_lighthouse_pulse_report1 *report = buf;
 	unsigned int i;
 
 	/* The pulses may appear in arbitrary order */
-	for (i = 0; i < 7; i++) {
-		const struct vive_headset_lighthouse_pulse1 *pulse;
-		uint16_t sensor_id;
-		uint16_t duration;
-		uint32_t timestamp;
-
-		pulse = &report->pulse[i];
-
-		sensor_id = __le16_to_cpu(pulse->id);
-		if (sensor_id == 0xffff)
+	for (i = 0; i < num_pulses; i++) {
+		if (sensor_id[i] == 0xffff)
 			continue;
 
-		timestamp = __le32_to_cpu(pulse->timestamp);
-		if (sensor_id == 0x00fe) {
+		if (sensor_id[i] == 0x00fe) {
 			/* TODO: handle vsync timestamp */
 			continue;
 		}
-		if (sensor_id == 0xfefe) {
+		if (sensor_id[i] == 0xfefe) {
 			/* Unknown timestamp, ignore */
 			continue;
 		}
 
-		if (sensor_id > 31) {
-			g_print("%s: unhandled sensor id: %04x\n",
-				self->dev.name, sensor_id);
+		if (sensor_id[i] > 31) {
+			self->priv->errors.unknown_sensors++;
 			return;
 		}
 
-		duration = __le16_to_cpu(pulse->duration);
+		vive_headset_lighthouse_handle_pulse(self, sensor_id[i],
+						     duration[i], timestamp[i]);
+	}
+}
+
+/*
+ * Decodes the periodic Lighthouse receiver message containing IR pulse
+ * timing measurements. All pulses are unpacked in a single pass before
+ * any of them is handled.
+ */
+static void
+vive_headset_lighthouse_decode_pulse_report1(OuvrtViveHeadsetLighthouse *self,
+					     const void *buf)
+{
+	const struct vive_headset_lighthouse_pulse_report1 *report = buf;
+	uint16_t sensor_id[7];
+	uint16_t duration[7];
+	uint32_t timestamp[7];
+	unsigned int i;
 
-		vive_headset_lighthouse_handle_pulse(self, sensor_id, duration,
-						     timestamp);
+	for (i = 0; i < 7; i++) {
+		sensor_id[i] = __le16_to_cpu(report->pulse[i].id);
+		duration[i] = __le16_to_cpu(report->pulse[i].duration);
+		timestamp[i] = __le32_to_cpu(report->pulse[i].timestamp);
 	}
+
+	vive_headset_lighthouse_handle_pulses(self, sensor_id, duration,
+					      timestamp, 7);
 }
 
+/*
+ * Decodes the Lighthouse receiver message with 8-bit sensor ids. Empty slots
+ * (0xff) are widened to 0xffff, so that both report types can share the
+ * same pulse handling.
+ */
 static void
 vive_headset_lighthouse_decode_pulse_report2(OuvrtViveHeadsetLighthouse *self,
 					     const void *buf)
 {
 	const struct vive_headset_lighthouse_pulse_report2 *report = buf;
+	uint16_t sensor_id[9];
+	uint16_t duration[9];
+	uint32_t timestamp[9];
 	unsigned int i;
 
-	/* The pulses may appear in arbitrary order */
 	for (i = 0; i < 9; i++) {
-		const struct vive_headset_lighthouse_pulse2 *pulse;
-		uint8_t sensor_id;
-		uint16_t duration;
-		uint32_t timestamp;
-
-		pulse = &report->pulse[i];
+		uint8_t id = report->pulse[i].id;
 
-		sensor_id = pulse->id;
-		if (sensor_id == 0xff)
-			continue;
-
-		timestamp = __le32_to_cpu(pulse->timestamp);
-		if (sensor_id == 0xfe) {
-			/* TODO: handle vsync timestamp */
-			continue;
-		}
-
-		if (sensor_id > 31) {
-			g_print("%s: unhandled sensor id: %04x\n",
-				self->dev.name, sensor_id);
-			return;
-		}
-
-		duration = __le16_to_cpu(pulse->duration);
-
-		vive_headset_lighthouse_handle_pulse(self, sensor_id, duration,
-						     timestamp);
+		sensor_id[i] = id | ((id == 0xff) << 8) * 0xff;
+		duration[i] = __le16_to_cpu(report->pulse[i].duration);
+		timestamp[i] = __le32_to_cpu(report->pulse[i].timestamp);
 	}
+
+	vive_headset_lighthouse_handle_pulses(self, sensor_id, duration,
+					      timestamp, 9);
 }
 
 /*
@@ -479,60 +540,69 @@ static int vive_headset_lighthouse_start(OuvrtDevice *dev)
 	return 0;
 }
 
+/*
+ * Prints and resets the decoding error counters, at most once every
+ * ERROR_REPORT_INTERVAL seconds.
+ */
+static void
+vive_headset_lighthouse_report_errors(OuvrtViveHeadsetLighthouse *self,
+				      double time)
+{
+	OuvrtViveHeadsetLighthousePrivate *priv = self->priv;
+	struct lighthouse_errors *e = &priv->errors;
+
+	if (time < priv->errors_time)
+		return;
+	priv->errors_time = time + ERROR_REPORT_INTERVAL;
+
+	if (!(e->unknown_pulses | e->irregular_syncs | e->missed_sync_bits |
+	      e->missed_syncs | e->unknown_sensors))
+		return;
+
+	g_print("%s: %u unknown pulses, %u irregular syncs, %u missed sync bits, %u missed syncs, %u unknown sensors\n",
+		self->dev.name, e->unknown_pulses, e->irregular_syncs,
+		e->missed_sync_bits, e->missed_syncs, e->unknown_sensors);
+	memset(e, 0, sizeof(*e));
+}
+
 /*
  * Handles Lighthouse Receiver messages.
  */
-static void vive_headset_lighthouse_thread(OuvrtDevice *dev)
+static void vive_headset_lighthouse_hid_report(OuvrtDevice *dev,
+					       const unsigned char *buf,
+					       size_t len, double time)
 {
 	OuvrtViveHeadsetLighthouse *self = OUVRT_VIVE_HEADSET_LIGHTHOUSE(dev);
-	unsigned char buf[64];
-	struct pollfd fds;
-	int ret;
-
-	while (dev->active) {
-		fds.fd = dev->fd;
-		fds.events = POLLIN;
-		fds.revents = 0;
-
-		ret = poll(&fds, 1, 1000);
-		if (ret == -1) {
-			g_print("%s: Poll failure: %d\n", dev->name, errno);
-			continue;
-		}
 
-		if (fds.revents & (POLLERR | POLLHUP | POLLNVAL))
-			break;
+	if (!self->priv->base_visible) {
+		g_print("%s: Spotted a base station\n", dev->name);
+		self->priv->base_visible = TRUE;
+	}
 
-		if (!(fds.revents & POLLIN)) {
-			/* No Lighthouse base station visible */
-			if (self->priv->base_visible) {
-				g_print("%s: Lost base station visibility\n",
-					dev->name);
-				self->priv->base_visible = FALSE;
-			}
-			continue;
-		}
+	if (len == 58 &&
+	    buf[0] == VIVE_HEADSET_LIGHTHOUSE_PULSE_REPORT1_ID) {
+		vive_headset_lighthouse_decode_pulse_report1(self, buf);
+	} else if (len == 64 ||
+		   buf[0] == VIVE_HEADSET_LIGHTHOUSE_PULSE_REPORT2_ID) {
+		vive_headset_lighthouse_decode_pulse_report2(self, buf);
+	} else {
+		g_print("%s: Error, invalid %zu-byte report 0x%02x\n",
+			dev->name, len, buf[0]);
+	}
 
-		if (!self->priv->base_visible) {
-			g_print("%s: Spotted a base station\n", dev->name);
-			self->priv->base_visible = TRUE;
-		}
+	vive_headset_lighthouse_report_errors(self, time);
+}
 
-		ret = read(dev->fd, buf, sizeof(buf));
-		if (ret == -1) {
-			g_print("%s: Read error: %d\n", dev->name, errno);
-			continue;
-		}
-		if (ret == 58 &&
-		    buf[0] == VIVE_HEADSET_LIGHTHOUSE_PULSE_REPORT1_ID) {
-			vive_headset_lighthouse_decode_pulse_report1(self, buf);
-		} else if (ret == 64 ||
-			   buf[0] == VIVE_HEADSET_LIGHTHOUSE_PULSE_REPORT2_ID) {
-			vive_headset_lighthouse_decode_pulse_report2(self, buf);
-		} else {
-			g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-				dev->name, ret, buf[0]);
-		}
+/*
+ * No reports arrive while no Lighthouse base station is visible.
+ */
+static void vive_headset_lighthouse_hid_timeout(OuvrtDevice *dev)
+{
+	OuvrtViveHeadsetLighthouse *self = OUVRT_VIVE_HEADSET_LIGHTHOUSE(dev);
+
+	if (self->priv->base_visible) {
+		g_print("%s: Lost base station visibility\n", dev->name);
+		self->priv->base_visible = FALSE;
 	}
 }
 
@@ -556,8 +626,9 @@ static void ouvrt_vive_headset_lighthouse_class_init(OuvrtViveHeadsetLighthouseC
 {
 	G_OBJECT_CLASS(klass)->finalize = ouvrt_vive_headset_lighthouse_finalize;
 	OUVRT_DEVICE_CLASS(klass)->start = vive_headset_lighthouse_start;
-	OUVRT_DEVICE_CLASS(klass)->thread = vive_headset_lighthouse_thread;
 	OUVRT_DEVICE_CLASS(klass)->stop = vive_headset_lighthouse_stop;
+	OUVRT_DEVICE_CLASS(klass)->hid_report = vive_headset_lighthouse_hid_report;
+	OUVRT_DEVICE_CLASS(klass)->hid_timeout = vive_headset_lighthouse_hid_timeout;
 }
 
 static void ouvrt_vive_headset_lighthouse_init(OuvrtViveHeadsetLighthouse *self)
@@ -570,6 +641,9 @@ static void ouvrt_vive_headset_lighthouse_init(OuvrtViveHeadsetLighthouse *self)
 	self->priv->last_timestamp = 0;
 	self->priv->last_sync.timestamp = 0;
 	self->priv->last_sync.duration = 0;
+	self->priv->channel = 0;
+	memset(&self->priv->errors, 0, sizeof(self->priv->errors));
+	self->priv->errors_time = 0;
 }
 
 /*
@@ -5,7 +5,6 @@
  */
 #include <asm/byteorder.h>
 #include <errno.h>
-#include <poll.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/fcntl.h>
@@ -18,6 +17,8 @@
 
 struct _OuvrtViveHeadsetMainboardPrivate {
 	uint16_t ipd;
+	/* Number of consecutive report timeouts */
+	int timeouts;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(OuvrtViveHeadsetMainboard, \
@@ -153,47 +154,32 @@ static int vive_headset_mainboard_start(OuvrtDevice *dev)
 /*
  * Handles Mainboard messages.
  */
-static void vive_headset_mainboard_thread(OuvrtDevice *dev)
+static void vive_headset_mainboard_hid_report(OuvrtDevice *dev,
+					      const unsigned char *buf,
+					      size_t len, double time)
 {
 	OuvrtViveHeadsetMainboard *self = OUVRT_VIVE_HEADSET_MAINBOARD(dev);
-	unsigned char buf[64];
-	struct pollfd fds;
-	int count = 0;
-	int ret;
 
-	while (dev->active) {
-		fds.fd = dev->fd;
-		fds.events = POLLIN;
-		fds.revents = 0;
+	(void)time;
 
-		ret = poll(&fds, 1, 1000);
-		if (ret == -1) {
-			g_print("%s: Poll failure: %d\n", dev->name, errno);
-			continue;
-		}
+	self->priv->timeouts = 0;
 
-		if (fds.events & (POLLERR | POLLHUP | POLLNVAL))
-			break;
+	if (len != 64 || buf[0] != 0x03) {
+		g_print("%s: Error, invalid %zu-byte report 0x%02x\n",
+			dev->name, len, buf[0]);
+		return;
+	}
 
-		if (!(fds.revents & POLLIN)) {
-			if (count++ > 3)
-				g_print("%s: Poll timeout: %d\n", dev->name, count);
-			continue;
-		}
+	vive_headset_mainboard_decode_message(self, buf, 64);
+}
 
-		ret = read(dev->fd, buf, sizeof(buf));
-		if (ret == -1) {
-			g_print("%s: Read error: %d\n", dev->name, errno);
-			continue;
-		}
-		if (ret != 64 || buf[0] != 0x03) {
-			g_print("%s: Error, invalid %d-byte report 0x%02x\n",
-				dev->name, ret, buf[0]);
-			continue;
-		}
+static void vive_headset_mainboard_hid_timeout(OuvrtDevice *dev)
+{
+	OuvrtViveHeadsetMainboard *self = OUVRT_VIVE_HEADSET_MAINBOARD(dev);
 
-		vive_headset_mainboard_decode_message(self, buf, 64);
-	}
+	if (self->priv->timeouts++ > 3)
+		g_print("%s: Poll timeout: %d\n", dev->name,
+			self->priv->timeouts);
 }
 
 /*
@@ -222,8 +208,9 @@ ouvrt_vive_headset_mainboard_class_init(OuvrtViveHeadsetMainboardClass *klass)
 {
 	G_OBJECT_CLASS(klass)->finalize = ouvrt_vive_headset_mainboard_finalize;
 	OUVRT_DEVICE_CLASS(klass)->start = vive_headset_mainboard_start;
-	OUVRT_DEVICE_CLASS(klass)->thread = vive_headset_mainboard_thread;
 	OUVRT_DEVICE_CLASS(klass)->stop = vive_headset_mainboard_stop;
+	OUVRT_DEVICE_CLASS(klass)->hid_report = vive_headset_mainboard_hid_report;
+	OUVRT_DEVICE_CLASS(klass)->hid_timeout = vive_headset_mainboard_hid_timeout;
 }
 
 static void ouvrt_vive_headset_mainboard_init(OuvrtViveHeadsetMainboard *self)
@@ -0,0 +1,378 @@
+/*
+ * Benchmarks blob detection, LED identification, and pose estimation
+ * on recorded camera frames
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ *
+ * Frames are read from a file of concatenated GRAY8 images, such as written
+ * by gst-launch-1.0 from the /tmp/ouvrtd-gst shared memory socket. The LED
+ * model file has one line per LED with position and direction x, y, z and
+ * the blinking pattern:
+ *
+ *   -0.052990 0.037154 0.043929 -0.572 0.601 0.557 0x2d5
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blobwatch.h"
+#include "flicker.h"
+#include "leds.h"
+#include "math.h"
+#include "pnp.h"
+#include "undistort.h"
+
+/* Same blob tracking parameters as the tracker */
+#define FULL_SCAN_INTERVAL	30
+#define TRACK_HISTORY		2
+
+enum stage {
+	STAGE_BLOBWATCH,
+	STAGE_FLICKER,
+	STAGE_PNP,
+	NUM_STAGES,
+};
+
+static const char *stage_names[NUM_STAGES] = {
+	"blobwatch",
+	"flicker",
+	"pnp",
+};
+
+/* Only frames that ran a stage are recorded, in ns[0] to ns[n - 1] */
+struct stage_stats {
+	uint64_t *ns;
+	int n;
+	uint64_t allocs;
+};
+
+/* Counts heap allocations, from all threads */
+static uint64_t num_allocs;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+static uint64_t allocs(void)
+{
+	return __atomic_load_n(&num_allocs, __ATOMIC_RELAXED);
+}
+
+/*
+ * Reads the whole frame file into memory, so that file I/O does not show up
+ * in the measurements.
+ */
+static uint8_t *read_frames(const char *filename, size_t frame_size,
+			    int *num_frames)
+{
+	uint8_t *frames;
+	size_t size;
+	FILE *f;
+
+	f = fopen(filename, "rb");
+	if (!f) {
+		fprintf(stderr, "failed to open '%s'\n", filename);
+		return NULL;
+	}
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	*num_frames = size / frame_size;
+	if (*num_frames == 0) {
+		fprintf(stderr, "'%s' contains no complete frame\n", filename);
+		fclose(f);
+		return NULL;
+	}
+
+	size = *num_frames * frame_size;
+	frames = malloc(size);
+	if (!frames || fread(frames, 1, size, f) != size) {
+		fprintf(stderr, "failed to read '%s'\n", filename);
+		free(frames);
+		frames = NULL;
+	}
+	fclose(f);
+
+	return frames;
+}
+
+/*
+ * Reads the LED model text file.
+ */
+static int read_leds(const char *filename, struct leds *leds)
+{
+	char line[256];
+	unsigned int pattern;
+	vec3 *p, *d;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr, "failed to open '%s'\n", filename);
+		return -1;
+	}
+
+	memset(leds, 0, sizeof(*leds));
+	while (fgets(line, sizeof(line), f) && leds->num < MAX_LEDS) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		p = &leds->positions[leds->num];
+		d = &leds->directions[leds->num];
+		if (sscanf(line, "%f %f %f %f %f %f %x", &p->x, &p->y, &p->z,
+			   &d->x, &d->y, &d->z, &pattern) != 7) {
+			fprintf(stderr, "invalid LED: %s", line);
+			fclose(f);
+			return -1;
+		}
+		leds->patterns[leds->num++] = pattern;
+	}
+	fclose(f);
+
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Records the time and heap allocations of a stage that started at time t
+ * with a allocations.
+ */
+static void record_stage(struct stage_stats *s, uint64_t t, uint64_t a)
+{
+	s->ns[s->n++] = now_ns() - t;
+	s->allocs += allocs() - a;
+}
+
+static void print_stats(enum stage stage, struct stage_stats *s)
+{
+	uint64_t sum = 0;
+	int n = s->n;
+	int i;
+
+	if (n == 0) {
+		printf("%-10s %10s\n", stage_names[stage], "-");
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		sum += s->ns[i];
+	qsort(s->ns, n, sizeof(*s->ns), cmp_u64);
+
+	printf("%-10s %10llu %10llu %10llu %12.2f\n", stage_names[stage],
+	       (unsigned long long)(sum / n),
+	       (unsigned long long)s->ns[n / 2],
+	       (unsigned long long)s->ns[(n * 99) / 100],
+	       (double)s->allocs / n);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: bench-tracker [options] <frames.gray> [leds.txt]\n"
+		"  -s, --size=WxH          frame size (default 752x480)\n"
+		"  -n, --iterations=N      passes over the frame file (default 1)\n"
+		"  -t, --threads=N         blob detection threads (default 1)\n"
+		"  -c, --camera=fx,fy,cx,cy[,k1,k2,p1,p2,k3]\n"
+		"                          camera intrinsics\n"
+		"  -R, --no-roi            always scan full frames\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{ "size", required_argument, NULL, 's' },
+		{ "iterations", required_argument, NULL, 'n' },
+		{ "threads", required_argument, NULL, 't' },
+		{ "camera", required_argument, NULL, 'c' },
+		{ "no-roi", no_argument, NULL, 'R' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct stage_stats stats[NUM_STAGES];
+	double k[5] = { 0 };
+	double fx = 715.0, fy = 715.0, cx = 376.0, cy = 240.0;
+	int width = 752, height = 480;
+	int iterations = 1, threads = 1;
+	int roi = 1;
+	struct undistort_map *undistort;
+	struct blobservation *ob;
+	struct blobwatch *bw;
+	struct flicker *fl;
+	struct leds leds;
+	struct leds *model = NULL;
+	uint8_t *frames;
+	dmat3 A;
+	dquat rot;
+	dvec3 trans;
+	int pose_valid = 0;
+	int num_frames, total, poses = 0;
+	uint64_t t, a;
+	int i, j, c, ret;
+
+	while ((c = getopt_long(argc, argv, "s:n:t:c:R", long_options,
+				NULL)) != -1) {
+		switch (c) {
+		case 's':
+			if (sscanf(optarg, "%dx%d", &width, &height) != 2) {
+				usage();
+				return -1;
+			}
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'c':
+			if (sscanf(optarg, "%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf",
+				   &fx, &fy, &cx, &cy, &k[0], &k[1], &k[2],
+				   &k[3], &k[4]) < 4) {
+				usage();
+				return -1;
+			}
+			break;
+		case 'R':
+			roi = 0;
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if (optind >= argc || iterations < 1 || threads < 1) {
+		usage();
+		return -1;
+	}
+
+	frames = read_frames(argv[optind], (size_t)width * height,
+			     &num_frames);
+	if (!frames)
+		return -1;
+
+	if (optind + 1 < argc) {
+		if (read_leds(argv[optind + 1], &leds) < 0)
+			return -1;
+		model = &leds;
+	}
+
+	A = (dmat3){ .m = { fx, 0, cx, 0, fy, cy, 0, 0, 1 } };
+
+	bw = blobwatch_new(width, height);
+	fl = flicker_new();
+	undistort = undistort_map_new(&A, k, width, height);
+	if (!bw || !fl || !undistort) {
+		fprintf(stderr, "failed to allocate blob detection\n");
+		return -1;
+	}
+	/* Disabled, flicker_process is called and timed separately */
+	blobwatch_set_flicker(bw, false);
+	blobwatch_set_roi(bw, roi, FULL_SCAN_INTERVAL);
+	blobwatch_set_track_history(bw, TRACK_HISTORY);
+	if (blobwatch_set_threads(bw, threads) < 0) {
+		fprintf(stderr, "failed to start detection threads\n");
+		return -1;
+	}
+
+	total = num_frames * iterations;
+	for (i = 0; i < NUM_STAGES; i++) {
+		stats[i].ns = calloc(total, sizeof(uint64_t));
+		stats[i].n = 0;
+		stats[i].allocs = 0;
+	}
+
+	for (i = 0; i < total; i++) {
+		uint8_t *frame = frames + (size_t)(i % num_frames) *
+					  width * height;
+
+		a = allocs();
+		t = now_ns();
+		blobwatch_process(bw, frame, width, height, 1, 0, model, &ob);
+		record_stage(&stats[STAGE_BLOBWATCH], t, a);
+
+		if (!ob || !model)
+			continue;
+
+		a = allocs();
+		t = now_ns();
+		flicker_process(fl, ob->blobs, ob->num_blobs, 0, model);
+		record_stage(&stats[STAGE_FLICKER], t, a);
+
+		a = allocs();
+		t = now_ns();
+		ret = -1;
+		if (pose_valid) {
+			ret = estimate_tracked_pose(ob->blobs, ob->num_blobs,
+						    model->positions,
+						    model->num, &A, k,
+						    undistort, &rot, &trans);
+		}
+		if (ret < 0) {
+			ret = estimate_initial_pose(ob->blobs, ob->num_blobs,
+						    model->positions,
+						    model->num, &A, k,
+						    undistort, &rot, &trans,
+						    false);
+		}
+		pose_valid = ret >= 0;
+		record_stage(&stats[STAGE_PNP], t, a);
+		poses += pose_valid;
+	}
+
+	printf("%d frames of %dx%d, %d thread(s), ROI %s\n", total, width,
+	       height, threads, roi ? "on" : "off");
+	printf("%-10s %10s %10s %10s %12s\n", "stage", "ns/frame", "p50 ns",
+	       "p99 ns", "allocs/frame");
+	for (j = 0; j < (model ? NUM_STAGES : 1); j++)
+		print_stats(j, &stats[j]);
+	if (model)
+		printf("pose found in %d of %d frames\n", poses, total);
+
+	for (i = 0; i < NUM_STAGES; i++)
+		free(stats[i].ns);
+	undistort_map_free(undistort);
+	blobwatch_free(bw);
+	flicker_free(fl);
+	free(frames);
+
+	return 0;
+}
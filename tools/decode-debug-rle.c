@@ -0,0 +1,131 @@
+/*
+ * Decodes a run-length compressed debug stream into raw GRAY8 frames
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ *
+ * The input is a dump of the compressed debug stream of ouvrtd --compress,
+ * for example written by:
+ *
+ *   gst-launch-1.0 shmsrc socket-path=/tmp/ouvrtd-gst ! filesink location=...
+ *
+ * Each buffer consists of the compressed frame, optionally followed by the
+ * debug attachment. The output can be viewed with a rawvideoparse GRAY8 pipeline
+ * or passed to bench-tracker.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "debug-rle.h"
+
+/*
+ * Reads the compressed frame that starts with the given header into data,
+ * and skips the debug attachment that may follow it.
+ *
+ * Returns 0 on success, or -1 at the end of the input or on errors.
+ */
+static int read_buffer(FILE *in, struct debug_rle_header *header,
+		       uint8_t **data, size_t *data_size)
+{
+	struct ouvrt_debug_attachment attach;
+
+	if (fread(header, sizeof(*header), 1, in) != 1)
+		return -1;
+	if (memcmp(header->magic, DEBUG_RLE_MAGIC, 4) != 0 ||
+	    header->size < sizeof(*header)) {
+		fprintf(stderr, "invalid compressed frame\n");
+		return -1;
+	}
+
+	if (*data_size < header->size) {
+		free(*data);
+		*data = malloc(header->size);
+		*data_size = header->size;
+		if (!*data)
+			return -1;
+	}
+	memcpy(*data, header, sizeof(*header));
+	if (fread(*data + sizeof(*header), header->size - sizeof(*header), 1,
+		  in) != 1)
+		return -1;
+
+	if (!(header->flags & DEBUG_RLE_FLAG_ATTACHMENT))
+		return 0;
+
+	if (fread(&attach, sizeof(attach), 1, in) != 1 ||
+	    fseek(in, (long)attach.num_blobs * sizeof(struct blob),
+		  SEEK_CUR) != 0)
+		return -1;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct debug_rle_header header;
+	uint8_t *data = NULL, *frame = NULL;
+	size_t data_size = 0, frame_size = 0;
+	size_t compressed = 0;
+	int width = 0, height = 0;
+	int num_frames = 0;
+	FILE *in, *out;
+
+	if (argc != 3) {
+		fprintf(stderr,
+			"usage: decode-debug-rle <stream.rle> <frames.gray>\n");
+		return -1;
+	}
+
+	in = fopen(argv[1], "rb");
+	if (!in) {
+		fprintf(stderr, "failed to open '%s'\n", argv[1]);
+		return -1;
+	}
+
+	out = strcmp(argv[2], "-") ? fopen(argv[2], "wb") : stdout;
+	if (!out) {
+		fprintf(stderr, "failed to open '%s'\n", argv[2]);
+		return -1;
+	}
+
+	while (read_buffer(in, &header, &data, &data_size) == 0) {
+		if (header.width != width || header.height != height) {
+			if (num_frames) {
+				fprintf(stderr, "frame size changed\n");
+				break;
+			}
+			width = header.width;
+			height = header.height;
+			frame_size = (size_t)width * height;
+			frame = malloc(frame_size);
+			if (!frame)
+				break;
+		}
+
+		if (debug_rle_decode(data, header.size, frame, width,
+				     height) < 0) {
+			fprintf(stderr, "corrupted frame %d\n", num_frames);
+			break;
+		}
+
+		fwrite(frame, 1, frame_size, out);
+		compressed += header.size;
+		num_frames++;
+	}
+
+	if (num_frames) {
+		fprintf(stderr, "%d frames of %dx%d, %.1f%% of raw size\n",
+			num_frames, width, height,
+			100.0 * compressed / (frame_size * num_frames));
+	}
+
+	free(frame);
+	free(data);
+	fclose(in);
+	if (out != stdout)
+		fclose(out);
+
+	return 0;
+}
@@ -0,0 +1,1182 @@
+/*
+ * Refines the Rift DK2 LED model and the Camera DK2 intrinsics from
+ * recorded sessions
+ * Copyright 2015 Philipp Zabel
+ * SPDX-License-Identifier:	GPL-2.0+
+ *
+ * The camera frames of recordings made with ouvrtd --record are passed
+ * through the same blob detection, LED identification, and pose estimation
+ * as in the tracker, starting from the recorded calibration. The identified
+ * blobs of every few frames with a pose are collected, and a bundle
+ * adjustment then jointly refines the frame poses, the LED positions, and
+ * the camera matrix and distortion coefficients by minimizing the Huber
+ * loss of the reprojection errors with Levenberg-Marquardt. The LED
+ * positions and intrinsics are tied to the recorded calibration by weak
+ * priors, which also fix the gauge freedom of the LED model frame. The
+ * normal equations are sparse: each observation only connects one frame
+ * pose with one LED and the intrinsics. So the frame poses are eliminated
+ * with the Schur complement, and the remaining dense system over all LEDs
+ * and the intrinsics is small enough to be solved directly.
+ *
+ * The results are written as refined calibration files into the ouvrtd
+ * cache directory, from where the daemon loads them instead of the factory
+ * calibration:
+ *
+ *   $ ./refine-calibration session1.rec session2.rec
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "blobwatch.h"
+#include "calibration-data.h"
+#include "leds.h"
+#include "math.h"
+#include "pnp.h"
+#include "recording-reader.h"
+#include "undistort.h"
+
+/* Same blob tracking parameters as the tracker */
+#define FULL_SCAN_INTERVAL	30
+#define TRACK_HISTORY		2
+
+#define MAX_DEVICES		16
+
+/* Identified blobs needed for a frame to be used */
+#define MIN_FRAME_OBSERVATIONS	6
+/* Reprojection error above which an identification is not trusted */
+#define LABEL_GATE		3.0	/* pixels */
+/* Reprojection errors above this are down-weighted */
+#define HUBER_DELTA		2.0	/* pixels */
+#define MIN_FRAMES		10
+
+/* Standard deviations of the priors on the recorded calibration */
+#define LED_SIGMA		0.001	/* meters */
+#define CAMERA_MATRIX_SIGMA	20.0	/* pixels */
+#define DIST_COEFF_SIGMA	0.05
+
+#define MAX_LAMBDA		1e10
+
+/* fx, fy, cx, cy, k1, k2, p1, p2, k3 */
+#define NUM_INTRINSICS		9
+/* Pose delta, LED position, and intrinsics of a single observation */
+#define NUM_LOCAL		(6 + 3 + NUM_INTRINSICS)
+
+struct observation {
+	int led;
+	/* Blob centroid in pixels */
+	double x;
+	double y;
+};
+
+struct frame {
+	dmat3 R;
+	dvec3 t;
+	int first_observation;
+	int num_observations;
+};
+
+struct bundle {
+	int num_leds;
+	dvec3 leds[MAX_LEDS];
+	double intrinsics[NUM_INTRINSICS];
+	dvec3 leds_prior[MAX_LEDS];
+	double intrinsics_prior[NUM_INTRINSICS];
+	bool fix_leds;
+	bool fix_intrinsics;
+
+	struct frame *frames;
+	int num_frames;
+	int max_frames;
+	struct observation *observations;
+	int num_observations;
+	int max_observations;
+	int led_observations[MAX_LEDS];
+
+	/* Normal equations, number of structure parameters, and Schur work */
+	int num_params;
+	double *S;
+	double *b;
+	double *diag;
+	double *U;
+	double *W;
+	double *bf;
+	double *X;
+	/* Backup of the frame poses while trying an update step */
+	struct frame *saved_frames;
+};
+
+/*
+ * Calibration as found in the first recording, which is also used for LED
+ * identification and initial pose estimation in all recordings.
+ */
+struct session {
+	bool have_rift;
+	bool have_camera;
+	char rift_serial[64];
+	char camera_serial[64];
+	struct rift_dk2_calibration rift;
+	struct camera_dk2_calibration camera;
+	int step;
+	int max_frames;
+	int tracked_frames;
+};
+
+/*
+ * Returns the index-th zero terminated string in the payload, or NULL.
+ */
+static const char *payload_string(const char *payload, size_t size, int index)
+{
+	const char *end = payload + size;
+	const char *nul;
+
+	for (;;) {
+		nul = memchr(payload, '\0', end - payload);
+		if (!nul)
+			return NULL;
+		if (index-- == 0)
+			return payload;
+		payload = nul + 1;
+	}
+}
+
+/*
+ * Projects the point p, given in the LED model frame, into the image with
+ * the pose [R|t] and intrinsics c. This is the camera model of
+ * project_points, in double precision for the numerical derivatives.
+ *
+ * Returns false if the point is behind the camera.
+ */
+static bool project(const dmat3 *R, const dvec3 *t, const dvec3 *p,
+		    const double c[NUM_INTRINSICS], double *u, double *v)
+{
+	const double *k = c + 4;
+	dvec3 P = dmat3_transform(R, t, p);
+	double x, y, r2, radial, xd, yd;
+
+	if (P.z <= 0)
+		return false;
+
+	x = P.x / P.z;
+	y = P.y / P.z;
+	r2 = x * x + y * y;
+	radial = 1 + ((k[4] * r2 + k[1]) * r2 + k[0]) * r2;
+	xd = x * radial + 2 * k[2] * x * y + k[3] * (r2 + 2 * x * x);
+	yd = y * radial + k[2] * (r2 + 2 * y * y) + 2 * k[3] * x * y;
+
+	*u = c[0] * xd + c[2];
+	*v = c[1] * yd + c[3];
+
+	return true;
+}
+
+/*
+ * Applies a small rotation, given as rotation vector delta[0-2], and a
+ * translation delta[3-5] to the camera frame pose.
+ */
+static void pose_update(dmat3 *R, dvec3 *t, const dmat3 *R0, const dvec3 *t0,
+			const double delta[6])
+{
+	const dvec3 w = { delta[0], delta[1], delta[2] };
+	dquat q;
+	dmat3 E;
+
+	dquat_from_rotation_vector(&q, &w);
+	dmat3_from_dquat(&E, &q);
+	dmat3_mult(R, &E, R0);
+	t->x = t0->x + delta[3];
+	t->y = t0->y + delta[4];
+	t->z = t0->z + delta[5];
+}
+
+/*
+ * Calculates the reprojection error of an observation in frame f from the
+ * local parameters x: the pose delta, the LED position, and the intrinsics.
+ *
+ * Returns false if the LED is behind the camera.
+ */
+static bool local_residual(const struct frame *f, const struct observation *o,
+			   const double x[NUM_LOCAL], double r[2])
+{
+	const dvec3 p = { x[6], x[7], x[8] };
+	double u, v;
+	dmat3 R;
+	dvec3 t;
+
+	pose_update(&R, &t, &f->R, &f->t, x);
+	if (!project(&R, &t, &p, x + 9, &u, &v))
+		return false;
+
+	r[0] = u - o->x;
+	r[1] = v - o->y;
+
+	return true;
+}
+
+static void local_params(const struct bundle *ba, const struct observation *o,
+			 double x[NUM_LOCAL])
+{
+	memset(x, 0, 6 * sizeof(double));
+	x[6] = ba->leds[o->led].x;
+	x[7] = ba->leds[o->led].y;
+	x[8] = ba->leds[o->led].z;
+	memcpy(x + 9, ba->intrinsics, sizeof(ba->intrinsics));
+}
+
+/*
+ * Returns the Huber weight of a residual with the given norm.
+ */
+static double huber_weight(double e)
+{
+	return e <= HUBER_DELTA ? 1.0 : HUBER_DELTA / e;
+}
+
+/*
+ * Returns the robust cost including the priors, and the RMS reprojection
+ * error of all observations in rms.
+ */
+static double bundle_cost(const struct bundle *ba, double *rms)
+{
+	const struct observation *o;
+	const struct frame *f;
+	double x[NUM_LOCAL];
+	double cost = 0, sum2 = 0;
+	double r[2], e, d;
+	int i, j;
+
+	for (i = 0; i < ba->num_frames; i++) {
+		f = &ba->frames[i];
+		for (j = 0; j < f->num_observations; j++) {
+			o = &ba->observations[f->first_observation + j];
+			local_params(ba, o, x);
+			if (!local_residual(f, o, x, r)) {
+				/* Only possible after a bad step */
+				sum2 += 1e6;
+				cost += 1e6;
+				continue;
+			}
+			e = r[0] * r[0] + r[1] * r[1];
+			sum2 += e;
+			e = __builtin_sqrt(e);
+			if (e <= HUBER_DELTA)
+				cost += 0.5 * e * e;
+			else
+				cost += HUBER_DELTA * (e - 0.5 * HUBER_DELTA);
+		}
+	}
+
+	for (i = 0; i < ba->num_leds; i++) {
+		dvec3 dp = dvec3_sub(&ba->leds[i], &ba->leds_prior[i]);
+
+		cost += 0.5 * dvec3_dot(&dp, &dp) / (LED_SIGMA * LED_SIGMA);
+	}
+	for (i = 0; i < NUM_INTRINSICS; i++) {
+		d = (ba->intrinsics[i] - ba->intrinsics_prior[i]) /
+		    (i < 4 ? CAMERA_MATRIX_SIGMA : DIST_COEFF_SIGMA);
+		cost += 0.5 * d * d;
+	}
+
+	*rms = ba->num_observations ?
+	       __builtin_sqrt(sum2 / ba->num_observations) : 0;
+
+	return cost;
+}
+
+/*
+ * Decomposes the symmetric positive definite n x n matrix A in place into
+ * its lower triangular Cholesky factor.
+ *
+ * Returns 0 on success, or -1 if A is not positive definite.
+ */
+static int cholesky_decompose(double *A, int n)
+{
+	double d, s;
+	int i, j, k;
+
+	for (j = 0; j < n; j++) {
+		d = A[j * n + j];
+		for (k = 0; k < j; k++)
+			d -= A[j * n + k] * A[j * n + k];
+		if (d <= 0)
+			return -1;
+		d = __builtin_sqrt(d);
+		A[j * n + j] = d;
+		for (i = j + 1; i < n; i++) {
+			s = A[i * n + j];
+			for (k = 0; k < j; k++)
+				s -= A[i * n + k] * A[j * n + k];
+			A[i * n + j] = s / d;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Solves L L^T x = b in place, with the Cholesky factor L.
+ */
+static void cholesky_solve(const double *L, double *b, int n)
+{
+	int i, k;
+
+	for (i = 0; i < n; i++) {
+		for (k = 0; k < i; k++)
+			b[i] -= L[i * n + k] * b[k];
+		b[i] /= L[i * n + i];
+	}
+	for (i = n - 1; i >= 0; i--) {
+		for (k = i + 1; k < n; k++)
+			b[i] -= L[k * n + i] * b[k];
+		b[i] /= L[i * n + i];
+	}
+}
+
+/*
+ * Accumulates the Gauss-Newton normal equations of a single observation,
+ * with central difference derivatives, into the pose block U and pose rhs
+ * bf of its frame, the pose-structure block W, and the structure block S
+ * and rhs b.
+ */
+static void add_observation(struct bundle *ba, const struct frame *f,
+			    const struct observation *o, double *U, double *W,
+			    double *bf)
+{
+	static const double steps[NUM_LOCAL] = {
+		1e-6, 1e-6, 1e-6, 1e-6, 1e-6, 1e-6,
+		1e-6, 1e-6, 1e-6,
+		1e-3, 1e-3, 1e-3, 1e-3, 1e-6, 1e-6, 1e-6, 1e-6, 1e-6,
+	};
+	const int M = ba->num_params;
+	double J[2][NUM_LOCAL];
+	double x[NUM_LOCAL];
+	double r[2], rp[2], rm[2];
+	int idx[NUM_LOCAL];
+	double w, h, g;
+	int j, k;
+
+	local_params(ba, o, x);
+	if (!local_residual(f, o, x, r))
+		return;
+
+	for (j = 0; j < NUM_LOCAL; j++) {
+		double xj = x[j];
+
+		/* Skip LEDs that are too close to the camera plane */
+		x[j] = xj + steps[j];
+		if (!local_residual(f, o, x, rp))
+			return;
+		x[j] = xj - steps[j];
+		if (!local_residual(f, o, x, rm))
+			return;
+		x[j] = xj;
+		J[0][j] = (rp[0] - rm[0]) / (2 * steps[j]);
+		J[1][j] = (rp[1] - rm[1]) / (2 * steps[j]);
+
+		/* Structure parameter index */
+		if (j < 6)
+			idx[j] = -1;
+		else if (j < 9)
+			idx[j] = 3 * o->led + j - 6;
+		else
+			idx[j] = 3 * ba->num_leds + j - 9;
+	}
+
+	/* Iteratively reweighted least squares for the Huber loss */
+	w = huber_weight(__builtin_sqrt(r[0] * r[0] + r[1] * r[1]));
+
+	for (j = 0; j < NUM_LOCAL; j++) {
+		for (k = 0; k < NUM_LOCAL; k++) {
+			h = w * (J[0][j] * J[0][k] + J[1][j] * J[1][k]);
+			if (j < 6 && k < 6)
+				U[j * 6 + k] += h;
+			else if (j < 6)
+				W[j * M + idx[k]] += h;
+			else if (k >= 6)
+				ba->S[idx[j] * M + idx[k]] += h;
+		}
+		g = -w * (J[0][j] * r[0] + J[1][j] * r[1]);
+		if (j < 6)
+			bf[j] += g;
+		else
+			ba->b[idx[j]] += g;
+		if (j >= 6)
+			ba->diag[idx[j]] += w * (J[0][j] * J[0][j] +
+						 J[1][j] * J[1][j]);
+	}
+}
+
+/*
+ * Linearizes the problem at the current parameters and calculates the
+ * Levenberg-Marquardt step with damping lambda. The step for the structure
+ * parameters is stored in b, the pose steps of each frame in its bf.
+ *
+ * Returns 0 on success, or -1 if the damped system is singular.
+ */
+static int bundle_step(struct bundle *ba, double lambda)
+{
+	const int M = ba->num_params;
+	double *U, *W, *bf, *X = ba->X;
+	double inv_sigma2, s;
+	int i, j, k, l;
+
+	memset(ba->S, 0, sizeof(double) * M * M);
+	memset(ba->b, 0, sizeof(double) * M);
+	memset(ba->diag, 0, sizeof(double) * M);
+
+	/* Priors */
+	for (i = 0; i < M; i++) {
+		double value, prior;
+
+		if (i < 3 * ba->num_leds) {
+			value = ((double *)&ba->leds[i / 3])[i % 3];
+			prior = ((double *)&ba->leds_prior[i / 3])[i % 3];
+			inv_sigma2 = 1.0 / (LED_SIGMA * LED_SIGMA);
+		} else {
+			j = i - 3 * ba->num_leds;
+			value = ba->intrinsics[j];
+			prior = ba->intrinsics_prior[j];
+			s = j < 4 ? CAMERA_MATRIX_SIGMA : DIST_COEFF_SIGMA;
+			inv_sigma2 = 1.0 / (s * s);
+		}
+		ba->S[i * M + i] += inv_sigma2;
+		ba->diag[i] += inv_sigma2;
+		ba->b[i] -= (value - prior) * inv_sigma2;
+	}
+
+	for (i = 0; i < ba->num_frames; i++) {
+		const struct frame *f = &ba->frames[i];
+
+		U = ba->U + i * 36;
+		W = ba->W + (size_t)i * 6 * M;
+		bf = ba->bf + i * 6;
+		memset(U, 0, sizeof(double) * 36);
+		memset(W, 0, sizeof(double) * 6 * M);
+		memset(bf, 0, sizeof(double) * 6);
+
+		for (j = 0; j < f->num_observations; j++) {
+			add_observation(ba, f, &ba->observations[
+					f->first_observation + j], U, W, bf);
+		}
+
+		for (j = 0; j < 6; j++)
+			U[j * 6 + j] *= 1 + lambda;
+		if (cholesky_decompose(U, 6) < 0)
+			return -1;
+
+		/* S -= W^T U^-1 W, b -= W^T U^-1 bf */
+		for (k = 0; k < M; k++) {
+			for (j = 0; j < 6; j++)
+				X[j] = W[j * M + k];
+			cholesky_solve(U, X, 6);
+			for (l = 0; l < M; l++) {
+				s = 0;
+				for (j = 0; j < 6; j++)
+					s += W[j * M + l] * X[j];
+				ba->S[l * M + k] -= s;
+			}
+			s = 0;
+			for (j = 0; j < 6; j++)
+				s += bf[j] * X[j];
+			ba->b[k] -= s;
+		}
+	}
+
+	for (i = 0; i < M; i++) {
+		ba->S[i * M + i] += lambda * ba->diag[i];
+
+		/* Fixed parameters are removed from the reduced system */
+		if ((i < 3 * ba->num_leds && ba->fix_leds) ||
+		    (i >= 3 * ba->num_leds && ba->fix_intrinsics)) {
+			for (j = 0; j < M; j++) {
+				ba->S[i * M + j] = 0;
+				ba->S[j * M + i] = 0;
+			}
+			ba->S[i * M + i] = 1;
+			ba->b[i] = 0;
+		}
+	}
+
+	if (cholesky_decompose(ba->S, M) < 0)
+		return -1;
+	cholesky_solve(ba->S, ba->b, M);
+
+	/* Back-substitution of the pose steps: U dp = bf - W ds */
+	for (i = 0; i < ba->num_frames; i++) {
+		U = ba->U + i * 36;
+		W = ba->W + (size_t)i * 6 * M;
+		bf = ba->bf + i * 6;
+		for (j = 0; j < 6; j++) {
+			for (k = 0; k < M; k++)
+				bf[j] -= W[j * M + k] * ba->b[k];
+		}
+		cholesky_solve(U, bf, 6);
+	}
+
+	return 0;
+}
+
+/*
+ * Applies the step calculated by bundle_step.
+ */
+static void bundle_apply_step(struct bundle *ba)
+{
+	struct frame *f;
+	dmat3 R;
+	dvec3 t;
+	int i;
+
+	for (i = 0; i < ba->num_frames; i++) {
+		f = &ba->frames[i];
+		pose_update(&R, &t, &f->R, &f->t, ba->bf + i * 6);
+		f->R = R;
+		f->t = t;
+	}
+	for (i = 0; i < 3 * ba->num_leds; i++)
+		((double *)&ba->leds[i / 3])[i % 3] += ba->b[i];
+	for (i = 0; i < NUM_INTRINSICS; i++)
+		ba->intrinsics[i] += ba->b[3 * ba->num_leds + i];
+}
+
+/*
+ * Runs Levenberg-Marquardt iterations until the cost converges.
+ *
+ * Returns 0 on success, negative values on error.
+ */
+static int bundle_adjust(struct bundle *ba, int iterations)
+{
+	const int M = 3 * ba->num_leds + NUM_INTRINSICS;
+	dvec3 saved_leds[MAX_LEDS];
+	double saved_intrinsics[NUM_INTRINSICS];
+	double lambda = 1e-3;
+	double cost, new_cost, rms;
+	int i;
+
+	ba->num_params = M;
+	ba->S = malloc(sizeof(double) * M * M);
+	ba->b = malloc(sizeof(double) * M);
+	ba->diag = malloc(sizeof(double) * M);
+	ba->X = malloc(sizeof(double) * 6);
+	ba->U = malloc(sizeof(double) * 36 * ba->num_frames);
+	ba->W = malloc(sizeof(double) * 6 * M * ba->num_frames);
+	ba->bf = malloc(sizeof(double) * 6 * ba->num_frames);
+	ba->saved_frames = malloc(sizeof(struct frame) * ba->num_frames);
+	if (!ba->S || !ba->b || !ba->diag || !ba->X || !ba->U || !ba->W ||
+	    !ba->bf || !ba->saved_frames) {
+		fprintf(stderr, "failed to allocate normal equations\n");
+		return -ENOMEM;
+	}
+
+	cost = bundle_cost(ba, &rms);
+	for (i = 0; i < iterations && lambda < MAX_LAMBDA; i++) {
+		if (bundle_step(ba, lambda) < 0) {
+			lambda *= 10;
+			continue;
+		}
+
+		memcpy(saved_leds, ba->leds, sizeof(saved_leds));
+		memcpy(saved_intrinsics, ba->intrinsics,
+		       sizeof(saved_intrinsics));
+		memcpy(ba->saved_frames, ba->frames,
+		       sizeof(struct frame) * ba->num_frames);
+
+		bundle_apply_step(ba);
+		new_cost = bundle_cost(ba, &rms);
+		if (new_cost >= cost) {
+			memcpy(ba->leds, saved_leds, sizeof(saved_leds));
+			memcpy(ba->intrinsics, saved_intrinsics,
+			       sizeof(saved_intrinsics));
+			memcpy(ba->frames, ba->saved_frames,
+			       sizeof(struct frame) * ba->num_frames);
+			lambda *= 10;
+			continue;
+		}
+
+		printf("iteration %2d: cost %.3f, RMS error %.4f px\n", i,
+		       new_cost, rms);
+		lambda = lambda / 10 > 1e-9 ? lambda / 10 : 1e-9;
+		if (cost - new_cost < 1e-9 * cost)
+			break;
+		cost = new_cost;
+	}
+
+	return 0;
+}
+
+static void bundle_free(struct bundle *ba)
+{
+	free(ba->frames);
+	free(ba->observations);
+	free(ba->S);
+	free(ba->b);
+	free(ba->diag);
+	free(ba->X);
+	free(ba->U);
+	free(ba->W);
+	free(ba->bf);
+	free(ba->saved_frames);
+}
+
+/*
+ * Adds the blobs identified in a frame with the estimated pose [rot|trans]
+ * to the bundle. Blobs that do not reproject close to their LED, and LEDs
+ * identified more than once, are skipped.
+ */
+static void bundle_add_frame(struct bundle *ba, const struct blobservation *ob,
+			     const dquat *rot, const dvec3 *trans)
+{
+	struct observation *o;
+	struct frame *f;
+	uint64_t seen = 0, duplicate = 0;
+	double u, v, du, dv;
+	int i, n = 0, max;
+	void *p;
+
+	if (ba->num_frames == ba->max_frames) {
+		max = ba->max_frames ? 2 * ba->max_frames : 256;
+		p = realloc(ba->frames, sizeof(*f) * max);
+		if (!p)
+			return;
+		ba->frames = p;
+		ba->max_frames = max;
+	}
+	if (ba->num_observations + MAX_LEDS > ba->max_observations) {
+		max = ba->max_observations ? 2 * ba->max_observations : 4096;
+		p = realloc(ba->observations, sizeof(*o) * max);
+		if (!p)
+			return;
+		ba->observations = p;
+		ba->max_observations = max;
+	}
+
+	for (i = 0; i < ob->num_blobs; i++) {
+		int led = ob->blobs[i].led_id;
+
+		if (led < 0 || led >= ba->num_leds)
+			continue;
+		if (seen & (1ULL << led))
+			duplicate |= 1ULL << led;
+		seen |= 1ULL << led;
+	}
+
+	f = &ba->frames[ba->num_frames];
+	dmat3_from_dquat(&f->R, rot);
+	f->t = *trans;
+	f->first_observation = ba->num_observations;
+
+	for (i = 0; i < ob->num_blobs; i++) {
+		const struct blob *b = &ob->blobs[i];
+		int led = b->led_id;
+
+		if (led < 0 || led >= ba->num_leds ||
+		    (duplicate & (1ULL << led)))
+			continue;
+		if (!project(&f->R, &f->t, &ba->leds[led], ba->intrinsics, &u,
+			     &v))
+			continue;
+		du = u - b->cx;
+		dv = v - b->cy;
+		if (du * du + dv * dv > LABEL_GATE * LABEL_GATE)
+			continue;
+
+		o = &ba->observations[f->first_observation + n++];
+		o->led = led;
+		o->x = b->cx;
+		o->y = b->cy;
+	}
+
+	if (n < MIN_FRAME_OBSERVATIONS)
+		return;
+
+	for (i = 0; i < n; i++)
+		ba->led_observations[ba->observations[f->first_observation +
+						      i].led]++;
+	f->num_observations = n;
+	ba->num_observations += n;
+	ba->num_frames++;
+}
+
+/*
+ * Initializes the bundle parameters and priors from the calibration of the
+ * first recording.
+ */
+static void bundle_init(struct bundle *ba, const struct session *s)
+{
+	int i;
+
+	ba->num_leds = s->rift.leds.num;
+	for (i = 0; i < ba->num_leds; i++)
+		ba->leds[i] = dvec3_from_vec3(&s->rift.leds.positions[i]);
+	ba->intrinsics[0] = s->camera.camera_matrix[0];
+	ba->intrinsics[1] = s->camera.camera_matrix[4];
+	ba->intrinsics[2] = s->camera.camera_matrix[2];
+	ba->intrinsics[3] = s->camera.camera_matrix[5];
+	memcpy(ba->intrinsics + 4, s->camera.dist_coeffs,
+	       sizeof(s->camera.dist_coeffs));
+
+	memcpy(ba->leds_prior, ba->leds, sizeof(ba->leds));
+	memcpy(ba->intrinsics_prior, ba->intrinsics, sizeof(ba->intrinsics));
+}
+
+/*
+ * Checks a calibration record against the calibration of the first
+ * recording, or takes it from there if this is the first recording.
+ *
+ * Returns 0 if the calibration can be used, or -1 if the recording is of
+ * different devices.
+ */
+static int session_add_calibration(struct session *s,
+				   const struct recording_record *record,
+				   const char *serial, int *rift_device,
+				   int *camera_device)
+{
+	const char *payload = (const char *)(record + 1);
+	const char *kind = payload_string(payload, record->size, 0);
+	const void *data;
+	size_t size;
+
+	if (!kind)
+		return 0;
+	data = kind + strlen(kind) + 1;
+	size = record->size - (strlen(kind) + 1);
+
+	if (strcmp(kind, "rift-dk2") == 0 &&
+	    size == sizeof(struct rift_dk2_calibration)) {
+		if (!s->have_rift) {
+			memcpy(&s->rift, data, size);
+			snprintf(s->rift_serial, sizeof(s->rift_serial), "%s",
+				 serial);
+			s->have_rift = true;
+		} else if (strcmp(s->rift_serial, serial) != 0) {
+			return -1;
+		}
+		*rift_device = record->device;
+	} else if (strcmp(kind, "camera-dk2") == 0 &&
+		   size == sizeof(struct camera_dk2_calibration)) {
+		if (!s->have_camera) {
+			memcpy(&s->camera, data, size);
+			snprintf(s->camera_serial, sizeof(s->camera_serial),
+				 "%s", serial);
+			s->have_camera = true;
+		} else if (strcmp(s->camera_serial, serial) != 0) {
+			return -1;
+		}
+		*camera_device = record->device;
+	}
+
+	return 0;
+}
+
+/*
+ * Replays the camera frames of a recording through blob detection and pose
+ * estimation, and adds the identified blobs of every step-th frame with a
+ * pose to the bundle.
+ *
+ * Returns 0 on success, negative values on error.
+ */
+static int session_process(struct session *s, struct bundle *ba,
+			   const char *filename)
+{
+	const struct recording_record *record;
+	struct recording_reader reader;
+	const char *serials[MAX_DEVICES] = { NULL };
+	struct undistort_map *undistort = NULL;
+	struct blobwatch *bw = NULL;
+	struct blobservation *ob;
+	int rift_device = -1, camera_device = -1;
+	uint8_t *buf = NULL;
+	size_t buf_size = 0;
+	uint32_t last_sequence = 0;
+	bool have_sequence = false;
+	bool pose_valid = false;
+	dquat rot;
+	dvec3 trans;
+	dmat3 A;
+	int skipped, ret;
+
+	ret = recording_reader_open(&reader, filename);
+	if (ret < 0)
+		return ret;
+
+	printf("processing '%s'\n", filename);
+	while ((record = recording_reader_next(&reader)) &&
+	       ba->num_frames < s->max_frames) {
+		const struct recording_frame *frame;
+
+		if (record->type == RECORDING_DEVICE) {
+			if (record->device < MAX_DEVICES) {
+				serials[record->device] =
+					payload_string((const char *)(record + 1),
+						       record->size, 2);
+			}
+			continue;
+		}
+
+		if (record->type == RECORDING_CALIBRATION) {
+			const char *serial = record->device < MAX_DEVICES ?
+					     serials[record->device] : NULL;
+
+			if (session_add_calibration(s, record,
+						    serial ? serial : "",
+						    &rift_device,
+						    &camera_device) < 0) {
+				fprintf(stderr, "'%s' was recorded with different devices, skipping\n",
+					filename);
+				break;
+			}
+			continue;
+		}
+
+		if (record->type != RECORDING_FRAME ||
+		    record->device != camera_device || rift_device < 0 ||
+		    record->size < sizeof(*frame))
+			continue;
+
+		frame = (const struct recording_frame *)(record + 1);
+		if (frame->size > buf_size) {
+			free(buf);
+			buf_size = frame->size;
+			buf = malloc(buf_size);
+			if (!buf) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+		if ((size_t)frame->width * frame->height *
+		    frame->pixel_stride > frame->size ||
+		    recording_frame_decode(frame, record->size, buf) < 0)
+			continue;
+
+		if (!bw) {
+			if (!ba->num_leds)
+				bundle_init(ba, s);
+			memcpy(A.m, s->camera.camera_matrix, sizeof(A.m));
+			bw = blobwatch_new(frame->width, frame->height);
+			undistort = undistort_map_new(&A,
+						      s->camera.dist_coeffs,
+						      frame->width,
+						      frame->height);
+			if (!bw || !undistort) {
+				fprintf(stderr, "failed to allocate blob detection\n");
+				ret = -ENOMEM;
+				break;
+			}
+			/* Identify blobs by their blinking patterns */
+			blobwatch_set_flicker(bw, true);
+			blobwatch_set_roi(bw, true, FULL_SCAN_INTERVAL);
+			blobwatch_set_track_history(bw, TRACK_HISTORY);
+			blobwatch_set_auto_threshold(bw, true);
+		}
+
+		skipped = 0;
+		if (have_sequence && record->sequence - last_sequence >= 1 &&
+		    record->sequence - last_sequence < 1000)
+			skipped = record->sequence - last_sequence - 1;
+		last_sequence = record->sequence;
+		have_sequence = true;
+
+		blobwatch_process(bw, buf, frame->width, frame->height,
+				  frame->pixel_stride, skipped,
+				  &s->rift.leds, &ob);
+		if (!ob)
+			continue;
+
+		ret = -1;
+		if (pose_valid) {
+			ret = estimate_tracked_pose(ob->blobs, ob->num_blobs,
+						    s->rift.leds.positions,
+						    s->rift.leds.num, &A,
+						    s->camera.dist_coeffs,
+						    undistort, &rot, &trans);
+		}
+		if (ret < 0) {
+			ret = estimate_initial_pose(ob->blobs, ob->num_blobs,
+						    s->rift.leds.positions,
+						    s->rift.leds.num, &A,
+						    s->camera.dist_coeffs,
+						    undistort, &rot, &trans,
+						    false);
+		}
+		pose_valid = ret >= 0;
+		ret = 0;
+		if (!pose_valid || s->tracked_frames++ % s->step)
+			continue;
+
+		bundle_add_frame(ba, ob, &rot, &trans);
+	}
+
+	if (camera_device < 0 || rift_device < 0)
+		fprintf(stderr, "'%s' contains no Rift DK2 and Camera DK2 calibration\n",
+			filename);
+
+	free(buf);
+	undistort_map_free(undistort);
+	if (bw)
+		blobwatch_free(bw);
+	recording_reader_close(&reader);
+
+	return ret;
+}
+
+/*
+ * Writes the calibration data of the given kind for the device with the
+ * given serial into the output directory, in the calibration cache file
+ * format, as a refined calibration. Refuses to write a file for an unknown,
+ * empty serial.
+ *
+ * Returns 0 on success, negative values on error.
+ */
+static int write_refined(const char *dir, const char *kind,
+			 const char *serial, const void *data, size_t size)
+{
+	struct calibration_cache_header header;
+	char name[128], filename[4096], tmpname[4100];
+	char *c;
+	FILE *f;
+	int ret = 0;
+
+	/* The daemon looks up calibrations by serial, it must be known */
+	if (!serial[0]) {
+		fprintf(stderr, "no %s serial number in the recording\n", kind);
+		return -EINVAL;
+	}
+
+	snprintf(name, sizeof(name), "%s-%s-refined.bin", kind, serial);
+	/* Same file name as the daemon uses, see calibration_cache_filename */
+	for (c = name; *c; c++) {
+		if (!((*c >= 'A' && *c <= 'Z') || (*c >= 'a' && *c <= 'z') ||
+		      (*c >= '0' && *c <= '9') || *c == '-' || *c == '.' ||
+		      *c == '_'))
+			*c = '_';
+	}
+	snprintf(filename, sizeof(filename), "%s/%s", dir, name);
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+	memcpy(header.magic, CALIBRATION_CACHE_MAGIC, 4);
+	header.format = CALIBRATION_CACHE_FORMAT;
+	header.size = size;
+	header.crc = crc32(0, data, size);
+
+	f = fopen(tmpname, "wb");
+	if (!f) {
+		fprintf(stderr, "failed to open '%s'\n", tmpname);
+		return -errno;
+	}
+	if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+	    fwrite(data, size, 1, f) != 1)
+		ret = -EIO;
+	if (fclose(f) != 0)
+		ret = -EIO;
+	if (ret == 0 && rename(tmpname, filename) < 0)
+		ret = -errno;
+	if (ret < 0) {
+		fprintf(stderr, "failed to write '%s'\n", filename);
+		remove(tmpname);
+		return ret;
+	}
+
+	printf("wrote %s\n", filename);
+
+	return 0;
+}
+
+/*
+ * Returns the ouvrtd cache directory, creating it if necessary.
+ */
+static const char *cache_dir(char *buf, size_t size)
+{
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+
+	if (xdg && xdg[0] == '/')
+		snprintf(buf, size, "%s", xdg);
+	else if (home)
+		snprintf(buf, size, "%s/.cache", home);
+	else
+		return NULL;
+	mkdir(buf, 0700);
+	strncat(buf, "/ouvrt", size - strlen(buf) - 1);
+	mkdir(buf, 0700);
+
+	return buf;
+}
+
+static void print_intrinsics(const char *label, const double c[NUM_INTRINSICS])
+{
+	printf("%s fx %.3f fy %.3f cx %.3f cy %.3f k %.6f %.6f %.6f %.6f %.6f\n",
+	       label, c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7], c[8]);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: refine-calibration [options] <recording>...\n"
+		"  -o, --output=DIR        output directory (default ~/.cache/ouvrt)\n"
+		"  -s, --step=N            use every Nth frame with a pose (default 5)\n"
+		"  -m, --max-frames=N      maximum number of frames used (default 1000)\n"
+		"  -i, --iterations=N      maximum number of iterations (default 50)\n"
+		"  -L, --fix-leds          do not refine the LED positions\n"
+		"  -I, --fix-intrinsics    do not refine the camera intrinsics\n"
+		"  -n, --dry-run           do not write the refined calibration\n");
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{ "output", required_argument, NULL, 'o' },
+		{ "step", required_argument, NULL, 's' },
+		{ "max-frames", required_argument, NULL, 'm' },
+		{ "iterations", required_argument, NULL, 'i' },
+		{ "fix-leds", no_argument, NULL, 'L' },
+		{ "fix-intrinsics", no_argument, NULL, 'I' },
+		{ "dry-run", no_argument, NULL, 'n' },
+		{ NULL, 0, NULL, 0 },
+	};
+	struct session s = {
+		.step = 5,
+		.max_frames = 1000,
+	};
+	struct bundle ba = { 0 };
+	const char *output = NULL;
+	char dir[4096];
+	int iterations = 50;
+	bool dry_run = false;
+	double rms_before, rms_after, shift, max_shift = 0, sum_shift = 0;
+	int refined_leds = 0;
+	int i, c, ret;
+
+	while ((c = getopt_long(argc, argv, "o:s:m:i:LIn", long_options,
+				NULL)) != -1) {
+		switch (c) {
+		case 'o':
+			output = optarg;
+			break;
+		case 's':
+			s.step = atoi(optarg);
+			break;
+		case 'm':
+			s.max_frames = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'L':
+			ba.fix_leds = true;
+			break;
+		case 'I':
+			ba.fix_intrinsics = true;
+			break;
+		case 'n':
+			dry_run = true;
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if (optind >= argc || s.step < 1 || s.max_frames < 1 ||
+	    iterations < 1) {
+		usage();
+		return -1;
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (session_process(&s, &ba, argv[i]) < 0) {
+			bundle_free(&ba);
+			return -1;
+		}
+	}
+
+	if (ba.num_frames < MIN_FRAMES) {
+		fprintf(stderr, "only %d usable frames, need at least %d\n",
+			ba.num_frames, MIN_FRAMES);
+		bundle_free(&ba);
+		return -1;
+	}
+
+	printf("%d frames with %d identified blobs of %d LEDs\n",
+	       ba.num_frames, ba.num_observations, ba.num_leds);
+	bundle_cost(&ba, &rms_before);
+	printf("initial RMS error %.4f px\n", rms_before);
+
+	if (bundle_adjust(&ba, iterations) < 0) {
+		bundle_free(&ba);
+		return -1;
+	}
+	bundle_cost(&ba, &rms_after);
+
+	for (i = 0; i < ba.num_leds; i++) {
+		dvec3 d = dvec3_sub(&ba.leds[i], &ba.leds_prior[i]);
+
+		if (!ba.led_observations[i])
+			continue;
+		shift = __builtin_sqrt(dvec3_dot(&d, &d));
+		sum_shift += shift;
+		if (shift > max_shift)
+			max_shift = shift;
+		refined_leds++;
+	}
+
+	printf("RMS error %.4f px -> %.4f px\n", rms_before, rms_after);
+	if (!ba.fix_leds && refined_leds) {
+		printf("%d LEDs moved by %.3f mm on average, %.3f mm max\n",
+		       refined_leds, 1000 * sum_shift / refined_leds,
+		       1000 * max_shift);
+	}
+	if (!ba.fix_intrinsics) {
+		print_intrinsics("before:", ba.intrinsics_prior);
+		print_intrinsics("after: ", ba.intrinsics);
+	}
+
+	if (rms_after >= rms_before) {
+		fprintf(stderr, "no improvement, not writing a refined calibration\n");
+		bundle_free(&ba);
+		return -1;
+	}
+
+	if (!dry_run) {
+		if (!output)
+			output = cache_dir(dir, sizeof(dir));
+		if (!output) {
+			fprintf(stderr, "no output directory\n");
+			bundle_free(&ba);
+			return -1;
+		}
+
+		ret = 0;
+		if (!ba.fix_leds) {
+			for (i = 0; i < ba.num_leds; i++) {
+				s.rift.leds.positions[i] =
+					vec3_from_dvec3(&ba.leds[i]);
+			}
+			ret = write_refined(output, "rift-dk2", s.rift_serial,
+					    &s.rift, sizeof(s.rift));
+		}
+		if (ret == 0 && !ba.fix_intrinsics) {
+			s.camera.camera_matrix[0] = ba.intrinsics[0];
+			s.camera.camera_matrix[4] = ba.intrinsics[1];
+			s.camera.camera_matrix[2] = ba.intrinsics[2];
+			s.camera.camera_matrix[5] = ba.intrinsics[3];
+			memcpy(s.camera.dist_coeffs, ba.intrinsics + 4,
+			       sizeof(s.camera.dist_coeffs));
+			ret = write_refined(output, "camera-dk2",
+					    s.camera_serial, &s.camera,
+					    sizeof(s.camera));
+		}
+		if (ret < 0) {
+			bundle_free(&ba);
+			return -1;
+		}
+	}
+
+	bundle_free(&ba);
+
+	return 0;
+}